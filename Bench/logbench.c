@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "loggen.h"
+#include "logreader.h"
+#include "decoder.h"
+#include "MsgProcessor.h"
+#include "sensorsink.h"
+#include "interleave.h"
+#include "convert.h"
+#include "pipeline.h"
+
+// Throughput of each stage of the conversion of a .log file, on a synthetic
+// recording (see loggen.h) or on a real one. Every stage runs --repeat times
+// on the whole file and the best run is reported, in MB/s of its input (of
+// its output for the writers) and in items per second.
+
+#define HEADER_RUNS 1000000
+#define BLOCK_HEADER_SIZE 16
+
+// The messages of the file, decoded once and replayed to ProcessDecodedMessage
+typedef struct CapturedMessage_s
+{
+    short function;
+    unsigned short payloadLength;
+    long offset;                    // in Capture.payloads
+}CapturedMessage;
+
+typedef struct Capture_s
+{
+    CapturedMessage* messages;
+    long nbMessages;
+    long capacity;
+    unsigned char* payloads;
+    long size;
+    long payloadCapacity;
+}Capture;
+
+typedef struct Bench_s
+{
+    LogReader reader;
+    long samplesPerBlock;
+    int resolutionBytes;
+    bool messages;                  // firmware v2 : the additional data holds a message stream
+    Capture capture;
+    long long payloadBytes;
+    char* interleaved;              // one block
+    char wavPath[1024];
+    char csvPath[1024];
+    char npyPrefix[1024];
+    const char* logPath;
+}Bench;
+
+typedef struct StageRun_s
+{
+    double bytes;
+    double items;
+}StageRun;
+
+typedef StageRun (*StageFunction)(Bench* bench);
+
+static void CountMessage(short function, unsigned short payloadLength, const unsigned char payload[], void* context)
+{
+    (void)function;
+    (void)payloadLength;
+    (void)payload;
+    (*(long long*)context)++;
+}
+
+static void CaptureMessage(short function, unsigned short payloadLength, const unsigned char payload[], void* context)
+{
+    Capture* capture = context;
+    if (capture->nbMessages == capture->capacity)
+    {
+        capture->capacity = capture->capacity > 0 ? 2 * capture->capacity : 4096;
+        capture->messages = realloc(capture->messages, capture->capacity * sizeof(CapturedMessage));
+    }
+    if (capture->size + payloadLength > capture->payloadCapacity)
+    {
+        capture->payloadCapacity = 2 * capture->payloadCapacity + payloadLength + 65536;
+        capture->payloads = realloc(capture->payloads, capture->payloadCapacity);
+    }
+    CapturedMessage* message = &capture->messages[capture->nbMessages++];
+    message->function = function;
+    message->payloadLength = payloadLength;
+    message->offset = capture->size;
+    memcpy(capture->payloads + capture->size, payload, payloadLength);
+    capture->size += payloadLength;
+}
+
+static void DecodeAll(Bench* bench, MessageHandler handler, void* context)
+{
+    int size = bench->reader.hdr.sizeOfAdditionnalDataBuffer - 2 * BLOCK_HEADER_SIZE;
+    MsgDecoder decoder;
+    ResetDecoder(&decoder);
+    for (long k = 0; k < bench->reader.nbBlocks; k++)
+        DecodeMessagesWith(&decoder, LogReaderAdditionnalData(&bench->reader, k) + BLOCK_HEADER_SIZE, size, handler, context);
+}
+
+static void ReplayMessages(Bench* bench, SensorSink* sink)
+{
+    MsgProcessor processor;
+    ResetProcessor(&processor, sink);
+    const Capture* capture = &bench->capture;
+    for (long i = 0; i < capture->nbMessages; i++)
+    {
+        const CapturedMessage* message = &capture->messages[i];
+        ProcessDecodedMessage(&processor, message->function, message->payloadLength, capture->payloads + message->offset);
+    }
+}
+
+//////////////////
+/// Stages     ///
+//////////////////
+
+static StageRun RunHeader(Bench* bench)
+{
+    HighBlueHeader hdr;
+    long long size = bench->reader.dataOffset;
+    int valid = 0;
+    for (int i = 0; i < HEADER_RUNS; i++)
+        valid += ParseLogHeader(bench->reader.data, size, &hdr, 0);
+    return (StageRun){ (double)size * valid, valid };
+}
+
+static StageRun RunDecode(Bench* bench)
+{
+    long long nbMessages = 0;
+    DecodeAll(bench, CountMessage, &nbMessages);
+    int size = bench->reader.hdr.sizeOfAdditionnalDataBuffer - 2 * BLOCK_HEADER_SIZE;
+    return (StageRun){ (double)size * bench->reader.nbBlocks, (double)nbMessages };
+}
+
+static StageRun RunProcess(Bench* bench)
+{
+    SensorSink sink;
+    SensorSinkInit(&sink, NULL, NULL);
+    ReplayMessages(bench, &sink);
+    SensorSinkClose(&sink);
+    return (StageRun){ (double)bench->payloadBytes, (double)bench->capture.nbMessages };
+}
+
+static StageRun RunInterleave(Bench* bench)
+{
+    const HighBlueHeader* hdr = &bench->reader.hdr;
+    for (long k = 0; k < bench->reader.nbBlocks; k++)
+        InterleaveBlock(bench->interleaved, (const char*)LogReaderDmaBlock(&bench->reader, k), hdr->numberOfChan,
+                        bench->samplesPerBlock, bench->resolutionBytes);
+    return (StageRun){ (double)hdr->dmaBlockSize * bench->reader.nbBlocks,
+                       (double)bench->samplesPerBlock * bench->reader.nbBlocks };
+}
+
+// The same interleaved block over and over : only the writes are timed
+static StageRun RunWavWrite(Bench* bench)
+{
+    FILE* file = fopen(bench->wavPath, "wb");
+    if (file == NULL)
+        return (StageRun){ 0, 0 };
+    char header[44] = { 0 };
+    fwrite(header, 1, sizeof(header), file);
+    long size = bench->reader.hdr.dmaBlockSize;
+    for (long k = 0; k < bench->reader.nbBlocks; k++)
+        fwrite(bench->interleaved, 1, size, file);
+    fclose(file);
+    return (StageRun){ (double)size * bench->reader.nbBlocks, (double)bench->samplesPerBlock * bench->reader.nbBlocks };
+}
+
+static StageRun RunCsvWrite(Bench* bench)
+{
+    FILE* file = fopen(bench->csvPath, "w");
+    if (file == NULL)
+        return (StageRun){ 0, 0 };
+    SensorSink sink;
+    SensorSinkInit(&sink, file, NULL);
+    ReplayMessages(bench, &sink);
+    SensorSinkClose(&sink);
+    double bytes = (double)ftell(file);
+    fclose(file);
+    return (StageRun){ bytes, (double)bench->capture.nbMessages };
+}
+
+static StageRun RunNpyWrite(Bench* bench)
+{
+    SensorSink sink;
+    SensorSinkInit(&sink, NULL, bench->npyPrefix);
+    ReplayMessages(bench, &sink);
+    double bytes = (double)SensorSinkClose(&sink);
+    return (StageRun){ bytes, (double)bench->capture.nbMessages };
+}
+
+// The whole conversion, .wav and .csv, on one thread or pipelined as log2wav
+// does it by default
+static StageRun Convert(Bench* bench, int pipelineDepth)
+{
+    ConvertOutputs outputs = { 0 };
+    outputs.wavPath = bench->wavPath;
+    outputs.csvPath = bench->csvPath;
+    ConvertOptions options = { 0 };
+    options.pipelineDepth = pipelineDepth;
+    ConvertResult result;
+    if (ConvertLogFile(bench->logPath, &outputs, &options, &result) != ConvertOK)
+    {
+        fprintf(stderr, "conversion failed : %s\n", result.error);
+        return (StageRun){ 0, 0 };
+    }
+    return (StageRun){ (double)result.bytesRead, (double)result.nbBlocks };
+}
+
+static StageRun RunConvert(Bench* bench)
+{
+    return Convert(bench, 0);
+}
+
+static StageRun RunConvertPipelined(Bench* bench)
+{
+    return Convert(bench, PIPELINE_DEFAULT_DEPTH);
+}
+
+typedef struct Stage_s
+{
+    const char* name;
+    const char* items;
+    StageFunction run;
+    bool messages;                  // needs the message stream of firmware v2
+}Stage;
+
+static const Stage stages[] = {
+    { "header parse", "headers", RunHeader, false },
+    { "decode", "msgs", RunDecode, true },
+    { "process", "msgs", RunProcess, true },
+    { "de-interleave", "frames", RunInterleave, false },
+    { "wav write", "frames", RunWavWrite, false },
+    { "csv write", "msgs", RunCsvWrite, true },
+    { "npy write", "msgs", RunNpyWrite, true },
+    { "convert", "blocks", RunConvert, false },
+    { "pipelined", "blocks", RunConvertPipelined, false },
+};
+
+static void RunStage(Bench* bench, const Stage* stage, int repeat)
+{
+    double best = 0;
+    StageRun run = { 0, 0 };
+    for (int r = 0; r < repeat; r++)
+    {
+        double start = StatsNow();
+        run = stage->run(bench);
+        double elapsed = StatsNow() - start;
+        if (r == 0 || elapsed < best)
+            best = elapsed;
+    }
+    if (run.items == 0 || best <= 0)
+    {
+        printf("%-14s %12s\n", stage->name, "-");
+        return;
+    }
+    printf("%-14s %10.1f MB/s %10.3f M%s/s %10.2f ms\n", stage->name, run.bytes / best * 1e-6,
+           run.items / best * 1e-6, stage->items, best * 1e3);
+}
+
+//////////////////
+/// Main       ///
+//////////////////
+
+static void printUsage(void)
+{
+    printf("Usage : logbench [options] [file.log]\n"
+           "\tTimes each stage of the conversion of file.log, or of a synthetic recording\n"
+           "\t--repeat N : runs of each stage, the best one is reported (default 3)\n"
+           "\t--dir DIR : directory of the synthetic .log and of the outputs (default : TMPDIR or .)\n"
+           "\t--generate FILE : only write the synthetic recording to FILE\n"
+           "Synthetic recording :\n"
+           "\t--seconds S (default 60), --channels N (4), --bits B (24), --rate HZ (256000)\n"
+           "\t--block N : samples per channel of each dmaBlock (2048)\n"
+           "\t--additional N : bytes of additional data of each block (4096)\n"
+           "\t--sensors X : sensor rates times X (1 : accel and gyro 50 Hz, mag 10 Hz, ...)\n"
+           "\t--packet N : sensor samples per frame (8)\n"
+           "\t--gps HZ, --pps HZ : GPS and PPS frame rates (1)\n"
+           "\t--corrupt F : fraction of frames with a wrong checksum (0)\n"
+           "\t--seed N\n");
+}
+
+static const char* npySuffixes[] = { "packet", "accel", "gyro", "mag", "temperature", "pressure",
+                                     "light", "gps", "pps", "mpu" };
+
+static void RemoveOutputs(const Bench* bench)
+{
+    remove(bench->wavPath);
+    remove(bench->csvPath);
+    char path[1100];
+    for (size_t i = 0; i < sizeof(npySuffixes) / sizeof(npySuffixes[0]); i++)
+    {
+        snprintf(path, sizeof(path), "%s_%s.npy", bench->npyPrefix, npySuffixes[i]);
+        remove(path);
+    }
+}
+
+static bool GenerateFile(const char* path, const LogGenOptions* gen)
+{
+    FILE* file = fopen(path, "wb");
+    LogGenResult result;
+    double start = StatsNow();
+    bool ok = file != NULL && GenerateLog(file, gen, &result);
+    if (file != NULL)
+        ok &= fclose(file) == 0;
+    if (!ok)
+    {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return false;
+    }
+    printf("%s : %ld blocks, %.1f MB, %lld frames (%lld corrupted, %lld dropped) in %.2f s\n", path, result.nbBlocks,
+           result.bytesWritten * 1e-6, result.nbFrames, result.nbCorrupted, result.nbDropped, StatsNow() - start);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    LogGenOptions gen;
+    LogGenDefaults(&gen);
+    int repeat = 3;
+    const char* dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : getenv("TEMP") != NULL ? getenv("TEMP") : ".";
+    const char* generatePath = NULL;
+    const char* logPath = NULL;
+    double sensorScale = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--help") == 0)
+        {
+            printUsage();
+            return 0;
+        }
+        else if (strcmp(argv[i], "--repeat") == 0 && hasValue)
+            repeat = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--dir") == 0 && hasValue)
+            dir = argv[++i];
+        else if (strcmp(argv[i], "--generate") == 0 && hasValue)
+            generatePath = argv[++i];
+        else if (strcmp(argv[i], "--seconds") == 0 && hasValue)
+            gen.seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "--channels") == 0 && hasValue)
+            gen.nbChan = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bits") == 0 && hasValue)
+            gen.resolutionBits = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rate") == 0 && hasValue)
+            gen.samplingFrequency = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--block") == 0 && hasValue)
+            gen.samplesPerBlock = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--additional") == 0 && hasValue)
+            gen.additionnalDataSize = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--sensors") == 0 && hasValue)
+            sensorScale = atof(argv[++i]);
+        else if (strcmp(argv[i], "--packet") == 0 && hasValue)
+            gen.samplesPerPacket = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--gps") == 0 && hasValue)
+            gen.gpsRate = atof(argv[++i]);
+        else if (strcmp(argv[i], "--pps") == 0 && hasValue)
+            gen.ppsRate = atof(argv[++i]);
+        else if (strcmp(argv[i], "--corrupt") == 0 && hasValue)
+            gen.corruptRate = atof(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && hasValue)
+            gen.seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+        else if (argv[i][0] == '-' || logPath != NULL)
+        {
+            printUsage();
+            return 1;
+        }
+        else
+            logPath = argv[i];
+    }
+    gen.accelRate *= sensorScale;
+    gen.gyroRate *= sensorScale;
+    gen.magRate *= sensorScale;
+    gen.temperatureRate *= sensorScale;
+    gen.pressureRate *= sensorScale;
+    gen.lightRate *= sensorScale;
+    if (repeat < 1)
+        repeat = 1;
+
+    Bench bench;
+    memset(&bench, 0, sizeof(Bench));
+    if (generatePath != NULL)
+        return GenerateFile(generatePath, &gen) ? 0 : 1;
+    char generated[1024];
+    if (logPath == NULL)
+    {
+        snprintf(generated, sizeof(generated), "%s/logbench.log", dir);
+        if (!GenerateFile(generated, &gen))
+            return 1;
+        logPath = generated;
+    }
+    bench.logPath = logPath;
+
+    if (OpenLogReader(&bench.reader, logPath, 0) != 0 || bench.reader.nbBlocks == 0)
+    {
+        fprintf(stderr, "Cannot read %s\n", logPath);
+        return 1;
+    }
+    const HighBlueHeader* hdr = &bench.reader.hdr;
+    bench.resolutionBytes = hdr->resolutionBits / 8;
+    bench.samplesPerBlock = hdr->dmaBlockSize / (hdr->numberOfChan * bench.resolutionBytes);
+    bench.interleaved = malloc(hdr->dmaBlockSize);
+    bench.messages = LogReaderAdditionnalData(&bench.reader, 0)[5] >= 2
+                     && hdr->sizeOfAdditionnalDataBuffer > 2 * BLOCK_HEADER_SIZE;
+    if (bench.messages)
+    {
+        DecodeAll(&bench, CaptureMessage, &bench.capture);
+        bench.payloadBytes = bench.capture.size;
+    }
+    snprintf(bench.wavPath, sizeof(bench.wavPath), "%s/logbench.wav", dir);
+    snprintf(bench.csvPath, sizeof(bench.csvPath), "%s/logbench.csv", dir);
+    snprintf(bench.npyPrefix, sizeof(bench.npyPrefix), "%s/logbench", dir);
+
+    printf("%s : %ld blocks of %ld samples x %d channels (%d bits), %.1f MB, %ld messages, %s de-interleaving\n",
+           logPath, bench.reader.nbBlocks, bench.samplesPerBlock, hdr->numberOfChan, hdr->resolutionBits,
+           bench.reader.size * 1e-6, bench.capture.nbMessages, InterleaveSimdLevel());
+    for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); i++)
+    {
+        if (stages[i].messages && !bench.messages)
+            continue;
+        RunStage(&bench, &stages[i], repeat);
+    }
+
+    RemoveOutputs(&bench);
+    CloseLogReader(&bench.reader);
+    if (logPath == generated)
+        remove(generated);
+    free(bench.interleaved);
+    free(bench.capture.messages);
+    free(bench.capture.payloads);
+    return 0;
+}
@@ -0,0 +1,366 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "loggen.h"
+#include "MsgProcessor.h"
+#include "decoder.h"
+#include "logreader.h"
+
+#define MSG_SOF 0xFE
+#define GEN_MAX_PAYLOAD 1000            // under MSG_MAX_PAYLOAD of the decoder
+#define BLOCK_HEADER_SIZE 16            // revision and end of packet time, and as much at the end
+#define CLOCK_HZ 100000000.0            // card counter (100 MHz)
+#define START_COUNTER 1000000000ULL     // counter at the first sample
+
+void LogGenDefaults(LogGenOptions* options)
+{
+    memset(options, 0, sizeof(LogGenOptions));
+    options->nbChan = 4;
+    options->resolutionBits = 24;
+    options->samplingFrequency = 256000;
+    options->samplesPerBlock = 2048;
+    options->additionnalDataSize = 4096;
+    options->seconds = 60;
+    options->accelRate = 50;
+    options->gyroRate = 50;
+    options->magRate = 10;
+    options->temperatureRate = 1;
+    options->pressureRate = 25;
+    options->lightRate = 10;
+    options->gpsRate = 1;
+    options->ppsRate = 1;
+    options->samplesPerPacket = 8;
+    options->clockDriftPPM = 2.5;
+    options->seed = 1;
+}
+
+static unsigned int NextRandom(unsigned int* state)
+{
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Uniform in [-amplitude, amplitude]
+static double RandomAround(unsigned int* state, double amplitude)
+{
+    return amplitude * (NextRandom(state) * (2.0 / 4294967295.0) - 1);
+}
+
+static void PutBE(unsigned char* p, unsigned long long value, int nbBytes)
+{
+    for (int i = nbBytes - 1; i >= 0; i--, value >>= 8)
+        p[i] = (unsigned char)value;
+}
+
+static void PutLE(unsigned char* p, unsigned long long value, int nbBytes)
+{
+    for (int i = 0; i < nbBytes; i++, value >>= 8)
+        p[i] = (unsigned char)value;
+}
+
+// Native float, as read by GetFloatSafe
+static void PutFloat(unsigned char* p, float value)
+{
+    memcpy(p, &value, 4);
+}
+
+////////////////////////
+/// Message stream   ///
+////////////////////////
+
+// Bytes waiting for the next additional data buffers
+typedef struct MsgStream_s
+{
+    unsigned char* data;
+    long size;
+    long capacity;
+    unsigned int random;
+    double corruptRate;
+    LogGenResult* result;
+}MsgStream;
+
+static void PushFrame(MsgStream* stream, int function, const unsigned char* payload, int payloadLength)
+{
+    long frameSize = payloadLength + 6;
+    if (stream->size + frameSize > stream->capacity)
+    {
+        stream->result->nbDropped++;
+        return;
+    }
+    unsigned char* frame = stream->data + stream->size;
+    frame[0] = MSG_SOF;
+    PutBE(frame + 1, (unsigned)function, 2);
+    PutBE(frame + 3, (unsigned)payloadLength, 2);
+    memcpy(frame + 5, payload, payloadLength);
+    frame[5 + payloadLength] = CalculateChecksum(function, payloadLength, payload);
+    if (stream->corruptRate > 0 && NextRandom(&stream->random) < stream->corruptRate * 4294967295.0)
+    {
+        frame[5 + NextRandom(&stream->random) % (payloadLength + 1)] ^= 0x55;
+        stream->result->nbCorrupted++;
+    }
+    stream->size += frameSize;
+    stream->result->nbFrames++;
+}
+
+// Moves up to size bytes of the stream to dst, the rest of dst is zeroed
+static void PopBytes(MsgStream* stream, unsigned char* dst, long size)
+{
+    long n = stream->size < size ? stream->size : size;
+    memcpy(dst, stream->data, n);
+    memset(dst + n, 0, size - n);
+    memmove(stream->data, stream->data + n, stream->size - n);
+    stream->size -= n;
+}
+
+////////////////////
+/// Sensors      ///
+////////////////////
+
+typedef struct SensorGen_s
+{
+    SensorType type;
+    double rate;
+    int nbChannels;
+    int resolutionBits;
+    float range;
+    long long nextSample;
+}SensorGen;
+
+// One sample of a V2 frame : timestamp (us, big endian) then the channels,
+// in the byte order ProcessDecodedMessage reads for this sensor
+static int PutSensorSample(unsigned char* p, const SensorGen* sensor, unsigned int timeStampUs, unsigned int* random)
+{
+    PutBE(p, timeStampUs, 4);
+    p += 4;
+    switch (sensor->type)
+    {
+        case Accel:         // around 1 G on Z, big endian
+        case Gyro:
+            for (int c = 0; c < 3; c++)
+            {
+                double g = sensor->type == Accel && c == 2 ? 1.0 : 0.0;
+                PutBE(p + 2 * c, (unsigned short)(short)lround((g + RandomAround(random, 0.02)) * 32768 / sensor->range), 2);
+            }
+            return 10;
+        case Mag:           // little endian
+            for (int c = 0; c < 3; c++)
+                PutLE(p + 2 * c, (unsigned short)(short)lround(1000 + RandomAround(random, 50)), 2);
+            return 10;
+        case Temperature:
+            PutFloat(p, (float)(15.5 + RandomAround(random, 0.05)));
+            return 8;
+        case Pressure:
+            PutFloat(p, (float)(101325 + RandomAround(random, 20)));
+            return 8;
+        case Light:
+            PutLE(p, 1200 + NextRandom(random) % 64, 2);
+            PutLE(p + 2, 300 + NextRandom(random) % 16, 2);
+            return 8;
+        default:
+            return 4;
+    }
+}
+
+// Frames of the samples of sensor due before the card time endTime (s)
+static void PushSensorFrames(MsgStream* stream, SensorGen* sensor, int samplesPerPacket, double endTime)
+{
+    unsigned char payload[GEN_MAX_PAYLOAD];
+    // a slow sensor sends at least one frame per second
+    if (samplesPerPacket > sensor->rate)
+        samplesPerPacket = sensor->rate > 1 ? (int)sensor->rate : 1;
+    while (sensor->rate > 0 && (sensor->nextSample + samplesPerPacket - 1) / sensor->rate < endTime)
+    {
+        payload[0] = (unsigned char)sensor->type;
+        payload[1] = 1;
+        payload[2] = (unsigned char)sensor->nbChannels;
+        PutFloat(payload + 3, sensor->range);
+        payload[7] = (unsigned char)sensor->resolutionBits;
+        PutFloat(payload + 8, (float)sensor->rate);
+        payload[12] = (unsigned char)samplesPerPacket;
+        int length = 13;
+        for (int i = 0; i < samplesPerPacket; i++)
+        {
+            unsigned int timeStampUs = 1 + (unsigned int)llround((sensor->nextSample + i) / sensor->rate * 1e6);
+            length += PutSensorSample(payload + length, sensor, timeStampUs, &stream->random);
+        }
+        PushFrame(stream, HS_DATA_PACKET_FULL_TIMESTAMP_V2, payload, length);
+        sensor->nextSample += samplesPerPacket;
+    }
+}
+
+// GPS fix n, ten days in May 2024 from 10:00:00
+static void PushGPSFrame(MsgStream* stream, long long n)
+{
+    unsigned char payload[34];
+    long long t = 10 * 3600 + n;
+    payload[0] = (unsigned char)(t / 3600 % 24);
+    payload[1] = (unsigned char)(t / 60 % 60);
+    payload[2] = (unsigned char)(t % 60);
+    PutLE(payload + 3, 0, 2);
+    payload[5] = (unsigned char)(12 + t / 86400);
+    payload[6] = 5;
+    payload[7] = 24;
+    payload[8] = 1;
+    payload[9] = 1;
+    PutFloat(payload + 10, 4307.1234f);
+    payload[14] = 'N';
+    PutFloat(payload + 15, 553.5f + (float)(n % 100) * 0.001f);
+    payload[19] = 'E';
+    PutFloat(payload + 20, 0.3f);
+    PutFloat(payload + 24, 12.5f);
+    PutFloat(payload + 28, 3.25f);
+    payload[32] = 9;
+    payload[33] = 1;
+    PushFrame(stream, GPS_DATA_PACKET, payload, sizeof(payload));
+}
+
+static void PushPPSFrame(MsgStream* stream, double cardTime)
+{
+    unsigned char payload[8];
+    double jitter = RandomAround(&stream->random, 20);
+    PutBE(payload, START_COUNTER + (unsigned long long)llround(cardTime * CLOCK_HZ + jitter), 8);
+    PushFrame(stream, GPS_PPS_PACKET, payload, sizeof(payload));
+}
+
+////////////////////
+/// File         ///
+////////////////////
+
+static long WriteHeader(FILE* file, const LogGenOptions* options, const SensorGen* sensors, int nbSensors, int dmaBlockSize)
+{
+    unsigned char header[4 + 21 + 6 * MAX_PERIPHERAL];
+    int nbPeripheral = 0;
+    unsigned char* periph = header + 25;
+    for (int i = 0; i < nbSensors && nbPeripheral < MAX_PERIPHERAL; i++)
+    {
+        if (sensors[i].rate <= 0)
+            continue;
+        periph[0] = (unsigned char)sensors[i].type;
+        periph[1] = 1;
+        periph[2] = (unsigned char)sensors[i].range;
+        periph[3] = (unsigned char)sensors[i].resolutionBits;
+        PutLE(periph + 4, (unsigned)lround(sensors[i].rate), 2);
+        periph += 6;
+        nbPeripheral++;
+    }
+    int headerSize = 21 + 6 * nbPeripheral;
+    PutLE(header, headerSize, 4);
+    PutLE(header + 4, 3, 2);
+    header[6] = (unsigned char)options->nbChan;
+    header[7] = (unsigned char)options->resolutionBits;
+    PutLE(header + 8, options->samplingFrequency, 4);
+    PutLE(header + 12, dmaBlockSize, 4);
+    PutLE(header + 16, options->additionnalDataSize, 4);
+    header[20] = (unsigned char)nbPeripheral;
+    PutLE(header + 21, 0, 4);
+    return fwrite(header, 1, headerSize + 4, file) == (size_t)headerSize + 4 ? headerSize + 4 : -1;
+}
+
+// Planar samples of block k : channel c is a sine at 1 kHz * (c + 1), -12 dB
+// full scale, plus a -60 dB noise
+static void FillDmaBlock(unsigned char* dmaBlock, const LogGenOptions* options, long k, unsigned int* random)
+{
+    int bytes = options->resolutionBits / 8;
+    double fullScale = ldexp(1, options->resolutionBits - 1) - 1;
+    long n = options->samplesPerBlock;
+    for (int c = 0; c < options->nbChan; c++)
+    {
+        double frequency = fmod(1000.0 * (c + 1), options->samplingFrequency / 2.0);
+        double w = 2 * M_PI * frequency / options->samplingFrequency;
+        // oscillator by rotation, restarted from the exact phase at each block
+        double phase = fmod(w * (double)k * n, 2 * M_PI);
+        double re = cos(phase), im = sin(phase), cw = cos(w), sw = sin(w);
+        unsigned char* p = dmaBlock + (long)c * n * bytes;
+        for (long i = 0; i < n; i++, p += bytes)
+        {
+            double v = 0.25 * fullScale * im + RandomAround(random, 1e-3 * fullScale);
+            v = v > fullScale ? fullScale : v < -fullScale - 1 ? -fullScale - 1 : v;
+            PutLE(p, (unsigned long long)llround(v), bytes);
+            double next = re * cw - im * sw;
+            im = re * sw + im * cw;
+            re = next;
+        }
+    }
+}
+
+bool GenerateLog(FILE* file, const LogGenOptions* options, LogGenResult* result)
+{
+    memset(result, 0, sizeof(LogGenResult));
+    int bits = options->resolutionBits;
+    if (options->nbChan <= 0 || options->nbChan > 255 || (bits != 16 && bits != 24 && bits != 32)
+        || options->samplingFrequency <= 0 || options->samplesPerBlock <= 0
+        || options->additionnalDataSize < BLOCK_HEADER_SIZE || options->samplesPerPacket < 1
+        || options->samplesPerPacket > 255)
+        return false;
+
+    SensorGen sensors[] = {
+        { Accel, options->accelRate, 3, 16, 2, 0 },
+        { Gyro, options->gyroRate, 3, 16, 250, 0 },
+        { Mag, options->magRate, 3, 16, 4, 0 },
+        { Pressure, options->pressureRate, 1, 32, 1, 0 },
+        { Light, options->lightRate, 2, 16, 1, 0 },
+        { Temperature, options->temperatureRate, 1, 32, 1, 0 },
+    };
+    int nbSensors = sizeof(sensors) / sizeof(sensors[0]);
+    // the frames must fit in a payload
+    int samplesPerPacket = options->samplesPerPacket;
+    if (samplesPerPacket * 10 + 13 > GEN_MAX_PAYLOAD)
+        samplesPerPacket = (GEN_MAX_PAYLOAD - 13) / 10;
+
+    int dmaBlockSize = options->samplesPerBlock * options->nbChan * (bits / 8);
+    long window = options->additionnalDataSize > 2 * BLOCK_HEADER_SIZE ? options->additionnalDataSize - 2 * BLOCK_HEADER_SIZE : 0;
+    long nbBlocks = (long)ceil(options->seconds * options->samplingFrequency / options->samplesPerBlock);
+    double blockDuration = (double)options->samplesPerBlock / options->samplingFrequency;
+    double secondDuration = 1 + options->clockDriftPPM * 1e-6;     // of the GPS, in card seconds
+
+    long headerBytes = WriteHeader(file, options, sensors, nbSensors, dmaBlockSize);
+    if (headerBytes < 0)
+        return false;
+    result->bytesWritten = headerBytes;
+
+    MsgStream stream = { 0 };
+    stream.capacity = 4 * window + GEN_MAX_PAYLOAD + 6;
+    stream.data = malloc(stream.capacity);
+    stream.random = options->seed * 2654435761u + 1;
+    stream.corruptRate = options->corruptRate;
+    stream.result = result;
+    unsigned int audioRandom = options->seed * 40503u + 7;
+    long recordSize = options->additionnalDataSize + dmaBlockSize;
+    unsigned char* record = malloc(recordSize);
+    long long nextGPS = 0, nextPPS = 0;
+    bool ok = stream.data != NULL && record != NULL;
+
+    for (long k = 0; k < nbBlocks && ok; k++)
+    {
+        double endTime = (k + 1) * blockDuration;
+        for (int i = 0; i < nbSensors; i++)
+            PushSensorFrames(&stream, &sensors[i], samplesPerPacket, endTime);
+        // the PPS marks the GPS second, the fix follows 100 ms later
+        while (options->ppsRate > 0 && nextPPS / options->ppsRate * secondDuration < endTime)
+        {
+            PushPPSFrame(&stream, nextPPS / options->ppsRate * secondDuration);
+            nextPPS++;
+        }
+        while (options->gpsRate > 0 && (nextGPS / options->gpsRate + 0.1) * secondDuration < endTime)
+            PushGPSFrame(&stream, nextGPS++);
+
+        unsigned char* additionnalData = record;
+        memset(additionnalData, 0, BLOCK_HEADER_SIZE);
+        additionnalData[5] = 2;
+        additionnalData[6] = 3;
+        PutBE(additionnalData + 7, START_COUNTER + (unsigned long long)llround(endTime * CLOCK_HZ), 8);
+        PopBytes(&stream, additionnalData + BLOCK_HEADER_SIZE, window);
+        memset(additionnalData + BLOCK_HEADER_SIZE + window, 0, options->additionnalDataSize - BLOCK_HEADER_SIZE - window);
+        FillDmaBlock(record + options->additionnalDataSize, options, k, &audioRandom);
+        ok = fwrite(record, 1, recordSize, file) == (size_t)recordSize;
+        result->bytesWritten += recordSize;
+        result->nbBlocks++;
+    }
+    free(stream.data);
+    free(record);
+    return ok && fflush(file) == 0;
+}
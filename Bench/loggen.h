@@ -0,0 +1,55 @@
+#ifndef LOGGEN_H
+#define LOGGEN_H
+#include <stdio.h>
+#include <stdbool.h>
+
+// Synthetic .log files, laid out as the QHB cards write them : a
+// HighBlueHeader, then for every block the additional data (firmware v2 :
+// revision, end of packet time, then the stream of checksummed
+// HS_DATA_PACKET_FULL_TIMESTAMP_V2, GPS and PPS frames) and the planar
+// dmaBlock (a sine per channel plus some noise).
+//
+// The sensor frames are scheduled on the card clock at the given rates and
+// flow from one additional data buffer to the next, a frame may be cut by the
+// end of a buffer as on the card. The card clock drifts from the GPS time by
+// clockDriftPPM, which shows in the PPS timestamps.
+
+typedef struct LogGenOptions_s
+{
+    int nbChan;
+    int resolutionBits;             // 16, 24 or 32
+    int samplingFrequency;
+    int samplesPerBlock;            // per channel, in each dmaBlock
+    int additionnalDataSize;        // bytes of additional data before each dmaBlock
+    double seconds;                 // length of the recording
+    double accelRate;               // samples per second of each sensor, 0 : none
+    double gyroRate;
+    double magRate;
+    double temperatureRate;
+    double pressureRate;
+    double lightRate;
+    double gpsRate;                 // GPS frames per second
+    double ppsRate;                 // PPS frames per second (1 on the cards)
+    int samplesPerPacket;           // sensor samples per V2 frame, 1 to 255
+    double corruptRate;             // fraction of the frames with a wrong checksum
+    double clockDriftPPM;           // of the card clock, seen by the PPS
+    unsigned int seed;
+}LogGenOptions;
+
+typedef struct LogGenResult_s
+{
+    long nbBlocks;
+    long long bytesWritten;
+    long long nbFrames;             // frames written, corrupted ones included
+    long long nbCorrupted;
+    long long nbDropped;            // frames which did not fit in the additional data buffers
+}LogGenResult;
+
+// Defaults of a QHB V3 : 4 channels of 24 bits at 256 kHz, sensors at the
+// rates of QHB_Scripts/QHB_V3/JConfig.CFG, GPS and PPS at 1 Hz
+void LogGenDefaults(LogGenOptions* options);
+
+// Writes the whole file. Returns false on invalid options or a write error.
+bool GenerateLog(FILE* file, const LogGenOptions* options, LogGenResult* result);
+
+#endif
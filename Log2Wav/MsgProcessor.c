@@ -1,18 +1,18 @@
  #include <stdbool.h>
  #include <math.h>
  #include <stdio.h>
+ #include <string.h>
  #include "MsgProcessor.h"
  #include "Macros.h"
+ #include "sensorsink.h"
+ #include "stats.h"
+ #include "sensorscale.h"
  
-float GetFloatSafe(unsigned char *p, int index)
+float GetFloatSafe(const unsigned char *p, int index)
 {
-    unsigned char tmp[4];
-    tmp[0]=p[0+index];
-    tmp[1]=p[1+index];
-    tmp[2]=p[2+index];
-    tmp[3]=p[3+index];
-    float *result_ptr = (float*)(tmp);
-    float result = *result_ptr;
+    //memcpy : lecture non alignee, une seule instruction
+    float result;
+    memcpy(&result, p + index, sizeof(float));
     return result;
 }
 
@@ -56,33 +56,111 @@ SensorXYZData NormalizeSensorsDatas(RAWXYZData datas, float range, unsigned char
 
 
 //Une fois processé, le message sera transformé en event sortant
-unsigned int lastAccelTimeStamp;
-unsigned int lastGyroTimeStamp;
-unsigned int lastMagTimeStamp;
-unsigned int lastLightTimeStamp;
-unsigned int lastPressureTimeStamp;
-unsigned int lastTemperatureTimeStamp;
-unsigned int lastTimeStamp;
-DateTime lastGPSDate;
-double lastPPSTimeStampNS;
+void ResetProcessor(MsgProcessor* processor, SensorSink* sink)
+{
+    memset(processor, 0, sizeof(MsgProcessor));
+    processor->sink = sink;
+}
 
-void ResetTimeStamp(void)
+void GetProcessorStats(const MsgProcessor* processor, ConvertStats* stats)
 {
-    lastAccelTimeStamp = 0;
-    lastGyroTimeStamp = 0;
-    lastMagTimeStamp = 0;
-    lastPressureTimeStamp = 0;
-    lastTemperatureTimeStamp = 0;
-    lastLightTimeStamp=0;
+    for (int i = 0; i < STATS_SENSOR_COUNT; i++)
+    {
+        stats->sensors[i].messages += processor->counts[i].messages;
+        stats->sensors[i].samples += processor->counts[i].samples;
+        stats->sensors[i].nonMonotonic += processor->counts[i].nonMonotonic;
+        stats->sensors[i].rollovers += processor->counts[i].rollovers;
+    }
 }
 
-void ProcessDecodedMessage(short command, unsigned short payloadLength, unsigned char payload[], FILE* sensorsFile)
+//Echantillons d'un paquet V2 d'un capteur XYZ, en SoA (255 au plus, nbSamples tient sur un octet)
+#define MAX_PACKET_SAMPLES 255
+typedef struct XYZBatch_s
+{
+    unsigned int timeStamps[MAX_PACKET_SAMPLES];
+    short raw[3][MAX_PACKET_SAMPLES];
+    double values[3][MAX_PACKET_SAMPLES];
+}XYZBatch;
+
+//Paquet V2 Accel, Gyro ou Mag : les echantillons sont decodes d'un coup puis
+//mis a l'echelle en une passe SIMD, le facteur d'echelle n'est recalcule que
+//si la configuration du capteur change. Les echantillons dont le timestamp
+//n'avance pas sont ensuite ignores, comme avant.
+static void ProcessXYZPacket(MsgProcessor* processor, SensorType type, const unsigned char payload[], int nbSamples,
+                             int lengthPerSample, float rangeScale, unsigned char resolutionBits, SensorStats* counts)
+{
+    unsigned int* lastTimeStamp = type == Accel ? &processor->lastAccelTimeStamp
+                                : type == Gyro ? &processor->lastGyroTimeStamp : &processor->lastMagTimeStamp;
+    SensorScaleCache* cache = &processor->scales[type - Accel];
+    if (!cache->valid || cache->range != rangeScale || cache->resolutionBits != resolutionBits)
+    {
+        cache->valid = true;
+        cache->range = rangeScale;
+        cache->resolutionBits = resolutionBits;
+        cache->factor = SensorScaleFactor(rangeScale, resolutionBits);
+    }
+    XYZBatch batch;
+    bool bigEndian = type != Mag;   //Mag est en little-endian
+    for (int i = 0; i < nbSamples; i++)
+    {
+        const unsigned char* sample = payload + 13 + i * lengthPerSample;
+        batch.timeStamps[i] = BUILD_UINT32(sample[3], sample[2], sample[1], sample[0]);
+    }
+    if (resolutionBits / 8 == 2)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const unsigned char* value = payload + 17 + 2 * axis;
+            short* raw = batch.raw[axis];
+            for (int i = 0; i < nbSamples; i++, value += lengthPerSample)
+                raw[i] = (short)(bigEndian ? (value[0] << 8 | value[1]) : (value[1] << 8 | value[0]));
+            ScaleInt16(batch.values[axis], raw, nbSamples, cache->factor);
+        }
+    }
+    else
+    {
+        //seuls les echantillons 16 bits sont decodes
+        memset(batch.values, 0, sizeof(batch.values));
+    }
+    for (int i = 0; i < nbSamples; i++)
+    {
+        unsigned int timeStamp = batch.timeStamps[i];
+        if (*lastTimeStamp >= 500000000)
+        {
+            *lastTimeStamp = 0;
+            counts->rollovers++;
+        }
+        if (timeStamp > *lastTimeStamp)
+        {
+            *lastTimeStamp = timeStamp;
+            SensorXYZData datas;
+            datas.timeStamp = (double)timeStamp / 1000.0;
+            datas.X = batch.values[0][i];
+            datas.Y = batch.values[1][i];
+            datas.Z = batch.values[2][i];
+            SinkXYZ(processor->sink, type, timeStamp, &datas);
+            counts->samples++;
+        }
+        else
+        {
+            counts->nonMonotonic++;
+        }
+    }
+}
+
+void ProcessDecodedMessage(MsgProcessor* processor, short command, unsigned short payloadLength, const unsigned char payload[])
 {
         unsigned int timeStamp = 0;
+        SensorSink* sink = processor->sink;
+        SensorStats* counts = &processor->counts[StatsSensorOf(command, payload, payloadLength)];
+        counts->messages++;
         switch (command)
         {
             case (short)HS_DATA_PACKET_FULL_TIMESTAMP:
                 {
+                    //Le payload pointe directement dans le buffer du fichier : on ne lit pas au dela de la trame
+                    if (payloadLength < 9)
+                        break;
                     SensorType type = (SensorType)payload[0];
                     unsigned char id = payload[1];
                     unsigned char nbChannels = payload[2];
@@ -92,13 +170,13 @@ void ProcessDecodedMessage(short command, unsigned short payloadLength, unsigned
                     unsigned short nbSamples = BUILD_UINT16(payload[8], payload[7]);
 
                     int lengthPerSample = nbChannels * resolutionBits / 8 + 4;
-                    for (int i = 0; i < nbSamples && payloadLength >= lengthPerSample * i + 9; i++)
+                    for (int i = 0; i < nbSamples && payloadLength >= lengthPerSample * (i + 1) + 9; i++)
                     {
                         timeStamp = BUILD_UINT32(9 + i * lengthPerSample,9 + i * lengthPerSample+1,9 + i * lengthPerSample+2,9 + i * lengthPerSample+3);
 
-                        if (timeStamp > lastTimeStamp)
+                        if (timeStamp > processor->lastTimeStamp)
                         {
-                            lastTimeStamp = timeStamp;
+                            processor->lastTimeStamp = timeStamp;
                             switch (type)
                             {
                                 case IMU:
@@ -119,7 +197,6 @@ void ProcessDecodedMessage(short command, unsigned short payloadLength, unsigned
                                     data.magY = BUILD_UINT16(27 + i * lengthPerSample,27 + i * lengthPerSample+1);
                                     data.magZ = BUILD_UINT16(29 + i * lengthPerSample,29 + i * lengthPerSample+1);
 
-                                    printf("IMU OK\n");
                                     IMUData data_=Normalize(data, range, resolutionBits);
                                 }
                                     break;
@@ -144,7 +221,7 @@ void ProcessDecodedMessage(short command, unsigned short payloadLength, unsigned
                         }
                         else
                         {
-                            printf("TS IMU Error\n");
+                            counts->nonMonotonic++;
                         }
                     }
 
@@ -153,6 +230,8 @@ void ProcessDecodedMessage(short command, unsigned short payloadLength, unsigned
                 break;
             case (short)HS_DATA_PACKET_FULL_TIMESTAMP_V2:
                 {
+                    if (payloadLength < 13)
+                        break;
                     SensorType type = (SensorType)payload[0];
                     unsigned char id = payload[1];
                     unsigned char nbChannels = payload[2];
@@ -162,7 +241,15 @@ void ProcessDecodedMessage(short command, unsigned short payloadLength, unsigned
                     unsigned short nbSamples = payload[12];
 
                     int lengthPerSample = nbChannels * resolutionBits / 8 + 4;
-                    for (int i = 0; i < nbSamples && payloadLength >= lengthPerSample * i + 13; i++)
+                    if (type == Accel || type == Gyro || type == Mag)
+                    {
+                        //les echantillons complets du payload
+                        int available = (payloadLength - 13) / lengthPerSample;
+                        ProcessXYZPacket(processor, type, payload, nbSamples < available ? nbSamples : available,
+                                         lengthPerSample, rangeScale, resolutionBits, counts);
+                        break;
+                    }
+                    for (int i = 0; i < nbSamples && payloadLength >= lengthPerSample * (i + 1) + 13; i++)
                     {
                         timeStamp = BUILD_UINT32(payload[13 + i * lengthPerSample+3],payload[13 + i * lengthPerSample+2],payload[13 + i * lengthPerSample+1],payload[13 + i * lengthPerSample]);
 
@@ -172,134 +259,77 @@ void ProcessDecodedMessage(short command, unsigned short payloadLength, unsigned
 
                                 break;
                             case Accel:
-                                {
-                                    if (lastAccelTimeStamp >= 500000000)
-                                        lastAccelTimeStamp = 0;
-                                    if (timeStamp > lastAccelTimeStamp)
-                                    {
-                                        lastAccelTimeStamp = timeStamp;
-                                        RAWXYZData dataXYZ;
-                                        dataXYZ.timeStamp = timeStamp;
-                                        unsigned char datasize = (resolutionBits / 8);
-                                        if(datasize==2)
-                                        {
-                                            dataXYZ.X=BUILD_INT16(payload[17 + i * lengthPerSample],payload[17 + i * lengthPerSample+1]);
-                                            dataXYZ.Y=BUILD_INT16(payload[17 + datasize+ i * lengthPerSample],payload[17 +datasize+ i * lengthPerSample+1]);
-                                            dataXYZ.Z=BUILD_INT16(payload[17 + 2*datasize+ i * lengthPerSample],payload[17 +2*datasize+ i * lengthPerSample+1]);
-                                        }
-                                        SensorXYZData datas=NormalizeSensorsDatas(dataXYZ, rangeScale, resolutionBits);
-                                        fprintf(sensorsFile, "ACCEL, %d, %lf,%lf,%lf\n", timeStamp, datas.X,datas.Y,datas.Z);
-                                    }
-                                    else
-                                    {
-                                        //printf("TS Accel Error\n");
-                                    }
-                                }
-                                break;
                             case Gyro:
-                                {
-                                    if (lastGyroTimeStamp >= 500000000)
-                                        lastGyroTimeStamp = 0;
-                                    if (timeStamp > lastGyroTimeStamp)
-                                    {
-                                        lastGyroTimeStamp = timeStamp;
-                                        RAWXYZData dataXYZ;
-                                        dataXYZ.timeStamp = timeStamp;
-                                        unsigned char datasize = (resolutionBits / 8);
-                                        if(datasize==2)
-                                        {
-                                            dataXYZ.X=BUILD_INT16(payload[17 + i * lengthPerSample],payload[17 + i * lengthPerSample+1]);
-                                            dataXYZ.Y=BUILD_INT16(payload[17 + datasize+ i * lengthPerSample],payload[17 +datasize+ i * lengthPerSample+1]);
-                                            dataXYZ.Z=BUILD_INT16(payload[17 + 2*datasize+ i * lengthPerSample],payload[17 +2*datasize+ i * lengthPerSample+1]);
-                                        }
-                                        SensorXYZData datas=NormalizeSensorsDatas(dataXYZ, rangeScale, resolutionBits);
-                                        fprintf(sensorsFile, "GYRO, %d, %lf,%lf,%lf\n", timeStamp, datas.X,datas.Y,datas.Z);
-                                    }
-                                    else
-                                    {
-                                        //printf("TS Gyro Error\n");
-                                    }
-                                }
-
-                                break;
                             case Mag:
-                                {
-                                    if (lastMagTimeStamp >= 500000000)
-                                        lastMagTimeStamp = 0;
-                                    if (timeStamp > lastMagTimeStamp)
-                                    {
-                                        lastMagTimeStamp = timeStamp;
-                                        RAWXYZData dataXYZ;
-                                        dataXYZ.timeStamp = timeStamp;
-                                        unsigned char datasize = (resolutionBits / 8);
-                                        if(datasize==2)
-                                        {
-                                            dataXYZ.X=BUILD_INT16(payload[17 + i * lengthPerSample+1],payload[17 + i * lengthPerSample]);
-                                            dataXYZ.Y=BUILD_INT16(payload[17 + datasize+ i * lengthPerSample+1],payload[17 +datasize+ i * lengthPerSample]);
-                                            dataXYZ.Z=BUILD_INT16(payload[17 + 2*datasize+ i * lengthPerSample+1],payload[17 +2*datasize+ i * lengthPerSample]);
-                                        }
-                                        SensorXYZData datas=NormalizeSensorsDatas(dataXYZ, rangeScale, resolutionBits);
-                                        fprintf(sensorsFile, "MAG, %d, %lf,%lf,%lf\n", timeStamp, datas.X,datas.Y,datas.Z);
-                                    }
-                                    else
-                                    {
-                                        //printf("TS Mag Error\n");
-                                    }
-                                }
+                                //ProcessXYZPacket
                                 break;
                             case Temperature:
-                                if (lastTemperatureTimeStamp >= 500000000)
-                                    lastTemperatureTimeStamp = 0;
-                                if (timeStamp > lastTemperatureTimeStamp)
+                                if (processor->lastTemperatureTimeStamp >= 500000000)
                                 {
-                                    lastTemperatureTimeStamp = timeStamp;
+                                    processor->lastTemperatureTimeStamp = 0;
+                                    counts->rollovers++;
+                                }
+                                if (timeStamp > processor->lastTemperatureTimeStamp)
+                                {
+                                    processor->lastTemperatureTimeStamp = timeStamp;
                                     TemperatureData dataTemperature;
                                     dataTemperature.timeStamp = (double)timeStamp;
                                     unsigned char datasize = (resolutionBits / 8);
                                     dataTemperature.temperature = GetFloatSafe(payload,17 + i * lengthPerSample);
                                     //OnTemperatureDataFromQHB(dataTemperature);
-                                    fprintf(sensorsFile, "TEMP, %ld, %lf\n", (unsigned long)dataTemperature.timeStamp, dataTemperature.temperature);
+                                    SinkTemperature(sink, &dataTemperature);
+                                    counts->samples++;
 
                                 }
                                 else
                                 {
+                                    counts->nonMonotonic++;
                                     //printf("TS Temperature Error\n");
                                 }
                                 break;
                             case Pressure:
-                                if (lastPressureTimeStamp >= 500000000)
-                                    lastPressureTimeStamp = 0;
-                                if (timeStamp > lastPressureTimeStamp)
+                                if (processor->lastPressureTimeStamp >= 500000000)
                                 {
-                                    lastPressureTimeStamp = timeStamp;
+                                    processor->lastPressureTimeStamp = 0;
+                                    counts->rollovers++;
+                                }
+                                if (timeStamp > processor->lastPressureTimeStamp)
+                                {
+                                    processor->lastPressureTimeStamp = timeStamp;
                                     PressureData dataPressure;
                                     dataPressure.timeStamp = (double)timeStamp;
                                     unsigned char datasize = (resolutionBits / 8);
                                     dataPressure.pressure = GetFloatSafe(payload,17 + i * lengthPerSample);
                                     //OnPressureDataFromQHB(dataPressure);
-                                    fprintf(sensorsFile, "PRESSURE, %ld, %lf\n", (unsigned long)dataPressure.timeStamp, dataPressure.pressure);
+                                    SinkPressure(sink, &dataPressure);
+                                    counts->samples++;
                                 }
                                 else
                                 {
-
+                                    counts->nonMonotonic++;
                                 }
                                 break;
                             case Light:
-                                if (lastLightTimeStamp >= 500000000)
-                                    lastLightTimeStamp = 0;
-                                if (timeStamp > lastLightTimeStamp)
+                                if (processor->lastLightTimeStamp >= 500000000)
                                 {
-                                    lastLightTimeStamp = timeStamp;
+                                    processor->lastLightTimeStamp = 0;
+                                    counts->rollovers++;
+                                }
+                                if (timeStamp > processor->lastLightTimeStamp)
+                                {
+                                    processor->lastLightTimeStamp = timeStamp;
                                     LightData dataLight;
                                     dataLight.timeStamp = timeStamp;
                                     unsigned char datasize = (resolutionBits / 8);
                                     dataLight.ch0 = BUILD_UINT16(payload[17 + i * lengthPerSample],payload[17 + i * lengthPerSample+1]);
                                     dataLight.ch1 = BUILD_UINT16(payload[17 + datasize+i * lengthPerSample],payload[17 +datasize+ i * lengthPerSample+1]);
                                     //OnLightDataFromQHB(dataLight);
-                                    fprintf(sensorsFile, "LIGHT, %ld, %d,%d\n", (unsigned long)dataLight.timeStamp, dataLight.ch0,dataLight.ch1);
+                                    SinkLight(sink, &dataLight);
+                                    counts->samples++;
                                 }
                                 else
                                 {
+                                    counts->nonMonotonic++;
                                     //printf("TS Light Error\n");
                                 }
 
@@ -313,6 +343,8 @@ void ProcessDecodedMessage(short command, unsigned short payloadLength, unsigned
                 break;
             case (short)GPS_DATA_PACKET:
                 {
+                        if (payloadLength < 34)
+                            break;
                         GPSDatas gpsDatas;
                         unsigned short ms =  BUILD_UINT16(payload[3],payload[4]);
                         if (ms > 999)
@@ -336,29 +368,37 @@ void ProcessDecodedMessage(short command, unsigned short payloadLength, unsigned
                         gpsDatas.satellites = payload[32];
                         gpsDatas.antenna = payload[33];
 
-                        if (lastGPSDate.year != gpsDatas.dateOfFix.year ||lastGPSDate.month != gpsDatas.dateOfFix.month ||lastGPSDate.day != gpsDatas.dateOfFix.day || 
-                            lastGPSDate.hour!=gpsDatas.dateOfFix.hour || lastGPSDate.minute!=gpsDatas.dateOfFix.minute || lastGPSDate.second!=gpsDatas.dateOfFix.second)
+                        if (processor->lastGPSDate.year != gpsDatas.dateOfFix.year ||processor->lastGPSDate.month != gpsDatas.dateOfFix.month ||processor->lastGPSDate.day != gpsDatas.dateOfFix.day || 
+                            processor->lastGPSDate.hour!=gpsDatas.dateOfFix.hour || processor->lastGPSDate.minute!=gpsDatas.dateOfFix.minute || processor->lastGPSDate.second!=gpsDatas.dateOfFix.second)
                         {
-                            lastGPSDate = gpsDatas.dateOfFix;
+                            processor->lastGPSDate = gpsDatas.dateOfFix;
                             //OnGPSDataFromQHB(gpsDatas);
-                            fprintf(sensorsFile, "GPS, %04d/%02d/%02d %02d:%02d:%02d ", gpsDatas.dateOfFix.year,gpsDatas.dateOfFix.month, gpsDatas.dateOfFix.day,
-                                                                            gpsDatas.dateOfFix.hour,gpsDatas.dateOfFix.minute,gpsDatas.dateOfFix.second);
-                            fprintf(sensorsFile, "fix:%d, fixQual:%d, Lat:%f %c, lon: %f %c,", gpsDatas.fix,gpsDatas.fixQuality, gpsDatas.latitude, gpsDatas.latitudeDirection,
-                                                                            gpsDatas.longitude,gpsDatas.longitudeDirection);
-                            fprintf(sensorsFile, "speed:%f, ang:%f, alt:%f, sat:%d\n", gpsDatas.speed,gpsDatas.angle, gpsDatas.altitude, gpsDatas.satellites);                                                                            
+                            SinkGPS(sink, &gpsDatas);
+                            counts->samples++;
+                        }
+                        else
+                        {
+                            counts->nonMonotonic++;
                         }
                 }
                 break;
             case (short)GPS_PPS_PACKET:
                 {
+                    if (payloadLength < 8)
+                        break;
                     unsigned long long PPSTimeStamp =BUILD_UINT64(payload[7],payload[6],payload[5],payload[4],payload[3],payload[2],payload[1],payload[0]);
                     PPSTimeStamp *= 10;     //Pour avoir une unité en nano-seconde (Freq Horloge interne pic32 = 100MHz)
 
-                    if (PPSTimeStamp>lastPPSTimeStampNS)
+                    if (PPSTimeStamp>processor->lastPPSTimeStampNS)
                     {
-                        lastPPSTimeStampNS = PPSTimeStamp;
+                        processor->lastPPSTimeStampNS = PPSTimeStamp;
                         //OnGPSPPSFromQHB(PPSTimeStamp);
-                        fprintf(sensorsFile, "PPS:%llu\n", PPSTimeStamp);
+                        SinkPPS(sink, PPSTimeStamp);
+                        counts->samples++;
+                    }
+                    else
+                    {
+                        counts->nonMonotonic++;
                     }
                 }
                 break;
@@ -1,5 +1,8 @@
+#ifndef MSGPROCESSOR_H
+#define MSGPROCESSOR_H
 #include <stdbool.h>
 #include <stdio.h>
+#include "stats.h"
 #define HS_DATA_PACKET_FULL_TIMESTAMP 0x0A0A
 #define HS_DATA_PACKET_FULL_TIMESTAMP_V2 0x0A0C
 #define GPS_DATA_PACKET 0x0A0D
@@ -108,8 +111,42 @@ typedef struct GPSDatas_s
 }GPSDatas;
 
 
-float GetFloatSafe(unsigned char *p, int index);
+float GetFloatSafe(const unsigned char *p, int index);
 IMUData Normalize(RAWIMUData datas, unsigned char accelRange, unsigned char resolutionBits);
 SensorXYZData NormalizeSensorsDatas(RAWXYZData datas, float range, unsigned char resolutionBits);
-void ResetTimeStamp(void);
-void ProcessDecodedMessage(short command, unsigned short payloadLength, unsigned char payload[], FILE* sensorsFile);
\ No newline at end of file
+
+//Facteur d'echelle de la derniere configuration (range, resolution) vue pour un capteur XYZ
+typedef struct SensorScaleCache_s
+{
+    bool valid;
+    float range;
+    unsigned char resolutionBits;
+    double factor;
+}SensorScaleCache;
+
+struct SensorSink_s;
+//Etat du traitement des messages d'un flux : derniers timestamps de chaque
+//capteur (les echantillons qui reviennent en arriere sont ignores) et compteurs.
+//Un par flux, rien n'est partage entre deux flux ni entre deux threads.
+typedef struct MsgProcessor_s
+{
+    struct SensorSink_s* sink;      //destination des messages traites
+    unsigned int lastAccelTimeStamp;
+    unsigned int lastGyroTimeStamp;
+    unsigned int lastMagTimeStamp;
+    unsigned int lastLightTimeStamp;
+    unsigned int lastPressureTimeStamp;
+    unsigned int lastTemperatureTimeStamp;
+    unsigned int lastTimeStamp;
+    DateTime lastGPSDate;
+    double lastPPSTimeStampNS;
+    SensorScaleCache scales[3];     //Accel, Gyro, Mag
+    SensorStats counts[STATS_SENSOR_COUNT];     //lus par GetProcessorStats (--stats)
+}MsgProcessor;
+
+void ResetProcessor(MsgProcessor* processor, struct SensorSink_s* sink);
+// Adds the per sensor counters of the messages processed since ResetProcessor
+void GetProcessorStats(const MsgProcessor* processor, ConvertStats* stats);
+void ProcessDecodedMessage(MsgProcessor* processor, short command, unsigned short payloadLength, const unsigned char payload[]);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "logreader.h"
+#include "blockdecoder.h"
+#include "sensorsink.h"
+#include "timemap.h"
+#include "stats.h"
+#include "stitch.h"
+#include "decimate.h"
+#include "align.h"
+
+#define ALIGN_TAPS (2 * ALIGN_HALF_TAPS)
+#define ALIGN_PHASES 256            // kernels tabulated per sample, the ones between are interpolated
+#define ALIGN_CUTOFF 0.45           // of the sampling frequency, below the Nyquist frequency for the window
+#define ALIGN_KAISER_BETA 8.0
+#define ALIGN_CHUNK 4096            // output frames computed per pass
+#define ALIGN_PROGRESS_INTERVAL 0.25
+
+// One card : its file, its clock model and the window of its samples
+typedef struct Recorder_s
+{
+    LogReader reader;
+    bool opened;
+    TimeMap map;
+    int firstChannel;               // in the output
+    int nbChan;
+    long samplesPerBlock;
+    long long nbSamples;            // per channel
+    const unsigned char* dmaBlock;  // last block read
+    long block;
+    float** window;                 // per channel, the samples windowStart to windowStart + windowLength
+    long long windowStart;
+    long windowLength;
+    long windowCapacity;
+    double startPosition;           // of the first and last output samples
+    double endPosition;
+}Recorder;
+
+////////////////////
+/// Kernel       ///
+////////////////////
+
+// (ALIGN_PHASES + 1) kernels of ALIGN_TAPS taps : kernel j interpolates at
+// j / ALIGN_PHASES of a sample after sample i, tap k applies to sample
+// i - ALIGN_HALF_TAPS + 1 + k. Each kernel has a unit gain at DC.
+static float* DesignKernels(void)
+{
+    float* kernels = malloc((ALIGN_PHASES + 1) * ALIGN_TAPS * sizeof(float));
+    double taps[ALIGN_TAPS];
+    for (int j = 0; j <= ALIGN_PHASES; j++)
+    {
+        double fraction = (double)j / ALIGN_PHASES, sum = 0;
+        for (int k = 0; k < ALIGN_TAPS; k++)
+        {
+            double x = k - ALIGN_HALF_TAPS + 1 - fraction;
+            double sinc = x == 0 ? 2 * ALIGN_CUTOFF : sin(2 * M_PI * ALIGN_CUTOFF * x) / (M_PI * x);
+            double r = x / ALIGN_HALF_TAPS;
+            taps[k] = r * r < 1 ? sinc * BesselI0(ALIGN_KAISER_BETA * sqrt(1 - r * r)) / BesselI0(ALIGN_KAISER_BETA) : 0;
+            sum += taps[k];
+        }
+        for (int k = 0; k < ALIGN_TAPS; k++)
+            kernels[j * ALIGN_TAPS + k] = (float)(taps[k] / sum);
+    }
+    return kernels;
+}
+
+////////////////////
+/// Recorders    ///
+////////////////////
+
+// Clock models of the file, from the additional data of every block
+static void FitClock(Recorder* recorder)
+{
+    const LogReader* reader = &recorder->reader;
+    TimeMapBuilder builder;
+    TimeMapBuilderInit(&builder, reader->hdr.samplingFrequency, recorder->samplesPerBlock);
+    SensorSink sink;
+    SensorSinkInit(&sink, NULL, NULL);
+    SensorSinkTimeMap(&sink, &builder);
+    BlockDecoder decoder;
+    BlockDecoderInit(&decoder, &sink, false);
+    for (long k = 0; k < reader->nbBlocks; k++)
+        BlockDecoderFeed(&decoder, k, LogReaderAdditionnalData(reader, k), reader->hdr.sizeOfAdditionnalDataBuffer);
+    SensorSinkClose(&sink);
+    // the grids now belong to the recorder
+    recorder->map = *TimeMapFinish(&builder);
+}
+
+static void LoadPlane(float* dst, const unsigned char* p, long nbSamples, int resolutionBytes)
+{
+    switch (resolutionBytes)
+    {
+        case 2:
+            for (long i = 0; i < nbSamples; i++, p += 2)
+                dst[i] = (float)(short)(p[0] | (p[1] << 8));
+            break;
+        case 3:
+            for (long i = 0; i < nbSamples; i++, p += 3)
+                dst[i] = (float)((int)((unsigned)p[0] << 8 | (unsigned)p[1] << 16 | (unsigned)p[2] << 24) >> 8);
+            break;
+        default:
+            for (long i = 0; i < nbSamples; i++, p += 4)
+                dst[i] = (float)(int)((unsigned)p[0] | (unsigned)p[1] << 8 | (unsigned)p[2] << 16 | (unsigned)p[3] << 24);
+            break;
+    }
+}
+
+// Appends up to count samples from sample, zeros outside of the recording.
+// The blocks are read in order, each one once.
+static long AppendSamples(Recorder* recorder, long long sample, long count)
+{
+    float** window = recorder->window;
+    long at = recorder->windowLength;
+    if (sample < 0 || sample >= recorder->nbSamples)
+    {
+        if (sample < 0 && count > -sample)
+            count = (long)-sample;
+        for (int c = 0; c < recorder->nbChan; c++)
+            memset(window[c] + at, 0, count * sizeof(float));
+        return count;
+    }
+    long block = (long)(sample / recorder->samplesPerBlock);
+    long offset = (long)(sample % recorder->samplesPerBlock);
+    if (count > recorder->samplesPerBlock - offset)
+        count = recorder->samplesPerBlock - offset;
+    if (block != recorder->block)
+    {
+        LogReader* reader = &recorder->reader;
+        if (reader->nextBlock < block)
+            LogReaderSeek(reader, block);
+        const unsigned char* additionnalData;
+        LogReaderNextBlock(reader, &additionnalData, &recorder->dmaBlock);
+        recorder->block = block;
+    }
+    int resolutionBytes = recorder->reader.hdr.resolutionBits / 8;
+    for (int c = 0; c < recorder->nbChan; c++)
+    {
+        const unsigned char* plane = recorder->dmaBlock + ((long long)c * recorder->samplesPerBlock + offset) * resolutionBytes;
+        LoadPlane(window[c] + at, plane, count, resolutionBytes);
+    }
+    return count;
+}
+
+// Window holding the samples first to last
+static void FillWindow(Recorder* recorder, long long first, long long last)
+{
+    // the samples before first are not needed anymore
+    long drop = first > recorder->windowStart ? (long)(first - recorder->windowStart) : 0;
+    if (drop >= recorder->windowLength)
+    {
+        recorder->windowStart = first;
+        recorder->windowLength = 0;
+    }
+    else if (drop > 0)
+    {
+        recorder->windowLength -= drop;
+        for (int c = 0; c < recorder->nbChan; c++)
+            memmove(recorder->window[c], recorder->window[c] + drop, recorder->windowLength * sizeof(float));
+        recorder->windowStart = first;
+    }
+    long needed = (long)(last - recorder->windowStart + 1);
+    if (needed > recorder->windowCapacity)
+    {
+        recorder->windowCapacity = needed + recorder->samplesPerBlock;
+        for (int c = 0; c < recorder->nbChan; c++)
+            recorder->window[c] = realloc(recorder->window[c], recorder->windowCapacity * sizeof(float));
+    }
+    while (recorder->windowLength < needed)
+    {
+        long long sample = recorder->windowStart + recorder->windowLength;
+        recorder->windowLength += AppendSamples(recorder, sample, needed - recorder->windowLength);
+    }
+}
+
+// Interpolates nbFrames frames of the recorder at the positions
+// position + f * step into its channels of the interleaved frames
+static void Resample(Recorder* recorder, const float* kernels, float* frames, int frameChannels, long nbFrames,
+                     double position, double step)
+{
+    double lastPosition = position + (nbFrames - 1) * step;
+    FillWindow(recorder, (long long)floor(position) - ALIGN_HALF_TAPS + 1, (long long)floor(lastPosition) + ALIGN_HALF_TAPS);
+    float taps[ALIGN_TAPS];
+    for (long f = 0; f < nbFrames; f++)
+    {
+        double p = position + f * step;
+        double base = floor(p);
+        double phase = (p - base) * ALIGN_PHASES;
+        int j = (int)phase;
+        if (j >= ALIGN_PHASES)
+            j = ALIGN_PHASES - 1;
+        float w = (float)(phase - j);
+        const float* k0 = kernels + j * ALIGN_TAPS;
+        const float* k1 = k0 + ALIGN_TAPS;
+        for (int k = 0; k < ALIGN_TAPS; k++)
+            taps[k] = k0[k] + w * (k1[k] - k0[k]);
+        long first = (long)((long long)base - ALIGN_HALF_TAPS + 1 - recorder->windowStart);
+        float* frame = frames + f * frameChannels + recorder->firstChannel;
+        for (int c = 0; c < recorder->nbChan; c++)
+        {
+            const float* samples = recorder->window[c] + first;
+            float sum = 0;
+            for (int k = 0; k < ALIGN_TAPS; k++)
+                sum += taps[k] * samples[k];
+            frame[c] = sum;
+        }
+    }
+}
+
+static void CloseRecorders(Recorder* recorders, int nbFiles)
+{
+    for (int i = 0; i < nbFiles; i++)
+    {
+        Recorder* recorder = &recorders[i];
+        if (recorder->opened)
+            CloseLogReader(&recorder->reader);
+        FreeTimeMap(&recorder->map);
+        for (int c = 0; c < recorder->nbChan && recorder->window != NULL; c++)
+            free(recorder->window[c]);
+        free(recorder->window);
+    }
+    free(recorders);
+}
+
+static ConvertStatus Fail(AlignResult* result, Recorder* recorders, int nbFiles, const char* path, const char* error)
+{
+    if (path != NULL)
+        snprintf(result->error, sizeof(result->error), "%.150s : %.100s", path, error);
+    else if (error != result->error)
+        snprintf(result->error, sizeof(result->error), "%s", error);
+    CloseRecorders(recorders, nbFiles);
+    return ConvertError;
+}
+
+static long long OutputTime(long long startNS, long long sample, int sampleRate)
+{
+    return startNS + llround((double)sample * 1e9 / sampleRate);
+}
+
+static void WriteTable(FILE* table, char* const* logPaths, const Recorder* recorders, int nbFiles, long long nbSamples)
+{
+    fprintf(table, "File,First channel,Channels,Start sample,Drift (ppm),PPS,PPS rejected,PPS jitter (ns)\n");
+    for (int i = 0; i < nbFiles; i++)
+    {
+        const Recorder* recorder = &recorders[i];
+        // samples of the card per output sample, minus one
+        double drift = nbSamples > 1 ? ((recorder->endPosition - recorder->startPosition) / (nbSamples - 1) - 1) * 1e6 : 0;
+        fprintf(table, "%s,%d,%d,%.6f,%.4f,%u,%u,%.0f\n", logPaths[i], recorder->firstChannel + 1, recorder->nbChan,
+                recorder->startPosition, drift, recorder->map.ppsAccepted, recorder->map.ppsRejected,
+                recorder->map.jitterNS);
+    }
+}
+
+ConvertStatus AlignLogFiles(char* const* logPaths, int nbFiles, const char* wavPath, FILE* wavStream,
+                            const AlignOptions* options, AlignResult* result)
+{
+    memset(result, 0, sizeof(AlignResult));
+    int verbose = options->convert.verbose;
+    Recorder* recorders = calloc(nbFiles > 0 ? nbFiles : 1, sizeof(Recorder));
+    if (nbFiles < 2)
+        return Fail(result, recorders, nbFiles, NULL, "at least two files are needed");
+
+    // every file is opened and its clock fitted before anything is written
+    int nbChannels = 0;
+    long long startNS = 0, endNS = 0;
+    for (int i = 0; i < nbFiles; i++)
+    {
+        Recorder* recorder = &recorders[i];
+        int status = OpenLogReader(&recorder->reader, logPaths[i], 0);
+        if (status != 0)
+            return Fail(result, recorders, nbFiles, logPaths[i], status == -3 ? "invalid header"
+                                                                 : status == -2 ? "empty file" : "cannot be opened");
+        recorder->opened = true;
+        const HighBlueHeader* hdr = &recorder->reader.hdr;
+        const HighBlueHeader* first = &recorders[0].reader.hdr;
+        if (hdr->samplingFrequency != first->samplingFrequency || hdr->resolutionBits != first->resolutionBits)
+            return Fail(result, recorders, nbFiles, logPaths[i], "not the sampling frequency or resolution of the first file");
+        if (hdr->resolutionBits != 16 && hdr->resolutionBits != 24 && hdr->resolutionBits != 32)
+            return Fail(result, recorders, nbFiles, logPaths[i], "resolution not supported yet sorry");
+        recorder->nbChan = hdr->numberOfChan;
+        recorder->firstChannel = nbChannels;
+        nbChannels += recorder->nbChan;
+        if (nbChannels > MAX_INTERLEAVE_CHAN)
+            return Fail(result, recorders, nbFiles, logPaths[i], "too many channels");
+        recorder->samplesPerBlock = hdr->dmaBlockSize / (hdr->numberOfChan * (hdr->resolutionBits / 8));
+        recorder->nbSamples = (long long)recorder->reader.nbBlocks * recorder->samplesPerBlock;
+        recorder->block = -1;
+        recorder->window = calloc(recorder->nbChan, sizeof(float*));
+        FitClock(recorder);
+        if (recorder->nbSamples < ALIGN_TAPS)
+            return Fail(result, recorders, nbFiles, logPaths[i], "too short");
+        long long firstNS, lastNS;
+        if (recorder->map.audio.count < 2 || recorder->map.time.count < 2)
+            return Fail(result, recorders, nbFiles, logPaths[i], "no packet timestamps or no PPS, cannot be aligned");
+        if (!(recorder->map.flags & TIMEMAP_UTC))
+            return Fail(result, recorders, nbFiles, logPaths[i], "no GPS fix, the UTC time of the recording is unknown");
+        // the kernel of the first and last output samples stays within every recording
+        TimeMapSampleUTC(&recorder->map, ALIGN_HALF_TAPS - 1, &firstNS);
+        TimeMapSampleUTC(&recorder->map, (double)(recorder->nbSamples - ALIGN_HALF_TAPS), &lastNS);
+        startNS = i == 0 || firstNS > startNS ? firstNS : startNS;
+        endNS = i == 0 || lastNS < endNS ? lastNS : endNS;
+        if (verbose)
+            printf("%s : %d channels, %lld samples, %u PPS (%u rejected), jitter %.0f ns, drift %.3f ppm\n", logPaths[i],
+                   recorder->nbChan, recorder->nbSamples, recorder->map.ppsAccepted, recorder->map.ppsRejected,
+                   recorder->map.jitterNS, recorder->map.driftPPM);
+    }
+    int sampleRate = recorders[0].reader.hdr.samplingFrequency;
+    if (startNS > endNS)
+        return Fail(result, recorders, nbFiles, NULL, "the recordings do not overlap");
+    long long nbSamples = (long long)floor((double)(endNS - startNS) * sampleRate / 1e9) + 1;
+
+    int* channels = malloc(nbChannels * sizeof(int));
+    for (int c = 0; c < nbChannels; c++)
+        channels[c] = c;
+    SampleFormatSpec format;
+    bool formatOK = ConvertSampleFormat(&options->convert, recorders[0].reader.hdr.resolutionBits, channels, nbChannels,
+                                        &format, result->error, sizeof(result->error));
+    free(channels);
+    if (!formatOK)
+        return Fail(result, recorders, nbFiles, NULL, result->error);
+    int frameSize = nbChannels * SampleFormatBytes(&format);
+
+    FILE* wavfile = wavStream != NULL ? wavStream : fopen(wavPath, "wb");
+    if (wavfile == NULL)
+        return Fail(result, recorders, nbFiles, NULL, "Failed to open wav output file");
+    char description[64];
+    snprintf(description, sizeof(description), "QHB recordings of %d cards aligned on the GPS time", nbFiles);
+    unsigned char header[STITCH_HEADER_SIZE];
+    bool rf64;
+    FormatStitchHeader(header, &format, sampleRate, nbChannels, description, startNS, STITCH_UNKNOWN_SIZE, &rf64);
+    bool ok = fwrite(header, 1, STITCH_HEADER_SIZE, wavfile) == STITCH_HEADER_SIZE;
+
+    float* kernels = DesignKernels();
+    float* frames = malloc((size_t)ALIGN_CHUNK * nbChannels * sizeof(float));
+    char* out = malloc((size_t)ALIGN_CHUNK * frameSize);
+    double nextProgress = 0;
+    for (long long n = 0; n < nbSamples && ok; n += ALIGN_CHUNK)
+    {
+        long nbFrames = nbSamples - n < ALIGN_CHUNK ? (long)(nbSamples - n) : ALIGN_CHUNK;
+        // the position is linear over a chunk, the drift only shows over many of them
+        long long chunkStartNS = OutputTime(startNS, n, sampleRate);
+        long long chunkEndNS = OutputTime(startNS, n + nbFrames, sampleRate);
+        for (int i = 0; i < nbFiles; i++)
+        {
+            Recorder* recorder = &recorders[i];
+            double position, endPosition;
+            TimeMapUTCSample(&recorder->map, chunkStartNS, &position);
+            TimeMapUTCSample(&recorder->map, chunkEndNS, &endPosition);
+            double step = (endPosition - position) / nbFrames;
+            if (n == 0)
+                recorder->startPosition = position;
+            recorder->endPosition = position + (nbFrames - 1) * step;
+            Resample(recorder, kernels, frames, nbChannels, nbFrames, position, step);
+        }
+        FormatFrames(out, frames, nbFrames, nbChannels, &format, n);
+        ok = fwrite(out, frameSize, nbFrames, wavfile) == (size_t)nbFrames;
+        if (options->convert.progress && StatsNow() >= nextProgress)
+        {
+            nextProgress = StatsNow() + ALIGN_PROGRESS_INTERVAL;
+            printf("\r aligning %d files :  %lld%%", nbFiles, (n + nbFrames) * 100 / nbSamples);
+            fflush(stdout);
+        }
+    }
+    if (options->convert.progress)
+        printf("\r aligning %d files :  %lld%%\r\n", nbFiles, ok ? 100LL : 0LL);
+    free(kernels);
+    free(frames);
+    free(out);
+
+    unsigned long long dataSize = (unsigned long long)nbSamples * frameSize;
+    if (ok && (dataSize & 1))
+        ok = fputc(0, wavfile) != EOF;      // chunks are word aligned
+    if (ok)
+    {
+        FormatStitchHeader(header, &format, sampleRate, nbChannels, description, startNS, dataSize, &rf64);
+        if (PatchStitchHeader(wavfile, header))
+            result->rf64 = rf64;
+        else if (verbose)
+            printf("wav output not seekable, streaming sizes kept\n");
+    }
+    if (wavfile == wavStream)
+        ok &= fflush(wavfile) == 0;
+    else
+        ok &= fclose(wavfile) == 0;
+    if (ok && options->tablePath != NULL)
+    {
+        FILE* table = fopen(options->tablePath, "w");
+        ok = table != NULL;
+        if (ok)
+        {
+            WriteTable(table, logPaths, recorders, nbFiles, nbSamples);
+            ok = fclose(table) == 0;
+        }
+        if (!ok)
+            snprintf(result->error, sizeof(result->error), "Failed to write alignment table");
+    }
+    result->nbFiles = nbFiles;
+    result->nbChannels = nbChannels;
+    result->nbSamples = nbSamples;
+    result->startNS = startNS;
+    result->bytesWritten = STITCH_HEADER_SIZE + dataSize + (dataSize & 1);
+    for (int i = 0; i < nbFiles; i++)
+        result->bytesRead += recorders[i].reader.size;
+    CloseRecorders(recorders, nbFiles);
+    if (!ok && result->error[0] == '\0')
+        snprintf(result->error, sizeof(result->error), "Failed to write wav output file");
+    return ok ? ConvertOK : ConvertError;
+}
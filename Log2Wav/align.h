@@ -0,0 +1,58 @@
+#ifndef ALIGN_H
+#define ALIGN_H
+#include <stdio.h>
+#include <stdbool.h>
+#include "convert.h"
+
+// Alignment of several recorders : the .log files of N cards recording at the
+// same time are merged into one multichannel wav (RF64 above 4 GB), the
+// channels of the first file first, sampled on a common UTC time grid so that
+// the hydrophones of all the cards are sample-aligned for localisation.
+//
+// The clock models of each file (see timemap.h) are fitted first, from the
+// additional data only. The output sample n is then the UTC time
+// start + n / samplingFrequency, where start is the first time recorded by
+// every card (half a kernel in, so that no output sample is interpolated from
+// outside of a recording). Each card is resampled to that grid while the
+// blocks are read in one forward pass : its fractional position is computed
+// from its model, which removes both the offset between the cards and the
+// drift of each card oscillator, and the samples are interpolated with a
+// Kaiser windowed sinc (ALIGN_HALF_TAPS on each side, phases interpolated
+// from a table).
+//
+// Memory is bounded whatever the length : a window of a few blocks per card,
+// one output chunk, and the time maps (16 bytes per second of recording).
+//
+// The table <prefix>_align.csv tells, for each file, where it lands :
+//   File,First channel,Channels,Start sample,Drift (ppm),PPS,PPS rejected,PPS jitter (ns)
+// where Start sample is the (fractional) sample of the file resampled to the
+// first output sample.
+
+#define ALIGN_HALF_TAPS 16
+
+typedef struct AlignOptions_s
+{
+    ConvertOptions convert;     // verbose, progress and sample format (sensitivities apply to the output
+                                // channels), the range, channels and decimation options are ignored
+    const char* tablePath;      // NULL : no alignment table
+}AlignOptions;
+
+typedef struct AlignResult_s
+{
+    int nbFiles;
+    int nbChannels;             // of the output
+    long long nbSamples;        // per channel
+    long long startNS;          // UTC of the first output sample, ns since 1970
+    long long bytesRead;
+    long long bytesWritten;
+    bool rf64;
+    char error[256];
+}AlignResult;
+
+// Aligns the files into wavPath, or into wavStream if not NULL (flushed, not
+// closed). Every file needs firmware >= 2, a GPS fix and the sampling
+// frequency and resolution of the first one.
+ConvertStatus AlignLogFiles(char* const* logPaths, int nbFiles, const char* wavPath, FILE* wavStream,
+                            const AlignOptions* options, AlignResult* result);
+
+#endif
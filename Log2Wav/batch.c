@@ -0,0 +1,640 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "batch.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#define PATH_SEPARATORS "/\\"
+#else
+#include <unistd.h>
+#include <glob.h>
+#define PATH_SEPARATORS "/"
+#endif
+
+typedef struct BatchJob_s
+{
+    char* logPath;
+    char* wavPath;
+    char* csvPath;          // NULL if no sensors output
+    char* npyPrefix;        // NULL if no .npy output
+    char* timePrefix;       // NULL if no PPS/GPS tables
+    char* indexPath;        // NULL if no block index
+    char* timeMapPath;      // NULL if no time map
+    char* decimatedPath;    // NULL if no decimated wav next to the full rate one
+    int index;              // position in the input order
+}BatchJob;
+
+typedef struct BatchError_s
+{
+    char* message;
+    struct BatchError_s* next;
+}BatchError;
+
+// Bounded queue shared by the walker (producer) and the workers
+typedef struct BatchQueue_s
+{
+    BatchJob** jobs;
+    int capacity;
+    int head;
+    int count;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+}BatchQueue;
+
+// Open addressing hash set of paths
+typedef struct PathSet_s
+{
+    char** paths;
+    int capacity;
+    int count;
+}PathSet;
+
+typedef struct BatchState_s
+{
+    BatchQueue queue;
+    const BatchOptions* options;
+    pthread_mutex_t statsLock;
+    int nbQueued;
+    int nbDone;
+    int nbConverted;
+    int nbSkipped;
+    int nbFailed;
+    long long bytesRead;
+    long long bytesWritten;
+    ConvertStats stats;     // summed over the files, with --stats
+    BatchError* errors;
+    BatchError** lastError;
+    PathSet seen;           // canonical paths of the files already queued
+    PathSet outputs;        // their output paths, without extension
+    char** tables;          // PPS/GPS tables prefix of each converted file, by input order, for the merge
+    int tablesCapacity;
+}BatchState;
+
+//////////////////
+/// Path utils ///
+//////////////////
+
+int GetCpuCount(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+static int MakeDir(const char* path)
+{
+#ifdef _WIN32
+    return _mkdir(path);
+#else
+    return mkdir(path, 0755);
+#endif
+}
+
+bool MakeDirs(const char* path)
+{
+    char* tmp = strdup(path);
+    for (char* p = tmp + 1; *p; p++)
+    {
+        if (strchr(PATH_SEPARATORS, *p) == NULL)
+            continue;
+        char sep = *p;
+        *p = '\0';
+        if (MakeDir(tmp) != 0 && errno != EEXIST)
+        {
+            free(tmp);
+            return false;
+        }
+        *p = sep;
+    }
+    bool ok = MakeDir(tmp) == 0 || errno == EEXIST;
+    free(tmp);
+    return ok;
+}
+
+static bool IsDirectory(const char* path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static bool HasLogExtension(const char* name)
+{
+    size_t len = strlen(name);
+    return len > 4 && name[len - 4] == '.' && tolower((unsigned char)name[len - 3]) == 'l'
+        && tolower((unsigned char)name[len - 2]) == 'o' && tolower((unsigned char)name[len - 1]) == 'g';
+}
+
+static const char* BaseName(const char* path)
+{
+    const char* base = path;
+    for (const char* p = path; *p; p++)
+        if (strchr(PATH_SEPARATORS, *p) != NULL && p[1] != '\0')
+            base = p + 1;
+    return base;
+}
+
+static char* JoinPath(const char* dir, const char* name)
+{
+    size_t len = strlen(dir);
+    char* path = malloc(len + strlen(name) + 2);
+    if (len > 0 && strchr(PATH_SEPARATORS, dir[len - 1]) == NULL)
+        sprintf(path, "%s/%s", dir, name);
+    else
+        sprintf(path, "%s%s", dir, name);
+    return path;
+}
+
+// Same path with the .log extension replaced by ext
+static char* ReplaceExtension(const char* path, const char* ext)
+{
+    size_t len = strlen(path) - (HasLogExtension(path) ? 4 : 0);
+    char* out = malloc(len + strlen(ext) + 1);
+    memcpy(out, path, len);
+    strcpy(out + len, ext);
+    return out;
+}
+
+static char* CanonicalPath(const char* path)
+{
+#ifdef _WIN32
+    char* full = _fullpath(NULL, path, 0);
+#else
+    char* full = realpath(path, NULL);
+#endif
+    return full != NULL ? full : strdup(path);
+}
+
+//////////////
+/// Queue  ///
+//////////////
+
+static void QueueInit(BatchQueue* q, int capacity)
+{
+    q->jobs = malloc(sizeof(BatchJob*) * capacity);
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->closed = false;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notEmpty, NULL);
+    pthread_cond_init(&q->notFull, NULL);
+}
+
+static void QueueDestroy(BatchQueue* q)
+{
+    free(q->jobs);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->notEmpty);
+    pthread_cond_destroy(&q->notFull);
+}
+
+static void QueuePush(BatchQueue* q, BatchJob* job)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity)
+        pthread_cond_wait(&q->notFull, &q->lock);
+    q->jobs[(q->head + q->count) % q->capacity] = job;
+    q->count++;
+    pthread_cond_signal(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Returns NULL once the queue is closed and empty
+static BatchJob* QueuePop(BatchQueue* q)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->notEmpty, &q->lock);
+    BatchJob* job = NULL;
+    if (q->count > 0)
+    {
+        job = q->jobs[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->notFull);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+static void QueueClose(BatchQueue* q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+///////////////
+/// Workers ///
+///////////////
+
+static void FreeJob(BatchJob* job)
+{
+    free(job->logPath);
+    free(job->wavPath);
+    free(job->csvPath);
+    free(job->npyPrefix);
+    free(job->timePrefix);
+    free(job->indexPath);
+    free(job->timeMapPath);
+    free(job->decimatedPath);
+    free(job);
+}
+
+static void AddError(BatchState* state, const char* logPath, const char* message)
+{
+    BatchError* error = malloc(sizeof(BatchError));
+    error->message = malloc(strlen(logPath) + strlen(message) + 4);
+    sprintf(error->message, "%s : %s", logPath, message);
+    error->next = NULL;
+    *state->lastError = error;
+    state->lastError = &error->next;
+}
+
+static void* BatchWorker(void* arg)
+{
+    BatchState* state = arg;
+    BatchJob* job;
+    while ((job = QueuePop(&state->queue)) != NULL)
+    {
+        ConvertResult result;
+        ConvertStatus status;
+        // the output tree is created lazily so that skipped directories stay empty
+        char* outDir = strdup(job->wavPath);
+        char* base = (char*)BaseName(outDir);
+        if (base != outDir)
+        {
+            base[-1] = '\0';
+            MakeDirs(outDir);
+        }
+        free(outDir);
+        ConvertOutputs outputs = {.wavPath = job->wavPath, .csvPath = job->csvPath, .npyPrefix = job->npyPrefix,
+                                  .timePrefix = job->timePrefix, .indexPath = job->indexPath,
+                                  .decimatedPath = job->decimatedPath, .timeMapPath = job->timeMapPath};
+        status = ConvertLogFile(job->logPath, &outputs, &state->options->convert, &result);
+
+        pthread_mutex_lock(&state->statsLock);
+        state->nbDone++;
+        state->bytesRead += result.bytesRead;
+        state->bytesWritten += result.bytesWritten;
+        StatsAdd(&state->stats, &result.stats);
+        switch (status)
+        {
+            case ConvertOK:
+                state->nbConverted++;
+                if (state->tables != NULL)
+                    state->tables[job->index] = strdup(job->timePrefix);
+                printf("[%d/%d] %s\n", state->nbDone, state->nbQueued, job->logPath);
+                break;
+            case ConvertSkippedEmpty:
+                state->nbSkipped++;
+                printf("[%d/%d] %s : skipped (empty)\n", state->nbDone, state->nbQueued, job->logPath);
+                break;
+            default:
+                state->nbFailed++;
+                AddError(state, job->logPath, result.error);
+                printf("[%d/%d] %s : FAILED (%s)\n", state->nbDone, state->nbQueued, job->logPath, result.error);
+                break;
+        }
+        fflush(stdout);
+        pthread_mutex_unlock(&state->statsLock);
+        FreeJob(job);
+    }
+    return NULL;
+}
+
+////////////////
+/// Walking  ///
+////////////////
+
+static unsigned long HashString(const char* s)
+{
+    unsigned long h = 2166136261u;
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+// Adds path to the set (which then owns it), returns false if it was already there
+static bool PathSetAdd(PathSet* set, char* path)
+{
+    if (2 * (set->count + 1) > set->capacity)
+    {
+        int oldCapacity = set->capacity;
+        char** old = set->paths;
+        set->capacity = oldCapacity > 0 ? 2 * oldCapacity : 256;
+        set->paths = calloc(set->capacity, sizeof(char*));
+        set->count = 0;
+        for (int i = 0; i < oldCapacity; i++)
+        {
+            if (old[i] == NULL)
+                continue;
+            unsigned long h = HashString(old[i]) % set->capacity;
+            while (set->paths[h] != NULL)
+                h = (h + 1) % set->capacity;
+            set->paths[h] = old[i];
+            set->count++;
+        }
+        free(old);
+    }
+    unsigned long h = HashString(path) % set->capacity;
+    while (set->paths[h] != NULL)
+    {
+        if (strcmp(set->paths[h], path) == 0)
+        {
+            free(path);
+            return false;
+        }
+        h = (h + 1) % set->capacity;
+    }
+    set->paths[h] = path;
+    set->count++;
+    return true;
+}
+
+static void PathSetFree(PathSet* set)
+{
+    for (int i = 0; i < set->capacity; i++)
+        free(set->paths[i]);
+    free(set->paths);
+}
+
+// logPath is the input file, relPath its path relative to the walked root
+static void QueueFile(BatchState* state, const char* logPath, const char* relPath)
+{
+    // a file given both by a directory and by a glob is converted once
+    if (!PathSetAdd(&state->seen, CanonicalPath(logPath)))
+        return;
+    char* outBase = state->options->outputRoot != NULL ? JoinPath(state->options->outputRoot, relPath) : strdup(logPath);
+    // two inputs with the same relative path (c1/f.log and c2/f.log with
+    // --output) would write the same outputs, only the first one is converted
+    if (!PathSetAdd(&state->outputs, ReplaceExtension(outBase, "")))
+    {
+        pthread_mutex_lock(&state->statsLock);
+        state->nbFailed++;
+        AddError(state, logPath, "same output path as another input, not converted");
+        pthread_mutex_unlock(&state->statsLock);
+        free(outBase);
+        return;
+    }
+    BatchJob* job = malloc(sizeof(BatchJob));
+    job->logPath = strdup(logPath);
+    bool flac = state->options->convert.flac;
+    job->wavPath = ReplaceExtension(outBase, flac ? ".flac" : ".wav");
+    job->csvPath = state->options->sensors ? ReplaceExtension(outBase, ".csv") : NULL;
+    job->npyPrefix = state->options->npy ? ReplaceExtension(outBase, "") : NULL;
+    bool merge = state->options->mergePrefix != NULL;
+    job->timePrefix = state->options->timeTables || merge ? ReplaceExtension(outBase, "") : NULL;
+    job->indexPath = state->options->index ? ReplaceExtension(outBase, ".log.idx") : NULL;
+    job->timeMapPath = state->options->timeMap ? ReplaceExtension(outBase, ".log.tmap") : NULL;
+    job->decimatedPath = NULL;
+    if (state->options->keepFullRate && state->options->convert.decimateRate > 0)
+    {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%dHz%s", state->options->convert.decimateRate, flac ? ".flac" : ".wav");
+        job->decimatedPath = ReplaceExtension(outBase, suffix);
+    }
+    free(outBase);
+    pthread_mutex_lock(&state->statsLock);
+    job->index = state->nbQueued++;
+    if (merge && job->index >= state->tablesCapacity)
+    {
+        int capacity = state->tablesCapacity > 0 ? 2 * state->tablesCapacity : 64;
+        state->tables = realloc(state->tables, sizeof(char*) * capacity);
+        memset(state->tables + state->tablesCapacity, 0, sizeof(char*) * (capacity - state->tablesCapacity));
+        state->tablesCapacity = capacity;
+    }
+    pthread_mutex_unlock(&state->statsLock);
+    QueuePush(&state->queue, job);
+}
+
+static int CompareNames(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Recursive walk, entries are visited in name order
+static void WalkDirectory(BatchState* state, const char* dir, const char* relDir)
+{
+    DIR* d = opendir(dir);
+    if (d == NULL)
+    {
+        pthread_mutex_lock(&state->statsLock);
+        state->nbFailed++;
+        AddError(state, dir, "cannot open directory");
+        pthread_mutex_unlock(&state->statsLock);
+        return;
+    }
+    int nbNames = 0, capacity = 64;
+    char** names = malloc(sizeof(char*) * capacity);
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (nbNames == capacity)
+        {
+            capacity *= 2;
+            names = realloc(names, sizeof(char*) * capacity);
+        }
+        names[nbNames++] = strdup(entry->d_name);
+    }
+    closedir(d);
+    qsort(names, nbNames, sizeof(char*), CompareNames);
+
+    for (int i = 0; i < nbNames; i++)
+    {
+        char* path = JoinPath(dir, names[i]);
+        char* relPath = relDir[0] != '\0' ? JoinPath(relDir, names[i]) : strdup(names[i]);
+        if (IsDirectory(path))
+            WalkDirectory(state, path, relPath);
+        else if (HasLogExtension(names[i]))
+            QueueFile(state, path, relPath);
+        free(path);
+        free(relPath);
+        free(names[i]);
+    }
+    free(names);
+}
+
+static void WalkInput(BatchState* state, const char* input)
+{
+    if (IsDirectory(input))
+        WalkDirectory(state, input, "");
+    else
+        QueueFile(state, input, BaseName(input));
+}
+
+///////////////
+///  Merge  ///
+///////////////
+
+// Appends the rows of a table (everything after its header line) to out,
+// the header is written before the first row of the merged table
+static bool AppendTableRows(FILE* out, const char* path, const char* header, bool* hasRows)
+{
+    FILE* in = fopen(path, "rb");
+    if (in == NULL)
+        return false;
+    char buffer[1 << 16];
+    int c;
+    while ((c = fgetc(in)) != EOF && c != '\n')
+        ;
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    {
+        if (!*hasRows)
+            fputs(header, out);
+        *hasRows = true;
+        fwrite(buffer, 1, n, out);
+    }
+    fclose(in);
+    return true;
+}
+
+// Concatenates the PPS and GPS tables of the converted files, as
+// pps_gps_extraction.py --merge_data does on the concatenated .csv
+static void MergeTimeTables(BatchState* state)
+{
+    static const char* suffixes[2] = {"_pps.csv", "_gps.csv"};
+    static const char* headers[2] = {"Timestamp\n", "Date,Heure,Fix,Fix Qual,Lat,Lon,Speed,Angle,Alt,Sat\n"};
+    const char* prefix = state->options->mergePrefix;
+    for (int t = 0; t < 2; t++)
+    {
+        char* outPath = malloc(strlen(prefix) + strlen(suffixes[t]) + 1);
+        sprintf(outPath, "%s%s", prefix, suffixes[t]);
+        FILE* out = fopen(outPath, "wb");
+        if (out == NULL)
+        {
+            state->nbFailed++;
+            AddError(state, outPath, "cannot create merged table");
+            free(outPath);
+            continue;
+        }
+        bool hasRows = false;
+        for (int i = 0; i < state->nbQueued; i++)
+        {
+            if (state->tables[i] == NULL)
+                continue;
+            char* path = malloc(strlen(state->tables[i]) + strlen(suffixes[t]) + 1);
+            sprintf(path, "%s%s", state->tables[i], suffixes[t]);
+            if (!AppendTableRows(out, path, headers[t], &hasRows))
+            {
+                state->nbFailed++;
+                AddError(state, path, "cannot read table to merge");
+            }
+            free(path);
+        }
+        if (!hasRows)
+            fputs("\n", out);
+        fclose(out);
+        printf("merged tables : %s\n", outPath);
+        free(outPath);
+    }
+}
+
+int RunBatch(char* const* inputs, int nbInputs, const BatchOptions* options)
+{
+    BatchState state;
+    memset(&state, 0, sizeof(BatchState));
+    state.options = options;
+    state.lastError = &state.errors;
+    pthread_mutex_init(&state.statsLock, NULL);
+    int nbThreads = options->nbThreads > 0 ? options->nbThreads : GetCpuCount();
+    int queueSize = options->queueSize > 0 ? options->queueSize : 4 * nbThreads;
+    QueueInit(&state.queue, queueSize);
+
+    double start = StatsNow();
+    pthread_t* workers = malloc(sizeof(pthread_t) * nbThreads);
+    for (int i = 0; i < nbThreads; i++)
+        pthread_create(&workers[i], NULL, BatchWorker, &state);
+
+    for (int i = 0; i < nbInputs; i++)
+    {
+#ifndef _WIN32
+        // patterns quoted on the command line are expanded here
+        if (strpbrk(inputs[i], "*?[") != NULL)
+        {
+            glob_t matches;
+            if (glob(inputs[i], 0, NULL, &matches) == 0)
+            {
+                for (size_t k = 0; k < matches.gl_pathc; k++)
+                    WalkInput(&state, matches.gl_pathv[k]);
+            }
+            else
+            {
+                fprintf(stderr, "no match for %s\n", inputs[i]);
+            }
+            globfree(&matches);
+            continue;
+        }
+#endif
+        WalkInput(&state, inputs[i]);
+    }
+    QueueClose(&state.queue);
+    for (int i = 0; i < nbThreads; i++)
+        pthread_join(workers[i], NULL);
+    if (options->mergePrefix != NULL)
+        MergeTimeTables(&state);
+    double elapsed = StatsNow() - start;
+    free(workers);
+
+    printf("\n%d files converted, %d skipped, %d failed with %d threads in %.2f s\n",
+           state.nbConverted, state.nbSkipped, state.nbFailed, nbThreads, elapsed);
+    if (elapsed > 0)
+        printf("read %.1f MB (%.1f MB/s), wrote %.1f MB (%.1f MB/s)\n",
+               state.bytesRead / 1e6, state.bytesRead / 1e6 / elapsed,
+               state.bytesWritten / 1e6, state.bytesWritten / 1e6 / elapsed);
+    if (options->convert.stats)
+    {
+        // the stage times are summed over the workers, the wall clock is the one of the run
+        state.stats.seconds = elapsed;
+        printf("\n");
+        PrintStats(stdout, &state.stats);
+    }
+    if (options->statsJson != NULL)
+    {
+        FILE* json = fopen(options->statsJson, "w");
+        if (json == NULL || !WriteStatsJson(json, &state.stats))
+        {
+            state.nbFailed++;
+            AddError(&state, options->statsJson, "cannot write statistics");
+        }
+        if (json != NULL)
+            fclose(json);
+    }
+    fflush(stdout);
+    if (state.errors != NULL)
+        fprintf(stderr, "\nErrors :\n");
+    while (state.errors != NULL)
+    {
+        BatchError* next = state.errors->next;
+        fprintf(stderr, "  %s\n", state.errors->message);
+        free(state.errors->message);
+        free(state.errors);
+        state.errors = next;
+    }
+    PathSetFree(&state.seen);
+    PathSetFree(&state.outputs);
+    for (int i = 0; i < state.tablesCapacity; i++)
+        free(state.tables[i]);
+    free(state.tables);
+    QueueDestroy(&state.queue);
+    pthread_mutex_destroy(&state.statsLock);
+    return state.nbFailed;
+}
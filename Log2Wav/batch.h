@@ -0,0 +1,38 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include <stdbool.h>
+#include "convert.h"
+
+// Batch mode: converts every .log file found in directories, glob patterns
+// or plain file arguments on a pool of worker threads fed by a bounded queue.
+
+typedef struct BatchOptions_s
+{
+    const char* outputRoot;     // the input tree is mirrored under this directory, NULL = next to each .log
+    int nbThreads;              // 0 = one per CPU
+    int queueSize;              // max files waiting for a worker, 0 = 4 per thread
+    bool sensors;               // also write the sensors .csv next to each .wav
+    bool npy;                   // also write one .npy per sensor stream next to each .wav
+    bool index;                 // also build (or reuse) the block index sidecar, .log.idx next to each .wav
+    bool timeTables;            // also write the PPS and GPS tables (_pps.csv, _gps.csv) next to each .wav
+    bool timeMap;               // also write the time map sidecar, .log.tmap next to each .wav
+    const char* mergePrefix;    // not NULL : the tables of all the files are also merged, in input order,
+                                // into <mergePrefix>_pps.csv and <mergePrefix>_gps.csv
+    bool keepFullRate;          // with convert.decimateRate : the full rate .wav is kept and the decimated
+                                // audio written next to it (_<rate>Hz.wav)
+    const char* statsJson;      // not NULL : the statistics summed over the files are also written there as
+                                // JSON (with convert.stats)
+    ConvertOptions convert;
+}BatchOptions;
+
+// Returns the number of files that failed. Errors are reported per file and
+// never stop the run.
+int RunBatch(char* const* inputs, int nbInputs, const BatchOptions* options);
+
+// Number of CPUs available, used as the default worker count
+int GetCpuCount(void);
+
+// mkdir -p, returns false if the directory could not be created
+bool MakeDirs(const char* path);
+
+#endif
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <string.h>
+#include "blockindex.h"
+#include "blockdecoder.h"
+
+#define V2_HEADER_SIZE 16   // revision and end of packet time, the same size is reserved at the end
+#define V1_HEADER_SIZE 6    // usb device
+
+void BlockDecoderInit(BlockDecoder* decoder, SensorSink* sink, bool verbose)
+{
+    memset(decoder, 0, sizeof(BlockDecoder));
+    decoder->sink = sink;
+    ResetDecoder(&decoder->messages);
+    ResetProcessor(&decoder->processor, sink);
+    decoder->verbose = verbose;
+    decoder->isFirst = true;
+}
+
+static void ParseMPU(BlockDecoder* decoder, const unsigned char* additionnalDataBlock, int size)
+{
+    int i, timestamp;
+    short int trameSize = 31, val; // fixed for now
+    const unsigned char* curData = additionnalDataBlock + V1_HEADER_SIZE;
+    if (decoder->verbose && decoder->isFirst)
+    {
+        printf("MPU Range : %hdG\n", *(curData + 5 + 3));
+        printf("MPU Resolution : %hd\n", *(curData + 5 + 3 + 1));
+        printf("MPU Sampling Frequency : %hd\n", *(curData + 5 + 3 + 3));
+    }
+    while (curData + trameSize + 6 < additionnalDataBlock + size)
+    {
+        if (!(curData[0] == 0xFE && curData[1] == 0x0A && curData[2] == 0x0A && curData[5] == 0x08))
+        {
+            // skip trame if header is incorrect
+            curData += trameSize + 6;
+            continue;
+        }
+        decoder->mpu.messages++;
+        curData += 3 + 2; // skip trame header, trame length
+        timestamp = *((int*)(curData + 9));
+        timestamp = ((timestamp & 0xFF000000) >> 24) | ((timestamp & 0x00FF0000) >> 8) | ((timestamp & 0x0000FF00) << 8) | ((timestamp & 0x000000FF) << 24);
+        if (timestamp > decoder->lastMPUTimeStamp)
+        {
+            short values[9];
+            for (i = 13; i < 31; i += 2)
+            {
+                val = *((short int*)(curData + i));
+                val = ((val & 0x00FF) << 8) | ((val & 0xFF00) >> 8);
+                values[(i - 13) / 2] = val;
+            }
+            SinkMPU(decoder->sink, timestamp, values);
+            decoder->lastMPUTimeStamp = timestamp;
+            decoder->mpu.samples++;
+        }
+        else
+        {
+            decoder->mpu.nonMonotonic++;
+        }
+        curData += trameSize + 1; // shift of trame size + 1 byte of checksum
+    }
+}
+
+void BlockDecoderFeed(BlockDecoder* decoder, long block, const unsigned char* additionnalData, int size)
+{
+    if (!SensorSinkActive(decoder->sink))
+        return;
+    SinkBlock(decoder->sink, block);
+    //On verifie le numero de version
+    unsigned char softwareMajorRev = additionnalData[5];
+    if (softwareMajorRev >= 2)
+    {
+        //On extrait la valeur du timeStamp MHz de fin de paquet courant
+        SinkPacketTimeStamp(decoder->sink, BlockEndTimeNS(additionnalData));
+        //On decode les msg du buffer additionnel
+        if (size > 2 * V2_HEADER_SIZE)
+            DecodeMessages(&decoder->messages, additionnalData + V2_HEADER_SIZE, size - 2 * V2_HEADER_SIZE, &decoder->processor);
+    }
+    else
+    {
+        ParseMPU(decoder, additionnalData, size);
+        decoder->mpuBytes += size;
+        decoder->isFirst = false;
+    }
+}
+
+void GetBlockDecoderStats(const BlockDecoder* decoder, ConvertStats* stats)
+{
+    GetDecoderStats(&decoder->messages, stats);
+    GetProcessorStats(&decoder->processor, stats);
+    stats->sensors[StatsIMU].messages += decoder->mpu.messages;
+    stats->sensors[StatsIMU].samples += decoder->mpu.samples;
+    stats->sensors[StatsIMU].nonMonotonic += decoder->mpu.nonMonotonic;
+    stats->messages += decoder->mpu.messages;
+    stats->stages[StatsDecode].bytes += decoder->mpuBytes;
+}
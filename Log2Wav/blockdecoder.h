@@ -0,0 +1,40 @@
+#ifndef BLOCKDECODER_H
+#define BLOCKDECODER_H
+#include <stdbool.h>
+#include "decoder.h"
+#include "MsgProcessor.h"
+#include "sensorsink.h"
+#include "stats.h"
+
+// Decoding context of one .log stream : everything needed to turn the
+// additional data of its blocks, in order, into sensors data. The frames cut
+// between two blocks and the last timestamp of each sensor live here, nothing
+// is global nor per thread, so that any number of streams can be decoded at
+// the same time, on one thread or on many (one context per stream, a context
+// is not shared between threads).
+//
+// Firmware >= 2 : the end of packet time of each block, then the
+// HS_DATA_PACKET_FULL_TIMESTAMP_V2, GPS and PPS messages.
+// Older firmwares : the fixed size MPU frames.
+
+typedef struct BlockDecoder_s
+{
+    SensorSink* sink;
+    MsgDecoder messages;        // v2 framing
+    MsgProcessor processor;     // v2 last timestamps
+    int lastMPUTimeStamp;       // v1 : last MPU timestamp written
+    SensorStats mpu;            // v1 counters
+    long long mpuBytes;         // v1 additional data scanned
+    bool verbose;               // the MPU settings of the first v1 block are printed
+    bool isFirst;
+}BlockDecoder;
+
+void BlockDecoderInit(BlockDecoder* decoder, SensorSink* sink, bool verbose);
+// Decodes the additional data of the next block of the stream to the sink,
+// does nothing when the sink has no output. block is the number of the block
+// in the .log, passed on with the typed events of the sink.
+void BlockDecoderFeed(BlockDecoder* decoder, long block, const unsigned char* additionnalData, int size);
+// Adds the counters of the blocks decoded since BlockDecoderInit
+void GetBlockDecoderStats(const BlockDecoder* decoder, ConvertStats* stats);
+
+#endif
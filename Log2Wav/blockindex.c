@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blockindex.h"
+#include "Macros.h"
+
+#define INDEX_MAGIC "QHBIDX\0\0"
+#define INDEX_VERSION 1
+#define INDEX_HEADER_SIZE 64
+#define INDEX_ENTRY_SIZE 32
+
+static void PutLE(unsigned char* p, unsigned long long value, int size)
+{
+    for (int i = 0; i < size; i++)
+        p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static unsigned long long GetLE(const unsigned char* p, int size)
+{
+    unsigned long long value = 0;
+    for (int i = size - 1; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+unsigned long long BlockEndTimeNS(const unsigned char* additionnalData)
+{
+    if (additionnalData[5] < 2)
+        return 0;
+    //On recupere l'instant de fin du paquet (compteur 100MHz big endian)
+    unsigned long long timeStamp100MHz = BUILD_UINT64(additionnalData[14], additionnalData[13],
+                                                      additionnalData[12], additionnalData[11],
+                                                      additionnalData[10], additionnalData[9],
+                                                      additionnalData[8], additionnalData[7]);
+    return timeStamp100MHz * 10;
+}
+
+static long SamplesPerBlock(const HighBlueHeader* hdr)
+{
+    int frameSize = hdr->numberOfChan * (hdr->resolutionBits / 8);
+    return frameSize > 0 ? hdr->dmaBlockSize / frameSize : 0;
+}
+
+static void IndexBlocks(const LogReader* reader, BlockIndex* index, long from)
+{
+    for (long k = from; k < index->nbBlocks; k++)
+    {
+        const unsigned char* additionnalData = LogReaderAdditionnalData(reader, k);
+        BlockIndexEntry* entry = &index->entries[k];
+        entry->offset = LogReaderBlockOffset(reader, k);
+        entry->endTimeNS = BlockEndTimeNS(additionnalData);
+        entry->firstSample = (long long)k * index->samplesPerBlock;
+        entry->majorRev = additionnalData[5];
+        entry->minorRev = additionnalData[6];
+    }
+}
+
+void BuildBlockIndex(const LogReader* reader, BlockIndex* index)
+{
+    index->nbBlocks = reader->nbBlocks;
+    index->samplesPerBlock = SamplesPerBlock(&reader->hdr);
+    index->entries = malloc(sizeof(BlockIndexEntry) * (reader->nbBlocks > 0 ? reader->nbBlocks : 1));
+    IndexBlocks(reader, index, 0);
+}
+
+static void FormatHeader(unsigned char* out, const LogReader* reader, long nbBlocks)
+{
+    const HighBlueHeader* hdr = &reader->hdr;
+    memset(out, 0, INDEX_HEADER_SIZE);
+    memcpy(out, INDEX_MAGIC, 8);
+    PutLE(out + 8, INDEX_VERSION, 4);
+    PutLE(out + 12, INDEX_ENTRY_SIZE, 4);
+    PutLE(out + 16, (unsigned int)hdr->headerSize, 4);
+    PutLE(out + 20, (unsigned int)hdr->dmaBlockSize, 4);
+    PutLE(out + 24, (unsigned int)hdr->sizeOfAdditionnalDataBuffer, 4);
+    PutLE(out + 28, (unsigned int)hdr->samplingFrequency, 4);
+    out[32] = (unsigned char)hdr->numberOfChan;
+    out[33] = (unsigned char)hdr->resolutionBits;
+    PutLE(out + 36, (unsigned int)hdr->timeStampOfStart, 4);
+    PutLE(out + 40, (unsigned long long)SamplesPerBlock(hdr), 4);
+    PutLE(out + 48, (unsigned long long)nbBlocks, 8);
+}
+
+bool WriteBlockIndex(const char* path, const LogReader* reader, const BlockIndex* index)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+        return false;
+    unsigned char header[INDEX_HEADER_SIZE];
+    FormatHeader(header, reader, index->nbBlocks);
+    bool ok = fwrite(header, 1, INDEX_HEADER_SIZE, file) == INDEX_HEADER_SIZE;
+    unsigned char record[INDEX_ENTRY_SIZE];
+    for (long k = 0; k < index->nbBlocks && ok; k++)
+    {
+        const BlockIndexEntry* entry = &index->entries[k];
+        memset(record, 0, INDEX_ENTRY_SIZE);
+        PutLE(record, (unsigned long long)entry->offset, 8);
+        PutLE(record + 8, entry->endTimeNS, 8);
+        PutLE(record + 16, (unsigned long long)entry->firstSample, 8);
+        record[24] = entry->majorRev;
+        record[25] = entry->minorRev;
+        ok = fwrite(record, 1, INDEX_ENTRY_SIZE, file) == INDEX_ENTRY_SIZE;
+    }
+    ok &= fclose(file) == 0;
+    return ok;
+}
+
+// *nbStoredOut is the number of entries found in the sidecar
+static bool LoadIndex(const char* path, const LogReader* reader, BlockIndex* index, long* nbStoredOut)
+{
+    memset(index, 0, sizeof(BlockIndex));
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    unsigned char header[INDEX_HEADER_SIZE], expected[INDEX_HEADER_SIZE];
+    bool ok = fread(header, 1, INDEX_HEADER_SIZE, file) == INDEX_HEADER_SIZE;
+    long nbStored = ok ? (long)GetLE(header + 48, 8) : 0;
+    // same .log header (everything but the number of entries), and not more blocks than the file
+    FormatHeader(expected, reader, nbStored);
+    ok = ok && memcmp(header, expected, INDEX_HEADER_SIZE) == 0 && nbStored <= reader->nbBlocks;
+    if (ok)
+    {
+        index->nbBlocks = reader->nbBlocks;
+        index->samplesPerBlock = SamplesPerBlock(&reader->hdr);
+        index->entries = malloc(sizeof(BlockIndexEntry) * (reader->nbBlocks > 0 ? reader->nbBlocks : 1));
+        unsigned char record[INDEX_ENTRY_SIZE];
+        for (long k = 0; k < nbStored && ok; k++)
+        {
+            ok = fread(record, 1, INDEX_ENTRY_SIZE, file) == INDEX_ENTRY_SIZE;
+            BlockIndexEntry* entry = &index->entries[k];
+            entry->offset = (long long)GetLE(record, 8);
+            entry->endTimeNS = GetLE(record + 8, 8);
+            entry->firstSample = (long long)GetLE(record + 16, 8);
+            entry->majorRev = record[24];
+            entry->minorRev = record[25];
+        }
+        // the last stored block must still be the same, otherwise the file was replaced
+        if (ok && nbStored > 0)
+        {
+            const BlockIndexEntry* last = &index->entries[nbStored - 1];
+            ok = last->offset == LogReaderBlockOffset(reader, nbStored - 1)
+                && last->endTimeNS == BlockEndTimeNS(LogReaderAdditionnalData(reader, nbStored - 1));
+        }
+        // blocks appended since the index was written
+        if (ok)
+            IndexBlocks(reader, index, nbStored);
+    }
+    fclose(file);
+    if (!ok)
+        FreeBlockIndex(index);
+    *nbStoredOut = nbStored;
+    return ok;
+}
+
+bool LoadBlockIndex(const char* path, const LogReader* reader, BlockIndex* index)
+{
+    long nbStored;
+    return LoadIndex(path, reader, index, &nbStored);
+}
+
+bool OpenBlockIndex(const char* path, const LogReader* reader, BlockIndex* index, bool* written)
+{
+    long nbStored;
+    *written = false;
+    if (LoadIndex(path, reader, index, &nbStored))
+    {
+        // rewritten only if the file has grown
+        if (nbStored == index->nbBlocks)
+            return true;
+    }
+    else
+    {
+        BuildBlockIndex(reader, index);
+    }
+    *written = true;
+    return WriteBlockIndex(path, reader, index);
+}
+
+void FreeBlockIndex(BlockIndex* index)
+{
+    free(index->entries);
+    index->entries = NULL;
+    index->nbBlocks = 0;
+}
+
+long BlockIndexFindTime(const BlockIndex* index, unsigned long long timeNS)
+{
+    long low = 0, high = index->nbBlocks;
+    while (low < high)
+    {
+        long mid = low + (high - low) / 2;
+        if (index->entries[mid].endTimeNS < timeNS)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+long ReaderFindTime(const LogReader* reader, unsigned long long timeNS)
+{
+    long low = 0, high = reader->nbBlocks;
+    while (low < high)
+    {
+        long mid = low + (high - low) / 2;
+        if (BlockEndTimeNS(LogReaderAdditionnalData(reader, mid)) < timeNS)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+long BlockIndexFindSample(const BlockIndex* index, long long sample)
+{
+    if (index->samplesPerBlock <= 0 || sample < 0)
+        return 0;
+    long long block = sample / index->samplesPerBlock;
+    return block < index->nbBlocks ? (long)block : index->nbBlocks;
+}
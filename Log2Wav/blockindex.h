@@ -0,0 +1,62 @@
+#ifndef BLOCKINDEX_H
+#define BLOCKINDEX_H
+#include <stdbool.h>
+#include "logreader.h"
+
+// Index of the blocks of a .log file, saved next to it as a small sidecar
+// (file.log.idx) so that a tool looking for the audio around a given time
+// jumps to the right block with one binary search instead of reading the
+// whole recording.
+//
+// Sidecar layout, little-endian :
+//   header (64 bytes) : magic "QHBIDX\0\0", version (u32), entry size (u32),
+//                       the .log header fields the index depends on, number of entries (u64)
+//   entries (32 bytes) : offset (u64), endTimeNS (u64), firstSample (u64),
+//                        major, minor revision (u8), 6 bytes of padding
+
+typedef struct BlockIndexEntry_s
+{
+    long long offset;                   // byte offset of the block (additional data) in the .log
+    unsigned long long endTimeNS;       // end of packet time (100 MHz counter in ns), 0 for firmware < 2
+    long long firstSample;              // number of the first audio sample (per channel) of the block
+    unsigned char majorRev;             // additionnalDataBlock[5]
+    unsigned char minorRev;             // additionnalDataBlock[6]
+}BlockIndexEntry;
+
+typedef struct BlockIndex_s
+{
+    long nbBlocks;
+    long samplesPerBlock;               // audio samples per channel in a dmaBlock
+    BlockIndexEntry* entries;
+}BlockIndex;
+
+// End of packet time of a block in ns, 0 if the firmware does not record it
+unsigned long long BlockEndTimeNS(const unsigned char* additionnalData);
+
+// Builds the index of every complete block of the reader, only the
+// additional data of each block is read
+void BuildBlockIndex(const LogReader* reader, BlockIndex* index);
+
+// Loads the sidecar at path if it was built for this file. An index of a
+// file which has grown since is completed with the new blocks.
+// Returns false if there is no usable sidecar.
+bool LoadBlockIndex(const char* path, const LogReader* reader, BlockIndex* index);
+// Returns false if the file cannot be written
+bool WriteBlockIndex(const char* path, const LogReader* reader, const BlockIndex* index);
+
+// Loads the sidecar at path, or builds the index and (re)writes the sidecar
+// if it is missing or stale. *written tells if the sidecar was (re)written.
+// Returns false only if the sidecar had to be written and could not be.
+bool OpenBlockIndex(const char* path, const LogReader* reader, BlockIndex* index, bool* written);
+void FreeBlockIndex(BlockIndex* index);
+
+// First block ending at or after timeNS, nbBlocks if none. The end times
+// are assumed increasing, which the firmware counter guarantees.
+long BlockIndexFindTime(const BlockIndex* index, unsigned long long timeNS);
+// Same search without an index, directly on the blocks of the mapped file
+// (reads the additional data of about log2(nbBlocks) blocks)
+long ReaderFindTime(const LogReader* reader, unsigned long long timeNS);
+// Block holding the audio sample (per channel) number sample
+long BlockIndexFindSample(const BlockIndex* index, long long sample);
+
+#endif
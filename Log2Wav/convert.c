@@ -0,0 +1,954 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "Macros.h"
+#include "blockdecoder.h"
+#include "interleave.h"
+#include "logreader.h"
+#include "sensorsink.h"
+#include "blockindex.h"
+#include "timemap.h"
+#include "decimate.h"
+#include "flac.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "convert.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define PROGRESS_INTERVAL 0.25   // seconds between two progress lines
+
+struct WaveHeader_s {
+    char chunkId[4]; // Riff Wave Header
+    int  chunkSize;
+    char format[4];
+    char subChunk1Id[4]; // Format Subchunk
+    int  subChunk1Size;
+    short int audioFormat;
+    short int numChannels;
+    int sampleRate;
+    int byteRate;
+    short int blockAlign;
+    short int bitsPerSample;
+    //short int extraParamSize;
+    char subChunk2Id[4]; // Data Subchunk
+    int  subChunk2Size;
+} WaveHeader_default = {{'R','I','F','F'}, 36, {'W','A','V','E'}, {'f','m','t',' '}, 16, 1, 0, 0, 0, 0, 0, {'d','a','t','a'}, 0};
+typedef struct WaveHeader_s WaveHeader;
+
+// Writes the whole buffer at offset without moving the file position, so
+// that several threads can fill different parts of the same file
+static bool PWriteAll(int fd, const char* buffer, long long size, long long offset){
+#ifdef _WIN32
+  HANDLE handle = (HANDLE)_get_osfhandle(fd);
+  OVERLAPPED overlapped = {0};
+  overlapped.Offset = (DWORD)offset;
+  overlapped.OffsetHigh = (DWORD)(offset >> 32);
+  DWORD written = 0;
+  return WriteFile(handle, buffer, (DWORD)size, &written, &overlapped) && written == size;
+#else
+  while(size > 0){
+    ssize_t written = pwrite(fd, buffer, size, offset);
+    if(written <= 0){
+      return false;
+    }
+    buffer += written;
+    size -= written;
+    offset += written;
+  }
+  return true;
+#endif
+}
+
+static bool ResizeFile(int fd, long long size){
+#ifdef _WIN32
+  return _chsize_s(fd, size) == 0;
+#else
+  return ftruncate(fd, size) == 0;
+#endif
+}
+
+// Part of the audio written to the wav : the samples [firstSample, endSample)
+// of some channels. Block k holds the samples [k, k+1) * blockSamples.
+typedef struct AudioSelection_s{
+  int nbChan;
+  const int* channels;        // plane of each channel written
+  long blockSamples;
+  int resolutionBytes;
+  const SampleFormatSpec* format;
+  int sampleBytes;            // in the wav
+  long long firstSample;
+  long long endSample;
+}AudioSelection;
+
+// Samples [*first, *end) of block k which are selected
+static void blockSpan(const AudioSelection* sel, long k, long* first, long* end){
+  long long blockStart = (long long)k * sel->blockSamples;
+  *first = blockStart < sel->firstSample ? (long)(sel->firstSample - blockStart) : 0;
+  *end = blockStart + sel->blockSamples > sel->endSample ? (long)(sel->endSample - blockStart) : sel->blockSamples;
+}
+
+// Interleaves the selected part of block k into wavBlock, returns its size
+// and sets *wavOffset to its position in the audio data of the wav
+static long selectBlock(const AudioSelection* sel, const char* dmaBlock, long k, char* wavBlock, long long* wavOffset){
+  long long blockStart = (long long)k * sel->blockSamples;
+  long first, end;
+  blockSpan(sel, k, &first, &end);
+  long frameSize = sel->nbChan * sel->sampleBytes;
+  *wavOffset = (blockStart + first - sel->firstSample) * frameSize;
+  InterleaveChannelsFormat(wavBlock, dmaBlock, sel->blockSamples, sel->channels, sel->nbChan, first, end - first,
+                           sel->format, blockStart + first - sel->firstSample);
+  return (end - first) * frameSize;
+}
+
+// Start of the selected part of each channel of block k, returns its length
+static long selectPlanes(const AudioSelection* sel, const char* dmaBlock, long k, const char** planes){
+  long first, end;
+  blockSpan(sel, k, &first, &end);
+  for(int c=0; c<sel->nbChan; c++){
+    planes[c] = dmaBlock + ((long)sel->channels[c] * sel->blockSamples + first) * sel->resolutionBytes;
+  }
+  return end - first;
+}
+
+// Decimates the selected part of block k into decBlock, returns its size
+static long decimateBlock(const AudioSelection* sel, Decimator* dec, const char* dmaBlock, long k, char* decBlock){
+  const char* planes[CONVERT_MAX_CHANNELS];
+  long n = selectPlanes(sel, dmaBlock, k, planes);
+  return DecimateBlock(dec, decBlock, planes, n) * sel->nbChan * sel->sampleBytes;
+}
+
+// Appends interleaved samples to a wav, or to the FLAC encoder writing it
+static bool writeAudio(FILE* file, FlacEncoder* flac, const char* frames, long size, int frameSize){
+  if(flac!=NULL){
+    return FlacEncodeFrames(flac, frames, size / frameSize);
+  }
+  StatsStage left = StatsSwitch(StatsWrite);
+  bool written = fwrite(frames, 1, size, file)==(size_t)size;
+  StatsSwitch(left);
+  return written;
+}
+
+// audioSize < 0 : unknown length, as written by sox or ffmpeg on a pipe
+static void writeWaveHeader(FILE* wavfile, int nbChan, int sampleRate, const SampleFormatSpec* format, long long audioSize){
+  WaveHeader whdr = WaveHeader_default;
+  int resolutionBytes = SampleFormatBytes(format);
+  whdr.audioFormat = format->format==SampleFormatFloat32 ? 3 : 1;  // WAVE_FORMAT_IEEE_FLOAT : PCM
+  whdr.numChannels = nbChan;
+  whdr.sampleRate = sampleRate;
+  whdr.bitsPerSample = resolutionBytes*8;
+  whdr.byteRate = whdr.sampleRate * whdr.numChannels * resolutionBytes;
+  whdr.blockAlign = whdr.numChannels * resolutionBytes;
+  whdr.chunkSize = 36 + audioSize;
+  whdr.subChunk2Size = whdr.chunkSize-36;
+  if(audioSize < 0){
+    whdr.chunkSize = -1;
+    whdr.subChunk2Size = -1;
+  }
+  fwrite(&whdr, sizeof(WaveHeader), 1, wavfile);
+}
+
+// Sizes of the RIFF and data chunks for audioSize bytes of samples, so that
+// a followed wav is valid while it is still being written
+static void patchWaveSizes(FILE* wavfile, long long audioSize){
+  int fd = fileno(wavfile);
+  int chunkSize = (int)(36 + audioSize);
+  int dataSize = (int)audioSize;
+  PWriteAll(fd, (const char*)&chunkSize, 4, 4);
+  PWriteAll(fd, (const char*)&dataSize, 4, 40);
+}
+
+// The wav stream given by the caller is only flushed
+static bool closeWav(FILE* wavfile, const ConvertOutputs* outputs){
+  if(wavfile==outputs->wavStream){
+    return fflush(wavfile)==0;
+  }
+  return fclose(wavfile)==0;
+}
+
+// A range of blocks converted by one audio thread. Each block lands at its
+// final position (audioOffset + its offset in the audio data) in the WAV file.
+typedef struct AudioRange_s{
+  const LogReader* reader;
+  const AudioSelection* sel;
+  long firstBlock;
+  long endBlock;
+  int fd;
+  long long audioOffset;
+  long wavBlockSize;
+  bool failed;
+  bool timed;                 // --stats : the stage times of the thread are added to stats
+  ConvertStats stats;
+}AudioRange;
+
+static void* convertAudioRange(void* arg){
+  AudioRange* range = arg;
+  const LogReader* reader = range->reader;
+  char* wavBlock = (char*) malloc(range->wavBlockSize);
+  if(range->timed){
+    StatsStartClock(StatsFormat);
+  }
+  for(long k=range->firstBlock; k<range->endBlock && !range->failed; k++){
+    long long wavOffset;
+    long size = selectBlock(range->sel, (const char*)LogReaderDmaBlock(reader, k), k, wavBlock, &wavOffset);
+    StatsSwitch(StatsWrite);
+    range->failed = !PWriteAll(range->fd, wavBlock, size, range->audioOffset + wavOffset);
+    StatsSwitch(StatsFormat);
+  }
+  StatsStopClock(&range->stats);
+  free(wavBlock);
+  return NULL;
+}
+
+// Audio stage of the pipeline : formats the dmaBlocks given by the reader
+// stage into the rings of the writers, or into the FLAC encoders which write
+// their own frames
+typedef struct AudioStage_s{
+  BlockRing* in;
+  const AudioSelection* sel;
+  long firstBlock;
+  bool fullRate;
+  FlacEncoder* wavFlac;
+  BlockRing* wavRing;         // full rate wav, NULL with wavFlac or without fullRate
+  Decimator* dec;             // NULL : no decimation
+  FlacEncoder* decFlac;
+  BlockRing* decRing;         // decimated wav, NULL with decFlac or without dec
+  long wavBlockSize;
+  long decBlockSize;
+  bool failed;
+  long long wavBytes;         // formatted, before any compression
+  long long decBytes;
+  bool timed;
+  ConvertStats stats;
+}AudioStage;
+
+static void* runAudioStage(void* arg){
+  AudioStage* stage = arg;
+  const AudioSelection* sel = stage->sel;
+  int frameSize = sel->nbChan * sel->sampleBytes;
+  // the FLAC encoders copy the frames, the writers get the ring slots
+  char* wavBlock = stage->wavFlac!=NULL ? malloc(stage->wavBlockSize) : NULL;
+  char* decBlock = stage->decFlac!=NULL ? malloc(stage->decBlockSize) : NULL;
+  if(stage->timed){
+    StatsStartClock(StatsFormat);
+  }
+  const unsigned char* dmaBlock;
+  long length;
+  for(long k=stage->firstBlock; !stage->failed && (dmaBlock = BlockRingPeek(stage->in, &length))!=NULL; k++){
+    if(stage->wavFlac!=NULL && sel->format->format==SampleFormatPCM){
+      const char* planes[CONVERT_MAX_CHANNELS];
+      long n = selectPlanes(sel, (const char*)dmaBlock, k, planes);
+      stage->failed = !FlacEncodePlanes(stage->wavFlac, planes, n);
+      stage->wavBytes += n * frameSize;
+    }else if(stage->fullRate){
+      char* dst = wavBlock!=NULL ? wavBlock : (char*)BlockRingAcquire(stage->wavRing, 0);
+      if(dst==NULL){
+        break;
+      }
+      long long wavOffset;
+      long size = selectBlock(sel, (const char*)dmaBlock, k, dst, &wavOffset);
+      if(wavBlock!=NULL){
+        stage->failed = !writeAudio(NULL, stage->wavFlac, wavBlock, size, frameSize);
+      }else{
+        BlockRingPublish(stage->wavRing, size);
+      }
+      stage->wavBytes += size;
+    }
+    if(stage->dec!=NULL && !stage->failed){
+      char* dst = decBlock!=NULL ? decBlock : (char*)BlockRingAcquire(stage->decRing, 0);
+      if(dst==NULL){
+        break;
+      }
+      long size = decimateBlock(sel, stage->dec, (const char*)dmaBlock, k, dst);
+      if(decBlock!=NULL){
+        stage->failed = !writeAudio(NULL, stage->decFlac, decBlock, size, frameSize);
+      }else{
+        BlockRingPublish(stage->decRing, size);
+      }
+      stage->decBytes += size;
+    }
+    BlockRingRelease(stage->in);
+  }
+  if(stage->failed){
+    BlockRingCancel(stage->in);
+  }
+  if(stage->wavRing!=NULL){
+    BlockRingClose(stage->wavRing);
+  }
+  if(stage->decRing!=NULL){
+    BlockRingClose(stage->decRing);
+  }
+  StatsStopClock(&stage->stats);
+  free(wavBlock);
+  free(decBlock);
+  return NULL;
+}
+
+// Sample number (per channel) of a bound, fallback if the bound is not set,
+// -1 if it is a packet time and the file has no packet timestamps
+static long long boundToSample(const ConvertBound* bound, const LogReader* reader, const BlockIndex* index,
+                               long blockSamples, long long fallback){
+  switch(bound->unit){
+    case BoundSample:
+      return (long long)bound->value;
+    case BoundSeconds:
+      return (long long)(bound->value * reader->hdr.samplingFrequency);
+    case BoundPacketTimeNS:{
+      if(reader->nbBlocks==0 || BlockEndTimeNS(LogReaderAdditionnalData(reader, 0))==0){
+        return -1;
+      }
+      long k = index!=NULL ? BlockIndexFindTime(index, bound->timeNS) : ReaderFindTime(reader, bound->timeNS);
+      if(k>=reader->nbBlocks){
+        return (long long)reader->nbBlocks * blockSamples;
+      }
+      // the samples of a block end at its end of packet time, one every 1/fs
+      unsigned long long blockEnd = index!=NULL ? index->entries[k].endTimeNS : BlockEndTimeNS(LogReaderAdditionnalData(reader, k));
+      long long before = (long long)((blockEnd - bound->timeNS) * (double)reader->hdr.samplingFrequency / 1e9);
+      if(before > blockSamples){
+        before = blockSamples;
+      }
+      return (long long)(k + 1) * blockSamples - before;
+    }
+    default:
+      return fallback;
+  }
+}
+
+bool ConvertSampleFormat(const ConvertOptions* options, int resolutionBits, const int* channels, int nbChannels,
+                         SampleFormatSpec* spec, char* error, int errorSize){
+  spec->format = options->sampleFormat;
+  spec->resolutionBytes = resolutionBits/8;
+  double fullScale = options->fullScaleVolts > 0 ? options->fullScaleVolts : 1.0;
+  for(int c=0; c<nbChannels && c<MAX_INTERLEAVE_CHAN; c++){
+    // a sample is an integer, full scale 2^(bits-1)
+    double gain = ldexp(1.0, 1 - resolutionBits);
+    if(options->nbSensitivities > 0){
+      int k = options->nbSensitivities==1 ? 0 : channels[c];
+      if(k >= options->nbSensitivities){
+        snprintf(error, errorSize, "no sensitivity given for channel %d", channels[c] + 1);
+        return false;
+      }
+      // V -> uPa -> Pa
+      gain *= fullScale / pow(10, options->sensitivity[k] / 20) * 1e-6;
+    }
+    spec->gains[c] = (float)gain;
+  }
+  return true;
+}
+
+ConvertStatus ConvertLogFile(const char* logPath, const ConvertOutputs* outputs,
+                             const ConvertOptions* options, ConvertResult* result){
+  int verbose = options->verbose;
+  memset(result, 0, sizeof(ConvertResult));
+  double startTime = StatsNow();
+  // map the whole file and read the header
+  LogReader reader;
+  bool stream = strcmp(logPath, "-")==0;
+  bool follow = options->follow && !stream;   // a pipe just blocks until the next bytes
+  int openStatus;
+  if(stream){
+    openStatus = OpenLogReaderStream(&reader, fileno(stdin), verbose);
+  }else if(follow){
+    openStatus = OpenLogReaderWait(&reader, logPath, verbose, options->followIdle);
+  }else{
+    openStatus = OpenLogReader(&reader, logPath, verbose);
+  }
+  // the end of a followed file or of a stream is not known in advance
+  bool openEnded = follow || stream;
+  // released at fail on an error
+  BlockIndex index = {0};
+  FILE* wavfile = NULL;
+  FILE* sensorsFile = NULL;
+  FILE* ppsFile = NULL;
+  FILE* gpsFile = NULL;
+  FILE* decfile = NULL;
+  if(openStatus==-2){
+    snprintf(result->error, sizeof(result->error), "skipped empty file : %s", logPath);
+    return ConvertSkippedEmpty;
+  }
+  if(openStatus==-3){
+    snprintf(result->error, sizeof(result->error), "Invalid header in input file");
+    goto fail;
+  }
+  if(openStatus!=0){
+    snprintf(result->error, sizeof(result->error), "Failed to open input file");
+    return ConvertError;
+  }
+  result->bytesRead = reader.size;
+  HighBlueHeader hdr = reader.hdr;
+  long long filesize = reader.size;
+  unsigned char softwareMajorRev=0;
+  unsigned char softwareMinorRev=0;
+  int resolutionBytes = hdr.resolutionBits/8;
+  long dataBlockSampleSize = hdr.dmaBlockSize / ( hdr.numberOfChan  * resolutionBytes);
+  if(verbose){
+    printf("file version number: %d,%d",softwareMajorRev,softwareMinorRev);
+    printf("file size (bytes) %lld \n", filesize);
+    printf("dataBlockSampleSize %ld\n", dataBlockSampleSize);
+  }
+  if(hdr.resolutionBits!=16 && hdr.resolutionBits!=24 && hdr.resolutionBits!=32){
+    snprintf(result->error, sizeof(result->error), "resolution %d not supported yet sorry", hdr.resolutionBits);
+    goto fail;
+  }
+
+  if(outputs->indexPath!=NULL && stream){
+    snprintf(result->error, sizeof(result->error), "the block index cannot be built from stdin");
+    goto fail;
+  }
+  if(outputs->indexPath!=NULL && !follow){
+    // only the additional data of each block is read, the sidecar of a file
+    // that has grown is completed
+    bool written;
+    bool indexOK = OpenBlockIndex(outputs->indexPath, &reader, &index, &written);
+    if(verbose){
+      printf("block index %s : %ld blocks%s\n", outputs->indexPath, index.nbBlocks, written ? "" : " (up to date)");
+    }
+    if(!indexOK){
+      snprintf(result->error, sizeof(result->error), "Failed to write index file");
+      goto fail;
+    }
+  }
+
+  // range and channels extracted, by default the whole file
+  int allChannels[CONVERT_MAX_CHANNELS];
+  AudioSelection sel;
+  sel.nbChan = options->nbChannels > 0 ? options->nbChannels : hdr.numberOfChan;
+  sel.channels = options->nbChannels > 0 ? options->channels : allChannels;
+  sel.blockSamples = dataBlockSampleSize;
+  sel.resolutionBytes = resolutionBytes;
+  for(int c=0; c<hdr.numberOfChan && c<CONVERT_MAX_CHANNELS; c++){
+    allChannels[c] = c;
+  }
+  for(int c=0; c<options->nbChannels; c++){
+    if(options->channels[c] < 0 || options->channels[c] >= hdr.numberOfChan){
+      snprintf(result->error, sizeof(result->error), "channel %d not in file (%d channels)", options->channels[c] + 1, hdr.numberOfChan);
+      goto fail;
+    }
+  }
+  SampleFormatSpec format;
+  if(!ConvertSampleFormat(options, hdr.resolutionBits, sel.channels, sel.nbChan, &format, result->error, sizeof(result->error))){
+    goto fail;
+  }
+  sel.format = &format;
+  sel.sampleBytes = SampleFormatBytes(&format);
+  if(options->flac && (format.format==SampleFormatFloat32 || options->rawAudio || sel.nbChan > FLAC_MAX_CHANNELS)){
+    snprintf(result->error, sizeof(result->error), "FLAC holds integer samples of at most %d channels, with its own header",
+             FLAC_MAX_CHANNELS);
+    goto fail;
+  }
+  if(openEnded && (options->start.unit==BoundPacketTimeNS || options->end.unit==BoundPacketTimeNS)){
+    snprintf(result->error, sizeof(result->error), "packet time bounds cannot be used with %s", stream ? "stdin" : "--follow");
+    goto fail;
+  }
+  long long totalSamples = openEnded ? LLONG_MAX : (long long)reader.nbBlocks * dataBlockSampleSize;
+  if(totalSamples==0){
+    // a valid header, then less than a block (truncated copy)
+    snprintf(result->error, sizeof(result->error), "no complete block in file");
+    goto fail;
+  }
+  const BlockIndex* seekIndex = index.entries!=NULL ? &index : NULL;
+  sel.firstSample = boundToSample(&options->start, &reader, seekIndex, dataBlockSampleSize, 0);
+  sel.endSample = boundToSample(&options->end, &reader, seekIndex, dataBlockSampleSize, totalSamples);
+  FreeBlockIndex(&index);
+  if(sel.firstSample < 0 || sel.endSample < 0){
+    snprintf(result->error, sizeof(result->error), "no packet timestamps in this file (firmware < 2)");
+    goto fail;
+  }
+  if(sel.endSample > totalSamples){
+    sel.endSample = totalSamples;
+  }
+  if(sel.firstSample >= sel.endSample){
+    snprintf(result->error, sizeof(result->error), "empty range");
+    goto fail;
+  }
+  // decimated audio, in its own wav or instead of the full rate one
+  bool decimate = options->decimateRate > 0;
+  bool fullRate = !decimate || outputs->decimatedPath!=NULL;
+  if(decimate && (options->decimateRate >= hdr.samplingFrequency || hdr.samplingFrequency % options->decimateRate != 0)){
+    snprintf(result->error, sizeof(result->error), "cannot decimate %d Hz to %d Hz, the rate must divide the sampling frequency",
+             hdr.samplingFrequency, options->decimateRate);
+    goto fail;
+  }
+  int decimateFactor = decimate ? hdr.samplingFrequency / options->decimateRate : 1;
+  // only the blocks holding the range are read
+  long firstBlock = sel.firstSample / dataBlockSampleSize;
+  long endBlock = sel.endSample==LLONG_MAX ? LONG_MAX : (long)((sel.endSample + dataBlockSampleSize - 1) / dataBlockSampleSize);
+  // open ended : the sizes in the wav header are patched as the audio is written
+  long long audioSize = sel.endSample==LLONG_MAX ? 0 : (sel.endSample - sel.firstSample) * sel.nbChan * sel.sampleBytes;
+  long long decimatedSize = sel.endSample==LLONG_MAX ? 0
+                          : DecimatedLength(sel.endSample - sel.firstSample, decimateFactor) * sel.nbChan * sel.sampleBytes;
+  if(!fullRate){
+    audioSize = decimatedSize;
+  }
+  if(verbose && !openEnded && (firstBlock > 0 || endBlock < reader.nbBlocks || options->nbChannels > 0)){
+    printf("extracting samples %lld to %lld (blocks %ld to %ld) of %d channels\n",
+           sel.firstSample, sel.endSample, firstBlock, endBlock, sel.nbChan);
+  }
+  if(!openEnded){
+    result->bytesRead = (long long)(endBlock - firstBlock) * reader.blockSize;
+  }
+
+  wavfile = outputs->wavStream!=NULL ? outputs->wavStream : fopen(outputs->wavPath, "wb");// open wav file
+  if(wavfile==NULL){
+    snprintf(result->error, sizeof(result->error), "Failed to open wav output file");
+    goto fail;
+  }
+  bool waveHeader = !options->rawAudio && !options->flac;
+  long long headerSize = waveHeader ? sizeof(WaveHeader) : 0;
+  if(waveHeader){
+    writeWaveHeader(wavfile, sel.nbChan, fullRate ? hdr.samplingFrequency : options->decimateRate, &format,
+                    sel.endSample==LLONG_MAX ? -1 : audioSize);
+  }
+
+  // open mpu file
+  if(outputs->csvPath!=NULL){
+    sensorsFile = fopen(outputs->csvPath, "w+");
+    if(sensorsFile==NULL){
+      snprintf(result->error, sizeof(result->error), "Failed to open sensors output file");
+      goto fail;
+    }
+    else
+    {
+      fprintf(sensorsFile,"Sensor Type,TimeStamp(ms) or Time, val0,val1,val2,val3,val4,val5,val6,val7\n");
+      //val0, val1, val2 dependent du type de capteur
+      //Val0 est la valeur normalisée de l'axe X pour (Accel(G), Gyr0(DPS), Mag(µT)), ou la valeur du canal1 du capteur de lumiere, ou la valeur de la temperature(°C), ou la valeur de la pression(Pa) ou le champ "fix" (pour le GPS)
+      //val1 est la valeur normalisée de l'axe Y pour (Accel(G), Gyro(DPS), Mag(µT)), ou la valeur du canal2 du capteur de lumiere, ou le champ fixQuality (pour le GPS)
+      //val2 est la valeur normalisée de l'axe Z pour (Accel(G), Gyro(DPS), Mag(µT)), ou le champ Latitude (pour le GPS)
+    }
+  }
+  if(outputs->timePrefix!=NULL){
+    char* path = malloc(strlen(outputs->timePrefix) + 9);
+    sprintf(path, "%s_pps.csv", outputs->timePrefix);
+    ppsFile = fopen(path, "w");
+    sprintf(path, "%s_gps.csv", outputs->timePrefix);
+    gpsFile = ppsFile!=NULL ? fopen(path, "w") : NULL;
+    free(path);
+    if(gpsFile==NULL){
+      snprintf(result->error, sizeof(result->error), "Failed to open PPS/GPS output file");
+      goto fail;
+    }
+  }
+  if(decimate){
+    decfile = fullRate ? fopen(outputs->decimatedPath, "wb") : wavfile;
+    if(decfile==NULL){
+      snprintf(result->error, sizeof(result->error), "Failed to open decimated wav output file");
+      goto fail;
+    }
+    if(decfile!=wavfile && waveHeader){
+      writeWaveHeader(decfile, sel.nbChan, options->decimateRate, &format,
+                      sel.endSample==LLONG_MAX ? -1 : decimatedSize);
+    }
+  }
+  long wavBlockSize = sel.nbChan * dataBlockSampleSize * sel.sampleBytes;
+  long nbRangeBlocks = endBlock - firstBlock;
+  // intra-file parallelism : the WAV is pre-sized and each thread writes the
+  // blocks of its range at their final position while this thread decodes
+  // the sensors data, which has to stay sequential
+  int audioThreads = openEnded || outputs->wavStream!=NULL || !fullRate || options->flac ? 1 : options->audioThreads;
+  if(audioThreads > nbRangeBlocks){
+    audioThreads = nbRangeBlocks;
+  }
+  AudioRange* ranges = NULL;
+  pthread_t* audioWorkers = NULL;
+  if(audioThreads > 1){
+    fflush(wavfile);
+    int fd = fileno(wavfile);
+    long long audioOffset = headerSize;
+    ResizeFile(fd, audioOffset + audioSize);
+    reader.releasePages = false;    // the other threads still need the pages behind us
+    ranges = calloc(audioThreads, sizeof(AudioRange));
+    audioWorkers = malloc(audioThreads * sizeof(pthread_t));
+    for(int t=0; t<audioThreads; t++){
+      ranges[t].reader = &reader;
+      ranges[t].sel = &sel;
+      ranges[t].firstBlock = firstBlock + nbRangeBlocks * t / audioThreads;
+      ranges[t].endBlock = firstBlock + nbRangeBlocks * (t + 1) / audioThreads;
+      ranges[t].fd = fd;
+      ranges[t].audioOffset = audioOffset;
+      ranges[t].wavBlockSize = wavBlockSize;
+      ranges[t].timed = options->stats;
+      pthread_create(&audioWorkers[t], NULL, convertAudioRange, &ranges[t]);
+    }
+    if(verbose){
+      printf("audio converted on %d threads\n", audioThreads);
+    }
+  }
+
+  SensorSink sink;
+  SensorSinkInit(&sink, sensorsFile, outputs->npyPrefix);
+  if(ppsFile!=NULL){
+    SensorSinkTimeTables(&sink, ppsFile, gpsFile);
+  }
+  if(outputs->events!=NULL){
+    SensorSinkSubscribe(&sink, outputs->eventStreams, outputs->eventsBatch, outputs->events, outputs->eventsContext);
+  }
+  TimeMapBuilder timeMap;
+  if(outputs->timeMapPath!=NULL){
+    TimeMapBuilderInit(&timeMap, hdr.samplingFrequency, dataBlockSampleSize);
+    SensorSinkTimeMap(&sink, &timeMap);
+  }
+  // every file starts with a fresh decoder
+  BlockDecoder blockDecoder;
+  BlockDecoderInit(&blockDecoder, &sink, verbose);
+
+  const unsigned char* dmaBlock;
+  const unsigned char* additionnalDataBlock;
+  // interleaved copy of a whole dmaBlock, written with a single fwrite
+  char* wavBlock = (char*) malloc(wavBlockSize);
+  Decimator dec = {0};
+  char* decBlock = NULL;
+  long decBlockSize = 0;
+  long long decWritten = 0;   // to decfile when it is not wavfile
+  if(decimate){
+    InitDecimator(&dec, hdr.samplingFrequency, options->decimateRate, sel.nbChan, resolutionBytes, dataBlockSampleSize, &format);
+    long maxInput = dataBlockSampleSize > dec.delay ? dataBlockSampleSize : dec.delay;
+    decBlockSize = DecimatorMaxOutput(&dec, maxInput) * sel.nbChan * sel.sampleBytes;
+    decBlock = malloc(decBlockSize);
+    if(verbose){
+      printf("decimation by %d, %d taps\n", dec.factor, dec.nbTaps);
+    }
+  }
+  // FLAC : the frames are encoded in parallel instead of the blocks written in parallel
+  FlacEncoder flacEncoders[2];
+  FlacEncoder* wavFlac = NULL;
+  FlacEncoder* decFlac = NULL;
+  bool flacOpened = true;
+  if(options->flac){
+    int nbThreads = options->audioThreads > 1 ? options->audioThreads : 1;
+    if(fullRate){
+      wavFlac = &flacEncoders[0];
+      flacOpened &= OpenFlacEncoder(wavFlac, wavfile, sel.nbChan, 8 * sel.sampleBytes, hdr.samplingFrequency, nbThreads);
+    }
+    if(decimate){
+      decFlac = decfile==wavfile ? &flacEncoders[0] : &flacEncoders[1];
+      flacOpened &= OpenFlacEncoder(decFlac, decfile, sel.nbChan, 8 * sel.sampleBytes, options->decimateRate, nbThreads);
+    }
+  }
+  if(verbose){
+    printf("interleave kernel : %s\n", InterleaveSimdLevel());
+  }
+  bool audioFailed = !flacOpened;
+  // each dataBlock is read in place from the mapped file
+  long long audioWritten = 0;
+  long long audioFormatted = 0;   // bytes of samples interleaved or encoded, before any compression
+  double nextProgress = 0;
+  if(options->stats){
+    StatsStartClock(StatsRead);
+  }
+  // pipeline : this thread decodes the sensors data while the blocks are read,
+  // formatted and written by the other stages
+  bool pipelined = options->pipelineDepth > 0 && !follow && audioWorkers == NULL && !audioFailed;
+  if(pipelined){
+    atomic_bool cancel;
+    atomic_init(&cancel, false);
+    BlockRing sensorRing, audioRing, wavRing, decRing;
+    bool wavWriter = fullRate && wavFlac==NULL;
+    bool decWriter = decimate && decFlac==NULL;
+    bool allocated = BlockRingInit(&sensorRing, options->pipelineDepth, hdr.sizeOfAdditionnalDataBuffer, &cancel);
+    allocated &= BlockRingInit(&audioRing, options->pipelineDepth, hdr.dmaBlockSize, &cancel);
+    allocated &= BlockRingInit(&wavRing, wavWriter ? options->pipelineDepth : 1, wavWriter ? wavBlockSize : 1, &cancel);
+    allocated &= BlockRingInit(&decRing, decWriter ? options->pipelineDepth : 1, decWriter ? decBlockSize : 1, &cancel);
+    BlockSource source = {.reader = &reader, .firstBlock = firstBlock, .endBlock = endBlock,
+                          .additionnal = &sensorRing, .audio = &audioRing, .timed = options->stats};
+    AudioStage audio = {.in = &audioRing, .sel = &sel, .firstBlock = firstBlock, .fullRate = fullRate,
+                        .wavFlac = wavFlac, .wavRing = wavWriter ? &wavRing : NULL,
+                        .dec = decimate ? &dec : NULL, .decFlac = decFlac, .decRing = decWriter ? &decRing : NULL,
+                        .wavBlockSize = wavBlockSize, .decBlockSize = decBlockSize, .timed = options->stats};
+    RingWriter writers[2] = {{.ring = &wavRing, .file = wavfile, .timed = options->stats},
+                             {.ring = &decRing, .file = decfile, .timed = options->stats}};
+    pthread_t sourceThread, audioThread, writerThreads[2];
+    if(allocated){
+      if(verbose){
+        printf("pipeline : %d blocks between the stages, reads through %s\n", options->pipelineDepth,
+               BlockSourceMethod(&reader));
+      }
+      pthread_create(&sourceThread, NULL, RunBlockSource, &source);
+      pthread_create(&audioThread, NULL, runAudioStage, &audio);
+      for(int w=0; w<2; w++){
+        if(w==0 ? wavWriter : decWriter){
+          pthread_create(&writerThreads[w], NULL, RunRingWriter, &writers[w]);
+        }
+      }
+      long length;
+      const unsigned char* additionnalData;
+      while((additionnalData = BlockRingPeek(&sensorRing, &length))!=NULL){
+        StatsSwitch(StatsDecode);
+        BlockDecoderFeed(&blockDecoder, firstBlock + result->nbBlocks, additionnalData, length);
+        BlockRingRelease(&sensorRing);
+        result->nbBlocks++;
+        if(options->progress && StatsNow() >= nextProgress){
+          nextProgress = StatsNow() + PROGRESS_INTERVAL;
+          printf("\r %s : ", logPath);
+          if(openEnded){
+            printf(" %ld blocks", result->nbBlocks);
+          }else{
+            printf(" %lld%%", result->nbBlocks*100LL/nbRangeBlocks);
+          }
+          fflush(stdout);
+        }
+        StatsSwitch(StatsRead);
+      }
+      pthread_join(sourceThread, NULL);
+      pthread_join(audioThread, NULL);
+      for(int w=0; w<2; w++){
+        if(w==0 ? wavWriter : decWriter){
+          pthread_join(writerThreads[w], NULL);
+          audioFailed |= writers[w].failed;
+          StatsAdd(&result->stats, &writers[w].stats);
+        }
+      }
+      StatsAdd(&result->stats, &source.stats);
+      StatsAdd(&result->stats, &audio.stats);
+      audioFailed |= audio.failed || source.failed;
+      if(source.failed){
+        snprintf(result->error, sizeof(result->error), "Failed to read input file");
+      }
+      audioWritten += audio.wavBytes;
+      *(decfile==wavfile ? &audioWritten : &decWritten) += audio.decBytes;
+      audioFormatted += audio.wavBytes + audio.decBytes;
+    }else{
+      snprintf(result->error, sizeof(result->error), "Not enough memory for the pipeline");
+      audioFailed = true;
+    }
+    BlockRingFree(&sensorRing);
+    BlockRingFree(&audioRing);
+    BlockRingFree(&wavRing);
+    BlockRingFree(&decRing);
+  }
+  LogReaderSeek(&reader, firstBlock);
+  while(!pipelined && reader.nextBlock < endBlock){
+    StatsSwitch(StatsRead);
+    if(!LogReaderNextBlock(&reader, &additionnalDataBlock, &dmaBlock)){
+      if(!follow){
+        break;
+      }
+      // every output is made readable, then wait for the next block
+      fflush(wavfile);
+      if(waveHeader){
+        patchWaveSizes(wavfile, audioWritten);
+      }
+      if(decfile!=NULL && decfile!=wavfile){
+        fflush(decfile);
+        if(waveHeader){
+          patchWaveSizes(decfile, decWritten);
+        }
+      }
+      SensorSinkFlush(&sink);
+      if(!LogReaderWaitBlocks(&reader, options->followIdle)){
+        break;
+      }
+      continue;
+    }
+    StatsSwitch(StatsDecode);
+    BlockDecoderFeed(&blockDecoder, reader.nextBlock - 1, additionnalDataBlock, hdr.sizeOfAdditionnalDataBuffer);
+
+    StatsSwitch(StatsFormat);
+    if(wavFlac!=NULL && format.format==SampleFormatPCM){
+      // the encoder reads the planes of the dmaBlock
+      const char* planes[CONVERT_MAX_CHANNELS];
+      long n = selectPlanes(&sel, (const char*)dmaBlock, reader.nextBlock - 1, planes);
+      if(!FlacEncodePlanes(wavFlac, planes, n)){
+        audioFailed = true;
+        break;
+      }
+      audioWritten += n * sel.nbChan * sel.sampleBytes;
+      audioFormatted += n * sel.nbChan * sel.sampleBytes;
+    }else if(audioWorkers == NULL && fullRate){
+      long long wavOffset;
+      long size = selectBlock(&sel, (const char*)dmaBlock, reader.nextBlock - 1, wavBlock, &wavOffset);
+      if(!writeAudio(wavfile, wavFlac, wavBlock, size, sel.nbChan * sel.sampleBytes)){
+        // disk full, or the reader of the pipe has gone
+        audioFailed = true;
+        break;
+      }
+      audioWritten += size;
+      audioFormatted += size;
+    }
+    if(decimate){
+      // the filter state runs from block to block
+      long size = decimateBlock(&sel, &dec, (const char*)dmaBlock, reader.nextBlock - 1, decBlock);
+      if(!writeAudio(decfile, decFlac, decBlock, size, sel.nbChan * sel.sampleBytes)){
+        audioFailed = true;
+        break;
+      }
+      *(decfile==wavfile ? &audioWritten : &decWritten) += size;
+      audioFormatted += size;
+    }else if(audioWorkers != NULL && !SensorSinkActive(&sink)){
+      // nothing left to do sequentially, wait for the audio threads
+      break;
+    }
+    result->nbBlocks++;
+    if(options->progress && audioWorkers == NULL && StatsNow() >= nextProgress){
+      // a few lines per second, not one per block
+      nextProgress = StatsNow() + PROGRESS_INTERVAL;
+      printf("\r %s : ", logPath);
+      if(openEnded){
+        printf(" %ld blocks", result->nbBlocks);
+      }else{
+        printf(" %lld%%", (reader.nextBlock - firstBlock)*100LL/nbRangeBlocks);
+      }
+      fflush(stdout);
+    }
+  }
+  if(audioWorkers != NULL){
+    for(int t=0; t<audioThreads; t++){
+      pthread_join(audioWorkers[t], NULL);
+      audioFailed |= ranges[t].failed;
+      for(int s=0; s<STATS_STAGE_COUNT; s++){
+        result->stats.stages[s].seconds += ranges[t].stats.stages[s].seconds;
+      }
+    }
+    audioFormatted = audioSize;
+    result->nbBlocks = nbRangeBlocks;
+    free(audioWorkers);
+    free(ranges);
+    if(options->progress){
+      printf("\r %s :  100%%", logPath);
+    }
+  }else if(options->progress){
+    // the last state, skipped by the throttling
+    printf("\r %s : ", logPath);
+    if(openEnded){
+      printf(" %ld blocks", result->nbBlocks);
+    }else{
+      long converted = pipelined ? result->nbBlocks : reader.nextBlock - firstBlock;
+      printf(" %lld%%", nbRangeBlocks>0 ? converted*100LL/nbRangeBlocks : 100LL);
+    }
+  }
+  if(options->progress){
+    printf("\r\n");
+  }
+  free(wavBlock);
+  StatsSwitch(StatsFormat);
+  if(decimate){
+    // the last input samples are still in the filter
+    long size = FlushDecimator(&dec, decBlock) * sel.nbChan * sel.sampleBytes;
+    audioFailed |= !writeAudio(decfile, decFlac, decBlock, size, sel.nbChan * sel.sampleBytes);
+    *(decfile==wavfile ? &audioWritten : &decWritten) += size;
+    FreeDecimator(&dec);
+    free(decBlock);
+  }
+  // the sizes written are the ones of the FLAC streams
+  for(int e=0; e<2; e++){
+    FlacEncoder* flac = e==0 ? wavFlac : decFlac!=wavFlac ? decFlac : NULL;
+    if(flac==NULL){
+      continue;
+    }
+    if(!CloseFlacEncoder(flac) || !flacOpened){
+      snprintf(result->error, sizeof(result->error), "%s", flac->error);
+      audioFailed = true;
+    }
+    *(flac->file==wavfile ? &audioWritten : &decWritten) = flac->bytesWritten;
+    audioSize = flac->file==wavfile ? audioWritten : audioSize;
+  }
+  if(openEnded){
+    audioSize = audioWritten;
+    fflush(wavfile);
+    // fails harmlessly on a pipe
+    if(waveHeader){
+      patchWaveSizes(wavfile, audioSize);
+    }
+    result->bytesRead = LogReaderBlockOffset(&reader, reader.nextBlock);
+  }
+  result->bytesWritten = headerSize + audioSize;
+  audioFailed |= !closeWav(wavfile, outputs);
+  if(decfile!=NULL && decfile!=wavfile){
+    if(openEnded && waveHeader){
+      fflush(decfile);
+      patchWaveSizes(decfile, decWritten);
+    }
+    result->bytesWritten += headerSize + decWritten;
+    audioFailed |= fclose(decfile)!=0;
+  }
+  bool indexFailed = false;
+  if(follow && outputs->indexPath!=NULL){
+    // the index of a followed file is written once it is complete
+    bool written;
+    indexFailed = !OpenBlockIndex(outputs->indexPath, &reader, &index, &written);
+    FreeBlockIndex(&index);
+  }
+  CloseLogReader(&reader);
+  result->bytesWritten += SensorSinkClose(&sink);
+  if(sensorsFile!=NULL){
+    result->bytesWritten += ftell(sensorsFile);
+    fclose(sensorsFile);
+  }
+  if(ppsFile!=NULL){
+    result->bytesWritten += ftell(ppsFile) + ftell(gpsFile);
+    fclose(ppsFile);
+    fclose(gpsFile);
+  }
+  bool timeMapFailed = false;
+  if(outputs->timeMapPath!=NULL){
+    const TimeMap* map = TimeMapFinish(&timeMap);
+    timeMapFailed = !WriteTimeMap(outputs->timeMapPath, map);
+    result->bytesWritten += 96 + 8 * (map->audio.count + map->time.count);
+    if(verbose){
+      char utc[32] = "no GPS fix";
+      if(map->flags & TIMEMAP_UTC){
+        time_t first = (time_t)(map->utcOrigin / 1000000000LL);
+        strftime(utc, sizeof(utc), "%Y-%m-%d %H:%M:%S", gmtime(&first));
+      }
+      printf("time map %s : %u PPS (%u rejected, %u steps), jitter %.0f ns rms, drift %.3f ppm, first PPS %s\n",
+             outputs->timeMapPath, map->ppsAccepted, map->ppsRejected, map->ppsSteps, map->jitterNS, map->driftPPM, utc);
+    }
+    TimeMapBuilderFree(&timeMap);
+  }
+  ConvertStats* stats = &result->stats;
+  StatsStopClock(stats);
+  GetBlockDecoderStats(&blockDecoder, stats);
+  stats->nbFiles = 1;
+  stats->nbBlocks = result->nbBlocks;
+  stats->bytesRead = result->bytesRead;
+  stats->bytesWritten = result->bytesWritten;
+  stats->stages[StatsRead].bytes = result->bytesRead;
+  stats->stages[StatsFormat].bytes += audioFormatted;
+  stats->stages[StatsWrite].bytes = result->bytesWritten;
+  stats->seconds = StatsNow() - startTime;
+  if(audioFailed){
+    if(result->error[0]=='\0'){
+      snprintf(result->error, sizeof(result->error), "Failed to write wav output file");
+    }
+    return ConvertError;
+  }
+  if(indexFailed){
+    snprintf(result->error, sizeof(result->error), "Failed to write index file");
+    return ConvertError;
+  }
+  if(timeMapFailed){
+    snprintf(result->error, sizeof(result->error), "Failed to write time map file");
+    return ConvertError;
+  }
+  return ConvertOK;
+
+fail:
+  // the outputs opened before the error
+  if(decfile!=NULL && decfile!=wavfile){
+    fclose(decfile);
+  }
+  if(ppsFile!=NULL){
+    fclose(ppsFile);
+  }
+  if(gpsFile!=NULL){
+    fclose(gpsFile);
+  }
+  if(sensorsFile!=NULL){
+    fclose(sensorsFile);
+  }
+  if(wavfile!=NULL){
+    closeWav(wavfile, outputs);
+  }
+  FreeBlockIndex(&index);
+  CloseLogReader(&reader);
+  return ConvertError;
+}
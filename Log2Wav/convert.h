@@ -0,0 +1,108 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+#include <stdio.h>
+#include <stdbool.h>
+#include "interleave.h"
+#include "stats.h"
+#include "sensorsink.h"
+
+// Conversion of one .log file into a .wav file and optional sensors outputs
+
+typedef enum ConvertStatus_e
+{
+    ConvertOK = 0,
+    ConvertSkippedEmpty,        // empty .log file, nothing written
+    ConvertError                // see ConvertResult.error
+}ConvertStatus;
+
+// Bound of the extracted range, as an audio sample number (per channel, from
+// the start of the file), a time from the start of the file, or a packet time
+// (the 100 MHz end of packet counter in ns, as in the PACKET TIMESTAMP lines)
+typedef enum BoundUnit_e
+{
+    BoundNone = 0,              // start or end of the file
+    BoundSample,
+    BoundSeconds,
+    BoundPacketTimeNS
+}BoundUnit;
+
+typedef struct ConvertBound_s
+{
+    BoundUnit unit;
+    double value;               // samples or s are rounded down
+    unsigned long long timeNS;  // BoundPacketTimeNS
+}ConvertBound;
+
+#define CONVERT_MAX_CHANNELS 256
+
+typedef struct ConvertOptions_s
+{
+    int verbose;                // print the header and the decoding details
+    bool progress;              // print the percentage of the file converted
+    int audioThreads;           // > 1 : the audio blocks are split in ranges converted in parallel
+    ConvertBound start;         // only the audio of [start, end) is written, and only the
+    ConvertBound end;           // blocks holding it are read (sensors included)
+    int nbChannels;             // 0 : every channel, else the channels written, in this order
+    int channels[CONVERT_MAX_CHANNELS];     // 0 based
+    bool follow;                // the .log is still growing : convert each block as soon as it is complete,
+    double followIdle;          // until the file has not grown for followIdle seconds
+    bool rawAudio;              // only the interleaved samples, without the wav header
+    int decimateRate;           // > 0 : the audio is also low-pass filtered and decimated to this rate,
+                                // which must divide the sampling frequency (see decimate.h)
+    SampleFormat sampleFormat;  // of the wav samples, PCM : as recorded (see interleave.h)
+    int nbSensitivities;        // float32 : > 0, the samples are calibrated in Pa with the hydrophone
+    double sensitivity[CONVERT_MAX_CHANNELS];   // sensitivity of each recorded channel (dB re 1 V/uPa),
+                                // a single value applies to every channel
+    double fullScaleVolts;      // float32 calibrated : ADC input of a full scale sample, 0 : 1 V
+    bool flac;                  // the audio outputs are FLAC streams instead of wavs (see flac.h),
+                                // encoded on audioThreads threads
+    bool stats;                 // time the stages of the conversion into ConvertResult.stats
+    int pipelineDepth;          // > 0 : the blocks are read, decoded, formatted and written by different
+                                // threads, with up to pipelineDepth blocks between two of them (see
+                                // pipeline.h). Not with follow, nor with audioThreads > 1 on a wav file
+}ConvertOptions;
+
+// Output files of one conversion
+typedef struct ConvertOutputs_s
+{
+    const char* wavPath;
+    const char* csvPath;        // NULL : no sensors .csv
+    const char* npyPrefix;      // NULL : no .npy, else one <npyPrefix>_<stream>.npy per sensor stream
+    const char* timePrefix;     // NULL : no PPS/GPS tables, else <timePrefix>_pps.csv and <timePrefix>_gps.csv
+    const char* indexPath;      // NULL : no block index sidecar, else reused or (re)built at this path
+    FILE* wavStream;            // not NULL : the wav is written to this stream (stdout, a pipe) in one
+                                // forward pass instead of wavPath, it is flushed but not closed
+    const char* decimatedPath;  // with options->decimateRate : the decimated wav, next to the full rate one.
+                                // NULL : the decimated audio replaces the full rate one in wavPath / wavStream
+    SensorEventHandler events;  // not NULL : the typed sensors events of the eventStreams are also passed to
+    void* eventsContext;        // events, by batches of eventsBatch (see SensorSinkSubscribe)
+    unsigned int eventStreams;
+    int eventsBatch;
+    const char* timeMapPath;    // NULL : no time map sidecar, else the PPS disciplined clock models of the
+                                // blocks converted are written at this path (see timemap.h)
+}ConvertOutputs;
+
+typedef struct ConvertResult_s
+{
+    long long bytesRead;        // size of the .log file
+    long long bytesWritten;     // audio and sensors bytes written
+    long nbBlocks;              // number of blocks converted
+    char error[256];
+    ConvertStats stats;         // counters of the conversion, the stage times only with options->stats
+}ConvertResult;
+
+// logPath "-" reads the .log from stdin in one forward pass (no index, no
+// packet time bounds). When the audio size is not known before the end
+// (stdin, follow mode) the wav header holds the streaming sizes 0xFFFFFFFF,
+// patched at the end if the wav is seekable.
+// Safe to call from several threads at once on different files.
+ConvertStatus ConvertLogFile(const char* logPath, const ConvertOutputs* outputs,
+                             const ConvertOptions* options, ConvertResult* result);
+
+// Output format of the channels (plane numbers) of a recording, from the
+// options. float32 samples are normalized (full scale 1.0), or in Pa when
+// sensitivities are given. Returns false if a channel has no sensitivity.
+bool ConvertSampleFormat(const ConvertOptions* options, int resolutionBits, const int* channels, int nbChannels,
+                         SampleFormatSpec* spec, char* error, int errorSize);
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "csvwriter.h"
+#include "stats.h"
+
+static const char digitPairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+void CsvWriterInit(CsvWriter* writer, FILE* file)
+{
+    writer->file = file;
+    writer->buffer = file != NULL ? malloc(CSV_BUFFER_SIZE) : NULL;
+    writer->length = 0;
+    writer->flushed = 0;
+}
+
+void CsvWriterFlush(CsvWriter* writer)
+{
+    if (writer->length == 0)
+        return;
+    StatsStage left = StatsSwitch(StatsWrite);
+    fwrite(writer->buffer, 1, writer->length, writer->file);
+    StatsSwitch(left);
+    writer->flushed += writer->length;
+    writer->length = 0;
+}
+
+long long CsvWriterClose(CsvWriter* writer)
+{
+    if (writer->file == NULL)
+        return 0;
+    CsvWriterFlush(writer);
+    free(writer->buffer);
+    writer->buffer = NULL;
+    writer->file = NULL;
+    return writer->flushed;
+}
+
+// Writes the decimal digits of value ending just before end, returns the first digit
+static char* FormatDigits(char* end, uint64_t value)
+{
+    while (value >= 100)
+    {
+        end -= 2;
+        memcpy(end, digitPairs + (value % 100) * 2, 2);
+        value /= 100;
+    }
+    if (value >= 10)
+    {
+        end -= 2;
+        memcpy(end, digitPairs + value * 2, 2);
+    }
+    else
+        *--end = (char)('0' + value);
+    return end;
+}
+
+void CsvPutUInt(CsvWriter* writer, unsigned long long value)
+{
+    char digits[20];
+    char* first = FormatDigits(digits + sizeof(digits), value);
+    CsvPutText(writer, first, digits + sizeof(digits) - first);
+}
+
+void CsvPutInt(CsvWriter* writer, long long value)
+{
+    char digits[21];
+    char* first = FormatDigits(digits + sizeof(digits), value < 0 ? 0 - (uint64_t)value : (uint64_t)value);
+    if (value < 0)
+        *--first = '-';
+    CsvPutText(writer, first, digits + sizeof(digits) - first);
+}
+
+void CsvPutPadded(CsvWriter* writer, unsigned int value, int width)
+{
+    char digits[16];
+    char* first = FormatDigits(digits + sizeof(digits), value);
+    while (digits + sizeof(digits) - first < width)
+        *--first = '0';
+    CsvPutText(writer, first, digits + sizeof(digits) - first);
+}
+
+// Value rounded to 6 decimals exactly as printf does : the binary value of the
+// double is scaled by 10^6 in 128 bits and rounded half to even on the bits
+// shifted out. Only done when the scaled result fits in 64 bits (|value| < 2^43),
+// false otherwise so that the caller falls back to snprintf.
+static bool ScaleMicro(double value, uint64_t* micro)
+{
+#ifdef __SIZEOF_INT128__
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int exponent = (int)((bits >> 52) & 0x7FF);
+    uint64_t mantissa = bits & ((1ULL << 52) - 1);
+    if (exponent == 0x7FF)
+        return false;                   // inf, nan
+    if (exponent != 0)
+        mantissa |= 1ULL << 52;
+    else
+        exponent = 1;                   // subnormals
+    int shift = 1075 - exponent;        // value = mantissa / 2^shift
+    if (shift < 10)
+        return false;
+    if (shift >= 75)
+    {
+        // mantissa * 10^6 < 2^73 : less than half a unit of the 6th decimal
+        *micro = 0;
+        return true;
+    }
+    unsigned __int128 scaled = (unsigned __int128)mantissa * 1000000u;
+    uint64_t rounded = (uint64_t)(scaled >> shift);
+    unsigned __int128 remainder = scaled & (((unsigned __int128)1 << shift) - 1);
+    unsigned __int128 half = (unsigned __int128)1 << (shift - 1);
+    if (remainder > half || (remainder == half && (rounded & 1)))
+        rounded++;
+    *micro = rounded;
+    return true;
+#else
+    (void)value;
+    (void)micro;
+    return false;
+#endif
+}
+
+void CsvPutDouble(CsvWriter* writer, double value)
+{
+    uint64_t micro;
+    char* out = CsvReserve(writer);
+    if (!ScaleMicro(value, &micro))
+    {
+        writer->length += snprintf(out, CSV_MAX_FIELD, "%f", value);
+        return;
+    }
+    char digits[32];
+    char* end = digits + sizeof(digits);
+    uint64_t fraction = micro % 1000000;
+    // 6 decimals, always printed
+    for (int i = 0; i < 3; i++)
+    {
+        end -= 2;
+        memcpy(end, digitPairs + (fraction % 100) * 2, 2);
+        fraction /= 100;
+    }
+    *--end = '.';
+    char* first = FormatDigits(end, micro / 1000000);
+    if (signbit(value))
+        *--first = '-';
+    size_t length = digits + sizeof(digits) - first;
+    memcpy(out, first, length);
+    writer->length += length;
+}
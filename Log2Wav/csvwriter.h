@@ -0,0 +1,55 @@
+#ifndef CSVWRITER_H
+#define CSVWRITER_H
+#include <stdio.h>
+#include <string.h>
+
+// Buffered text writer for the sensors .csv. Numbers are rendered directly
+// into a large buffer (no format string parsing, no locale) which is written
+// to the file in big chunks. The output is byte for byte what the printf
+// conversions named on each function would give.
+
+#define CSV_BUFFER_SIZE (1 << 20)
+#define CSV_MAX_FIELD 512               // room reserved before each field
+
+typedef struct CsvWriter_s
+{
+    FILE* file;                         // NULL : writer disabled
+    char* buffer;
+    size_t length;
+    long long flushed;                  // bytes already handed to the file
+}CsvWriter;
+
+void CsvWriterInit(CsvWriter* writer, FILE* file);
+void CsvWriterFlush(CsvWriter* writer);
+// Flushes and frees the buffer, the file stays owned by the caller.
+// Returns the number of bytes written through the writer.
+long long CsvWriterClose(CsvWriter* writer);
+
+// Makes sure CSV_MAX_FIELD bytes can be appended without overflowing
+static inline char* CsvReserve(CsvWriter* writer)
+{
+    if (writer->length > CSV_BUFFER_SIZE - CSV_MAX_FIELD)
+        CsvWriterFlush(writer);
+    return writer->buffer + writer->length;
+}
+
+static inline void CsvPutChar(CsvWriter* writer, char c)
+{
+    *CsvReserve(writer) = c;
+    writer->length++;
+}
+
+// Literal text, shorter than CSV_MAX_FIELD
+static inline void CsvPutText(CsvWriter* writer, const char* text, size_t length)
+{
+    memcpy(CsvReserve(writer), text, length);
+    writer->length += length;
+}
+#define CsvPutLiteral(writer, text) CsvPutText(writer, text, sizeof(text) - 1)
+
+void CsvPutInt(CsvWriter* writer, long long value);                          // %d, %ld, %hd
+void CsvPutUInt(CsvWriter* writer, unsigned long long value);                // %llu
+void CsvPutPadded(CsvWriter* writer, unsigned int value, int width);         // %02d, %04d
+void CsvPutDouble(CsvWriter* writer, double value);                          // %f, %lf
+
+#endif
@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "decimate.h"
+#include "interleave.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DECIMATE_X86
+#include <immintrin.h>
+#endif
+
+// Taps are padded to a multiple of the widest loop (2 x 8 floats)
+#define DECIMATE_TAPS_ALIGN 16
+// Anti-alias filter : stopband attenuation, and passband edge as a fraction of the output Nyquist frequency
+#define DECIMATE_ATTENUATION_DB 100.0
+#define DECIMATE_PASSBAND 0.8
+
+////////////////////
+/// Dot products ///
+////////////////////
+
+static float DotScalar(const float* taps, const float* samples, int nbTaps)
+{
+    float sum = 0;
+    for (int k = 0; k < nbTaps; k++)
+        sum += taps[k] * samples[k];
+    return sum;
+}
+
+#ifdef DECIMATE_X86
+
+__attribute__((target("sse2")))
+static float DotSSE2(const float* taps, const float* samples, int nbTaps)
+{
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+    for (int k = 0; k < nbTaps; k += 8)
+    {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(taps + k), _mm_loadu_ps(samples + k)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(taps + k + 4), _mm_loadu_ps(samples + k + 4)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(sum0, sum1));
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+__attribute__((target("avx2,fma")))
+static float DotAVX2(const float* taps, const float* samples, int nbTaps)
+{
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    for (int k = 0; k < nbTaps; k += 16)
+    {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(taps + k), _mm256_loadu_ps(samples + k), sum0);
+        sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(taps + k + 8), _mm256_loadu_ps(samples + k + 8), sum1);
+    }
+    __m256 sum = _mm256_add_ps(sum0, sum1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    float lanes[4];
+    _mm_storeu_ps(lanes, half);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+#endif
+
+// Same SIMD level as the interleaving (LOG2WAV_SIMD applies to both)
+static float (*SelectDot(void))(const float*, const float*, int)
+{
+#ifdef DECIMATE_X86
+    const char* level = InterleaveSimdLevel();
+    if (strcmp(level, "avx2") == 0 && __builtin_cpu_supports("fma"))
+        return DotAVX2;
+    if (strcmp(level, "scalar") != 0)
+        return DotSSE2;
+#endif
+    return DotScalar;
+}
+
+////////////////////
+/// Filter design ///
+////////////////////
+
+double BesselI0(double x)
+{
+    double sum = 1, term = 1;
+    for (int k = 1; k < 50; k++)
+    {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+// Kaiser windowed sinc low-pass, unit gain at DC
+static double* DesignLowPass(int inputRate, int outputRate, int* nbTaps)
+{
+    double nyquist = outputRate / 2.0;
+    double transition = (1 - DECIMATE_PASSBAND) * nyquist / inputRate;       // normalized to the input rate
+    double cutoff = (1 + DECIMATE_PASSBAND) / 2 * nyquist / inputRate;
+    double beta = 0.1102 * (DECIMATE_ATTENUATION_DB - 8.7);
+    int n = (int)ceil((DECIMATE_ATTENUATION_DB - 8) / (2.285 * 2 * M_PI * transition)) + 1;
+    n |= 1;     // odd : the delay is a whole number of samples
+    double* h = malloc(n * sizeof(double));
+    double center = (n - 1) / 2.0, sum = 0;
+    for (int k = 0; k < n; k++)
+    {
+        double x = k - center;
+        double sinc = x == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * x) / (M_PI * x);
+        double r = x / center;
+        h[k] = sinc * BesselI0(beta * sqrt(1 - r * r)) / BesselI0(beta);
+        sum += h[k];
+    }
+    for (int k = 0; k < n; k++)
+        h[k] /= sum;
+    *nbTaps = n;
+    return h;
+}
+
+bool InitDecimator(Decimator* dec, int inputRate, int outputRate, int nbChan, int resolutionBytes, long maxSamples,
+                   const SampleFormatSpec* format)
+{
+    memset(dec, 0, sizeof(Decimator));
+    if (outputRate <= 0 || outputRate >= inputRate || inputRate % outputRate != 0)
+        return false;
+    int n;
+    double* h = DesignLowPass(inputRate, outputRate, &n);
+    dec->factor = inputRate / outputRate;
+    dec->nbTaps = (n + DECIMATE_TAPS_ALIGN - 1) / DECIMATE_TAPS_ALIGN * DECIMATE_TAPS_ALIGN;
+    dec->taps = calloc(dec->nbTaps, sizeof(float));
+    // the padding taps are the oldest ones, they do not change the delay
+    for (int k = 0; k < n; k++)
+        dec->taps[dec->nbTaps - 1 - k] = (float)h[k];
+    free(h);
+    dec->nbChan = nbChan;
+    dec->resolutionBytes = resolutionBytes;
+    if (format != NULL)
+        dec->format = *format;
+    else
+        dec->format.format = SampleFormatPCM;
+    dec->format.resolutionBytes = resolutionBytes;
+    dec->capacity = maxSamples;
+    dec->frames = malloc((maxSamples / dec->factor + 1) * nbChan * sizeof(float));
+    dec->work = malloc(nbChan * sizeof(float*));
+    for (int c = 0; c < nbChan; c++)
+        dec->work[c] = calloc(dec->nbTaps - 1 + maxSamples, sizeof(float));
+    dec->delay = (n - 1) / 2;
+    dec->next = dec->delay;
+    dec->dot = SelectDot();
+    return true;
+}
+
+void FreeDecimator(Decimator* dec)
+{
+    for (int c = 0; c < dec->nbChan && dec->work != NULL; c++)
+        free(dec->work[c]);
+    free(dec->work);
+    free(dec->frames);
+    free(dec->taps);
+    memset(dec, 0, sizeof(Decimator));
+}
+
+long DecimatorMaxOutput(const Decimator* dec, long nbSamples)
+{
+    return nbSamples / dec->factor + 1;
+}
+
+long long DecimatedLength(long long n, int factor)
+{
+    return (n + factor - 1) / factor;
+}
+
+////////////////////
+/// Conversion   ///
+////////////////////
+
+static void LoadSamples(float* dst, const char* src, long nbSamples, int resolutionBytes)
+{
+    const unsigned char* p = (const unsigned char*)src;
+    switch (resolutionBytes)
+    {
+        case 2:
+            for (long i = 0; i < nbSamples; i++, p += 2)
+                dst[i] = (float)(short)(p[0] | (p[1] << 8));
+            break;
+        case 3:
+            for (long i = 0; i < nbSamples; i++, p += 3)
+                dst[i] = (float)((int)((unsigned)p[0] << 8 | (unsigned)p[1] << 16 | (unsigned)p[2] << 24) >> 8);
+            break;
+        default:
+            for (long i = 0; i < nbSamples; i++, p += 4)
+                dst[i] = (float)(int)((unsigned)p[0] | (unsigned)p[1] << 8 | (unsigned)p[2] << 16 | (unsigned)p[3] << 24);
+            break;
+    }
+}
+
+// Runs the filter on the nbSamples samples already loaded after the history
+static long Filter(Decimator* dec, char* dst, long nbSamples)
+{
+    int history = dec->nbTaps - 1;
+    long nbOut = 0;
+    for (; dec->next < nbSamples; dec->next += dec->factor, nbOut++)
+    {
+        float* frame = dec->frames + nbOut * dec->nbChan;
+        for (int c = 0; c < dec->nbChan; c++)
+            frame[c] = dec->dot(dec->taps, dec->work[c] + dec->next, dec->nbTaps);
+    }
+    FormatFrames(dst, dec->frames, nbOut, dec->nbChan, &dec->format, dec->nbOutput);
+    dec->nbOutput += nbOut;
+    dec->next -= nbSamples;
+    // the newest samples become the history of the next call
+    for (int c = 0; c < dec->nbChan; c++)
+        memmove(dec->work[c], dec->work[c] + nbSamples, history * sizeof(float));
+    return nbOut;
+}
+
+long DecimateBlock(Decimator* dec, char* dst, const char* const* planes, long nbSamples)
+{
+    int history = dec->nbTaps - 1;
+    for (int c = 0; c < dec->nbChan; c++)
+        LoadSamples(dec->work[c] + history, planes[c], nbSamples, dec->resolutionBytes);
+    return Filter(dec, dst, nbSamples);
+}
+
+long FlushDecimator(Decimator* dec, char* dst)
+{
+    int history = dec->nbTaps - 1;
+    int frameSize = dec->nbChan * SampleFormatBytes(&dec->format);
+    long nbOut = 0;
+    for (long left = dec->delay; left > 0;)
+    {
+        long n = left < dec->capacity ? left : dec->capacity;
+        for (int c = 0; c < dec->nbChan; c++)
+            memset(dec->work[c] + history, 0, n * sizeof(float));
+        nbOut += Filter(dec, dst + nbOut * frameSize, n);
+        left -= n;
+    }
+    return nbOut;
+}
@@ -0,0 +1,58 @@
+#ifndef DECIMATE_H
+#define DECIMATE_H
+#include <stdbool.h>
+#include "interleave.h"
+
+// Decimation of the audio by an integer factor, applied to the channel planes
+// of each dmaBlock while converting, so that a 32 kHz analysis wav is written
+// from the same read as the 256 kHz one.
+//
+// Anti-alias FIR : Kaiser windowed sinc, flat to 0.8 of the output Nyquist
+// frequency and 100 dB down at the output Nyquist frequency. Only the samples
+// kept are computed (polyphase form : each output is one dot product of the
+// taps with the last input samples), in float, AVX2/FMA or SSE2 when
+// available. The filter delay is compensated : output sample k is the filtered
+// input sample k * factor, and a stream of n input samples gives
+// ceil(n / factor) output samples once flushed.
+
+typedef struct Decimator_s
+{
+    int factor;
+    int nbTaps;                 // rounded up to the vector width, the extra taps are 0
+    float* taps;                // reversed : taps[nbTaps-1] applies to the newest sample
+    int nbChan;
+    int resolutionBytes;        // of the input planes
+    SampleFormatSpec format;    // of the output samples
+    long capacity;              // max input samples per call
+    float** work;               // per channel : nbTaps-1 samples of history, then the new samples
+    float* frames;              // filtered frames before the conversion to the output format
+    long long nbOutput;         // frames written so far (dither position)
+    long next;                  // position of the next output in the new samples (may be past them)
+    long delay;                 // filter delay in input samples
+    float (*dot)(const float* taps, const float* samples, int nbTaps);
+}Decimator;
+
+// Returns false if outputRate does not divide inputRate (or is not lower).
+// maxSamples : most samples given to one DecimateBlock call.
+// format : output sample format, NULL for the input resolution.
+bool InitDecimator(Decimator* dec, int inputRate, int outputRate, int nbChan, int resolutionBytes, long maxSamples,
+                   const SampleFormatSpec* format);
+void FreeDecimator(Decimator* dec);
+
+// Filters nbSamples samples of each plane (planes[c] : channel c, packed
+// little-endian samples of resolutionBytes bytes, unaligned) and writes the
+// output frames interleaved to dst, converted by FormatFrames. Returns the number of frames written, at most
+// DecimatorMaxOutput(dec, nbSamples).
+long DecimateBlock(Decimator* dec, char* dst, const char* const* planes, long nbSamples);
+// Pushes the filter delay out at the end of the stream, writes at most
+// DecimatorMaxOutput(dec, dec->delay) frames
+long FlushDecimator(Decimator* dec, char* dst);
+long DecimatorMaxOutput(const Decimator* dec, long nbSamples);
+
+// Number of output frames for n input samples
+long long DecimatedLength(long long n, int factor);
+
+// Modified Bessel function of the first kind, order 0 (Kaiser window)
+double BesselI0(double x);
+
+#endif
@@ -1,9 +1,12 @@
 #include <stdlib.h>
+#include <string.h>
 #include "decoder.h"
 #include "MsgProcessor.h"
+#include "sensorsink.h"
+#include "stats.h"
 
 unsigned char CalculateChecksum(int msgFunction,
-                int msgPayloadLength, unsigned char msgPayload[])
+                int msgPayloadLength, const unsigned char msgPayload[])
 {
     unsigned char checksum = 0;
     checksum ^= (unsigned char)0xFE;
@@ -18,97 +21,128 @@ unsigned char CalculateChecksum(int msgFunction,
     return checksum;
 }
 
-typedef enum StateReception_e
+void ResetDecoder(MsgDecoder* decoder)
 {
-    Waiting,
-    FunctionMSB,
-    FunctionLSB,
-    PayloadLengthMSB,
-    PayloadLengthLSB,
-    Payload,
-    CheckSum
-}StateReception;
+    decoder->carryLength = 0;
+    decoder->messages = 0;
+    decoder->payloadBytes = 0;
+    decoder->scannedBytes = 0;
+    decoder->invalidLengths = 0;
+    memset(decoder->checksumErrors, 0, sizeof(decoder->checksumErrors));
+}
 
-StateReception rcvState = Waiting;
-int msgDecodedFunction = 0;
-int msgDecodedPayloadLength = 0;
-unsigned char *msgDecodedPayload;
-int msgDecodedPayloadIndex = 0;
+//Taille totale de la trame commencant en frame : MSG_HEADER_SIZE tant que
+//l'entete n'est pas complete, 0 si la longueur annoncee est invalide
+static int FrameSize(const unsigned char* frame, int available)
+{
+    if (available < MSG_HEADER_SIZE)
+        return MSG_HEADER_SIZE;
+    int payloadLength = (frame[3] << 8) | frame[4];
+    if (payloadLength >= MSG_MAX_PAYLOAD)
+        return 0;
+    return MSG_HEADER_SIZE + payloadLength + 1;
+}
 
-//Debug stats
-unsigned int msgDecoded = 0;
+//Verifie le checksum d'une trame complete et la transmet sans copie
+static void DispatchFrame(MsgDecoder* decoder, const unsigned char* frame, int frameSize, MessageHandler handler, void* context)
+{
+    short function = (short)((frame[1] << 8) | frame[2]);
+    int payloadLength = frameSize - MSG_HEADER_SIZE - 1;
+    const unsigned char* payload = frame + MSG_HEADER_SIZE;
+    if (CalculateChecksum(function, payloadLength, payload) == frame[frameSize - 1])
+    {
+        //Lance l'event de fin de decodage
+        decoder->messages++;
+        decoder->payloadBytes += payloadLength;
+        StatsStage left = StatsSwitch(StatsNormalize);
+        handler(function, payloadLength, payload, context);
+        StatsSwitch(left);
+    }
+    else
+    {
+        decoder->checksumErrors[StatsSensorOf(function, payload, payloadLength)]++;
+    }
+}
 
-void DecodeMessage(unsigned char c, FILE* sensorFile)
+static void ProcessMessage(short function, unsigned short payloadLength, const unsigned char payload[], void* context)
 {
-        switch (rcvState)
+    ProcessDecodedMessage(context, function, payloadLength, payload);
+}
+
+void DecodeMessages(MsgDecoder* decoder, const unsigned char* data, int size, MsgProcessor* processor)
+{
+    DecodeMessagesWith(decoder, data, size, ProcessMessage, processor);
+}
+
+void DecodeMessagesWith(MsgDecoder* decoder, const unsigned char* data, int size, MessageHandler handler, void* context)
+{
+    int pos = 0;
+    decoder->scannedBytes += size;
+    //On termine d'abord la trame commencee dans le buffer precedent
+    while (decoder->carryLength > 0)
+    {
+        int frameSize = FrameSize(decoder->carry, decoder->carryLength);
+        if (frameSize == 0)
         {
-            case Waiting:
-                if (c == 0xFE)
-                    rcvState = FunctionMSB;
-                break;
-            case FunctionMSB:
-                msgDecodedFunction = (short)(c << 8);
-                rcvState = FunctionLSB;
-                break;
-            case FunctionLSB:
-                msgDecodedFunction += (short)(c << 0);
-                rcvState = PayloadLengthMSB;
-                break;
-            case PayloadLengthMSB:
-                msgDecodedPayloadLength = (unsigned short)(c << 8);
-                rcvState = PayloadLengthLSB;
-                break;
-            case PayloadLengthLSB:
-                msgDecodedPayloadLength += (unsigned short)(c << 0);
-                if (msgDecodedPayloadLength > 0)
-                {
-                    if (msgDecodedPayloadLength < 1024)
-                    {
-                        msgDecodedPayloadIndex = 0;
-                        msgDecodedPayload = malloc(msgDecodedPayloadLength);
-                        rcvState = Payload;
-                    }
-                    else
-                    {
-                        rcvState = Waiting;
-                    }
-                }
-                else
-                    rcvState = CheckSum;
-                break;
-            case Payload:
-                if (msgDecodedPayloadIndex > msgDecodedPayloadLength)
-                {
-                    //Erreur
-                    msgDecodedPayloadIndex = 0;
-                    rcvState = Waiting;
-                }
-                msgDecodedPayload[msgDecodedPayloadIndex++] = c;
-                if (msgDecodedPayloadIndex >= msgDecodedPayloadLength)
-                {
-                    rcvState = CheckSum;
-                    msgDecodedPayloadIndex = 0;
-                }
-                break;
-            case CheckSum:
-            {
-                unsigned char calculatedChecksum = CalculateChecksum(msgDecodedFunction, msgDecodedPayloadLength, msgDecodedPayload);
-                unsigned char receivedChecksum = c;
-                if (calculatedChecksum == receivedChecksum)
-                {
-                    //Lance l'event de fin de decodage
-                    ProcessDecodedMessage(msgDecodedFunction, msgDecodedPayloadLength, msgDecodedPayload,sensorFile);
-                    msgDecoded++;
-                }
-                else
-                {
-                    //printf("erreur Checksum");
-                }
-                rcvState = Waiting;
-            }
-                break;
-            default:
-                rcvState = Waiting;
-                break;
+            //Longueur invalide : on reprend la recherche juste apres l'entete
+            decoder->invalidLengths++;
+            decoder->carryLength = 0;
+            break;
         }
-}
\ No newline at end of file
+        int missing = frameSize - decoder->carryLength;
+        int available = size - pos;
+        int taken = missing < available ? missing : available;
+        memcpy(decoder->carry + decoder->carryLength, data + pos, taken);
+        decoder->carryLength += taken;
+        pos += taken;
+        if (decoder->carryLength < frameSize)
+            return;
+        if (frameSize == MSG_HEADER_SIZE)
+            continue;   //entete complete, la taille de la trame est maintenant connue
+        DispatchFrame(decoder, decoder->carry, frameSize, handler, context);
+        decoder->carryLength = 0;
+    }
+
+    while (pos < size)
+    {
+        const unsigned char* sof = memchr(data + pos, MSG_SOF, size - pos);
+        if (sof == NULL)
+            return;
+        int start = (int)(sof - data);
+        int available = size - start;
+        int frameSize = FrameSize(sof, available);
+        if (frameSize == 0)
+        {
+            decoder->invalidLengths++;
+            pos = start + MSG_HEADER_SIZE;
+            continue;
+        }
+        if (available < frameSize)
+        {
+            //Trame coupee par la fin du buffer
+            memcpy(decoder->carry, sof, available);
+            decoder->carryLength = available;
+            return;
+        }
+        DispatchFrame(decoder, sof, frameSize, handler, context);
+        pos = start + frameSize;
+    }
+}
+
+unsigned int GetDecodedMessageCount(const MsgDecoder* decoder)
+{
+    return (unsigned int)decoder->messages;
+}
+
+void GetDecoderStats(const MsgDecoder* decoder, ConvertStats* stats)
+{
+    stats->messages += decoder->messages;
+    stats->invalidLengths += decoder->invalidLengths;
+    stats->stages[StatsDecode].bytes += decoder->scannedBytes;
+    stats->stages[StatsNormalize].bytes += decoder->payloadBytes;
+    for (int i = 0; i < STATS_SENSOR_COUNT; i++)
+    {
+        stats->checksumErrors += decoder->checksumErrors[i];
+        stats->sensors[i].checksumErrors += decoder->checksumErrors[i];
+    }
+}
@@ -1,5 +1,44 @@
+#ifndef DECODER_H
+#define DECODER_H
 #include <stdio.h>
+#include "stats.h"
+
+//Trame : 0xFE, fonction (2 octets), longueur payload (2 octets), payload, checksum
+#define MSG_SOF 0xFE
+#define MSG_HEADER_SIZE 5
+#define MSG_MAX_PAYLOAD 1024
+#define MSG_MAX_FRAME (MSG_HEADER_SIZE + MSG_MAX_PAYLOAD + 1)
 
 unsigned char CalculateChecksum(int msgFunction,
-                int msgPayloadLength, unsigned char msgPayload[]);
-void DecodeMessage(unsigned char c, FILE* sensorFile);
\ No newline at end of file
+                int msgPayloadLength, const unsigned char msgPayload[]);
+
+// State of the framing of one stream of messages. Only a frame cut by the end
+// of a buffer is copied, into carry, until the next buffer completes it.
+// Nothing is shared between decoders, each stream (file, thread) has its own.
+typedef struct MsgDecoder_s
+{
+    unsigned char carry[MSG_MAX_FRAME];
+    int carryLength;            // 0 : waiting for a start of frame
+    // counters since ResetDecoder, read by GetDecoderStats (--stats)
+    long long messages;
+    long long payloadBytes;
+    long long scannedBytes;
+    long long invalidLengths;
+    long long checksumErrors[STATS_SENSOR_COUNT];
+}MsgDecoder;
+
+void ResetDecoder(MsgDecoder* decoder);
+// Decodes every complete message of a buffer. A message cut by the end of the
+// buffer is completed by the next call, the payloads are passed to
+// ProcessDecodedMessage without any copy nor allocation.
+struct MsgProcessor_s;
+void DecodeMessages(MsgDecoder* decoder, const unsigned char* data, int size, struct MsgProcessor_s* processor);
+// Same framing, but every valid message is passed to handler instead of
+// ProcessDecodedMessage (benchmarks, other consumers of the messages)
+typedef void (*MessageHandler)(short function, unsigned short payloadLength, const unsigned char payload[], void* context);
+void DecodeMessagesWith(MsgDecoder* decoder, const unsigned char* data, int size, MessageHandler handler, void* context);
+unsigned int GetDecodedMessageCount(const MsgDecoder* decoder);
+// Adds the counters of the messages decoded since ResetDecoder
+void GetDecoderStats(const MsgDecoder* decoder, ConvertStats* stats);
+
+#endif
@@ -0,0 +1,1001 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "interleave.h"
+#include "flac.h"
+
+// Frames of a batch per thread
+#define FLAC_BATCH_FRAMES 8
+#define FLAC_MAX_PARTITION_ORDER 8
+#define FLAC_LPC_PRECISION 15
+// Shorter channels (the last frame) are not worth a predictor
+#define FLAC_MIN_PREDICTED 32
+#define FLAC_STREAMINFO_SIZE (4 + 4 + 34)
+
+/////////////////
+/// Bit I/O   ///
+/////////////////
+
+typedef struct BitWriter_s
+{
+    unsigned char* buffer;
+    long pos;
+    unsigned long long acc;
+    int nbBits;                 // bits of acc not yet stored, < 8 between calls
+}BitWriter;
+
+// n <= 32, the low n bits of value
+static inline void PutBits(BitWriter* w, unsigned int value, int n)
+{
+    w->acc = (w->acc << n) | (value & (unsigned int)((1ULL << n) - 1));
+    w->nbBits += n;
+    while (w->nbBits >= 8)
+    {
+        w->nbBits -= 8;
+        w->buffer[w->pos++] = (unsigned char)(w->acc >> w->nbBits);
+    }
+}
+
+static void AlignWriter(BitWriter* w)
+{
+    if (w->nbBits > 0)
+        PutBits(w, 0, 8 - w->nbBits);
+}
+
+typedef struct BitReader_s
+{
+    const unsigned char* buffer;
+    long size;
+    long pos;
+    unsigned long long acc;
+    int nbBits;
+    bool overrun;
+}BitReader;
+
+static inline void Refill(BitReader* r)
+{
+    while (r->nbBits <= 48)
+    {
+        r->acc = (r->acc << 8) | (r->pos < r->size ? r->buffer[r->pos] : 0);
+        r->overrun |= r->pos >= r->size + 8;
+        r->pos++;
+        r->nbBits += 8;
+    }
+}
+
+static inline unsigned int GetBits(BitReader* r, int n)
+{
+    if (r->nbBits < n)
+        Refill(r);
+    r->nbBits -= n;
+    return (unsigned int)((r->acc >> r->nbBits) & ((1ULL << n) - 1));
+}
+
+static inline int GetSigned(BitReader* r, int n)
+{
+    if (n == 0)
+        return 0;
+    unsigned int v = GetBits(r, n);
+    return n == 32 ? (int)v : (int)(v << (32 - n)) >> (32 - n);
+}
+
+static inline unsigned int GetUnary(BitReader* r)
+{
+    unsigned int q = 0;
+    for (;;)
+    {
+        if (r->nbBits == 0)
+        {
+            Refill(r);
+            if (r->overrun)
+                return q;
+        }
+        r->nbBits--;
+        if ((r->acc >> r->nbBits) & 1)
+            return q;
+        q++;
+    }
+}
+
+////////////////
+/// CRCs     ///
+////////////////
+
+static unsigned char Crc8Table[256];
+static unsigned short Crc16Table[256];
+static pthread_once_t CrcTablesOnce = PTHREAD_ONCE_INIT;
+
+static void InitCrcTables(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        unsigned int c8 = i, c16 = i << 8;
+        for (int b = 0; b < 8; b++)
+        {
+            c8 = (c8 & 0x80) ? (c8 << 1) ^ 0x07 : c8 << 1;
+            c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x8005 : c16 << 1;
+        }
+        Crc8Table[i] = (unsigned char)c8;
+        Crc16Table[i] = (unsigned short)c16;
+    }
+}
+
+static unsigned int Crc8(const unsigned char* p, long size)
+{
+    unsigned int crc = 0;
+    for (long i = 0; i < size; i++)
+        crc = Crc8Table[crc ^ p[i]];
+    return crc;
+}
+
+static unsigned int Crc16(const unsigned char* p, long size)
+{
+    unsigned int crc = 0;
+    for (long i = 0; i < size; i++)
+        crc = ((crc << 8) ^ Crc16Table[(crc >> 8) ^ p[i]]) & 0xffff;
+    return crc;
+}
+
+/////////////////////
+/// Rice coding   ///
+/////////////////////
+
+// Partitioned Rice coding of a residual
+typedef struct RicePlan_s
+{
+    int partitionOrder;
+    int method;                 // 0 : 4-bit parameters, 1 : 5-bit parameters
+    int params[1 << FLAC_MAX_PARTITION_ORDER];      // -1 : escaped, rawBits bits per residual
+    int rawBits[1 << FLAC_MAX_PARTITION_ORDER];
+    long long bits;             // exact size of the coded residual
+}RicePlan;
+
+static inline unsigned int Fold(int e)
+{
+    return ((unsigned int)e << 1) ^ (unsigned int)(e >> 31);
+}
+
+static inline int BitLength(unsigned long long v)
+{
+    int n = 0;
+    for (; v != 0; v >>= 1)
+        n++;
+    return n;
+}
+
+// Estimated size of count folded residuals summing to sum, with parameter k
+static inline unsigned long long RiceEstimate(unsigned long long sum, long count, int k)
+{
+    return (unsigned long long)count * (k + 1) + (sum >> k);
+}
+
+static int BestParameter(unsigned long long sum, long count, int maxParam)
+{
+    if (count == 0 || sum == 0)
+        return 0;
+    int k = BitLength(sum / count);
+    int best = k > maxParam ? maxParam : k;
+    for (int t = k - 2; t <= k; t++)
+    {
+        if (t >= 0 && t <= maxParam && RiceEstimate(sum, count, t) < RiceEstimate(sum, count, best))
+            best = t;
+    }
+    return best;
+}
+
+// residual[order..n) : chooses the partition order and the parameters from
+// estimates, then counts the exact size (with escaped partitions if shorter)
+static void PlanRice(const int* residual, int n, int order, RicePlan* plan)
+{
+    int maxOrder = 0;
+    while (maxOrder < FLAC_MAX_PARTITION_ORDER && (n % (2 << maxOrder)) == 0 && (n >> (maxOrder + 1)) > order)
+        maxOrder++;
+    unsigned long long sums[1 << FLAC_MAX_PARTITION_ORDER];
+    int parts = 1 << maxOrder;
+    int partSize = n >> maxOrder;
+    for (int p = 0; p < parts; p++)
+    {
+        unsigned long long sum = 0;
+        for (int i = p == 0 ? order : p * partSize; i < (p + 1) * partSize; i++)
+            sum += Fold(residual[i]);
+        sums[p] = sum;
+    }
+    unsigned long long bestCost = ~0ULL;
+    for (int po = maxOrder; po >= 0; po--)
+    {
+        int nbParts = 1 << po;
+        int size = n >> po;
+        unsigned long long cost = 6;
+        for (int p = 0; p < nbParts; p++)
+        {
+            long count = p == 0 ? size - order : size;
+            int k = BestParameter(sums[p], count, 30);
+            cost += (k > 14 ? 5 : 4) + RiceEstimate(sums[p], count, k);
+        }
+        if (cost < bestCost)
+        {
+            bestCost = cost;
+            plan->partitionOrder = po;
+            for (int p = 0; p < nbParts; p++)
+                plan->params[p] = BestParameter(sums[p], p == 0 ? size - order : size, 30);
+        }
+        // sums of the next (coarser) level
+        for (int p = 0; p < nbParts / 2; p++)
+            sums[p] = sums[2 * p] + sums[2 * p + 1];
+    }
+    int nbParts = 1 << plan->partitionOrder;
+    int size = n >> plan->partitionOrder;
+    plan->method = 0;
+    for (int p = 0; p < nbParts; p++)
+        plan->method |= plan->params[p] > 14;
+    int paramBits = plan->method ? 5 : 4;
+    plan->bits = 6;
+    for (int p = 0; p < nbParts; p++)
+    {
+        int k = plan->params[p];
+        long long riceBits = 0;
+        unsigned int maxMagnitude = 0;
+        bool nonZero = false;
+        int start = p == 0 ? order : p * size;
+        for (int i = start; i < (p + 1) * size; i++)
+        {
+            int e = residual[i];
+            riceBits += (Fold(e) >> k) + 1 + k;
+            unsigned int m = e >= 0 ? (unsigned int)e : ~(unsigned int)e;
+            maxMagnitude = m > maxMagnitude ? m : maxMagnitude;
+            nonZero |= e != 0;
+        }
+        int raw = nonZero ? BitLength(maxMagnitude) + 1 : 0;
+        long long escapedBits = 5 + (long long)raw * ((p + 1) * size - start);
+        if (raw <= 31 && escapedBits < riceBits)
+        {
+            plan->params[p] = -1;
+            plan->rawBits[p] = raw;
+            riceBits = escapedBits;
+        }
+        plan->bits += paramBits + riceBits;
+    }
+}
+
+static void WriteResidual(BitWriter* w, const int* residual, int n, int order, const RicePlan* plan)
+{
+    int paramBits = plan->method ? 5 : 4;
+    int nbParts = 1 << plan->partitionOrder;
+    int size = n >> plan->partitionOrder;
+    PutBits(w, plan->method, 2);
+    PutBits(w, plan->partitionOrder, 4);
+    for (int p = 0; p < nbParts; p++)
+    {
+        int start = p == 0 ? order : p * size;
+        int end = (p + 1) * size;
+        int k = plan->params[p];
+        if (k < 0)
+        {
+            PutBits(w, (1u << paramBits) - 1, paramBits);
+            PutBits(w, plan->rawBits[p], 5);
+            for (int i = start; i < end; i++)
+                PutBits(w, (unsigned int)residual[i], plan->rawBits[p]);
+            continue;
+        }
+        PutBits(w, k, paramBits);
+        for (int i = start; i < end; i++)
+        {
+            unsigned int u = Fold(residual[i]);
+            unsigned int q = u >> k;
+            for (; q >= 32; q -= 32)
+                PutBits(w, 0, 32);
+            // q zeros, a one, then the k low bits
+            if (q + 1 + k <= 32)
+                PutBits(w, (1u << k) | (u & ((1u << k) - 1)), q + 1 + k);
+            else
+            {
+                PutBits(w, 1, q + 1);
+                PutBits(w, u, k);
+            }
+        }
+    }
+}
+
+static bool ReadResidual(BitReader* r, int* residual, int n, int order)
+{
+    int method = GetBits(r, 2);
+    if (method > 1)
+        return false;
+    int paramBits = method ? 5 : 4;
+    int escape = (1 << paramBits) - 1;
+    int partitionOrder = GetBits(r, 4);
+    int size = n >> partitionOrder;
+    for (int p = 0; p < (1 << partitionOrder); p++)
+    {
+        int start = p == 0 ? order : p * size;
+        int k = GetBits(r, paramBits);
+        if (k == escape)
+        {
+            int raw = GetBits(r, 5);
+            for (int i = start; i < (p + 1) * size; i++)
+                residual[i] = GetSigned(r, raw);
+            continue;
+        }
+        for (int i = start; i < (p + 1) * size && !r->overrun; i++)
+        {
+            unsigned int u = (GetUnary(r) << k) | GetBits(r, k);
+            residual[i] = (int)(u >> 1) ^ -(int)(u & 1);
+        }
+    }
+    return !r->overrun;
+}
+
+//////////////////
+/// Predictors ///
+//////////////////
+
+// Per thread buffers
+typedef struct FlacWork_s
+{
+    int* fixedResidual;
+    int* lpcResidual;
+    int* decoded;
+    double* window;
+    double* windowed;
+    int windowSize;
+    RicePlan fixedPlan;
+    RicePlan lpcPlan;
+}FlacWork;
+
+static inline bool FitsResidual(long long e)
+{
+    return e > -2147483648LL && e <= 2147483647LL;
+}
+
+// Order (0 to 4) of the fixed predictor with the smallest residual
+static int BestFixedOrder(const int* x, int n)
+{
+    unsigned long long sums[5] = { 0 };
+    for (int i = 4; i < n; i++)
+    {
+        long long e0 = x[i];
+        long long e1 = e0 - x[i - 1];
+        long long e2 = e1 - ((long long)x[i - 1] - x[i - 2]);
+        long long e3 = e2 - ((long long)x[i - 1] - 2LL * x[i - 2] + x[i - 3]);
+        long long e4 = e3 - ((long long)x[i - 1] - 3LL * x[i - 2] + 3LL * x[i - 3] - x[i - 4]);
+        sums[0] += llabs(e0);
+        sums[1] += llabs(e1);
+        sums[2] += llabs(e2);
+        sums[3] += llabs(e3);
+        sums[4] += llabs(e4);
+    }
+    int best = 0;
+    for (int o = 1; o < 5; o++)
+    {
+        if (sums[o] < sums[best])
+            best = o;
+    }
+    return best;
+}
+
+static inline long long FixedPrediction(const int* x, int i, int order)
+{
+    switch (order)
+    {
+        case 0: return 0;
+        case 1: return x[i - 1];
+        case 2: return 2LL * x[i - 1] - x[i - 2];
+        case 3: return 3LL * x[i - 1] - 3LL * x[i - 2] + x[i - 3];
+        default: return 4LL * x[i - 1] - 6LL * x[i - 2] + 4LL * x[i - 3] - x[i - 4];
+    }
+}
+
+static bool FixedResidual(const int* x, int n, int order, int* residual)
+{
+    for (int i = order; i < n; i++)
+    {
+        long long e = x[i] - FixedPrediction(x, i, order);
+        if (!FitsResidual(e))
+            return false;
+        residual[i] = (int)e;
+    }
+    return true;
+}
+
+static inline long long LpcPrediction(const int* x, int i, const int* qlp, int order, int shift)
+{
+    long long sum = 0;
+    for (int j = 0; j < order; j++)
+        sum += (long long)qlp[j] * x[i - 1 - j];
+    return sum >> shift;
+}
+
+static bool LpcResidual(const int* x, int n, const int* qlp, int order, int shift, int* residual)
+{
+    for (int i = order; i < n; i++)
+    {
+        long long e = x[i] - LpcPrediction(x, i, qlp, order, shift);
+        if (!FitsResidual(e))
+            return false;
+        residual[i] = (int)e;
+    }
+    return true;
+}
+
+// Tukey(0.5) window
+static void MakeWindow(FlacWork* work, int n)
+{
+    int taper = n / 4;
+    for (int i = 0; i < n; i++)
+    {
+        double w = 1;
+        if (i < taper)
+            w = 0.5 - 0.5 * cos(M_PI * i / taper);
+        else if (i >= n - taper)
+            w = 0.5 - 0.5 * cos(M_PI * (n - 1 - i) / taper);
+        work->window[i] = w;
+    }
+    work->windowSize = n;
+}
+
+// Linear predictor of x : autocorrelation of the windowed signal,
+// Levinson-Durbin, order chosen from the prediction errors, then quantized
+// coefficients. Returns the order, 0 if there is no usable predictor.
+static int LpcAnalysis(FlacWork* work, const int* x, int n, int bps, int* qlp, int* shift)
+{
+    int maxOrder = FLAC_MAX_LPC_ORDER;
+    if (work->windowSize != n)
+        MakeWindow(work, n);
+    for (int i = 0; i < n; i++)
+        work->windowed[i] = x[i] * work->window[i];
+    // one pass over the samples for all the lags, maxOrder + 1 independent sums
+    const double* y = work->windowed;
+    double r[FLAC_MAX_LPC_ORDER + 1] = { 0 };
+    int head = n < maxOrder ? n : maxOrder;
+    for (int i = 0; i < head; i++)
+        for (int lag = 0; lag <= i; lag++)
+            r[lag] += y[i] * y[i - lag];
+    for (int i = head; i < n; i++)
+        for (int lag = 0; lag <= FLAC_MAX_LPC_ORDER; lag++)
+            r[lag] += y[i] * y[i - lag];
+    if (r[0] <= 0)
+        return 0;
+    double a[FLAC_MAX_LPC_ORDER] = { 0 }, lpc[FLAC_MAX_LPC_ORDER][FLAC_MAX_LPC_ORDER];
+    double error = r[0];
+    int order = 0;
+    double bestBits = 1e300;
+    for (int m = 0; m < maxOrder; m++)
+    {
+        double acc = r[m + 1];
+        for (int j = 0; j < m; j++)
+            acc -= a[j] * r[m - j];
+        double k = acc / error;
+        double next[FLAC_MAX_LPC_ORDER];
+        for (int j = 0; j < m; j++)
+            next[j] = a[j] - k * a[m - 1 - j];
+        memcpy(a, next, m * sizeof(double));
+        a[m] = k;
+        error *= 1 - k * k;
+        memcpy(lpc[m], a, (m + 1) * sizeof(double));
+        // Rice coded residual of this error, plus the warm up and the coefficients
+        double perSample = error > 0 ? 0.5 * log2(error / n) + 1 : 1;
+        double bits = (n - m - 1) * (perSample > 1 ? perSample : 1) + (m + 1) * (bps + FLAC_LPC_PRECISION);
+        if (bits < bestBits)
+        {
+            bestBits = bits;
+            order = m + 1;
+        }
+        if (error <= 0)
+            break;
+    }
+    // quantization with the error carried over to the next coefficient
+    double cmax = 0;
+    for (int j = 0; j < order; j++)
+        cmax = fabs(lpc[order - 1][j]) > cmax ? fabs(lpc[order - 1][j]) : cmax;
+    if (cmax <= 0)
+        return 0;
+    int log2cmax;
+    frexp(cmax, &log2cmax);
+    int s = FLAC_LPC_PRECISION - 1 - log2cmax;
+    if (s < 0)
+        return 0;
+    if (s > 15)
+        s = 15;
+    int qmax = (1 << (FLAC_LPC_PRECISION - 1)) - 1;
+    double carry = 0;
+    for (int j = 0; j < order; j++)
+    {
+        carry += lpc[order - 1][j] * (1 << s);
+        long q = lround(carry);
+        q = q > qmax ? qmax : q < -qmax - 1 ? -qmax - 1 : q;
+        carry -= q;
+        qlp[j] = (int)q;
+    }
+    *shift = s;
+    return order;
+}
+
+///////////////////
+/// Frames      ///
+///////////////////
+
+static void EncodeSubframe(FlacWork* work, BitWriter* w, const int* x, int n, int bps)
+{
+    bool constant = true;
+    for (int i = 1; i < n && constant; i++)
+        constant = x[i] == x[0];
+    if (constant)
+    {
+        PutBits(w, 0x00, 8);
+        PutBits(w, (unsigned int)x[0], bps);
+        return;
+    }
+    enum { Verbatim, Fixed, Lpc } kind = Verbatim;
+    long long bestBits = (long long)n * bps;
+    int fixedOrder = 0, lpcOrder = 0, shift = 0;
+    int qlp[FLAC_MAX_LPC_ORDER];
+    if (n >= FLAC_MIN_PREDICTED)
+    {
+        fixedOrder = BestFixedOrder(x, n);
+        if (FixedResidual(x, n, fixedOrder, work->fixedResidual))
+        {
+            PlanRice(work->fixedResidual, n, fixedOrder, &work->fixedPlan);
+            long long bits = (long long)fixedOrder * bps + work->fixedPlan.bits;
+            if (bits < bestBits)
+            {
+                bestBits = bits;
+                kind = Fixed;
+            }
+        }
+        lpcOrder = LpcAnalysis(work, x, n, bps, qlp, &shift);
+        if (lpcOrder > 0 && LpcResidual(x, n, qlp, lpcOrder, shift, work->lpcResidual))
+        {
+            PlanRice(work->lpcResidual, n, lpcOrder, &work->lpcPlan);
+            long long bits = (long long)lpcOrder * (bps + FLAC_LPC_PRECISION) + 9 + work->lpcPlan.bits;
+            if (bits < bestBits)
+                kind = Lpc;
+        }
+    }
+    switch (kind)
+    {
+        case Verbatim:
+            PutBits(w, 0x01 << 1, 8);
+            for (int i = 0; i < n; i++)
+                PutBits(w, (unsigned int)x[i], bps);
+            break;
+        case Fixed:
+            PutBits(w, (0x08 | fixedOrder) << 1, 8);
+            for (int i = 0; i < fixedOrder; i++)
+                PutBits(w, (unsigned int)x[i], bps);
+            WriteResidual(w, work->fixedResidual, n, fixedOrder, &work->fixedPlan);
+            break;
+        case Lpc:
+            PutBits(w, (0x20 | (lpcOrder - 1)) << 1, 8);
+            for (int i = 0; i < lpcOrder; i++)
+                PutBits(w, (unsigned int)x[i], bps);
+            PutBits(w, FLAC_LPC_PRECISION - 1, 4);
+            PutBits(w, shift, 5);
+            for (int j = 0; j < lpcOrder; j++)
+                PutBits(w, (unsigned int)qlp[j], FLAC_LPC_PRECISION);
+            WriteResidual(w, work->lpcResidual, n, lpcOrder, &work->lpcPlan);
+            break;
+    }
+}
+
+static int SampleSizeCode(int bps)
+{
+    switch (bps)
+    {
+        case 16: return 4;
+        case 24: return 6;
+        default: return 7;
+    }
+}
+
+// Frame number, coded as an extended UTF-8 character
+static void PutFrameNumber(BitWriter* w, unsigned long long v)
+{
+    if (v < 0x80)
+    {
+        PutBits(w, (unsigned int)v, 8);
+        return;
+    }
+    int nbBytes = 2;
+    while (nbBytes < 7 && v >= (1ULL << (5 * nbBytes + 1)))
+        nbBytes++;
+    PutBits(w, (0xff00u >> nbBytes) | (unsigned int)(v >> (6 * (nbBytes - 1))), 8);
+    for (int b = nbBytes - 2; b >= 0; b--)
+        PutBits(w, 0x80 | (unsigned int)((v >> (6 * b)) & 0x3f), 8);
+}
+
+// Returns the frame size, *headerSize the size of its header
+static long EncodeFrame(FlacWork* work, unsigned char* out, int* const* planes, int nbChan, int n, int bps,
+                        long long frameNumber, int* headerSize)
+{
+    BitWriter w = { out, 0, 0, 0 };
+    int blockCode = n == FLAC_BLOCK_SIZE ? 12 : n <= 256 ? 6 : 7;
+    PutBits(&w, 0xfff8, 16);            // sync, fixed block size
+    PutBits(&w, blockCode, 4);
+    PutBits(&w, 0, 4);                  // sample rate of the STREAMINFO
+    PutBits(&w, nbChan - 1, 4);         // independent channels
+    PutBits(&w, SampleSizeCode(bps), 3);
+    PutBits(&w, 0, 1);
+    PutFrameNumber(&w, frameNumber);
+    if (blockCode == 6)
+        PutBits(&w, n - 1, 8);
+    else if (blockCode == 7)
+        PutBits(&w, n - 1, 16);
+    PutBits(&w, Crc8(out, w.pos), 8);
+    *headerSize = (int)w.pos;
+    for (int c = 0; c < nbChan; c++)
+        EncodeSubframe(work, &w, planes[c], n, bps);
+    AlignWriter(&w);
+    PutBits(&w, Crc16(out, w.pos), 16);
+    return w.pos;
+}
+
+// Decodes the frame and compares it with the samples it was encoded from
+static bool VerifyFrame(FlacWork* work, const unsigned char* frame, long size, int headerSize,
+                        int* const* planes, int nbChan, int n, int bps)
+{
+    if (Crc8(frame, headerSize) != 0 || Crc16(frame, size) != 0)
+        return false;
+    BitReader r = { frame + headerSize, size - headerSize - 2, 0, 0, 0, false };
+    int* x = work->decoded;
+    for (int c = 0; c < nbChan; c++)
+    {
+        int header = GetBits(&r, 8);
+        int type = header >> 1;
+        if ((header & 0x81) != 0)
+            return false;
+        if (type == 0)
+        {
+            int v = GetSigned(&r, bps);
+            for (int i = 0; i < n; i++)
+                x[i] = v;
+        }
+        else if (type == 1)
+        {
+            for (int i = 0; i < n; i++)
+                x[i] = GetSigned(&r, bps);
+        }
+        else if (type >= 8 && type <= 12)
+        {
+            int order = type - 8;
+            for (int i = 0; i < order; i++)
+                x[i] = GetSigned(&r, bps);
+            if (!ReadResidual(&r, x, n, order))
+                return false;
+            for (int i = order; i < n; i++)
+                x[i] = (int)(x[i] + FixedPrediction(x, i, order));
+        }
+        else if (type >= 32)
+        {
+            int order = type - 31;
+            int qlp[32];
+            for (int i = 0; i < order; i++)
+                x[i] = GetSigned(&r, bps);
+            int precision = GetBits(&r, 4) + 1;
+            int shift = GetSigned(&r, 5);
+            if (precision == 16 || shift < 0)
+                return false;
+            for (int j = 0; j < order; j++)
+                qlp[j] = GetSigned(&r, precision);
+            if (!ReadResidual(&r, x, n, order))
+                return false;
+            for (int i = order; i < n; i++)
+                x[i] = (int)(x[i] + LpcPrediction(x, i, qlp, order, shift));
+        }
+        else
+            return false;
+        if (r.overrun || memcmp(x, planes[c], n * sizeof(int)) != 0)
+            return false;
+    }
+    // the subframes end with the padding before the CRC
+    long long consumed = (long long)r.pos * 8 - r.nbBits;
+    return consumed <= (long long)r.size * 8 && consumed > (long long)r.size * 8 - 8;
+}
+
+///////////////////
+/// Batches     ///
+///////////////////
+
+struct FlacBatch_s
+{
+    int* samples[FLAC_MAX_CHANNELS];    // planar, capacity samples per channel
+    long capacity;
+    long nbSamples;
+    long long firstFrame;
+    int nbFrames;
+    unsigned char** frames;             // encoded frames
+    long* frameSizes;
+    int nbChan;
+    int bitsPerSample;
+    pthread_mutex_t lock;
+    int nextFrame;
+    pthread_t* workers;
+    int nbWorkers;
+    long long badFrame;                 // -1, or the first frame which failed the verification
+};
+
+static FlacBatch* NewBatch(int nbChan, int bitsPerSample, int nbFrames, int nbThreads)
+{
+    FlacBatch* batch = calloc(1, sizeof(FlacBatch));
+    batch->capacity = (long)nbFrames * FLAC_BLOCK_SIZE;
+    for (int c = 0; c < nbChan; c++)
+        batch->samples[c] = malloc(batch->capacity * sizeof(int));
+    // a frame is never longer than its verbatim coding
+    long frameCapacity = 32 + nbChan * (2 + (long)FLAC_BLOCK_SIZE * bitsPerSample / 8);
+    batch->frames = malloc(nbFrames * sizeof(unsigned char*));
+    for (int k = 0; k < nbFrames; k++)
+        batch->frames[k] = malloc(frameCapacity);
+    batch->frameSizes = calloc(nbFrames, sizeof(long));
+    batch->nbChan = nbChan;
+    batch->bitsPerSample = bitsPerSample;
+    batch->workers = malloc(sizeof(pthread_t) * nbThreads);
+    batch->badFrame = -1;
+    pthread_mutex_init(&batch->lock, NULL);
+    return batch;
+}
+
+static void FreeBatch(FlacBatch* batch, int nbFrames)
+{
+    for (int c = 0; c < batch->nbChan; c++)
+        free(batch->samples[c]);
+    for (int k = 0; k < nbFrames; k++)
+        free(batch->frames[k]);
+    free(batch->frames);
+    free(batch->frameSizes);
+    free(batch->workers);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch);
+}
+
+static void* EncodeBatch(void* arg)
+{
+    FlacBatch* batch = arg;
+    FlacWork work = { 0 };
+    work.fixedResidual = malloc(FLAC_BLOCK_SIZE * sizeof(int));
+    work.lpcResidual = malloc(FLAC_BLOCK_SIZE * sizeof(int));
+    work.decoded = malloc(FLAC_BLOCK_SIZE * sizeof(int));
+    work.window = malloc(FLAC_BLOCK_SIZE * sizeof(double));
+    work.windowed = malloc(FLAC_BLOCK_SIZE * sizeof(double));
+    for (;;)
+    {
+        pthread_mutex_lock(&batch->lock);
+        int k = batch->nextFrame++;
+        pthread_mutex_unlock(&batch->lock);
+        if (k >= batch->nbFrames)
+            break;
+        long first = (long)k * FLAC_BLOCK_SIZE;
+        int n = batch->nbSamples - first < FLAC_BLOCK_SIZE ? (int)(batch->nbSamples - first) : FLAC_BLOCK_SIZE;
+        int* planes[FLAC_MAX_CHANNELS];
+        for (int c = 0; c < batch->nbChan; c++)
+            planes[c] = batch->samples[c] + first;
+        int headerSize;
+        long size = EncodeFrame(&work, batch->frames[k], planes, batch->nbChan, n, batch->bitsPerSample,
+                                batch->firstFrame + k, &headerSize);
+        batch->frameSizes[k] = size;
+        if (!VerifyFrame(&work, batch->frames[k], size, headerSize, planes, batch->nbChan, n, batch->bitsPerSample))
+        {
+            pthread_mutex_lock(&batch->lock);
+            if (batch->badFrame < 0 || batch->firstFrame + k < batch->badFrame)
+                batch->badFrame = batch->firstFrame + k;
+            pthread_mutex_unlock(&batch->lock);
+        }
+    }
+    free(work.fixedResidual);
+    free(work.lpcResidual);
+    free(work.decoded);
+    free(work.window);
+    free(work.windowed);
+    return NULL;
+}
+
+// Encodes the samples of the batch, in the background if there are threads
+static void StartBatch(FlacEncoder* enc, FlacBatch* batch)
+{
+    batch->firstFrame = (enc->nbSamples - batch->nbSamples) / FLAC_BLOCK_SIZE;
+    batch->nbFrames = (int)((batch->nbSamples + FLAC_BLOCK_SIZE - 1) / FLAC_BLOCK_SIZE);
+    batch->nextFrame = 0;
+    batch->badFrame = -1;
+    batch->nbWorkers = enc->nbThreads > 1 ? enc->nbThreads : 0;
+    for (int t = 0; t < batch->nbWorkers; t++)
+        pthread_create(&batch->workers[t], NULL, EncodeBatch, batch);
+    if (batch->nbWorkers == 0)
+        EncodeBatch(batch);
+}
+
+// Waits for the frames of the batch and writes them, in order
+static void FinishBatch(FlacEncoder* enc, FlacBatch* batch)
+{
+    for (int t = 0; t < batch->nbWorkers; t++)
+        pthread_join(batch->workers[t], NULL);
+    batch->nbWorkers = 0;
+    if (batch->badFrame >= 0 && !enc->failed)
+    {
+        snprintf(enc->error, sizeof(enc->error), "FLAC verification failed at frame %lld", batch->badFrame);
+        enc->failed = true;
+    }
+    for (int k = 0; k < batch->nbFrames && !enc->failed; k++)
+    {
+        unsigned int size = (unsigned int)batch->frameSizes[k];
+        if (fwrite(batch->frames[k], 1, size, enc->file) != size)
+        {
+            snprintf(enc->error, sizeof(enc->error), "Failed to write FLAC output file");
+            enc->failed = true;
+        }
+        enc->bytesWritten += size;
+        enc->minFrameSize = enc->nbFrames == 0 || size < enc->minFrameSize ? size : enc->minFrameSize;
+        enc->maxFrameSize = size > enc->maxFrameSize ? size : enc->maxFrameSize;
+        enc->nbFrames++;
+    }
+    batch->nbFrames = 0;
+    batch->nbSamples = 0;
+}
+
+// The filled batch is encoded while the other one is written then refilled
+static void DispatchBatch(FlacEncoder* enc)
+{
+    FinishBatch(enc, enc->batches[enc->current ^ 1]);
+    StartBatch(enc, enc->batches[enc->current]);
+    enc->current ^= 1;
+}
+
+///////////////////
+/// Stream      ///
+///////////////////
+
+static void FormatStreamInfo(unsigned char* out, const FlacEncoder* enc, const unsigned char* md5)
+{
+    BitWriter w = { out, 0, 0, 0 };
+    memcpy(out, "fLaC", 4);
+    w.pos = 4;
+    PutBits(&w, 0x80, 8);               // last metadata block, STREAMINFO
+    PutBits(&w, 34, 24);
+    int blockSize = enc->nbSamples > 0 && enc->nbSamples < FLAC_BLOCK_SIZE ? (int)enc->nbSamples : FLAC_BLOCK_SIZE;
+    PutBits(&w, blockSize, 16);
+    PutBits(&w, blockSize, 16);
+    PutBits(&w, enc->minFrameSize, 24);
+    PutBits(&w, enc->maxFrameSize, 24);
+    PutBits(&w, enc->sampleRate, 20);
+    PutBits(&w, enc->nbChan - 1, 3);
+    PutBits(&w, enc->bitsPerSample - 1, 5);
+    PutBits(&w, (unsigned int)(enc->nbSamples >> 32), 4);     // 0 : unknown length
+    PutBits(&w, (unsigned int)enc->nbSamples, 32);
+    for (int i = 0; i < 16; i++)
+        PutBits(&w, md5 != NULL ? md5[i] : 0, 8);
+}
+
+bool OpenFlacEncoder(FlacEncoder* enc, FILE* file, int nbChan, int bitsPerSample, int sampleRate, int nbThreads)
+{
+    memset(enc, 0, sizeof(FlacEncoder));
+    if (nbChan < 1 || nbChan > FLAC_MAX_CHANNELS)
+    {
+        snprintf(enc->error, sizeof(enc->error), "FLAC holds at most %d channels", FLAC_MAX_CHANNELS);
+        return false;
+    }
+    pthread_once(&CrcTablesOnce, InitCrcTables);
+    enc->file = file;
+    enc->nbChan = nbChan;
+    enc->bitsPerSample = bitsPerSample;
+    enc->sampleRate = sampleRate;
+    enc->nbThreads = nbThreads > 1 ? nbThreads : 1;
+    int nbFrames = FLAC_BATCH_FRAMES * enc->nbThreads;
+    enc->batches[0] = NewBatch(nbChan, bitsPerSample, nbFrames, enc->nbThreads);
+    enc->batches[1] = NewBatch(nbChan, bitsPerSample, nbFrames, enc->nbThreads);
+    enc->interleaved = malloc((long)FLAC_BLOCK_SIZE * nbChan * (bitsPerSample / 8));
+    Md5Init(&enc->md5);
+    unsigned char header[FLAC_STREAMINFO_SIZE];
+    FormatStreamInfo(header, enc, NULL);
+    if (fwrite(header, 1, FLAC_STREAMINFO_SIZE, file) != FLAC_STREAMINFO_SIZE)
+    {
+        snprintf(enc->error, sizeof(enc->error), "Failed to write FLAC output file");
+        enc->failed = true;
+    }
+    enc->bytesWritten = FLAC_STREAMINFO_SIZE;
+    return !enc->failed;
+}
+
+static void LoadSamples(int* dst, const char* src, long nbSamples, int bytes, int stride)
+{
+    const unsigned char* p = (const unsigned char*)src;
+    switch (bytes)
+    {
+        case 2:
+            for (long i = 0; i < nbSamples; i++, p += stride)
+                dst[i] = (short)(p[0] | p[1] << 8);
+            break;
+        case 3:
+            for (long i = 0; i < nbSamples; i++, p += stride)
+                dst[i] = (int)((unsigned)p[0] << 8 | (unsigned)p[1] << 16 | (unsigned)p[2] << 24) >> 8;
+            break;
+        default:
+            for (long i = 0; i < nbSamples; i++, p += stride)
+                dst[i] = (int)((unsigned)p[0] | (unsigned)p[1] << 8 | (unsigned)p[2] << 16 | (unsigned)p[3] << 24);
+            break;
+    }
+}
+
+bool FlacEncodePlanes(FlacEncoder* enc, const char* const* planes, long nbSamples)
+{
+    int bytes = enc->bitsPerSample / 8;
+    InterleaveKernel interleave = SelectInterleaveKernel(bytes, enc->nbChan);
+    const char* shifted[FLAC_MAX_CHANNELS];
+    for (long done = 0; done < nbSamples && !enc->failed;)
+    {
+        FlacBatch* batch = enc->batches[enc->current];
+        long n = nbSamples - done;
+        n = n < batch->capacity - batch->nbSamples ? n : batch->capacity - batch->nbSamples;
+        n = n < FLAC_BLOCK_SIZE ? n : FLAC_BLOCK_SIZE;
+        for (int c = 0; c < enc->nbChan; c++)
+        {
+            shifted[c] = planes[c] + done * bytes;
+            LoadSamples(batch->samples[c] + batch->nbSamples, shifted[c], n, bytes, bytes);
+        }
+        // the MD5 is the one of the wav samples
+        interleave(enc->interleaved, shifted, enc->nbChan, n);
+        Md5Update(&enc->md5, enc->interleaved, (unsigned long long)n * enc->nbChan * bytes);
+        batch->nbSamples += n;
+        enc->nbSamples += n;
+        done += n;
+        if (batch->nbSamples == batch->capacity)
+            DispatchBatch(enc);
+    }
+    return !enc->failed;
+}
+
+bool FlacEncodeFrames(FlacEncoder* enc, const char* frames, long nbFrames)
+{
+    int bytes = enc->bitsPerSample / 8;
+    int frameSize = enc->nbChan * bytes;
+    Md5Update(&enc->md5, frames, (unsigned long long)nbFrames * frameSize);
+    for (long done = 0; done < nbFrames && !enc->failed;)
+    {
+        FlacBatch* batch = enc->batches[enc->current];
+        long n = nbFrames - done;
+        n = n < batch->capacity - batch->nbSamples ? n : batch->capacity - batch->nbSamples;
+        for (int c = 0; c < enc->nbChan; c++)
+            LoadSamples(batch->samples[c] + batch->nbSamples, frames + done * frameSize + c * bytes, n, bytes, frameSize);
+        batch->nbSamples += n;
+        enc->nbSamples += n;
+        done += n;
+        if (batch->nbSamples == batch->capacity)
+            DispatchBatch(enc);
+    }
+    return !enc->failed;
+}
+
+bool CloseFlacEncoder(FlacEncoder* enc)
+{
+    if (enc->batches[0] == NULL)
+        return false;
+    if (enc->batches[enc->current]->nbSamples > 0)
+        DispatchBatch(enc);
+    FinishBatch(enc, enc->batches[enc->current ^ 1]);
+    unsigned char md5[16];
+    Md5Final(&enc->md5, md5);
+    if (!enc->failed)
+    {
+        // not on a pipe : the STREAMINFO keeps the unknown sizes
+        unsigned char header[FLAC_STREAMINFO_SIZE];
+        FormatStreamInfo(header, enc, md5);
+        if (fflush(enc->file) == 0 && fseek(enc->file, 0, SEEK_SET) == 0)
+        {
+            if (fwrite(header, 1, FLAC_STREAMINFO_SIZE, enc->file) != FLAC_STREAMINFO_SIZE)
+            {
+                snprintf(enc->error, sizeof(enc->error), "Failed to write FLAC output file");
+                enc->failed = true;
+            }
+            fseek(enc->file, 0, SEEK_END);
+        }
+    }
+    if (fflush(enc->file) != 0 && !enc->failed)
+    {
+        snprintf(enc->error, sizeof(enc->error), "Failed to write FLAC output file");
+        enc->failed = true;
+    }
+    int nbFrames = FLAC_BATCH_FRAMES * enc->nbThreads;
+    FreeBatch(enc->batches[0], nbFrames);
+    FreeBatch(enc->batches[1], nbFrames);
+    free(enc->interleaved);
+    enc->batches[0] = enc->batches[1] = NULL;
+    enc->interleaved = NULL;
+    return !enc->failed;
+}
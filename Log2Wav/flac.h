@@ -0,0 +1,62 @@
+#ifndef FLAC_H
+#define FLAC_H
+#include <stdio.h>
+#include <stdbool.h>
+#include "md5.h"
+
+// FLAC output (RFC 9639), written instead of the wav when the output name ends
+// with .flac : same samples, about half the bytes for hydrophone recordings.
+//
+// The audio is cut in frames of FLAC_BLOCK_SIZE samples per channel, encoded
+// independently : a batch of frames is encoded by nbThreads threads while the
+// next batch is filled from the dmaBlocks. Each channel of a frame is coded
+// with the best of a constant, a fixed polynomial predictor (order 0 to 4) or
+// a linear predictor (Levinson-Durbin up to order FLAC_MAX_LPC_ORDER), the
+// residual with partitioned Rice codes. No inter-channel decorrelation, the
+// hydrophones are not a stereo pair.
+//
+// Every frame is decoded back by its thread and compared with the samples
+// before it is written (as flac --verify), and the STREAMINFO holds the MD5 of
+// the samples, i.e. of the data chunk of the equivalent wav.
+
+#define FLAC_BLOCK_SIZE 4096
+#define FLAC_MAX_CHANNELS 8
+#define FLAC_MAX_LPC_ORDER 12
+
+typedef struct FlacBatch_s FlacBatch;   // frames encoded together, see flac.c
+
+typedef struct FlacEncoder_s
+{
+    FILE* file;
+    int nbChan;
+    int bitsPerSample;          // 16, 24 or 32, little-endian input samples of bitsPerSample/8 bytes
+    int sampleRate;
+    int nbThreads;
+    long long nbSamples;        // per channel, received so far
+    long long nbFrames;         // written
+    long long bytesWritten;
+    unsigned int minFrameSize;
+    unsigned int maxFrameSize;
+    Md5Context md5;
+    FlacBatch* batches[2];      // one is filled while the other one is encoded
+    int current;                // batch being filled
+    char* interleaved;          // copy of the planes in the wav order, for the MD5
+    bool failed;
+    char error[128];
+}FlacEncoder;
+
+// Writes the stream header to file, the STREAMINFO is completed by
+// CloseFlacEncoder if the file can be seeked (not on a pipe)
+bool OpenFlacEncoder(FlacEncoder* enc, FILE* file, int nbChan, int bitsPerSample, int sampleRate, int nbThreads);
+
+// Appends nbSamples samples of each plane (planes[c] : channel c, unaligned)
+bool FlacEncodePlanes(FlacEncoder* enc, const char* const* planes, long nbSamples);
+// Appends nbFrames interleaved frames, as they would be written to a wav
+bool FlacEncodeFrames(FlacEncoder* enc, const char* frames, long nbFrames);
+
+// Encodes the last frames, completes the STREAMINFO and frees the encoder.
+// The file is flushed but not closed. Returns false if a write or a frame
+// verification failed, see enc->error.
+bool CloseFlacEncoder(FlacEncoder* enc);
+
+#endif
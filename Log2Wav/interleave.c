@@ -0,0 +1,775 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "interleave.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define INTERLEAVE_X86
+#include <immintrin.h>
+#endif
+
+//////////////////////
+/// Scalar kernels ///
+//////////////////////
+
+// Loads and stores go through memcpy: the planes come straight from the .log
+// file layout and are not even 2-byte aligned in general.
+static void InterleaveScalar16(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    for (long i = 0; i < nbSamples; i++)
+    {
+        for (int c = 0; c < nbChan; c++)
+        {
+            memcpy(dst, planes[c] + 2 * i, 2);
+            dst += 2;
+        }
+    }
+}
+
+static void InterleaveScalar24(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    for (long i = 0; i < nbSamples; i++)
+    {
+        for (int c = 0; c < nbChan; c++)
+        {
+            memcpy(dst, planes[c] + 3 * i, 3);
+            dst += 3;
+        }
+    }
+}
+
+static void InterleaveScalar32(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    for (long i = 0; i < nbSamples; i++)
+    {
+        for (int c = 0; c < nbChan; c++)
+        {
+            memcpy(dst, planes[c] + 4 * i, 4);
+            dst += 4;
+        }
+    }
+}
+
+static void InterleaveMono16(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    (void)nbChan;
+    memcpy(dst, planes[0], nbSamples * 2);
+}
+
+static void InterleaveMono24(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    (void)nbChan;
+    memcpy(dst, planes[0], nbSamples * 3);
+}
+
+static void InterleaveMono32(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    (void)nbChan;
+    memcpy(dst, planes[0], nbSamples * 4);
+}
+
+// Finishes the samples [start, nbSamples) left over by a vector loop
+static void InterleaveTail(char* dst, const char* const* planes, int nbChan, long start, long nbSamples, int resolutionBytes)
+{
+    const char* shifted[MAX_INTERLEAVE_CHAN];
+    for (int c = 0; c < nbChan; c++)
+        shifted[c] = planes[c] + start * resolutionBytes;
+    dst += start * nbChan * resolutionBytes;
+    switch (resolutionBytes)
+    {
+        case 2: InterleaveScalar16(dst, shifted, nbChan, nbSamples - start); break;
+        case 3: InterleaveScalar24(dst, shifted, nbChan, nbSamples - start); break;
+        default: InterleaveScalar32(dst, shifted, nbChan, nbSamples - start); break;
+    }
+}
+
+#ifdef INTERLEAVE_X86
+
+////////////////////
+/// SSE2 kernels ///
+////////////////////
+
+__attribute__((target("sse2")))
+static void InterleaveSSE2_16x2(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    (void)nbChan;
+    long i = 0;
+    for (; i + 8 <= nbSamples; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(planes[0] + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(planes[1] + 2 * i));
+        _mm_storeu_si128((__m128i*)(dst + 4 * i), _mm_unpacklo_epi16(a, b));
+        _mm_storeu_si128((__m128i*)(dst + 4 * i + 16), _mm_unpackhi_epi16(a, b));
+    }
+    InterleaveTail(dst, planes, 2, i, nbSamples, 2);
+}
+
+__attribute__((target("sse2")))
+static void InterleaveSSE2_16x4(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    (void)nbChan;
+    long i = 0;
+    for (; i + 8 <= nbSamples; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(planes[0] + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(planes[1] + 2 * i));
+        __m128i c = _mm_loadu_si128((const __m128i*)(planes[2] + 2 * i));
+        __m128i d = _mm_loadu_si128((const __m128i*)(planes[3] + 2 * i));
+        __m128i abLo = _mm_unpacklo_epi16(a, b);
+        __m128i abHi = _mm_unpackhi_epi16(a, b);
+        __m128i cdLo = _mm_unpacklo_epi16(c, d);
+        __m128i cdHi = _mm_unpackhi_epi16(c, d);
+        char* out = dst + 8 * i;
+        _mm_storeu_si128((__m128i*)(out), _mm_unpacklo_epi32(abLo, cdLo));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi32(abLo, cdLo));
+        _mm_storeu_si128((__m128i*)(out + 32), _mm_unpacklo_epi32(abHi, cdHi));
+        _mm_storeu_si128((__m128i*)(out + 48), _mm_unpackhi_epi32(abHi, cdHi));
+    }
+    InterleaveTail(dst, planes, 4, i, nbSamples, 2);
+}
+
+__attribute__((target("sse2")))
+static void InterleaveSSE2_32x2(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    (void)nbChan;
+    long i = 0;
+    for (; i + 4 <= nbSamples; i += 4)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(planes[0] + 4 * i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(planes[1] + 4 * i));
+        _mm_storeu_si128((__m128i*)(dst + 8 * i), _mm_unpacklo_epi32(a, b));
+        _mm_storeu_si128((__m128i*)(dst + 8 * i + 16), _mm_unpackhi_epi32(a, b));
+    }
+    InterleaveTail(dst, planes, 2, i, nbSamples, 4);
+}
+
+__attribute__((target("sse2")))
+static void InterleaveSSE2_32x4(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    (void)nbChan;
+    long i = 0;
+    for (; i + 4 <= nbSamples; i += 4)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(planes[0] + 4 * i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(planes[1] + 4 * i));
+        __m128i c = _mm_loadu_si128((const __m128i*)(planes[2] + 4 * i));
+        __m128i d = _mm_loadu_si128((const __m128i*)(planes[3] + 4 * i));
+        __m128i abLo = _mm_unpacklo_epi32(a, b);
+        __m128i abHi = _mm_unpackhi_epi32(a, b);
+        __m128i cdLo = _mm_unpacklo_epi32(c, d);
+        __m128i cdHi = _mm_unpackhi_epi32(c, d);
+        char* out = dst + 16 * i;
+        _mm_storeu_si128((__m128i*)(out), _mm_unpacklo_epi64(abLo, cdLo));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi64(abLo, cdLo));
+        _mm_storeu_si128((__m128i*)(out + 32), _mm_unpacklo_epi64(abHi, cdHi));
+        _mm_storeu_si128((__m128i*)(out + 48), _mm_unpackhi_epi64(abHi, cdHi));
+    }
+    InterleaveTail(dst, planes, 4, i, nbSamples, 4);
+}
+
+////////////////////
+/// AVX2 kernels ///
+////////////////////
+
+__attribute__((target("avx2")))
+static void InterleaveAVX2_16x2(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    (void)nbChan;
+    long i = 0;
+    for (; i + 16 <= nbSamples; i += 16)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(planes[0] + 2 * i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(planes[1] + 2 * i));
+        __m256i lo = _mm256_unpacklo_epi16(a, b);
+        __m256i hi = _mm256_unpackhi_epi16(a, b);
+        _mm256_storeu_si256((__m256i*)(dst + 4 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i*)(dst + 4 * i + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    InterleaveTail(dst, planes, 2, i, nbSamples, 2);
+}
+
+__attribute__((target("avx2")))
+static void InterleaveAVX2_16x4(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    (void)nbChan;
+    long i = 0;
+    for (; i + 16 <= nbSamples; i += 16)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(planes[0] + 2 * i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(planes[1] + 2 * i));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(planes[2] + 2 * i));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(planes[3] + 2 * i));
+        __m256i abLo = _mm256_unpacklo_epi16(a, b);
+        __m256i abHi = _mm256_unpackhi_epi16(a, b);
+        __m256i cdLo = _mm256_unpacklo_epi16(c, d);
+        __m256i cdHi = _mm256_unpackhi_epi16(c, d);
+        // each 128-bit lane now holds 2 complete frames
+        __m256i q0 = _mm256_unpacklo_epi32(abLo, cdLo);     // frames 0,1 | 8,9
+        __m256i q1 = _mm256_unpackhi_epi32(abLo, cdLo);     // frames 2,3 | 10,11
+        __m256i q2 = _mm256_unpacklo_epi32(abHi, cdHi);     // frames 4,5 | 12,13
+        __m256i q3 = _mm256_unpackhi_epi32(abHi, cdHi);     // frames 6,7 | 14,15
+        char* out = dst + 8 * i;
+        _mm256_storeu_si256((__m256i*)(out), _mm256_permute2x128_si256(q0, q1, 0x20));
+        _mm256_storeu_si256((__m256i*)(out + 32), _mm256_permute2x128_si256(q2, q3, 0x20));
+        _mm256_storeu_si256((__m256i*)(out + 64), _mm256_permute2x128_si256(q0, q1, 0x31));
+        _mm256_storeu_si256((__m256i*)(out + 96), _mm256_permute2x128_si256(q2, q3, 0x31));
+    }
+    InterleaveTail(dst, planes, 4, i, nbSamples, 2);
+}
+
+// 2x2 (resp. 4x4) transposes of 8 x 32 bits samples per channel, used by the
+// 32-bit kernels and by the 24-bit ones once the samples have been widened
+__attribute__((target("avx2")))
+static inline void Transpose32x2(__m256i a, __m256i b, __m256i out[2])
+{
+    __m256i lo = _mm256_unpacklo_epi32(a, b);
+    __m256i hi = _mm256_unpackhi_epi32(a, b);
+    out[0] = _mm256_permute2x128_si256(lo, hi, 0x20);
+    out[1] = _mm256_permute2x128_si256(lo, hi, 0x31);
+}
+
+__attribute__((target("avx2")))
+static inline void Transpose32x4(__m256i a, __m256i b, __m256i c, __m256i d, __m256i out[4])
+{
+    __m256i abLo = _mm256_unpacklo_epi32(a, b);
+    __m256i abHi = _mm256_unpackhi_epi32(a, b);
+    __m256i cdLo = _mm256_unpacklo_epi32(c, d);
+    __m256i cdHi = _mm256_unpackhi_epi32(c, d);
+    __m256i q0 = _mm256_unpacklo_epi64(abLo, cdLo);     // frames 0 | 4
+    __m256i q1 = _mm256_unpackhi_epi64(abLo, cdLo);     // frames 1 | 5
+    __m256i q2 = _mm256_unpacklo_epi64(abHi, cdHi);     // frames 2 | 6
+    __m256i q3 = _mm256_unpackhi_epi64(abHi, cdHi);     // frames 3 | 7
+    out[0] = _mm256_permute2x128_si256(q0, q1, 0x20);
+    out[1] = _mm256_permute2x128_si256(q2, q3, 0x20);
+    out[2] = _mm256_permute2x128_si256(q0, q1, 0x31);
+    out[3] = _mm256_permute2x128_si256(q2, q3, 0x31);
+}
+
+__attribute__((target("avx2")))
+static void InterleaveAVX2_32x2(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    (void)nbChan;
+    long i = 0;
+    __m256i out[2];
+    for (; i + 8 <= nbSamples; i += 8)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(planes[0] + 4 * i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(planes[1] + 4 * i));
+        Transpose32x2(a, b, out);
+        _mm256_storeu_si256((__m256i*)(dst + 8 * i), out[0]);
+        _mm256_storeu_si256((__m256i*)(dst + 8 * i + 32), out[1]);
+    }
+    InterleaveTail(dst, planes, 2, i, nbSamples, 4);
+}
+
+__attribute__((target("avx2")))
+static void InterleaveAVX2_32x4(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    (void)nbChan;
+    long i = 0;
+    __m256i out[4];
+    for (; i + 8 <= nbSamples; i += 8)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(planes[0] + 4 * i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(planes[1] + 4 * i));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(planes[2] + 4 * i));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(planes[3] + 4 * i));
+        Transpose32x4(a, b, c, d, out);
+        for (int k = 0; k < 4; k++)
+            _mm256_storeu_si256((__m256i*)(dst + 16 * i + 32 * k), out[k]);
+    }
+    InterleaveTail(dst, planes, 4, i, nbSamples, 4);
+}
+
+// Packed 24-bit samples are widened to one sample per 32-bit lane, transposed
+// like 32-bit samples, then narrowed back to 3 bytes before the store.
+// Loading 8 samples reads 32 bytes (24 used), hence the i + 11 bound.
+__attribute__((target("avx2")))
+static inline __m256i Widen24(const char* p)
+{
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+    return _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(v, lanes), spread);
+}
+
+__attribute__((target("avx2")))
+static inline void StoreNarrow24(char* dst, __m256i v)
+{
+    const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                          0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, pack), lanes);
+    _mm_storeu_si128((__m128i*)dst, _mm256_castsi256_si128(v));
+    _mm_storel_epi64((__m128i*)(dst + 16), _mm256_extracti128_si256(v, 1));
+}
+
+__attribute__((target("avx2")))
+static void InterleaveAVX2_24x2(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    (void)nbChan;
+    long i = 0;
+    __m256i out[2];
+    for (; i + 11 <= nbSamples; i += 8)
+    {
+        Transpose32x2(Widen24(planes[0] + 3 * i), Widen24(planes[1] + 3 * i), out);
+        StoreNarrow24(dst + 6 * i, out[0]);
+        StoreNarrow24(dst + 6 * i + 24, out[1]);
+    }
+    InterleaveTail(dst, planes, 2, i, nbSamples, 3);
+}
+
+__attribute__((target("avx2")))
+static void InterleaveAVX2_24x4(char* dst, const char* const* planes, int nbChan, long nbSamples)
+{
+    (void)nbChan;
+    long i = 0;
+    __m256i out[4];
+    for (; i + 11 <= nbSamples; i += 8)
+    {
+        Transpose32x4(Widen24(planes[0] + 3 * i), Widen24(planes[1] + 3 * i),
+                      Widen24(planes[2] + 3 * i), Widen24(planes[3] + 3 * i), out);
+        for (int k = 0; k < 4; k++)
+            StoreNarrow24(dst + 12 * i + 24 * k, out[k]);
+    }
+    InterleaveTail(dst, planes, 4, i, nbSamples, 3);
+}
+
+#endif
+
+/////////////////
+/// Dispatch  ///
+/////////////////
+
+SimdLevel GetSimdLevel(void)
+{
+    static int level = -1;
+    if (level >= 0)
+        return (SimdLevel)level;
+    int detected = SimdScalar;
+#ifdef INTERLEAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        detected = SimdSSE2;
+    if (__builtin_cpu_supports("avx2"))
+        detected = SimdAVX2;
+#endif
+    const char* cap = getenv("LOG2WAV_SIMD");
+    if (cap != NULL)
+    {
+        if (strcmp(cap, "scalar") == 0 && detected > SimdScalar)
+            detected = SimdScalar;
+        else if (strcmp(cap, "sse2") == 0 && detected > SimdSSE2)
+            detected = SimdSSE2;
+    }
+    level = detected;
+    return (SimdLevel)level;
+}
+
+const char* InterleaveSimdLevel(void)
+{
+    switch (GetSimdLevel())
+    {
+        case SimdAVX2: return "avx2";
+        case SimdSSE2: return "sse2";
+        default: return "scalar";
+    }
+}
+
+InterleaveKernel SelectInterleaveKernel(int resolutionBytes, int nbChan)
+{
+    if (nbChan == 1)
+    {
+        switch (resolutionBytes)
+        {
+            case 2: return InterleaveMono16;
+            case 3: return InterleaveMono24;
+            default: return InterleaveMono32;
+        }
+    }
+#ifdef INTERLEAVE_X86
+    SimdLevel level = GetSimdLevel();
+    if (level >= SimdAVX2)
+    {
+        if (resolutionBytes == 2 && nbChan == 2) return InterleaveAVX2_16x2;
+        if (resolutionBytes == 2 && nbChan == 4) return InterleaveAVX2_16x4;
+        if (resolutionBytes == 3 && nbChan == 2) return InterleaveAVX2_24x2;
+        if (resolutionBytes == 3 && nbChan == 4) return InterleaveAVX2_24x4;
+        if (resolutionBytes == 4 && nbChan == 2) return InterleaveAVX2_32x2;
+        if (resolutionBytes == 4 && nbChan == 4) return InterleaveAVX2_32x4;
+    }
+    if (level >= SimdSSE2)
+    {
+        // no byte shuffle in SSE2, 24-bit samples stay on the scalar path
+        if (resolutionBytes == 2 && nbChan == 2) return InterleaveSSE2_16x2;
+        if (resolutionBytes == 2 && nbChan == 4) return InterleaveSSE2_16x4;
+        if (resolutionBytes == 4 && nbChan == 2) return InterleaveSSE2_32x2;
+        if (resolutionBytes == 4 && nbChan == 4) return InterleaveSSE2_32x4;
+    }
+#endif
+    switch (resolutionBytes)
+    {
+        case 2: return InterleaveScalar16;
+        case 3: return InterleaveScalar24;
+        default: return InterleaveScalar32;
+    }
+}
+
+void InterleaveBlock(char* dst, const char* dmaBlock, int nbChan, long nbSamples, int resolutionBytes)
+{
+    const char* planes[MAX_INTERLEAVE_CHAN];
+    for (int c = 0; c < nbChan && c < MAX_INTERLEAVE_CHAN; c++)
+        planes[c] = dmaBlock + (long)c * nbSamples * resolutionBytes;
+    SelectInterleaveKernel(resolutionBytes, nbChan)(dst, planes, nbChan, nbSamples);
+}
+
+void InterleaveChannels(char* dst, const char* dmaBlock, long planeSamples, int resolutionBytes,
+                        const int* channels, int nbChannels, long firstSample, long nbSamples)
+{
+    const char* planes[MAX_INTERLEAVE_CHAN];
+    for (int c = 0; c < nbChannels && c < MAX_INTERLEAVE_CHAN; c++)
+        planes[c] = dmaBlock + ((long)channels[c] * planeSamples + firstSample) * resolutionBytes;
+    SelectInterleaveKernel(resolutionBytes, nbChannels)(dst, planes, nbChannels, nbSamples);
+}
+
+//////////////////////////
+/// Format conversions ///
+//////////////////////////
+
+// Parameters of one conversion call, shared by the kernels
+typedef struct FormatState_s
+{
+    int resolutionBytes;
+    const float* gains;                             // float32
+    float scale;                                    // int16 : 2^(16 - bits)
+    unsigned int frame;                             // low 32 bits of the number of the first frame
+    unsigned int salts[MAX_INTERLEAVE_CHAN][2];     // int16 : keys of the 2 uniform noises of each channel
+}FormatState;
+
+// Converts the samples [start, nbSamples) of the planes, dst points to frame 0
+typedef void (*FormatKernel)(char* dst, const char* const* planes, int nbChan, long start, long nbSamples,
+                             const FormatState* st);
+
+static inline int LoadSample(const char* p, int resolutionBytes)
+{
+    const unsigned char* u = (const unsigned char*)p;
+    switch (resolutionBytes)
+    {
+        case 2: return (short)(u[0] | u[1] << 8);
+        case 3: return (int)((unsigned)u[0] << 8 | (unsigned)u[1] << 16 | (unsigned)u[2] << 24) >> 8;
+        default: return (int)((unsigned)u[0] | (unsigned)u[1] << 8 | (unsigned)u[2] << 16 | (unsigned)u[3] << 24);
+    }
+}
+
+// lowbias32 integer hash (C. Wellons). The dither noise is a hash of the
+// channel and frame numbers instead of a sequential generator, so that any
+// slice of the output can be computed on its own, 8 frames at a time in AVX2.
+static inline unsigned int Hash32(unsigned int x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// TPDF dither : difference of 2 uniform noises of 24 bits, in ]-1, 1[ LSB
+static inline float Dither(const FormatState* st, int c, unsigned int frame)
+{
+    float u1 = (float)(Hash32(st->salts[c][0] ^ frame) >> 8);
+    float u2 = (float)(Hash32(st->salts[c][1] ^ frame) >> 8);
+    return (u1 - u2) * (1.0f / 16777216);
+}
+
+static inline short Quantize16(float v)
+{
+    v = v < 32767.0f ? v : 32767.0f;
+    v = v > -32768.0f ? v : -32768.0f;
+    return (short)lrintf(v);        // round to nearest even, as _mm256_cvtps_epi32
+}
+
+static void FormatScalarFloat(char* dst, const char* const* planes, int nbChan, long start, long nbSamples,
+                              const FormatState* st)
+{
+    int res = st->resolutionBytes;
+    for (long i = start; i < nbSamples; i++)
+    {
+        for (int c = 0; c < nbChan; c++)
+        {
+            float v = (float)LoadSample(planes[c] + i * res, res) * st->gains[c];
+            memcpy(dst + (i * nbChan + c) * 4, &v, 4);
+        }
+    }
+}
+
+static void FormatScalarDither16(char* dst, const char* const* planes, int nbChan, long start, long nbSamples,
+                                 const FormatState* st)
+{
+    int res = st->resolutionBytes;
+    for (long i = start; i < nbSamples; i++)
+    {
+        for (int c = 0; c < nbChan; c++)
+        {
+            float v = (float)LoadSample(planes[c] + i * res, res) * st->scale + Dither(st, c, st->frame + (unsigned)i);
+            short sample = Quantize16(v);
+            memcpy(dst + (i * nbChan + c) * 2, &sample, 2);
+        }
+    }
+}
+
+#ifdef INTERLEAVE_X86
+
+// 8 samples of a plane, sign extended to 32 bits
+__attribute__((target("avx2"), always_inline))
+static inline __m256i Load8(const char* p, int resolutionBytes)
+{
+    switch (resolutionBytes)
+    {
+        case 2: return _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)p));
+        case 3: return _mm256_srai_epi32(_mm256_slli_epi32(Widen24(p), 8), 8);
+        default: return _mm256_loadu_si256((const __m256i*)p);
+    }
+}
+
+// Interleaves 8 frames of 32-bit lanes, v[c] holding channel c
+__attribute__((target("avx2"), always_inline))
+static inline void Interleave8(__m256i out[4], const __m256i v[4], int nbChan)
+{
+    if (nbChan == 4)
+        Transpose32x4(v[0], v[1], v[2], v[3], out);
+    else if (nbChan == 2)
+        Transpose32x2(v[0], v[1], out);
+    else
+        out[0] = v[0];
+}
+
+__attribute__((target("avx2")))
+static inline __m256i Hash8(__m256i x)
+{
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7feb352d));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32((int)0x846ca68bu));
+    return _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void FormatAVX2Float(char* dst, const char* const* planes, long start, long nbSamples,
+                                   const FormatState* st, int res, int nbChan)
+{
+    long i = start;
+    long bound = res == 3 ? 11 : 8;
+    __m256 gains[4];
+    __m256i v[4], out[4];
+    for (int c = 0; c < nbChan; c++)
+        gains[c] = _mm256_set1_ps(st->gains[c]);
+    for (; i + bound <= nbSamples; i += 8)
+    {
+        for (int c = 0; c < nbChan; c++)
+            v[c] = _mm256_castps_si256(_mm256_mul_ps(_mm256_cvtepi32_ps(Load8(planes[c] + res * i, res)), gains[c]));
+        Interleave8(out, v, nbChan);
+        for (int k = 0; k < nbChan; k++)
+            _mm256_storeu_si256((__m256i*)(dst + 4 * nbChan * i + 32 * k), out[k]);
+    }
+    FormatScalarFloat(dst, planes, nbChan, i, nbSamples, st);
+}
+
+// Same arithmetic as FormatScalarDither16, bit for bit
+__attribute__((target("avx2"), always_inline))
+static inline void FormatAVX2Dither16(char* dst, const char* const* planes, long start, long nbSamples,
+                                      const FormatState* st, int res, int nbChan)
+{
+    long i = start;
+    long bound = res == 3 ? 11 : 8;
+    const __m256 scale = _mm256_set1_ps(st->scale);
+    const __m256 unit = _mm256_set1_ps(1.0f / 16777216);
+    const __m256 high = _mm256_set1_ps(32767.0f);
+    const __m256 low = _mm256_set1_ps(-32768.0f);
+    __m256i frames = _mm256_add_epi32(_mm256_set1_epi32((int)(st->frame + (unsigned)i)),
+                                      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i v[4], out[4];
+    for (; i + bound <= nbSamples; i += 8)
+    {
+        for (int c = 0; c < nbChan; c++)
+        {
+            __m256 x = _mm256_mul_ps(_mm256_cvtepi32_ps(Load8(planes[c] + res * i, res)), scale);
+            __m256 u1 = _mm256_cvtepi32_ps(_mm256_srli_epi32(
+                Hash8(_mm256_xor_si256(_mm256_set1_epi32((int)st->salts[c][0]), frames)), 8));
+            __m256 u2 = _mm256_cvtepi32_ps(_mm256_srli_epi32(
+                Hash8(_mm256_xor_si256(_mm256_set1_epi32((int)st->salts[c][1]), frames)), 8));
+            x = _mm256_add_ps(x, _mm256_mul_ps(_mm256_sub_ps(u1, u2), unit));
+            x = _mm256_max_ps(_mm256_min_ps(x, high), low);
+            v[c] = _mm256_cvtps_epi32(x);
+        }
+        frames = _mm256_add_epi32(frames, _mm256_set1_epi32(8));
+        Interleave8(out, v, nbChan);
+        // the values are in range, packs only narrows them
+        for (int k = 0; k < nbChan; k++)
+        {
+            __m256i narrow = _mm256_permute4x64_epi64(_mm256_packs_epi32(out[k], out[k]), 0x08);
+            _mm_storeu_si128((__m128i*)(dst + 2 * nbChan * i + 16 * k), _mm256_castsi256_si128(narrow));
+        }
+    }
+    FormatScalarDither16(dst, planes, nbChan, i, nbSamples, st);
+}
+
+#define FORMAT_AVX2_KERNEL(name, body, res, chans)                                                          \
+    __attribute__((target("avx2")))                                                                         \
+    static void name(char* dst, const char* const* planes, int nbChan, long start, long nbSamples,          \
+                     const FormatState* st)                                                                 \
+    {                                                                                                       \
+        (void)nbChan;                                                                                       \
+        body(dst, planes, start, nbSamples, st, res, chans);                                                \
+    }
+
+FORMAT_AVX2_KERNEL(FloatAVX2_16x1, FormatAVX2Float, 2, 1)
+FORMAT_AVX2_KERNEL(FloatAVX2_16x2, FormatAVX2Float, 2, 2)
+FORMAT_AVX2_KERNEL(FloatAVX2_16x4, FormatAVX2Float, 2, 4)
+FORMAT_AVX2_KERNEL(FloatAVX2_24x1, FormatAVX2Float, 3, 1)
+FORMAT_AVX2_KERNEL(FloatAVX2_24x2, FormatAVX2Float, 3, 2)
+FORMAT_AVX2_KERNEL(FloatAVX2_24x4, FormatAVX2Float, 3, 4)
+FORMAT_AVX2_KERNEL(FloatAVX2_32x1, FormatAVX2Float, 4, 1)
+FORMAT_AVX2_KERNEL(FloatAVX2_32x2, FormatAVX2Float, 4, 2)
+FORMAT_AVX2_KERNEL(FloatAVX2_32x4, FormatAVX2Float, 4, 4)
+FORMAT_AVX2_KERNEL(Dither16AVX2_24x1, FormatAVX2Dither16, 3, 1)
+FORMAT_AVX2_KERNEL(Dither16AVX2_24x2, FormatAVX2Dither16, 3, 2)
+FORMAT_AVX2_KERNEL(Dither16AVX2_24x4, FormatAVX2Dither16, 3, 4)
+FORMAT_AVX2_KERNEL(Dither16AVX2_32x1, FormatAVX2Dither16, 4, 1)
+FORMAT_AVX2_KERNEL(Dither16AVX2_32x2, FormatAVX2Dither16, 4, 2)
+FORMAT_AVX2_KERNEL(Dither16AVX2_32x4, FormatAVX2Dither16, 4, 4)
+
+#endif
+
+// No SSE2 kernels : the dither hash needs the 32-bit multiply of SSE4.1,
+// and the float conversion alone is not worth a third path
+static FormatKernel SelectFormatKernel(SampleFormat format, int resolutionBytes, int nbChan)
+{
+#ifdef INTERLEAVE_X86
+    static const FormatKernel floatKernels[3][3] = {
+        { FloatAVX2_16x1, FloatAVX2_16x2, FloatAVX2_16x4 },
+        { FloatAVX2_24x1, FloatAVX2_24x2, FloatAVX2_24x4 },
+        { FloatAVX2_32x1, FloatAVX2_32x2, FloatAVX2_32x4 } };
+    static const FormatKernel ditherKernels[3][3] = {
+        { NULL, NULL, NULL },
+        { Dither16AVX2_24x1, Dither16AVX2_24x2, Dither16AVX2_24x4 },
+        { Dither16AVX2_32x1, Dither16AVX2_32x2, Dither16AVX2_32x4 } };
+    int chans = nbChan == 1 ? 0 : nbChan == 2 ? 1 : nbChan == 4 ? 2 : -1;
+    if (GetSimdLevel() >= SimdAVX2 && chans >= 0 && resolutionBytes >= 2 && resolutionBytes <= 4)
+    {
+        FormatKernel kernel = format == SampleFormatFloat32 ? floatKernels[resolutionBytes - 2][chans]
+                                                            : ditherKernels[resolutionBytes - 2][chans];
+        if (kernel != NULL)
+            return kernel;
+    }
+#endif
+    return format == SampleFormatFloat32 ? FormatScalarFloat : FormatScalarDither16;
+}
+
+int SampleFormatBytes(const SampleFormatSpec* spec)
+{
+    switch (spec->format)
+    {
+        case SampleFormatFloat32: return 4;
+        case SampleFormatInt16Dither: return 2;
+        default: return spec->resolutionBytes;
+    }
+}
+
+// The noise keys change every 2^32 frames (4.6 hours at 256 kHz), the calls
+// are split so that the frame numbers of a call fit in 32 bits
+static void InitFormatState(FormatState* st, const SampleFormatSpec* spec, int nbChannels, long long firstFrame)
+{
+    st->resolutionBytes = spec->resolutionBytes;
+    st->gains = spec->gains;
+    st->scale = ldexpf(1.0f, 16 - 8 * spec->resolutionBytes);
+    st->frame = (unsigned int)firstFrame;
+    if (spec->format != SampleFormatInt16Dither)
+        return;
+    unsigned int epoch = Hash32((unsigned int)(firstFrame >> 32));
+    for (int c = 0; c < nbChannels && c < MAX_INTERLEAVE_CHAN; c++)
+    {
+        st->salts[c][0] = Hash32(epoch + 2 * c + 1);
+        st->salts[c][1] = Hash32(epoch + 2 * c + 2);
+    }
+}
+
+static long EpochSamples(long long firstFrame, long nbSamples)
+{
+    long long left = (((firstFrame >> 32) + 1) << 32) - firstFrame;
+    return left < nbSamples ? (long)left : nbSamples;
+}
+
+void InterleaveChannelsFormat(char* dst, const char* dmaBlock, long planeSamples, const int* channels, int nbChannels,
+                              long firstSample, long nbSamples, const SampleFormatSpec* spec, long long firstFrame)
+{
+    int res = spec->resolutionBytes;
+    // 16-bit samples are already int16, a dither would only add noise
+    if (spec->format == SampleFormatPCM || (spec->format == SampleFormatInt16Dither && res == 2))
+    {
+        InterleaveChannels(dst, dmaBlock, planeSamples, res, channels, nbChannels, firstSample, nbSamples);
+        return;
+    }
+    FormatKernel kernel = SelectFormatKernel(spec->format, res, nbChannels);
+    int frameSize = nbChannels * SampleFormatBytes(spec);
+    FormatState st;
+    const char* planes[MAX_INTERLEAVE_CHAN];
+    while (nbSamples > 0)
+    {
+        long n = EpochSamples(firstFrame, nbSamples);
+        for (int c = 0; c < nbChannels && c < MAX_INTERLEAVE_CHAN; c++)
+            planes[c] = dmaBlock + ((long)channels[c] * planeSamples + firstSample) * res;
+        InitFormatState(&st, spec, nbChannels, firstFrame);
+        kernel(dst, planes, nbChannels, 0, n, &st);
+        dst += n * frameSize;
+        firstSample += n;
+        firstFrame += n;
+        nbSamples -= n;
+    }
+}
+
+static void StoreSample(char* dst, float value, int resolutionBytes)
+{
+    double limit = (double)(1LL << (8 * resolutionBytes - 1));
+    double rounded = floor(value + 0.5);
+    if (rounded > limit - 1)
+        rounded = limit - 1;
+    if (rounded < -limit)
+        rounded = -limit;
+    long long sample = (long long)rounded;
+    for (int b = 0; b < resolutionBytes; b++)
+        dst[b] = (char)(sample >> (8 * b));
+}
+
+void FormatFrames(char* dst, const float* frames, long nbFrames, int nbChannels,
+                  const SampleFormatSpec* spec, long long firstFrame)
+{
+    int sampleBytes = SampleFormatBytes(spec);
+    FormatState st;
+    while (nbFrames > 0)
+    {
+        long n = EpochSamples(firstFrame, nbFrames);
+        InitFormatState(&st, spec, nbChannels, firstFrame);
+        for (long i = 0; i < n; i++)
+        {
+            for (int c = 0; c < nbChannels; c++, frames++, dst += sampleBytes)
+            {
+                if (spec->format == SampleFormatFloat32)
+                {
+                    float v = *frames * st.gains[c];
+                    memcpy(dst, &v, 4);
+                }
+                else if (spec->format == SampleFormatInt16Dither)
+                {
+                    short sample = Quantize16(*frames * st.scale + Dither(&st, c, st.frame + (unsigned)i));
+                    memcpy(dst, &sample, 2);
+                }
+                else
+                    StoreSample(dst, *frames, spec->resolutionBytes);
+            }
+        }
+        firstFrame += n;
+        nbFrames -= n;
+    }
+}
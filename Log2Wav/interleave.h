@@ -0,0 +1,74 @@
+#ifndef INTERLEAVE_H
+#define INTERLEAVE_H
+
+// Planar -> interleaved transpose of the audio samples of a dmaBlock.
+// The QHB cards store each DMA block channel after channel (plane 0 holds all
+// the samples of chan 0, then plane 1, ...) while a WAV frame wants one sample
+// of every channel side by side.
+
+// planes[ichan] points to the first sample of channel ichan, dst receives
+// nbSamples * nbChan interleaved samples. Planes and dst may be unaligned.
+typedef void (*InterleaveKernel)(char* dst, const char* const* planes, int nbChan, long nbSamples);
+
+typedef enum SimdLevel_e
+{
+    SimdScalar = 0,
+    SimdSSE2 = 1,
+    SimdAVX2 = 2
+}SimdLevel;
+
+// SIMD level of this CPU, capped by LOG2WAV_SIMD, shared by all the kernels
+SimdLevel GetSimdLevel(void);
+
+// Returns the fastest kernel for the given sample size (2, 3 or 4 bytes) and
+// channel count on this CPU (AVX2 / SSE2 / scalar, chosen at runtime).
+// The LOG2WAV_SIMD environment variable (scalar, sse2, avx2) caps the level.
+InterleaveKernel SelectInterleaveKernel(int resolutionBytes, int nbChan);
+
+// Name of the SIMD level used by SelectInterleaveKernel ("avx2", "sse2", "scalar")
+const char* InterleaveSimdLevel(void);
+
+// Transposes a whole dmaBlock (nbChan consecutive planes of nbSamples samples)
+void InterleaveBlock(char* dst, const char* dmaBlock, int nbChan, long nbSamples, int resolutionBytes);
+
+// Transposes the samples [firstSample, firstSample + nbSamples) of a subset of
+// the planes of a dmaBlock (planeSamples samples per plane). channels[i] is the
+// plane written as the i-th channel of each frame of dst.
+#define MAX_INTERLEAVE_CHAN 256
+void InterleaveChannels(char* dst, const char* dmaBlock, long planeSamples, int resolutionBytes,
+                        const int* channels, int nbChannels, long firstSample, long nbSamples);
+
+// Output sample formats other than the recorded integers, converted in the
+// same pass as the transpose (AVX2 kernels for 1, 2 and 4 channels)
+typedef enum SampleFormat_e
+{
+    SampleFormatPCM = 0,        // as recorded, 16, 24 or 32-bit integers
+    SampleFormatFloat32,        // float32, times a gain per channel
+    SampleFormatInt16Dither     // 16-bit integers with a TPDF dither of +-1 LSB
+}SampleFormat;
+
+typedef struct SampleFormatSpec_s
+{
+    SampleFormat format;
+    int resolutionBytes;                        // of the recorded samples
+    float gains[MAX_INTERLEAVE_CHAN];        // float32 : gain of each output channel, a recorded
+                                                // sample is an integer (full scale 2^(bits-1))
+}SampleFormatSpec;
+
+// Bytes per output sample
+int SampleFormatBytes(const SampleFormatSpec* spec);
+
+// InterleaveChannels with a conversion to spec->format. firstFrame is the
+// number of the first frame written in the whole output : the dither only
+// depends on it and on the channel, so that the result does not depend on
+// how the audio is cut into blocks or threads, nor on the SIMD level.
+void InterleaveChannelsFormat(char* dst, const char* dmaBlock, long planeSamples, const int* channels, int nbChannels,
+                              long firstSample, long nbSamples, const SampleFormatSpec* spec, long long firstFrame);
+
+// Same conversion for interleaved frames already in float (sample values of
+// the recorded resolution, as computed by the decimator). PCM samples are
+// rounded and clipped to the recorded resolution.
+void FormatFrames(char* dst, const float* frames, long nbFrames, int nbChannels,
+                  const SampleFormatSpec* spec, long long firstFrame);
+
+#endif
@@ -3,275 +3,490 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <math.h>
-#include "Macros.h"
-#include "decoder.h"
+#include <time.h>
+#include "qhb.h"
 
-#define MAX_PERIPHERAL 5                   //Nombre max de peripheriques externes
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#define dup _dup
+#define dup2 _dup2
+#define fdopen _fdopen
+#else
+#include <unistd.h>
+#endif
 
+// The wav goes to the real stdout, everything printed goes to stderr so that
+// it cannot end up in the middle of the audio
+static FILE* takeStdout(void){
+  fflush(stdout);
+  int fd = dup(fileno(stdout));
+  if(fd < 0){
+    return NULL;
+  }
+#ifdef _WIN32
+  _setmode(fd, _O_BINARY);
+#endif
+  dup2(fileno(stderr), fileno(stdout));
+  return fdopen(fd, "wb");
+}
 
-typedef struct{
-    char Type;                                       //type du peripherique (0x01 accel, 0x02 gyro, 0x03 magneto, 0x04 temperature, 0x05 pressure, 0x06 light,...)
-    char ID;                                         //ID du peripherique
-    char Range;                                      //Range de la mesure (ex: 2G, 4G, 6G, 8G, 16G pour un accel)
-    char Resolution;                                 //Resolution de mesure du peripherique
-    short Frequency;                                 //Frequence d'echantillonage du peripherique
-}PERIPHERAL_CONFIGURATION;
-
-typedef struct{
-    int headerSize;       //Taille du header ce champ exclu
-    int versionNumber;
-    char numberOfChan;
-    char resolutionBits;
-    int samplingFrequency;
-    int dmaBlockSize;
-    int sizeOfAdditionnalDataBuffer;
-    char numberOfExternalPeripheral;
-    int timeStampOfStart;
-    PERIPHERAL_CONFIGURATION periphConfig[MAX_PERIPHERAL];
-}HighBlueHeader;
+// sample number, seconds ("30s") or packet time ("123ns")
+static bool parseBound(const char* text, ConvertBound* bound){
+  char* end;
+  size_t len = strlen(text);
+  if(len>2 && strcmp(text + len-2, "ns")==0){
+    bound->unit = BoundPacketTimeNS;
+    bound->timeNS = strtoull(text, &end, 10);
+    return end == text + len-2;
+  }
+  if(len>1 && text[len-1]=='s'){
+    bound->unit = BoundSeconds;
+    bound->value = strtod(text, &end);
+    return end == text + len-1 && bound->value >= 0;
+  }
+  bound->unit = BoundSample;
+  bound->value = (double)strtoll(text, &end, 10);
+  return end == text + len && len > 0 && bound->value >= 0;
+}
 
-struct WaveHeader_s {
-    char chunkId[4]; // Riff Wave Header
-    int  chunkSize;
-    char format[4];
-    char subChunk1Id[4]; // Format Subchunk
-    int  subChunk1Size;
-    short int audioFormat;
-    short int numChannels;
-    int sampleRate;
-    int byteRate;
-    short int blockAlign;
-    short int bitsPerSample;
-    //short int extraParamSize;
-    char subChunk2Id[4]; // Data Subchunk
-    int  subChunk2Size;
-} WaveHeader_default = {{'R','I','F','F'}, 36, {'W','A','V','E'}, {'f','m','t',' '}, 16, 1, 0, 0, 0, 0, 0, {'d','a','t','a'}, 0};
-typedef struct WaveHeader_s WaveHeader;
+// comma separated channel numbers, from 1
+static bool parseChannels(const char* text, ConvertOptions* options){
+  options->nbChannels = 0;
+  while(*text){
+    char* end;
+    long c = strtol(text, &end, 10);
+    if(end==text || c<1 || c>CONVERT_MAX_CHANNELS || options->nbChannels==CONVERT_MAX_CHANNELS){
+      return false;
+    }
+    options->channels[options->nbChannels++] = (int)c - 1;
+    text = *end==',' ? end + 1 : end;
+    if(*end!=',' && *end!='\0'){
+      return false;
+    }
+  }
+  return options->nbChannels > 0;
+}
 
+// comma separated hydrophone sensitivities in dB re 1 V/uPa, one per recorded channel
+static bool parseSensitivities(const char* text, ConvertOptions* options){
+  options->nbSensitivities = 0;
+  while(*text){
+    char* end;
+    double db = strtod(text, &end);
+    if(end==text || options->nbSensitivities==CONVERT_MAX_CHANNELS){
+      return false;
+    }
+    options->sensitivity[options->nbSensitivities++] = db;
+    text = *end==',' ? end + 1 : end;
+    if(*end!=',' && *end!='\0'){
+      return false;
+    }
+  }
+  return options->nbSensitivities > 0;
+}
 
-void parseLogFileHeader(FILE* logfile, HighBlueHeader* hdr, int verbose){
-  // header parse
-  fread(&hdr->headerSize, 4, 1, logfile);
-  fread(&hdr->versionNumber, 2, 1, logfile);
-  fread(&hdr->numberOfChan, 1, 1, logfile);
-  fread(&hdr->resolutionBits, 1, 1, logfile);
-  fread(&hdr->samplingFrequency, 4, 1, logfile);
-  fread(&hdr->dmaBlockSize, 4, 1, logfile);
-  fread(&hdr->sizeOfAdditionnalDataBuffer, 4, 1, logfile);
-  fread(&hdr->numberOfExternalPeripheral, 1, 1, logfile);
-  fread(&hdr->timeStampOfStart, 4, 1, logfile);
-  if(verbose){
-    printf("header size : %d\n", hdr->headerSize);
-    printf("version number : %d\n", hdr->versionNumber);
-    printf("number of chans : %d\n", hdr->numberOfChan);
-    printf("resolutionBits : %d\n", hdr->resolutionBits);
-    printf("samplingFrequency : %d\n", hdr->samplingFrequency);
-    printf("dmaBlockSize : %d\n", hdr->dmaBlockSize);
-    printf("sizeOfAdditionnalDataBuffer : %d\n", hdr->sizeOfAdditionnalDataBuffer);
-    printf("numberOfExternalPeripheral : %d\n", hdr->numberOfExternalPeripheral);
-    printf("timeStampOfStart : %d\n", hdr->timeStampOfStart);
-  }
-  // load external periph config
-  for(int i=0; i<hdr->numberOfExternalPeripheral; i++){
-      fread(&hdr->periphConfig[i].Type, 1, 1, logfile);
-      fread(&hdr->periphConfig[i].ID, 1, 1, logfile);
-      fread(&hdr->periphConfig[i].Range, 1, 1, logfile);
-      fread(&hdr->periphConfig[i].Resolution, 1, 1, logfile);
-      fread(&hdr->periphConfig[i].Frequency, 2, 1, logfile);
-  }
-  return;
+static void printUsage(void){
+  printf("Script needs to be called with at least 1 arguments :\n\t input file name (.log file)\n\t(optionnal) output filename (.wav file)\n\t(optionnal) sensor Datas filename (.csv file)\n\t(optionnal) verbose (1 / void)\n");
+  printf("\nOptions (anywhere on the command line) :\n"
+         "\t--threads N : convert the audio of the file on N threads\n"
+         "\t--pipeline N : read, decode, format and write on different threads, with N blocks in flight\n"
+         "\t\tbetween two of them (default 16 with several CPUs, 0 converts on a single thread, io_uring\n"
+         "\t\treads on Linux)\n"
+         "\t--npy : write each sensor stream to its own NumPy file (<wav name>_accel.npy, ...)\n"
+         "\t--pps-gps : write the PPS and GPS tables (<wav name>_pps.csv, <wav name>_gps.csv)\n"
+         "\t--index : build (or reuse) the block index of the file (<log name>.log.idx)\n"
+         "\t--timemap : fit the PPS disciplined clock of the file and write its time map (<log name>.log.tmap),\n"
+         "\t\tto convert any sample or packet time to UTC (verbose prints the PPS jitter and clock drift)\n"
+         "\t--start B, --end B : only extract the audio from B to B (end excluded), B is a sample number\n"
+         "\t\t(per channel), a time from the start of the file in seconds (30s, 1.5s) or a packet time\n"
+         "\t\tin ns (123456789000ns, as in the PACKET TIMESTAMP lines of the .csv)\n"
+         "\t--channels LIST : only extract these channels, numbered from 1 (--channels 1,3)\n"
+         "\t--follow : the .log file is still being written, convert each block as soon as it is complete\n"
+         "\t\tand stop once the file has not grown for --idle seconds (default 5)\n"
+         "\t--decimate RATE : low-pass filter and decimate the audio to RATE Hz (must divide the sampling\n"
+         "\t\tfrequency, 256000 -> 32000) while converting, the wav holds the decimated audio\n"
+         "\t--keep-full : with --decimate, keep the full rate wav and write the decimated one next to it\n"
+         "\t\t(<wav name>_<RATE>Hz.wav)\n"
+         "\t--format F : samples of the wav, pcm (as recorded, default), float (float32, full scale 1.0)\n"
+         "\t\tor int16 (16 bits with a triangular dither)\n"
+         "\t--sensitivity LIST : float32 samples in Pa, from the hydrophone sensitivity of each recorded\n"
+         "\t\tchannel in dB re 1 V/uPa (--sensitivity -170.2,-169.8, a single value for every channel)\n"
+         "\t--full-scale V : with --sensitivity, ADC input in volts of a full scale sample (default 1)\n"
+         "\t--flac : write FLAC instead of wav (lossless, about half the size), implied by a .flac output\n"
+         "\t\tname, the frames are encoded on the --threads threads\n"
+         "\t--raw : write the interleaved samples only, without the wav header\n"
+         "\t- as the input file reads the .log from stdin, as the output file writes the wav to stdout\n"
+         "\t\t(log2wav - - < file.log | sox -t wav - out.flac)\n"
+         "\t--stats : time each stage (read, decode, normalize, format, write) and count the messages,\n"
+         "\t\tchecksum errors and timestamp anomalies of each sensor, printed at the end\n"
+         "\t--stats-json FILE : also write these statistics to FILE as JSON (implies --stats)\n"
+         "\t--verbose\n");
+  printf("\nBatch mode, converts every .log file of directories (walked recursively), globs or files :\n"
+         "\t--batch [options] input [input...]\n"
+         "\t--output DIR : mirror the input tree into DIR (default : next to each .log)\n"
+         "\t--threads N : number of files converted in parallel (default : one per CPU)\n"
+         "\t--pipeline N : also pipeline the conversion of each file, as above (default 0)\n"
+         "\t--sensors : also extract the sensors .csv\n"
+         "\t--npy : also extract the sensors streams as .npy files\n"
+         "\t--pps-gps : also extract the PPS and GPS tables\n"
+         "\t--index : also build the block index of each file (.log.idx, next to the .wav)\n"
+         "\t--timemap : also write the time map of each file (.log.tmap, next to the .wav)\n"
+         "\t--decimate RATE [--keep-full] : decimated wav of each file, as above\n"
+         "\t--format F, --sensitivity LIST, --full-scale V : sample format of the wavs, as above\n"
+         "\t--flac : write .flac files instead of .wav\n"
+         "\t--stats, --stats-json FILE : statistics summed over all the files, as above\n"
+         "\t--merge PREFIX : also merge the PPS and GPS tables of all the files into PREFIX_pps.csv and PREFIX_gps.csv\n");
+  printf("\nSession stitching, converts the fragments of a session, in the given order, into one wav (RF64 above 4 GB) :\n"
+         "\t--stitch OUT.wav [--channels LIST] file.log [file.log...]\n"
+         "\tthe gaps between fragments found from the packet timestamps are listed in OUT_gaps.csv\n");
+  printf("\nMulti-recorder alignment, merges the .log files of cards recording at the same time into one wav\n"
+         "sampled on the GPS time (firmware >= 2 with PPS and GPS fix, same sampling frequency and resolution) :\n"
+         "\t--align OUT.wav [--format F] [--sensitivity LIST] file.log file.log [file.log...]\n"
+         "\tthe channels of each file follow those of the previous one, where each file lands (start sample, drift,\n"
+         "\tPPS) is listed in OUT_align.csv\n");
 }
 
-short int toLittleEndian(short int val){
-  return val = ((val & 0x00FF)<<8) | ((val & 0xFF00)>>8);
+// Prefix of the outputs named after a wav or a .log file
+static char* outputPrefix(const char* path){
+  char* prefix = strdup(path);
+  size_t len = strlen(prefix);
+  if(len>4 && (strcmp(prefix + len-4, ".wav")==0 || strcmp(prefix + len-4, ".log")==0)){
+    prefix[len-4] = '\0';
+  }else if(len>5 && strcmp(prefix + len-5, ".flac")==0){
+    prefix[len-5] = '\0';
+  }
+  return prefix;
 }
 
-void parseMPU(unsigned char* additionnalDataBlock, int size, bool verbose, FILE* mpuFile){
-  static int maxtimeStamp = 0;
-  int i, timestamp;
-  short int trameSize = 31, val; // fixed for now
-  unsigned char* curData = additionnalDataBlock + 6; // first 6 bytes are for usb device
-  if(verbose){
-    printf("MPU Range : %hdG\n", *(curData + 5 + 3));
-    printf("MPU Resolution : %hd\n", *(curData + 5 + 3 + 1));
-    printf("MPU Sampling Frequency : %hd\n", *(curData + 5 + 3 + 3));
-  }
-  while(curData + trameSize + 6 < additionnalDataBlock + size){
-    if(!(curData[0]==0xFE && curData[1]==0x0A && curData[2]==0x0A && curData[5]==0x08)){
-      // skip trame if header is incorrect
-      curData += trameSize + 6;
-      continue;
+static int runStitch(char** positional, int nbPositional, const char* stitchPath, const ConvertOptions* options){
+  StitchOptions stitchOptions = {*options, NULL};
+  FILE* wavStream = NULL;
+  bool toStdout = strcmp(stitchPath, "-")==0;
+  if(toStdout){
+    wavStream = takeStdout();
+    if(wavStream==NULL){
+      printf("Failed to open stdout\n");
+      return 1;
     }
-    curData += 3 + 2; // skip trame header, trame length
-    timestamp = *((int*) (curData + 9));
-    timestamp = ((timestamp & 0xFF000000)>>24) | ((timestamp & 0x00FF0000)>>8) | ((timestamp & 0x0000FF00)<<8) | ((timestamp & 0x000000FF)<<24);
-    if(timestamp > maxtimeStamp){
-      fprintf(mpuFile, "%d,", timestamp);
-      //printf("%d\n", timestamp);
-      // treat payload
-      for(i=13; i<31; i+=2){
-        val = *((short int*) (curData + i));
-        val = ((val & 0x00FF)<<8) | ((val & 0xFF00)>>8);
-        //printf("curData %x %x %hd", *(curData+i), *(curData + i +1), val);
-        if(i<29){
-          fprintf(mpuFile, "%hd,", val);
-        }else{
-          fprintf(mpuFile, "%hd\n", val);
-        }
-      }
-      maxtimeStamp = timestamp;
+    stitchOptions.convert.progress = false;
+  }
+  char* prefix = outputPrefix(toStdout ? positional[0] : stitchPath);
+  char* gapsPath = malloc(strlen(prefix) + 10);
+  sprintf(gapsPath, "%s_gaps.csv", prefix);
+  stitchOptions.gapsPath = gapsPath;
+  StitchResult result;
+  ConvertStatus status = StitchLogFiles(positional, nbPositional, stitchPath, wavStream, &stitchOptions, &result);
+  if(status==ConvertOK){
+    printf("%d files stitched (%d empty skipped), %lld samples, %d gaps (%s)%s\n", result.nbFiles, result.nbSkipped,
+           result.nbSamples, result.nbGaps, gapsPath, result.rf64 ? ", RF64" : "");
+  }else{
+    printf("%s\n", result.error);
+  }
+  if(wavStream!=NULL){
+    fclose(wavStream);
+  }
+  free(gapsPath);
+  free(prefix);
+  return status==ConvertError ? 1 : 0;
+}
+
+static int runAlign(char** positional, int nbPositional, const char* alignPath, const ConvertOptions* options){
+  AlignOptions alignOptions = {*options, NULL};
+  FILE* wavStream = NULL;
+  bool toStdout = strcmp(alignPath, "-")==0;
+  if(toStdout){
+    wavStream = takeStdout();
+    if(wavStream==NULL){
+      printf("Failed to open stdout\n");
+      return 1;
     }
-    curData += trameSize + 1; // shift of trame size + 1 byte of checksum
+    alignOptions.convert.progress = false;
   }
+  char* prefix = outputPrefix(toStdout ? positional[0] : alignPath);
+  char* tablePath = malloc(strlen(prefix) + 11);
+  sprintf(tablePath, "%s_align.csv", prefix);
+  alignOptions.tablePath = tablePath;
+  AlignResult result;
+  ConvertStatus status = AlignLogFiles(positional, nbPositional, alignPath, wavStream, &alignOptions, &result);
+  if(status==ConvertOK){
+    time_t start = (time_t)(result.startNS / 1000000000LL);
+    struct tm utc;
+#ifdef _WIN32
+    gmtime_s(&utc, &start);
+#else
+    gmtime_r(&start, &utc);
+#endif
+    printf("%d recorders aligned, %d channels, %lld samples from %04d-%02d-%02d %02d:%02d:%02d.%09lld UTC (%s)%s\n",
+           result.nbFiles, result.nbChannels, result.nbSamples, utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+           utc.tm_hour, utc.tm_min, utc.tm_sec, result.startNS % 1000000000LL, tablePath, result.rf64 ? ", RF64" : "");
+  }else{
+    printf("%s\n", result.error);
+  }
+  if(wavStream!=NULL){
+    fclose(wavStream);
+  }
+  free(tablePath);
+  free(prefix);
+  return status==ConvertError ? 1 : 0;
 }
 
-unsigned char softwareMajorRev=0;
-unsigned char softwareMinorRev=0;
 int main(int argc, char* argv[]){
   if(argc < 2){
-    printf("Script needs to be called with at least 1 arguments :\n\t input file name (.log file)\n\t(optionnal) output filename (.wav file)\n\t(optionnal) sensor Datas filename (.csv file)\n\t(optionnal) verbose (1 / void)\n");
-    return 0;
-  }
-  HighBlueHeader hdr;
-  FILE* logfile = fopen(argv[1], "rb");
-  if(logfile==NULL){
-    printf("Failed to open input file\n");
+    printUsage();
     return 0;
   }
-  // get file size
-  fseek(logfile, 0, SEEK_END);
-  long filesize =  ftell(logfile);
-  if(filesize == 0){
-    printf("skipped empty file : %s\n", argv[1]);
-    return 0;
+  // options can be given anywhere, the other arguments keep their legacy meaning
+  char** positional = malloc(argc * sizeof(char*));
+  int nbPositional = 0;
+  bool batch = false;
+  BatchOptions batchOptions = {0};
+  ConvertOptions options = {0};
+  int nbThreads = 0;
+  int pipelineDepth = -1;     // default : pipelined when converting a single file on several CPUs
+  const char* stitchPath = NULL;
+  const char* alignPath = NULL;
+  bool explicitFormat = false;
+  for(int i=1; i<argc; i++){
+    if(strncmp(argv[i], "--", 2)!=0){
+      positional[nbPositional++] = argv[i];
+    }else if(strcmp(argv[i], "--batch")==0){
+      batch = true;
+    }else if(strcmp(argv[i], "--output")==0 && i+1<argc){
+      batchOptions.outputRoot = argv[++i];
+    }else if(strcmp(argv[i], "--threads")==0 && i+1<argc){
+      nbThreads = atoi(argv[++i]);
+    }else if(strcmp(argv[i], "--pipeline")==0 && i+1<argc){
+      pipelineDepth = atoi(argv[++i]);
+    }else if(strcmp(argv[i], "--sensors")==0){
+      batchOptions.sensors = true;
+    }else if(strcmp(argv[i], "--npy")==0){
+      batchOptions.npy = true;
+    }else if((strcmp(argv[i], "--start")==0 || strcmp(argv[i], "--end")==0) && i+1<argc){
+      ConvertBound* bound = argv[i][2]=='s' ? &options.start : &options.end;
+      if(!parseBound(argv[++i], bound)){
+        printf("Invalid bound %s\n", argv[i]);
+        free(positional);
+        return 1;
+      }
+    }else if(strcmp(argv[i], "--channels")==0 && i+1<argc){
+      if(!parseChannels(argv[++i], &options)){
+        printf("Invalid channel list %s\n", argv[i]);
+        free(positional);
+        return 1;
+      }
+    }else if(strcmp(argv[i], "--follow")==0){
+      options.follow = true;
+    }else if(strcmp(argv[i], "--idle")==0 && i+1<argc){
+      options.followIdle = atof(argv[++i]);
+    }else if(strcmp(argv[i], "--stitch")==0 && i+1<argc){
+      stitchPath = argv[++i];
+    }else if(strcmp(argv[i], "--align")==0 && i+1<argc){
+      alignPath = argv[++i];
+    }else if(strcmp(argv[i], "--decimate")==0 && i+1<argc){
+      options.decimateRate = atoi(argv[++i]);
+      if(options.decimateRate <= 0){
+        printf("Invalid rate %s\n", argv[i]);
+        free(positional);
+        return 1;
+      }
+    }else if(strcmp(argv[i], "--keep-full")==0){
+      batchOptions.keepFullRate = true;
+    }else if(strcmp(argv[i], "--format")==0 && i+1<argc){
+      i++;
+      if(strcmp(argv[i], "pcm")==0){
+        options.sampleFormat = SampleFormatPCM;
+      }else if(strcmp(argv[i], "float")==0){
+        options.sampleFormat = SampleFormatFloat32;
+      }else if(strcmp(argv[i], "int16")==0){
+        options.sampleFormat = SampleFormatInt16Dither;
+      }else{
+        printf("Invalid format %s (pcm, float or int16)\n", argv[i]);
+        free(positional);
+        return 1;
+      }
+      explicitFormat = true;
+    }else if(strcmp(argv[i], "--sensitivity")==0 && i+1<argc){
+      if(!parseSensitivities(argv[++i], &options)){
+        printf("Invalid sensitivity list %s\n", argv[i]);
+        free(positional);
+        return 1;
+      }
+    }else if(strcmp(argv[i], "--full-scale")==0 && i+1<argc){
+      options.fullScaleVolts = atof(argv[++i]);
+      if(options.fullScaleVolts <= 0){
+        printf("Invalid full scale %s\n", argv[i]);
+        free(positional);
+        return 1;
+      }
+    }else if(strcmp(argv[i], "--flac")==0){
+      options.flac = true;
+    }else if(strcmp(argv[i], "--raw")==0){
+      options.rawAudio = true;
+    }else if(strcmp(argv[i], "--index")==0){
+      batchOptions.index = true;
+    }else if(strcmp(argv[i], "--timemap")==0){
+      batchOptions.timeMap = true;
+    }else if(strcmp(argv[i], "--pps-gps")==0){
+      batchOptions.timeTables = true;
+    }else if(strcmp(argv[i], "--merge")==0 && i+1<argc){
+      batchOptions.mergePrefix = argv[++i];
+    }else if(strcmp(argv[i], "--stats")==0){
+      options.stats = true;
+    }else if(strcmp(argv[i], "--stats-json")==0 && i+1<argc){
+      batchOptions.statsJson = argv[++i];
+      options.stats = true;
+    }else if(strcmp(argv[i], "--verbose")==0){
+      options.verbose = 1;
+    }else{
+      printf("Unknown option %s\n", argv[i]);
+      printUsage();
+      free(positional);
+      return 1;
+    }
   }
-  fseek(logfile, 0, SEEK_SET);
-  int verbose = 0;
-  if(argc==5){
-    verbose = *argv[4]=='1';
-  }
-  // file opened successfully, we read the header
-  parseLogFileHeader(logfile, &hdr, verbose);
-  int resolutionBytes = hdr.resolutionBits/8;
-  long dataBlockSampleSize = hdr.dmaBlockSize / ( hdr.numberOfChan  * resolutionBytes);
-  if(verbose){
-    printf("file version number: %d,%d",softwareMajorRev,softwareMinorRev);
-    printf("file size (bytes) %ld \n", filesize);
-    printf("dataBlockSampleSize %ld\n", dataBlockSampleSize);
-  }
-  if(hdr.resolutionBits!=16 && hdr.resolutionBits!=24 && hdr.resolutionBits!=32){
-    printf("resolution %d not supported yet sorry\n", hdr.resolutionBits);
+  if(nbPositional==0){
+    printUsage();
+    free(positional);
     return 0;
   }
-  // move to start of the data
-  fseek(logfile, hdr.headerSize + 4, SEEK_SET);
 
-  FILE* wavfile;// open wav file
-  if(argc>2){
-    wavfile = fopen(argv[2], "wb");
-  }else{
-    strcpy(argv[1] + strlen(argv[1])-3, "wav\0");
-    wavfile = fopen(argv[1], "wb");
+  if(options.followIdle <= 0){
+    options.followIdle = 5;
   }
-  if(wavfile==NULL){
-    printf("Failed to open wav output file\n");
-    return 0;
+  // calibrated samples are float32
+  if(options.nbSensitivities > 0){
+    if(explicitFormat && options.sampleFormat!=SampleFormatFloat32){
+      printf("--sensitivity needs float samples\n");
+      free(positional);
+      return 1;
+    }
+    options.sampleFormat = SampleFormatFloat32;
   }
-  WaveHeader whdr = WaveHeader_default;
-  whdr.numChannels = hdr.numberOfChan;
-  whdr.sampleRate = hdr.samplingFrequency;
-  whdr.bitsPerSample = hdr.resolutionBits;
-  whdr.byteRate = whdr.sampleRate * whdr.numChannels * resolutionBytes;
-  whdr.blockAlign = whdr.numChannels * resolutionBytes;
-  whdr.chunkSize = 36 + (filesize - hdr.headerSize - 4) / (hdr.dmaBlockSize + hdr.sizeOfAdditionnalDataBuffer) * hdr.numberOfChan * dataBlockSampleSize * resolutionBytes;
-  whdr.subChunk2Size = whdr.chunkSize-36;
-  fwrite(&whdr, sizeof(WaveHeader), 1, wavfile);
 
-  FILE* sensorsFile = NULL;  // open mpu file
-  if(argc>3){
-    sensorsFile = fopen(argv[3], "w+");
-    if(sensorsFile==NULL){
-      printf("Failed to open sensors output file\n");
-      return 0;
-    }
-    else
-    {
-      fprintf(sensorsFile,"Sensor Type,TimeStamp(ms) or Time, val0,val1,val2,val3,val4,val5,val6,val7\n");
-      //val0, val1, val2 dependent du type de capteur
-      //Val0 est la valeur normalisée de l'axe X pour (Accel(G), Gyr0(DPS), Mag(µT)), ou la valeur du canal1 du capteur de lumiere, ou la valeur de la temperature(°C), ou la valeur de la pression(Pa) ou le champ "fix" (pour le GPS)
-      //val1 est la valeur normalisée de l'axe Y pour (Accel(G), Gyro(DPS), Mag(µT)), ou la valeur du canal2 du capteur de lumiere, ou le champ fixQuality (pour le GPS)
-      //val2 est la valeur normalisée de l'axe Z pour (Accel(G), Gyro(DPS), Mag(µT)), ou le champ Latitude (pour le GPS)
+  if(stitchPath!=NULL){
+    if(options.flac){
+      printf("--stitch writes a wav (RF64 above 4 GB), not FLAC\n");
+      free(positional);
+      return 1;
     }
+    options.progress = true;
+    int rc = runStitch(positional, nbPositional, stitchPath, &options);
+    free(positional);
+    return rc;
   }
 
-  char* dmaBlock = (char*) malloc(hdr.dmaBlockSize);
-  char* additionnalDataBlock = (char*) malloc(hdr.sizeOfAdditionnalDataBuffer);
-  char* samples = (char*) malloc(hdr.numberOfChan * resolutionBytes);
-  int ichan, isample;
-  long pos = 0;
-  bool isFirst = true;
-  // read each dataBlock
-  do{
-    //On vient recuperer le buffer de datas additionnelles
-    fread(additionnalDataBlock, hdr.sizeOfAdditionnalDataBuffer, 1, logfile);
+  if(alignPath!=NULL){
+    if(options.flac){
+      printf("--align writes a wav (RF64 above 4 GB), not FLAC\n");
+      free(positional);
+      return 1;
+    }
+    options.progress = true;
+    int rc = runAlign(positional, nbPositional, alignPath, &options);
+    free(positional);
+    return rc;
+  }
 
-    //On verifie le numero de version
-    softwareMajorRev=additionnalDataBlock[5];
-    softwareMinorRev=additionnalDataBlock[6];
-    
-    int enteteSize=6;
-    unsigned long long timeStamp100MHzCurrentPacket=0;
-    if(softwareMajorRev>=2)
-    {
-      //On recupere l'instant de fin du paquet courant
-      timeStamp100MHzCurrentPacket=BUILD_UINT64(additionnalDataBlock[14],
-                  additionnalDataBlock[13],
-                  additionnalDataBlock[12],
-                  additionnalDataBlock[11],
-                  additionnalDataBlock[10],
-                  additionnalDataBlock[9],
-                  additionnalDataBlock[8],
-                  additionnalDataBlock[7]);
-      timeStamp100MHzCurrentPacket*=10;     //To put the ts in ns
-      enteteSize=16;
+  if(batch){
+    batchOptions.nbThreads = nbThreads;
+    // the files are already converted in parallel
+    options.pipelineDepth = pipelineDepth > 0 ? pipelineDepth : 0;
+    batchOptions.convert = options;
+    int nbFailed = RunBatch(positional, nbPositional, &batchOptions);
+    free(positional);
+    return nbFailed > 0 ? 1 : 0;
+  }
 
-      if(sensorsFile !=NULL)
-      {
-        //On extrait la valeur du timeStamp MHz de fin de paquet courant
-        fprintf(sensorsFile,"PACKET TIMESTAMP: %llu\n",timeStamp100MHzCurrentPacket);
-        //On decode les msg du buffer additionnel
-        for(int i=enteteSize;i<hdr.sizeOfAdditionnalDataBuffer-enteteSize; i++)
-        {
-            DecodeMessage(additionnalDataBlock[i], sensorsFile);
-        }
-      }
+  options.progress = true;
+  options.audioThreads = nbThreads;
+  // on a single CPU the stages would only take turns
+  options.pipelineDepth = pipelineDepth >= 0 ? pipelineDepth : GetCpuCount() > 1 ? PIPELINE_DEFAULT_DEPTH : 0;
+  if(nbPositional==4){
+    options.verbose |= *positional[3]=='1';
+  }
+  char* wavPath;
+  bool fromStdin = strcmp(positional[0], "-")==0;
+  if(nbPositional>1){
+    wavPath = strdup(positional[1]);
+  }else if(fromStdin){
+    wavPath = strdup("-");
+  }else{
+    wavPath = malloc(strlen(positional[0]) + 2);
+    strcpy(wavPath, positional[0]);
+    strcpy(wavPath + strlen(wavPath)-3, options.flac ? "flac" : "wav");
+  }
+  // a .flac output name is enough to choose FLAC
+  size_t wavPathLength = strlen(wavPath);
+  options.flac |= wavPathLength>5 && strcmp(wavPath + wavPathLength-5, ".flac")==0;
+  ConvertOutputs outputs = {.wavPath = wavPath, .csvPath = nbPositional>2 ? positional[2] : NULL};
+  bool toStdout = strcmp(wavPath, "-")==0;
+  if(toStdout){
+    outputs.wavStream = takeStdout();
+    if(outputs.wavStream==NULL){
+      printf("Failed to open stdout\n");
+      free(wavPath);
+      free(positional);
+      return 1;
     }
-    else
-    {
-      if(sensorsFile != NULL)
-      {
-        parseMPU(additionnalDataBlock, hdr.sizeOfAdditionnalDataBuffer, isFirst && verbose, sensorsFile);
-        isFirst = false;
-      }
+    options.progress = false;
+  }
+  // the .npy files and the PPS/GPS tables are named after the wav file, or
+  // after the .log file when the wav goes to stdout
+  char* prefix = outputPrefix(toStdout && !fromStdin ? positional[0] : toStdout ? "stdin" : wavPath);
+  if(batchOptions.npy){
+    outputs.npyPrefix = prefix;
+  }
+  char* decimatedPath = NULL;
+  if(options.decimateRate > 0 && batchOptions.keepFullRate){
+    decimatedPath = malloc(strlen(prefix) + 32);
+    sprintf(decimatedPath, "%s_%dHz.%s", prefix, options.decimateRate, options.flac ? "flac" : "wav");
+    outputs.decimatedPath = decimatedPath;
+  }
+  if(batchOptions.timeTables){
+    outputs.timePrefix = prefix;
+  }
+  // the index is a sidecar of the .log file
+  char* indexPath = NULL;
+  if(batchOptions.index){
+    indexPath = malloc(strlen(positional[0]) + 5);
+    sprintf(indexPath, "%s.idx", positional[0]);
+    outputs.indexPath = indexPath;
+  }
+  // so is the time map, named after the wav when the .log comes from stdin
+  char* timeMapPath = NULL;
+  if(batchOptions.timeMap){
+    const char* logName = fromStdin ? prefix : positional[0];
+    timeMapPath = malloc(strlen(logName) + 10);
+    sprintf(timeMapPath, fromStdin ? "%s.log.tmap" : "%s.tmap", logName);
+    outputs.timeMapPath = timeMapPath;
+  }
+  ConvertResult result;
+  ConvertStatus status = ConvertLogFile(positional[0], &outputs, &options, &result);
+  if(status!=ConvertOK){
+    printf("%s\n", result.error);
+  }
+  // with the wav on stdout, stdout now goes to stderr
+  if(options.stats && status!=ConvertError){
+    PrintStats(stdout, &result.stats);
+  }
+  if(batchOptions.statsJson!=NULL && status!=ConvertError){
+    FILE* json = fopen(batchOptions.statsJson, "w");
+    if(json==NULL || !WriteStatsJson(json, &result.stats)){
+      printf("Failed to write %s\n", batchOptions.statsJson);
     }
-
-    fread(dmaBlock, hdr.dmaBlockSize, 1, logfile);
-    for(isample=0; isample<dataBlockSampleSize; isample++){
-      for(ichan=0; ichan<hdr.numberOfChan; ichan++){
-        memcpy(samples + ichan * resolutionBytes, dmaBlock + (ichan * dataBlockSampleSize + isample) * resolutionBytes, resolutionBytes);
-      }
-      fwrite(samples, resolutionBytes, hdr.numberOfChan, wavfile);
+    if(json!=NULL){
+      fclose(json);
     }
-    printf("\r %s : ", argv[1]);
-    pos = ftell(logfile);
-    printf(" %ld%%", pos*100/filesize);
-  }while(pos < filesize - 1);
-  printf("\r\n");
-  fclose(wavfile);
-  fclose(logfile);
-  if(sensorsFile!=NULL){
-    fclose(sensorsFile);
-  }
-  return 0;
+  }
+  if(outputs.wavStream!=NULL){
+    fclose(outputs.wavStream);
+  }
+  free(indexPath);
+  free(timeMapPath);
+  free(decimatedPath);
+  free(prefix);
+  free(wavPath);
+  free(positional);
+  return status==ConvertError ? 1 : 0;
 }
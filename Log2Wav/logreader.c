@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logreader.h"
+#include "Macros.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+// Consumed pages are released by chunks of this size
+#define LOGREADER_RELEASE_CHUNK (8LL * 1024 * 1024)
+// Interval between two checks of the size of a followed file
+#define LOGREADER_FOLLOW_POLL_MS 5
+
+// Read ahead of a stream
+#define LOGREADER_STREAM_BUFFER (4LL * 1024 * 1024)
+// Larger headers are taken for garbage on a stream
+#define LOGREADER_MAX_HEADER (1 << 20)
+
+// fixed part of the header, headerSize field included
+#define LOG_HEADER_FIXED_SIZE 25
+#define LOG_PERIPHERAL_SIZE 6
+
+static int ReadInt32(const unsigned char* p)
+{
+    return (int)BUILD_UINT32(p[0], p[1], p[2], p[3]);
+}
+
+bool ParseLogHeader(const unsigned char* raw, long long size, HighBlueHeader* hdr, int verbose)
+{
+    memset(hdr, 0, sizeof(HighBlueHeader));
+    if (size < LOG_HEADER_FIXED_SIZE)
+        return false;
+    hdr->headerSize = ReadInt32(raw);
+    hdr->versionNumber = BUILD_UINT16(raw[4], raw[5]);
+    hdr->numberOfChan = raw[6];
+    hdr->resolutionBits = raw[7];
+    hdr->samplingFrequency = ReadInt32(raw + 8);
+    hdr->dmaBlockSize = ReadInt32(raw + 12);
+    hdr->sizeOfAdditionnalDataBuffer = ReadInt32(raw + 16);
+    hdr->numberOfExternalPeripheral = raw[20];
+    hdr->timeStampOfStart = ReadInt32(raw + 21);
+    if (verbose)
+    {
+        printf("header size : %d\n", hdr->headerSize);
+        printf("version number : %d\n", hdr->versionNumber);
+        printf("number of chans : %d\n", hdr->numberOfChan);
+        printf("resolutionBits : %d\n", hdr->resolutionBits);
+        printf("samplingFrequency : %d\n", hdr->samplingFrequency);
+        printf("dmaBlockSize : %d\n", hdr->dmaBlockSize);
+        printf("sizeOfAdditionnalDataBuffer : %d\n", hdr->sizeOfAdditionnalDataBuffer);
+        printf("numberOfExternalPeripheral : %d\n", hdr->numberOfExternalPeripheral);
+        printf("timeStampOfStart : %d\n", hdr->timeStampOfStart);
+    }
+    // load external periph config
+    const unsigned char* periph = raw + LOG_HEADER_FIXED_SIZE;
+    for (int i = 0; i < hdr->numberOfExternalPeripheral && i < MAX_PERIPHERAL; i++)
+    {
+        if (periph + LOG_PERIPHERAL_SIZE > raw + size)
+            return false;
+        hdr->periphConfig[i].Type = periph[0];
+        hdr->periphConfig[i].ID = periph[1];
+        hdr->periphConfig[i].Range = periph[2];
+        hdr->periphConfig[i].Resolution = periph[3];
+        hdr->periphConfig[i].Frequency = BUILD_UINT16(periph[4], periph[5]);
+        periph += LOG_PERIPHERAL_SIZE;
+    }
+    return hdr->headerSize >= 0 && hdr->numberOfChan > 0 && hdr->resolutionBits >= 8
+        && hdr->dmaBlockSize > 0 && hdr->sizeOfAdditionnalDataBuffer >= 0;
+}
+
+static void CountBlocks(LogReader* reader)
+{
+    reader->nbBlocks = 0;
+    if (reader->size > reader->dataOffset)
+        reader->nbBlocks = (long)((reader->size - reader->dataOffset) / reader->blockSize);
+}
+
+int OpenLogReader(LogReader* reader, const char* path, int verbose)
+{
+    memset(reader, 0, sizeof(LogReader));
+    reader->fd = -1;
+    reader->releasePages = true;
+#ifdef _WIN32
+    // the writer of a followed file keeps it open
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return -1;
+    reader->fileHandle = file;
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(file, &fileSize);
+    reader->size = fileSize.QuadPart;
+    if (reader->size == 0)
+    {
+        CloseLogReader(reader);
+        return -2;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+    {
+        CloseLogReader(reader);
+        return -1;
+    }
+    reader->mapHandle = mapping;
+    reader->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (reader->data == NULL)
+    {
+        CloseLogReader(reader);
+        return -1;
+    }
+#else
+    reader->fd = open(path, O_RDONLY);
+    if (reader->fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(reader->fd, &st) != 0)
+    {
+        CloseLogReader(reader);
+        return -1;
+    }
+    reader->size = st.st_size;
+    if (reader->size == 0)
+    {
+        CloseLogReader(reader);
+        return -2;
+    }
+    void* map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        CloseLogReader(reader);
+        return -1;
+    }
+    reader->data = map;
+    posix_madvise(map, reader->size, POSIX_MADV_SEQUENTIAL);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#endif
+    if (!ParseLogHeader(reader->data, reader->size, &reader->hdr, verbose))
+    {
+        CloseLogReader(reader);
+        return -3;
+    }
+    reader->dataOffset = (long long)reader->hdr.headerSize + 4;
+    reader->blockSize = (long long)reader->hdr.sizeOfAdditionnalDataBuffer + reader->hdr.dmaBlockSize;
+    CountBlocks(reader);
+    return 0;
+}
+
+// Reads up to size bytes, less only at the end of the stream. Returns -1 on error.
+static long long ReadStream(int fd, unsigned char* buffer, long long size)
+{
+    long long done = 0;
+    while (done < size)
+    {
+#ifdef _WIN32
+        int n = _read(fd, buffer + done, (unsigned int)(size - done));
+#else
+        ssize_t n = read(fd, buffer + done, size - done);
+#endif
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+int OpenLogReaderStream(LogReader* reader, int fd, int verbose)
+{
+    memset(reader, 0, sizeof(LogReader));
+    reader->fd = fd;
+    reader->stream = true;
+#ifdef _WIN32
+    _setmode(fd, _O_BINARY);
+#endif
+    unsigned char sizeField[4];
+    long long n = ReadStream(fd, sizeField, 4);
+    if (n < 0)
+        return -1;
+    if (n == 0)
+        return -2;
+    int headerSize = ReadInt32(sizeField);
+    if (n < 4 || headerSize + 4 < LOG_HEADER_FIXED_SIZE || headerSize > LOGREADER_MAX_HEADER)
+        return -3;
+    unsigned char* raw = malloc(headerSize + 4);
+    memcpy(raw, sizeField, 4);
+    n = ReadStream(fd, raw + 4, headerSize);
+    bool valid = n == headerSize && ParseLogHeader(raw, headerSize + 4, &reader->hdr, verbose);
+    free(raw);
+    if (n < 0)
+        return -1;
+    if (!valid)
+        return -3;
+    reader->dataOffset = (long long)headerSize + 4;
+    reader->blockSize = (long long)reader->hdr.sizeOfAdditionnalDataBuffer + reader->hdr.dmaBlockSize;
+    reader->size = reader->dataOffset;
+    long long blocks = LOGREADER_STREAM_BUFFER / reader->blockSize;
+    reader->bufferCapacity = (blocks > 0 ? blocks : 1) * reader->blockSize;
+    reader->buffer = malloc(reader->bufferCapacity);
+    return 0;
+}
+
+// Reads at least the next complete block of the stream, the blocks before
+// nextBlock are dropped. Returns false at the end of the stream.
+static bool ReadStreamBlocks(LogReader* reader)
+{
+    // the incomplete block at the end of the buffer is moved to its start
+    long long used = (reader->nbBlocks - reader->bufferFirst) * reader->blockSize;
+    reader->bufferFill -= used;
+    memmove(reader->buffer, reader->buffer + used, reader->bufferFill);
+    reader->bufferFirst = reader->nbBlocks;
+    while (reader->bufferFill < reader->blockSize)
+    {
+        // whatever is available, a pipe returns less than asked
+#ifdef _WIN32
+        int n = _read(reader->fd, reader->buffer + reader->bufferFill, (unsigned int)(reader->bufferCapacity - reader->bufferFill));
+#else
+        ssize_t n = read(reader->fd, reader->buffer + reader->bufferFill, reader->bufferCapacity - reader->bufferFill);
+#endif
+        if (n <= 0)
+            return false;
+        reader->bufferFill += n;
+        reader->size += n;
+    }
+    reader->nbBlocks += (long)(reader->bufferFill / reader->blockSize);
+    return true;
+}
+
+void CloseLogReader(LogReader* reader)
+{
+    if (reader->stream)
+    {
+        free(reader->buffer);
+        reader->buffer = NULL;
+        return;
+    }
+#ifdef _WIN32
+    if (reader->data != NULL)
+        UnmapViewOfFile(reader->data);
+    if (reader->mapHandle != NULL)
+        CloseHandle(reader->mapHandle);
+    if (reader->fileHandle != NULL)
+        CloseHandle(reader->fileHandle);
+#else
+    if (reader->data != NULL)
+        munmap((void*)reader->data, reader->size);
+    if (reader->fd >= 0)
+        close(reader->fd);
+#endif
+    reader->data = NULL;
+    reader->mapHandle = NULL;
+    reader->fileHandle = NULL;
+    reader->fd = -1;
+}
+
+long long LogReaderBlockOffset(const LogReader* reader, long block)
+{
+    return reader->dataOffset + block * reader->blockSize;
+}
+
+const unsigned char* LogReaderAdditionnalData(const LogReader* reader, long block)
+{
+    if (reader->stream)
+        return reader->buffer + (block - reader->bufferFirst) * reader->blockSize;
+    return reader->data + LogReaderBlockOffset(reader, block);
+}
+
+const unsigned char* LogReaderDmaBlock(const LogReader* reader, long block)
+{
+    return LogReaderAdditionnalData(reader, block) + reader->hdr.sizeOfAdditionnalDataBuffer;
+}
+
+// Drops the pages before offset from the mapping and from the page cache
+static void ReleaseConsumedPages(LogReader* reader, long long offset)
+{
+#ifndef _WIN32
+    long pageSize = sysconf(_SC_PAGESIZE);
+    long long end = offset / pageSize * pageSize;
+    if (end <= reader->releasedUpTo)
+        return;
+    // the mapped pages have to be dropped from the mapping first, the page
+    // cache keeps the pages still mapped. posix_madvise does nothing with glibc.
+#ifdef MADV_DONTNEED
+    madvise((void*)(reader->data + reader->releasedUpTo), end - reader->releasedUpTo, MADV_DONTNEED);
+#else
+    posix_madvise((void*)(reader->data + reader->releasedUpTo), end - reader->releasedUpTo, POSIX_MADV_DONTNEED);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(reader->fd, reader->releasedUpTo, end - reader->releasedUpTo, POSIX_FADV_DONTNEED);
+#endif
+    reader->releasedUpTo = end;
+#endif
+}
+
+bool LogReaderNextBlock(LogReader* reader, const unsigned char** additionnalData, const unsigned char** dmaBlock)
+{
+    while (reader->stream && reader->nextBlock >= reader->nbBlocks)
+    {
+        if (!ReadStreamBlocks(reader))
+            return false;
+    }
+    if (reader->nextBlock >= reader->nbBlocks)
+        return false;
+    long long offset = LogReaderBlockOffset(reader, reader->nextBlock);
+    if (reader->releasePages && offset - reader->releasedUpTo >= LOGREADER_RELEASE_CHUNK)
+        ReleaseConsumedPages(reader, offset);
+    *additionnalData = LogReaderAdditionnalData(reader, reader->nextBlock);
+    *dmaBlock = LogReaderDmaBlock(reader, reader->nextBlock);
+    reader->nextBlock++;
+    return true;
+}
+
+void LogReaderSeek(LogReader* reader, long block)
+{
+    reader->nextBlock = block;
+    if (reader->stream)
+        return;
+#ifndef _WIN32
+    long pageSize = sysconf(_SC_PAGESIZE);
+    reader->releasedUpTo = LogReaderBlockOffset(reader, block) / pageSize * pageSize;
+#endif
+}
+
+bool LogReaderRefresh(LogReader* reader)
+{
+    long nbBlocks = reader->nbBlocks;
+#ifdef _WIN32
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(reader->fileHandle, &fileSize) || fileSize.QuadPart <= reader->size)
+        return false;
+    HANDLE mapping = CreateFileMappingA(reader->fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+        return false;
+    const unsigned char* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL)
+    {
+        CloseHandle(mapping);
+        return false;
+    }
+    UnmapViewOfFile(reader->data);
+    CloseHandle(reader->mapHandle);
+    reader->data = data;
+    reader->mapHandle = mapping;
+    reader->size = fileSize.QuadPart;
+#else
+    struct stat st;
+    if (fstat(reader->fd, &st) != 0 || st.st_size <= reader->size)
+        return false;
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    munmap((void*)reader->data, reader->size);
+    reader->data = map;
+    reader->size = st.st_size;
+    posix_madvise(map, reader->size, POSIX_MADV_SEQUENTIAL);
+#endif
+    CountBlocks(reader);
+    return reader->nbBlocks > nbBlocks;
+}
+
+static void SleepPoll(void)
+{
+#ifdef _WIN32
+    Sleep(LOGREADER_FOLLOW_POLL_MS);
+#else
+    struct timespec delay = {0, LOGREADER_FOLLOW_POLL_MS * 1000000L};
+    nanosleep(&delay, NULL);
+#endif
+}
+
+int OpenLogReaderWait(LogReader* reader, const char* path, int verbose, double idleSeconds)
+{
+    int status = OpenLogReader(reader, path, 0);
+    for (double waited = 0; status != 0 && waited < idleSeconds; waited += LOGREADER_FOLLOW_POLL_MS / 1000.0)
+    {
+        SleepPoll();
+        status = OpenLogReader(reader, path, 0);
+    }
+    if (status == 0 && verbose)
+        ParseLogHeader(reader->data, reader->size, &reader->hdr, verbose);
+    return status;
+}
+
+bool LogReaderWaitBlocks(LogReader* reader, double idleSeconds)
+{
+    for (double waited = 0; waited < idleSeconds; waited += LOGREADER_FOLLOW_POLL_MS / 1000.0)
+    {
+        if (LogReaderRefresh(reader))
+            return true;
+        SleepPoll();
+    }
+    return LogReaderRefresh(reader);
+}
@@ -0,0 +1,97 @@
+#ifndef LOGREADER_H
+#define LOGREADER_H
+#include <stdbool.h>
+
+#define MAX_PERIPHERAL 5                   //Nombre max de peripheriques externes
+
+
+typedef struct{
+    char Type;                                       //type du peripherique (0x01 accel, 0x02 gyro, 0x03 magneto, 0x04 temperature, 0x05 pressure, 0x06 light,...)
+    char ID;                                         //ID du peripherique
+    char Range;                                      //Range de la mesure (ex: 2G, 4G, 6G, 8G, 16G pour un accel)
+    char Resolution;                                 //Resolution de mesure du peripherique
+    short Frequency;                                 //Frequence d'echantillonage du peripherique
+}PERIPHERAL_CONFIGURATION;
+
+typedef struct{
+    int headerSize;       //Taille du header ce champ exclu
+    int versionNumber;
+    char numberOfChan;
+    char resolutionBits;
+    int samplingFrequency;
+    int dmaBlockSize;
+    int sizeOfAdditionnalDataBuffer;
+    char numberOfExternalPeripheral;
+    int timeStampOfStart;
+    PERIPHERAL_CONFIGURATION periphConfig[MAX_PERIPHERAL];
+}HighBlueHeader;
+
+// Read-only view of a whole .log file. The file is memory mapped with
+// sequential access hints so that the decoder and the de-interleaver work
+// directly on the mapped pages, without any copy into user buffers.
+// Every record after the header is sizeOfAdditionnalDataBuffer bytes of
+// additional data followed by a dmaBlockSize bytes dmaBlock.
+typedef struct LogReader_s
+{
+    HighBlueHeader hdr;
+    const unsigned char* data;      // start of the file
+    long long size;                 // file size in bytes
+    long long dataOffset;           // offset of the first block (headerSize + 4)
+    long long blockSize;            // additional data + dmaBlock
+    long nbBlocks;                  // number of complete blocks in the file
+    long nextBlock;                 // next block returned by LogReaderNextBlock
+    long long releasedUpTo;         // bytes already handed back to the OS
+    bool releasePages;              // drop the consumed pages in LogReaderNextBlock (default true)
+    int fd;
+    bool stream;                    // read from a pipe (stdin) in one forward pass, see OpenLogReaderStream
+    unsigned char* buffer;          // stream : blocks read ahead, starting at block bufferFirst
+    long bufferFirst;
+    long long bufferFill;           // stream : bytes in buffer, the last block may be incomplete
+    long long bufferCapacity;
+    void* mapHandle;                // file mapping handle (Windows only)
+    void* fileHandle;               // file handle kept for LogReaderRefresh (Windows only)
+}LogReader;
+
+// Maps the file and parses its header. Returns 0 on success, -1 if the file
+// cannot be opened or mapped, -2 if it is empty, -3 if the header is invalid.
+int OpenLogReader(LogReader* reader, const char* path, int verbose);
+// Same, but waits up to idleSeconds for the file to exist and to hold a
+// complete header (follow mode, the recorder may not have written it yet)
+int OpenLogReaderWait(LogReader* reader, const char* path, int verbose, double idleSeconds);
+// Reads the file from a descriptor which cannot be mapped nor seeked (stdin
+// fed by a pipe). The blocks are read ahead a few MB at a time, nbBlocks
+// counts the blocks received so far and only the blocks from nextBlock on
+// are available : LogReaderSeek can only go forward, and the pointers
+// returned by LogReaderNextBlock stay valid until its next call.
+// The descriptor is not closed by CloseLogReader. Same return codes.
+int OpenLogReaderStream(LogReader* reader, int fd, int verbose);
+void CloseLogReader(LogReader* reader);
+
+// Parses a .log header from its raw bytes (at least size bytes available).
+// Returns false if the header is truncated or inconsistent.
+bool ParseLogHeader(const unsigned char* raw, long long size, HighBlueHeader* hdr, int verbose);
+
+// Random access to the two parts of block k (0 <= k < nbBlocks)
+const unsigned char* LogReaderAdditionnalData(const LogReader* reader, long block);
+const unsigned char* LogReaderDmaBlock(const LogReader* reader, long block);
+long long LogReaderBlockOffset(const LogReader* reader, long block);
+
+// Sequential access: returns false once every complete block has been read.
+// Pages of the blocks already consumed are dropped from the page cache
+// every few MB so that converting thousands of files does not evict
+// everything else.
+bool LogReaderNextBlock(LogReader* reader, const unsigned char** additionnalData, const unsigned char** dmaBlock);
+
+// Next block returned by LogReaderNextBlock, the pages before it are never touched
+void LogReaderSeek(LogReader* reader, long block);
+
+// Follow mode, for a file still being written (recorder in USB mode, copy in
+// progress) : maps the data appended since the file was opened. Returns true
+// if new complete blocks are available. The pointers obtained before stay
+// valid only until this call.
+bool LogReaderRefresh(LogReader* reader);
+// Waits for new complete blocks, polling the file size every few ms.
+// Returns false if the file did not grow for idleSeconds.
+bool LogReaderWaitBlocks(LogReader* reader, double idleSeconds);
+
+#endif
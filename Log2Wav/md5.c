@@ -0,0 +1,91 @@
+#include <string.h>
+#include "md5.h"
+
+static const unsigned int Md5Sines[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391 };
+
+static const unsigned char Md5Shifts[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21 };
+
+static void Md5Block(Md5Context* ctx, const unsigned char* block)
+{
+    unsigned int m[16];
+    for (int i = 0; i < 16; i++)
+        m[i] = (unsigned)block[4 * i] | (unsigned)block[4 * i + 1] << 8
+             | (unsigned)block[4 * i + 2] << 16 | (unsigned)block[4 * i + 3] << 24;
+    unsigned int a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    for (int i = 0; i < 64; i++)
+    {
+        unsigned int f;
+        int g;
+        switch (i >> 4)
+        {
+            case 0: f = (b & c) | (~b & d); g = i; break;
+            case 1: f = (d & b) | (~d & c); g = (5 * i + 1) & 15; break;
+            case 2: f = b ^ c ^ d; g = (3 * i + 5) & 15; break;
+            default: f = c ^ (b | ~d); g = (7 * i) & 15; break;
+        }
+        f += a + Md5Sines[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (f << Md5Shifts[i]) | (f >> (32 - Md5Shifts[i]));
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+}
+
+void Md5Init(Md5Context* ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->length = 0;
+}
+
+void Md5Update(Md5Context* ctx, const void* data, unsigned long long size)
+{
+    const unsigned char* p = data;
+    size_t pending = (size_t)(ctx->length & 63);
+    ctx->length += size;
+    if (pending > 0)
+    {
+        size_t n = 64 - pending < size ? 64 - pending : (size_t)size;
+        memcpy(ctx->buffer + pending, p, n);
+        p += n;
+        size -= n;
+        if (pending + n < 64)
+            return;
+        Md5Block(ctx, ctx->buffer);
+    }
+    for (; size >= 64; p += 64, size -= 64)
+        Md5Block(ctx, p);
+    memcpy(ctx->buffer, p, size);
+}
+
+void Md5Final(Md5Context* ctx, unsigned char digest[16])
+{
+    unsigned long long bits = ctx->length * 8;
+    unsigned char pad[72] = { 0x80 };
+    int pending = (int)(ctx->length & 63);
+    int padding = pending < 56 ? 56 - pending : 120 - pending;
+    for (int i = 0; i < 8; i++)
+        pad[padding + i] = (unsigned char)(bits >> (8 * i));
+    Md5Update(ctx, pad, padding + 8);
+    for (int i = 0; i < 4; i++)
+        for (int b = 0; b < 4; b++)
+            digest[4 * i + b] = (unsigned char)(ctx->state[i] >> (8 * b));
+}
@@ -0,0 +1,17 @@
+#ifndef MD5_H
+#define MD5_H
+
+// MD5 (RFC 1321), for the signature of the audio in the FLAC STREAMINFO
+
+typedef struct Md5Context_s
+{
+    unsigned int state[4];
+    unsigned long long length;      // bytes hashed
+    unsigned char buffer[64];       // pending bytes of the current 64-byte block
+}Md5Context;
+
+void Md5Init(Md5Context* ctx);
+void Md5Update(Md5Context* ctx, const void* data, unsigned long long size);
+void Md5Final(Md5Context* ctx, unsigned char digest[16]);
+
+#endif
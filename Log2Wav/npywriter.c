@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <string.h>
+#include "npywriter.h"
+
+#define NPY_MAGIC "\x93NUMPY"
+#define NPY_PREAMBLE_SIZE 10          // magic, version, header length
+#define NPY_ALIGNMENT 64
+#define NPY_BUFFER_SIZE (1 << 20)
+
+// Header text with the shape padded to 20 digits, so that its length does
+// not depend on count and the final patch fits in the space reserved at open
+static int FormatHeader(char* out, size_t outSize, const char* descr, long long count)
+{
+    char dict[4096];
+    int len = snprintf(dict, sizeof(dict), "{'descr': %s, 'fortran_order': False, 'shape': (%lld,), }", descr, count);
+    int padded = 20 - snprintf(NULL, 0, "%lld", count);
+    int total = NPY_PREAMBLE_SIZE + len + padded + 1;
+    total = (total + NPY_ALIGNMENT - 1) / NPY_ALIGNMENT * NPY_ALIGNMENT;
+    int headerLength = total - NPY_PREAMBLE_SIZE;
+    if ((size_t)total > outSize)
+        return -1;
+    memcpy(out, NPY_MAGIC, 6);
+    out[6] = 1;
+    out[7] = 0;
+    out[8] = (char)(headerLength & 0xFF);
+    out[9] = (char)(headerLength >> 8);
+    memcpy(out + NPY_PREAMBLE_SIZE, dict, len);
+    memset(out + NPY_PREAMBLE_SIZE + len, ' ', total - NPY_PREAMBLE_SIZE - len - 1);
+    out[total - 1] = '\n';
+    return total;
+}
+
+int NpyOpen(NpyWriter* writer, const char* path, const char* descr, size_t recordSize)
+{
+    char header[4096 + NPY_ALIGNMENT];
+    writer->file = fopen(path, "wb");
+    if (writer->file == NULL)
+        return -1;
+    setvbuf(writer->file, NULL, _IOFBF, NPY_BUFFER_SIZE);
+    writer->descr = descr;
+    writer->recordSize = recordSize;
+    writer->count = 0;
+    int headerSize = FormatHeader(header, sizeof(header), descr, 0);
+    fwrite(header, 1, headerSize, writer->file);
+    return 0;
+}
+
+void NpyAppend(NpyWriter* writer, const void* record)
+{
+    fwrite(record, writer->recordSize, 1, writer->file);
+    writer->count++;
+}
+
+static void PatchHeader(NpyWriter* writer)
+{
+    char header[4096 + NPY_ALIGNMENT];
+    int headerSize = FormatHeader(header, sizeof(header), writer->descr, writer->count);
+    fseek(writer->file, 0, SEEK_SET);
+    fwrite(header, 1, headerSize, writer->file);
+}
+
+void NpyFlush(NpyWriter* writer)
+{
+    if (writer->file == NULL)
+        return;
+    PatchHeader(writer);
+    fseek(writer->file, 0, SEEK_END);
+    fflush(writer->file);
+}
+
+void NpyClose(NpyWriter* writer)
+{
+    if (writer->file == NULL)
+        return;
+    PatchHeader(writer);
+    fclose(writer->file);
+    writer->file = NULL;
+}
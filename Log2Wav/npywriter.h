@@ -0,0 +1,29 @@
+#ifndef NPYWRITER_H
+#define NPYWRITER_H
+#include <stdio.h>
+
+// Writer of NumPy .npy files (format version 1.0) holding a 1-D array of
+// fixed size records. The header is written with room for any record count
+// and patched with the real shape when the file is closed, so records can be
+// streamed without knowing their number in advance.
+// Records are appended as packed little-endian bytes matching descr, e.g.
+// "[('timestamp', '<u4'), ('x', '<f8'), ('y', '<f8'), ('z', '<f8')]".
+
+typedef struct NpyWriter_s
+{
+    FILE* file;
+    const char* descr;
+    size_t recordSize;
+    long long count;
+}NpyWriter;
+
+// Returns 0 on success, -1 if the file cannot be created
+int NpyOpen(NpyWriter* writer, const char* path, const char* descr, size_t recordSize);
+void NpyAppend(NpyWriter* writer, const void* record);
+// Writes the buffered records and patches the header, the file is then a
+// valid .npy of the records appended so far
+void NpyFlush(NpyWriter* writer);
+// Patches the header with the number of records and closes the file
+void NpyClose(NpyWriter* writer);
+
+#endif
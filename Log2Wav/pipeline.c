@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include "pipeline.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// io_uring without liburing : the kernel header and the two system calls are
+// enough for reads, and nothing more has to be linked
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define PIPELINE_URING
+#endif
+#endif
+#endif
+
+#define PIPELINE_SPINS 64               // busy waits before yielding
+#define PIPELINE_YIELDS 64              // yields before sleeping
+#define PIPELINE_SLEEP_US 50
+#define PIPELINE_RELEASE_CHUNK (8LL * 1024 * 1024)
+#define PIPELINE_URING_ENTRIES 64       // max reads in flight
+
+////////////////////
+/// Rings        ///
+////////////////////
+
+// Waits a little longer at each call, *rounds counts the calls
+static void Backoff(unsigned int* rounds)
+{
+    unsigned int n = (*rounds)++;
+    if (n < PIPELINE_SPINS)
+    {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_ia32_pause();
+#endif
+        return;
+    }
+#ifdef _WIN32
+    Sleep(n < PIPELINE_SPINS + PIPELINE_YIELDS ? 0 : 1);
+#else
+    if (n < PIPELINE_SPINS + PIPELINE_YIELDS)
+    {
+        sched_yield();
+        return;
+    }
+    struct timespec delay = {0, PIPELINE_SLEEP_US * 1000L};
+    nanosleep(&delay, NULL);
+#endif
+}
+
+bool BlockRingInit(BlockRing* ring, unsigned int nbSlots, long slotSize, atomic_bool* cancel)
+{
+    memset(ring, 0, sizeof(BlockRing));
+    ring->nbSlots = 1;
+    while (ring->nbSlots < nbSlots)
+        ring->nbSlots <<= 1;
+    ring->slotSize = slotSize > 0 ? slotSize : 1;
+    ring->slots = malloc((size_t)ring->nbSlots * ring->slotSize);
+    ring->lengths = calloc(ring->nbSlots, sizeof(long));
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, false);
+    ring->cancel = cancel;
+    return ring->slots != NULL && ring->lengths != NULL;
+}
+
+void BlockRingFree(BlockRing* ring)
+{
+    free(ring->slots);
+    free(ring->lengths);
+    ring->slots = NULL;
+    ring->lengths = NULL;
+}
+
+unsigned char* BlockRingAcquire(BlockRing* ring, unsigned int ahead)
+{
+    // only this side writes head
+    unsigned long long slot = atomic_load_explicit(&ring->head, memory_order_relaxed) + ahead;
+    unsigned int rounds = 0;
+    // the consumer has released the slot once tail has gone past it
+    while (slot - atomic_load_explicit(&ring->tail, memory_order_acquire) >= ring->nbSlots)
+    {
+        if (atomic_load_explicit(ring->cancel, memory_order_relaxed))
+            return NULL;
+        Backoff(&rounds);
+    }
+    return ring->slots + (slot & (ring->nbSlots - 1)) * ring->slotSize;
+}
+
+void BlockRingPublish(BlockRing* ring, long length)
+{
+    unsigned long long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring->lengths[head & (ring->nbSlots - 1)] = length;
+    // the slot and its length are visible before the new head
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void BlockRingClose(BlockRing* ring)
+{
+    atomic_store_explicit(&ring->closed, true, memory_order_release);
+}
+
+const unsigned char* BlockRingPeek(BlockRing* ring, long* length)
+{
+    unsigned long long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int rounds = 0;
+    while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+    {
+        if (atomic_load_explicit(ring->cancel, memory_order_relaxed))
+            return NULL;
+        // closed after the last publish : check the head once more
+        if (atomic_load_explicit(&ring->closed, memory_order_acquire))
+        {
+            if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+                return NULL;
+            break;
+        }
+        Backoff(&rounds);
+    }
+    unsigned int index = tail & (ring->nbSlots - 1);
+    *length = ring->lengths[index];
+    return ring->slots + (size_t)index * ring->slotSize;
+}
+
+void BlockRingRelease(BlockRing* ring)
+{
+    unsigned long long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    // the slot has been read before the producer may reuse it
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+void BlockRingCancel(BlockRing* ring)
+{
+    atomic_store_explicit(ring->cancel, true, memory_order_relaxed);
+}
+
+////////////////////
+/// io_uring     ///
+////////////////////
+
+#ifdef PIPELINE_URING
+
+typedef struct Uring_s
+{
+    int fd;
+    unsigned int entries;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned int* sqHead;
+    unsigned int* sqTail;
+    unsigned int* sqMask;
+    unsigned int* sqArray;
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int* cqMask;
+    struct io_uring_cqe* cqes;
+    unsigned int toSubmit;
+}Uring;
+
+static void CloseUring(Uring* ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED)
+        munmap(ring->sqRing, ring->sqRingSize);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    ring->fd = -1;
+}
+
+// Returns false if the kernel has no io_uring (before 5.1, or forbidden)
+static bool OpenUring(Uring* ring, unsigned int entries)
+{
+    memset(ring, 0, sizeof(Uring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return false;
+    ring->entries = params.sq_entries;
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cqRingSize > ring->sqRingSize)
+        ring->sqRingSize = ring->cqRingSize;
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    ring->cqRing = single ? ring->sqRing
+                          : mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                                 IORING_OFF_CQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        CloseUring(ring);
+        return false;
+    }
+    unsigned char* sq = ring->sqRing;
+    unsigned char* cq = ring->cqRing;
+    ring->sqHead = (unsigned int*)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned int*)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned int*)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned int*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned int*)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+// Queues a vectored read, submitted by the next UringEnter
+static void UringReadv(Uring* ring, int fd, const struct iovec* iov, int nbIov, long long offset, unsigned long long tag)
+{
+    unsigned int tail = *ring->sqTail;
+    unsigned int index = tail & *ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (unsigned long long)(uintptr_t)iov;
+    sqe->len = nbIov;
+    sqe->user_data = tag;
+    ring->sqArray[index] = index;
+    // the entry is written before the kernel sees the new tail
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+}
+
+// Submits the queued reads and waits for minComplete completions
+static bool UringEnter(Uring* ring, unsigned int minComplete)
+{
+    for (;;)
+    {
+        long n = syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, minComplete,
+                         minComplete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0)
+        {
+            ring->toSubmit -= (unsigned int)n < ring->toSubmit ? (unsigned int)n : ring->toSubmit;
+            return true;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return false;
+    }
+}
+
+// Next completion, false if there is none yet
+static bool UringReap(Uring* ring, unsigned long long* tag, int* result)
+{
+    unsigned int head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        return false;
+    struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+    *tag = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Waits for the completion of the reads the kernel has taken, so that their
+// buffers can be freed. The reads still queued are dropped.
+static void UringDrain(Uring* ring, long inFlight)
+{
+    inFlight -= (long)(*ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE));
+    unsigned int rounds = 0;
+    while (inFlight > 0)
+    {
+        unsigned long long tag;
+        int result;
+        if (UringReap(ring, &tag, &result))
+        {
+            inFlight--;
+            continue;
+        }
+        // the completions are posted even if io_uring_enter keeps failing
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+            Backoff(&rounds);
+    }
+}
+
+// Ends a short read synchronously (only at the end of the file, in theory)
+static bool CompleteRead(int fd, struct iovec* iov, int nbIov, long long offset, long long done)
+{
+    for (int i = 0; i < nbIov; i++)
+    {
+        long long size = iov[i].iov_len;
+        if (done >= size)
+        {
+            done -= size;
+            offset += size;
+            continue;
+        }
+        unsigned char* base = iov[i].iov_base;
+        offset += done;
+        for (long long at = done; at < size;)
+        {
+            ssize_t n = pread(fd, base + at, size - at, offset);
+            if (n <= 0)
+                return false;
+            at += n;
+            offset += n;
+        }
+        done = 0;
+    }
+    return true;
+}
+
+// Reads of the blocks straight into the slots, as many in flight as the rings
+// have free slots. Returns false if io_uring could not be set up, before
+// anything has been published.
+static bool ReadBlocksUring(BlockSource* source)
+{
+    LogReader* reader = source->reader;
+    unsigned int depth = source->audio->nbSlots < source->additionnal->nbSlots ? source->audio->nbSlots
+                                                                             : source->additionnal->nbSlots;
+    if (depth > PIPELINE_URING_ENTRIES)
+        depth = PIPELINE_URING_ENTRIES;
+    Uring ring;
+    if (!OpenUring(&ring, depth))
+        return false;
+    if (depth > ring.entries)
+        depth = ring.entries;
+    struct iovec* iov = malloc(depth * 2 * sizeof(struct iovec));
+    bool* complete = calloc(depth, sizeof(bool));
+    long additionnalSize = reader->hdr.sizeOfAdditionnalDataBuffer;
+    long dmaSize = reader->hdr.dmaBlockSize;
+    long long releasedUpTo = LogReaderBlockOffset(reader, source->firstBlock);
+    long next = source->firstBlock;     // next block to read
+    long done = source->firstBlock;     // next block to publish
+    long inFlight = 0;
+    bool stop = iov == NULL || complete == NULL;
+    source->uring = true;
+    while ((done < source->endBlock && !stop) || inFlight > 0)
+    {
+        while (!stop && next < source->endBlock && next - done < (long)depth)
+        {
+            unsigned char* additionnal = BlockRingAcquire(source->additionnal, (unsigned int)(next - done));
+            unsigned char* dma = additionnal != NULL ? BlockRingAcquire(source->audio, (unsigned int)(next - done)) : NULL;
+            if (dma == NULL)
+            {
+                stop = true;
+                break;
+            }
+            struct iovec* v = &iov[(next - source->firstBlock) % depth * 2];
+            v[0].iov_base = additionnal;
+            v[0].iov_len = additionnalSize;
+            v[1].iov_base = dma;
+            v[1].iov_len = dmaSize;
+            UringReadv(&ring, reader->fd, v, 2, LogReaderBlockOffset(reader, next), (unsigned long long)next);
+            next++;
+            inFlight++;
+        }
+        if (inFlight == 0)
+            break;
+        if (!UringEnter(&ring, 1))
+        {
+            // the reads in flight still write into the slots
+            source->failed = true;
+            BlockRingCancel(source->audio);
+            UringDrain(&ring, inFlight);
+            break;
+        }
+        unsigned long long tag;
+        int result;
+        while (UringReap(&ring, &tag, &result))
+        {
+            long block = (long)tag;
+            struct iovec* v = &iov[(block - source->firstBlock) % depth * 2];
+            long long expected = additionnalSize + dmaSize;
+            if (result < 0 || (result < expected
+                               && !CompleteRead(reader->fd, v, 2, LogReaderBlockOffset(reader, block), result)))
+            {
+                source->failed = true;
+                stop = true;
+                BlockRingCancel(source->audio);
+            }
+            complete[(block - source->firstBlock) % depth] = true;
+            inFlight--;
+        }
+        // the blocks are published in order
+        while (!stop && done < next && complete[(done - source->firstBlock) % depth])
+        {
+            complete[(done - source->firstBlock) % depth] = false;
+            BlockRingPublish(source->additionnal, additionnalSize);
+            BlockRingPublish(source->audio, dmaSize);
+            source->nbBlocks++;
+            done++;
+        }
+        long long offset = LogReaderBlockOffset(reader, done);
+        if (reader->releasePages && offset - releasedUpTo >= PIPELINE_RELEASE_CHUNK)
+        {
+#ifdef POSIX_FADV_DONTNEED
+            posix_fadvise(reader->fd, releasedUpTo, offset - releasedUpTo, POSIX_FADV_DONTNEED);
+#endif
+            releasedUpTo = offset;
+        }
+    }
+    free(iov);
+    free(complete);
+    CloseUring(&ring);
+    return true;
+}
+
+static bool UringAvailable(void)
+{
+    // probed once, the answer does not change while running
+    static atomic_int available = -1;
+    int known = atomic_load(&available);
+    if (known < 0)
+    {
+        Uring ring;
+        known = OpenUring(&ring, 1);
+        if (known)
+            CloseUring(&ring);
+        atomic_store(&available, known);
+    }
+    return known;
+}
+
+#endif
+
+////////////////////
+/// Stages       ///
+////////////////////
+
+const char* BlockSourceMethod(const LogReader* reader)
+{
+    if (reader->stream)
+        return "stdin";
+#ifdef PIPELINE_URING
+    if (UringAvailable())
+        return "io_uring";
+#endif
+    return "the mapping";
+}
+
+// Blocks copied from the mapping or from the stream buffer of the reader
+static void CopyBlocks(BlockSource* source)
+{
+    LogReader* reader = source->reader;
+    long additionnalSize = reader->hdr.sizeOfAdditionnalDataBuffer;
+    long dmaSize = reader->hdr.dmaBlockSize;
+    LogReaderSeek(reader, source->firstBlock);
+    while (reader->nextBlock < source->endBlock)
+    {
+        const unsigned char* additionnalData;
+        const unsigned char* dmaBlock;
+        if (!LogReaderNextBlock(reader, &additionnalData, &dmaBlock))
+            break;
+        unsigned char* additionnal = BlockRingAcquire(source->additionnal, 0);
+        unsigned char* dma = additionnal != NULL ? BlockRingAcquire(source->audio, 0) : NULL;
+        if (dma == NULL)
+            break;
+        // the copy takes the page faults, or the data just read from the stream
+        memcpy(additionnal, additionnalData, additionnalSize);
+        memcpy(dma, dmaBlock, dmaSize);
+        BlockRingPublish(source->additionnal, additionnalSize);
+        BlockRingPublish(source->audio, dmaSize);
+        source->nbBlocks++;
+    }
+}
+
+void* RunBlockSource(void* arg)
+{
+    BlockSource* source = arg;
+    if (source->timed)
+        StatsStartClock(StatsRead);
+    bool done = false;
+#ifdef PIPELINE_URING
+    if (!source->reader->stream && source->reader->fd >= 0 && UringAvailable())
+        done = ReadBlocksUring(source);
+#endif
+    if (!done)
+        CopyBlocks(source);
+    BlockRingClose(source->additionnal);
+    BlockRingClose(source->audio);
+    StatsStopClock(&source->stats);
+    return NULL;
+}
+
+void* RunRingWriter(void* arg)
+{
+    RingWriter* writer = arg;
+    if (writer->timed)
+        StatsStartClock(StatsWrite);
+    long length;
+    const unsigned char* slot;
+    while ((slot = BlockRingPeek(writer->ring, &length)) != NULL)
+    {
+        if (fwrite(slot, 1, length, writer->file) != (size_t)length)
+        {
+            // disk full, or the reader of the pipe has gone
+            writer->failed = true;
+            BlockRingCancel(writer->ring);
+            break;
+        }
+        writer->bytesWritten += length;
+        BlockRingRelease(writer->ring);
+    }
+    StatsStopClock(&writer->stats);
+    return NULL;
+}
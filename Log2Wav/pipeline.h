@@ -0,0 +1,96 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "logreader.h"
+#include "stats.h"
+
+// Building blocks of the pipelined conversion : the stages run on their own
+// threads and hand the blocks over through bounded rings, so that the disk
+// reads, the sensors decoding, the audio formatting and the writes overlap
+// instead of adding up.
+//
+//   reader ---> additional data ring ---> sensors decoding
+//          \--> dmaBlock ring ---> audio formatting ---> ring ---> writer
+//
+// Each ring has a single producer and a single consumer and no lock : the
+// slots are handed over by two counters, each one written by one side only.
+// A stage waiting for a slot spins a little, then yields, then sleeps.
+// Any stage may cancel the whole pipeline (write error), the others then
+// stop at their next slot.
+
+#define PIPELINE_DEFAULT_DEPTH 16   // slots of each ring
+
+typedef struct BlockRing_s
+{
+    unsigned char* slots;
+    long* lengths;                  // bytes used in each slot
+    long slotSize;
+    unsigned int nbSlots;           // power of two
+    _Atomic unsigned long long head;    // slots published, written by the producer
+    _Atomic unsigned long long tail;    // slots released, written by the consumer
+    atomic_bool closed;             // nothing will be published anymore
+    atomic_bool* cancel;            // shared by the stages of a pipeline
+}BlockRing;
+
+// nbSlots is rounded up to a power of two. Returns false if out of memory.
+bool BlockRingInit(BlockRing* ring, unsigned int nbSlots, long slotSize, atomic_bool* cancel);
+void BlockRingFree(BlockRing* ring);
+
+// Producer : slot ahead positions after the next one to publish, once it is
+// free (several slots can be filled at once). NULL if cancelled.
+unsigned char* BlockRingAcquire(BlockRing* ring, unsigned int ahead);
+// Publishes the next slot, holding length bytes
+void BlockRingPublish(BlockRing* ring, long length);
+void BlockRingClose(BlockRing* ring);
+
+// Consumer : next published slot, NULL once the ring is closed and empty or
+// when cancelled
+const unsigned char* BlockRingPeek(BlockRing* ring, long* length);
+void BlockRingRelease(BlockRing* ring);
+
+// Stops every stage sharing the cancel flag of the ring
+void BlockRingCancel(BlockRing* ring);
+
+// Reader stage : the blocks [firstBlock, endBlock) of the reader, the
+// additional data of each one to the additionnal ring and its dmaBlock to the
+// audio ring. A file is read with io_uring where the kernel has it (Linux,
+// several reads in flight straight into the slots), else the blocks are
+// copied from the mapping, or from the stream, which faults or reads them in
+// on this thread.
+typedef struct BlockSource_s
+{
+    LogReader* reader;              // only used by the stage until it ends
+    long firstBlock;
+    long endBlock;                  // LONG_MAX : up to the end of the stream
+    BlockRing* additionnal;
+    BlockRing* audio;
+    bool timed;                     // --stats : the time of the thread is added to stats
+    bool uring;                     // set by the stage : the reads went through io_uring
+    bool failed;                    // read error
+    long nbBlocks;                  // blocks published
+    ConvertStats stats;
+}BlockSource;
+
+// Thread entry point, arg is a BlockSource. Closes both rings at the end.
+void* RunBlockSource(void* arg);
+
+// Writer stage : appends the slots of a ring to a file
+typedef struct RingWriter_s
+{
+    BlockRing* ring;
+    FILE* file;
+    bool timed;
+    bool failed;                    // cancels the pipeline
+    long long bytesWritten;
+    ConvertStats stats;
+}RingWriter;
+
+// Thread entry point, arg is a RingWriter
+void* RunRingWriter(void* arg);
+
+// Name of the read path the reader stage would take for this reader
+const char* BlockSourceMethod(const LogReader* reader);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef QHB_H
+#define QHB_H
+
+// libqhb : everything but the log2wav command line (log2wav.c), built as
+// a static library and linked by log2wav, logbench or any other program
+// ingesting QHB recordings.
+//
+// The library keeps no global state : each stream is decoded with its own
+// context (LogReader for the file, BlockDecoder for the sensors data,
+// MsgDecoder + MsgProcessor for a bare message stream), so that many streams
+// can be decoded at the same time, on one thread or on many. A context must
+// not be used by two threads at once. The only per thread state is the
+// StatsClock of --stats, which times the calling thread.
+
+#include "logreader.h"
+#include "blockindex.h"
+#include "decoder.h"
+#include "MsgProcessor.h"
+#include "blockdecoder.h"
+#include "timemap.h"
+#include "sensorsink.h"
+#include "interleave.h"
+#include "stats.h"
+#include "pipeline.h"
+#include "convert.h"
+#include "batch.h"
+#include "stitch.h"
+#include "align.h"
+
+#endif
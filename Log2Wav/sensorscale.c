@@ -0,0 +1,71 @@
+#include <math.h>
+#include "interleave.h"
+#include "sensorscale.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SENSORSCALE_X86
+#include <immintrin.h>
+#endif
+
+double SensorScaleFactor(float range, unsigned char resolutionBits)
+{
+    // same operations as NormalizeSensorsDatas, so that the products match
+    double dataMaxValue = pow(2, resolutionBits) / 2;
+    return range / dataMaxValue;
+}
+
+static void ScaleInt16Scalar(double* out, const short* in, int count, double scale)
+{
+    for (int i = 0; i < count; i++)
+        out[i] = scale * in[i];
+}
+
+#ifdef SENSORSCALE_X86
+
+__attribute__((target("sse2")))
+static void ScaleInt16SSE2(double* out, const short* in, int count, double scale)
+{
+    __m128d factor = _mm_set1_pd(scale);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i raw = _mm_loadu_si128((const __m128i*)(in + i));
+        // sign extension of the 16-bit samples to 32 bits
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(raw, raw), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(raw, raw), 16);
+        _mm_storeu_pd(out + i, _mm_mul_pd(factor, _mm_cvtepi32_pd(lo)));
+        _mm_storeu_pd(out + i + 2, _mm_mul_pd(factor, _mm_cvtepi32_pd(_mm_shuffle_epi32(lo, 0x4E))));
+        _mm_storeu_pd(out + i + 4, _mm_mul_pd(factor, _mm_cvtepi32_pd(hi)));
+        _mm_storeu_pd(out + i + 6, _mm_mul_pd(factor, _mm_cvtepi32_pd(_mm_shuffle_epi32(hi, 0x4E))));
+    }
+    ScaleInt16Scalar(out + i, in + i, count - i, scale);
+}
+
+__attribute__((target("avx2")))
+static void ScaleInt16AVX2(double* out, const short* in, int count, double scale)
+{
+    __m256d factor = _mm256_set1_pd(scale);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i wide = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i)));
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(factor, _mm256_cvtepi32_pd(_mm256_castsi256_si128(wide))));
+        _mm256_storeu_pd(out + i + 4, _mm256_mul_pd(factor, _mm256_cvtepi32_pd(_mm256_extracti128_si256(wide, 1))));
+    }
+    ScaleInt16Scalar(out + i, in + i, count - i, scale);
+}
+
+#endif
+
+void ScaleInt16(double* out, const short* in, int count, double scale)
+{
+#ifdef SENSORSCALE_X86
+    switch (GetSimdLevel())
+    {
+        case SimdAVX2: ScaleInt16AVX2(out, in, count, scale); return;
+        case SimdSSE2: ScaleInt16SSE2(out, in, count, scale); return;
+        default: break;
+    }
+#endif
+    ScaleInt16Scalar(out, in, count, scale);
+}
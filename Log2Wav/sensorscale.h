@@ -0,0 +1,14 @@
+#ifndef SENSORSCALE_H
+#define SENSORSCALE_H
+
+// Scaling of the raw int16 sensor samples to physical units, a whole packet
+// at a time : out[i] = scale * in[i], exactly as the scalar expression (the
+// products are the same IEEE doubles, only computed 2 or 4 at a time).
+
+// Scale factor of a (range, resolution) configuration, range / 2^(bits-1)
+double SensorScaleFactor(float range, unsigned char resolutionBits);
+
+// out and in may be unaligned, count up to any size
+void ScaleInt16(double* out, const short* in, int count, double scale);
+
+#endif
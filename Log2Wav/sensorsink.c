@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sensorsink.h"
+#include "stats.h"
+
+// Name suffix and dtype of each .npy stream, records are packed little-endian
+typedef struct NpyStreamFormat_s
+{
+    const char* suffix;
+    const char* descr;
+    size_t recordSize;
+}NpyStreamFormat;
+
+static const NpyStreamFormat npyFormats[SENSOR_STREAM_COUNT] = {
+    [StreamPacket] = {"packet", "'<u8'", 8},
+    [StreamAccel] = {"accel", "[('timestamp', '<u4'), ('x', '<f8'), ('y', '<f8'), ('z', '<f8')]", 28},
+    [StreamGyro] = {"gyro", "[('timestamp', '<u4'), ('x', '<f8'), ('y', '<f8'), ('z', '<f8')]", 28},
+    [StreamMag] = {"mag", "[('timestamp', '<u4'), ('x', '<f8'), ('y', '<f8'), ('z', '<f8')]", 28},
+    [StreamTemperature] = {"temperature", "[('timestamp', '<u4'), ('temperature', '<f8')]", 12},
+    [StreamPressure] = {"pressure", "[('timestamp', '<u4'), ('pressure', '<f8')]", 12},
+    [StreamLight] = {"light", "[('timestamp', '<u4'), ('ch0', '<u2'), ('ch1', '<u2')]", 8},
+    [StreamGPS] = {"gps", "[('year', '<u2'), ('month', 'u1'), ('day', 'u1'), ('hour', 'u1'), ('minute', 'u1'), ('second', 'u1'), "
+                          "('fix', 'u1'), ('fix_quality', 'u1'), ('latitude', '<f8'), ('latitude_direction', 'S1'), "
+                          "('longitude', '<f8'), ('longitude_direction', 'S1'), ('speed', '<f8'), ('angle', '<f8'), "
+                          "('altitude', '<f8'), ('satellites', 'u1'), ('antenna', 'u1')]", 53},
+    [StreamPPS] = {"pps", "'<u8'", 8},
+    [StreamMPU] = {"mpu", "[('timestamp', '<i4'), ('val0', '<i2'), ('val1', '<i2'), ('val2', '<i2'), ('val3', '<i2'), "
+                          "('val4', '<i2'), ('val5', '<i2'), ('val6', '<i2'), ('val7', '<i2'), ('val8', '<i2')]", 22},
+};
+
+void SensorSinkInit(SensorSink* sink, FILE* csv, const char* npyPrefix)
+{
+    memset(sink, 0, sizeof(SensorSink));
+    CsvWriterInit(&sink->csv, csv);
+    sink->npyPrefix = npyPrefix;
+}
+
+void SensorSinkTimeTables(SensorSink* sink, FILE* pps, FILE* gps)
+{
+    CsvWriterInit(&sink->pps, pps);
+    CsvWriterInit(&sink->gps, gps);
+}
+
+void SensorSinkTimeMap(SensorSink* sink, TimeMapBuilder* builder)
+{
+    sink->timeMap = builder;
+}
+
+void SensorSinkSubscribe(SensorSink* sink, unsigned int streamMask, int batchSize, SensorEventHandler handler, void* context)
+{
+    free(sink->events);
+    sink->handler = handler;
+    sink->handlerContext = context;
+    sink->streamMask = streamMask;
+    sink->batchSize = batchSize > 0 ? batchSize : 1;
+    sink->nbEvents = 0;
+    sink->events = handler != NULL ? malloc(sizeof(SensorEvent) * sink->batchSize) : NULL;
+}
+
+bool SensorSinkActive(const SensorSink* sink)
+{
+    return sink->csv.file != NULL || sink->npyPrefix != NULL || sink->pps.file != NULL || sink->gps.file != NULL ||
+           sink->handler != NULL || sink->timeMap != NULL;
+}
+
+static void FlushEvents(SensorSink* sink)
+{
+    if (sink->nbEvents == 0)
+        return;
+    sink->handler(sink->events, sink->nbEvents, sink->handlerContext);
+    sink->nbEvents = 0;
+}
+
+static void PostEvent(SensorSink* sink)
+{
+    if (++sink->nbEvents == sink->batchSize)
+        FlushEvents(sink);
+}
+
+// The header of a table is written with its first row, pandas writes an
+// empty table as a single empty line
+static void CloseTable(CsvWriter* table, long long nbRows)
+{
+    if (table->file != NULL && nbRows == 0)
+        CsvPutChar(table, '\n');
+    CsvWriterClose(table);
+}
+
+static void FlushText(CsvWriter* writer)
+{
+    if (writer->file == NULL)
+        return;
+    CsvWriterFlush(writer);
+    fflush(writer->file);
+}
+
+void SensorSinkFlush(SensorSink* sink)
+{
+    FlushText(&sink->csv);
+    FlushText(&sink->pps);
+    FlushText(&sink->gps);
+    for (int i = 0; i < SENSOR_STREAM_COUNT; i++)
+        NpyFlush(&sink->npy[i]);
+    if (sink->handler != NULL)
+        FlushEvents(sink);
+}
+
+long long SensorSinkClose(SensorSink* sink)
+{
+    if (sink->handler != NULL)
+        FlushEvents(sink);
+    free(sink->events);
+    sink->events = NULL;
+    sink->handler = NULL;
+    CsvWriterClose(&sink->csv);
+    CloseTable(&sink->pps, sink->nbPPSRows);
+    CloseTable(&sink->gps, sink->nbGPSRows);
+    long long bytes = 0;
+    for (int i = 0; i < SENSOR_STREAM_COUNT; i++)
+    {
+        if (sink->npy[i].file == NULL)
+            continue;
+        bytes += sink->npy[i].count * (long long)sink->npy[i].recordSize;
+        NpyClose(&sink->npy[i]);
+    }
+    return bytes;
+}
+
+// Writer of a stream, opened on its first record. NULL if .npy is not wanted.
+static NpyWriter* StreamWriter(SensorSink* sink, SensorStream stream)
+{
+    if (sink->npyPrefix == NULL)
+        return NULL;
+    NpyWriter* writer = &sink->npy[stream];
+    if (writer->file == NULL)
+    {
+        const NpyStreamFormat* format = &npyFormats[stream];
+        char* path = malloc(strlen(sink->npyPrefix) + strlen(format->suffix) + 6);
+        sprintf(path, "%s_%s.npy", sink->npyPrefix, format->suffix);
+        int status = NpyOpen(writer, path, format->descr, format->recordSize);
+        free(path);
+        if (status != 0)
+            return NULL;
+    }
+    return writer;
+}
+
+// Little-endian packing of the record fields (the hosts we run on are all little-endian)
+#define PUT(record, offset, value) memcpy((record) + (offset), &(value), sizeof(value))
+
+const char* SensorStreamName(SensorStream stream)
+{
+    return npyFormats[stream].suffix;
+}
+
+const char* SensorStreamDescr(SensorStream stream)
+{
+    return npyFormats[stream].descr;
+}
+
+size_t SensorStreamRecordSize(SensorStream stream)
+{
+    return npyFormats[stream].recordSize;
+}
+
+size_t PackSensorRecord(const SensorEvent* event, unsigned char* record)
+{
+    switch (event->stream)
+    {
+        case StreamPacket:
+        case StreamPPS:
+            PUT(record, 0, event->timeStampNS);
+            break;
+        case StreamAccel:
+        case StreamGyro:
+        case StreamMag:
+            PUT(record, 0, event->timeStamp);
+            PUT(record, 4, event->xyz.X);
+            PUT(record, 12, event->xyz.Y);
+            PUT(record, 20, event->xyz.Z);
+            break;
+        case StreamTemperature:
+            PUT(record, 0, event->timeStamp);
+            PUT(record, 4, event->temperature.temperature);
+            break;
+        case StreamPressure:
+            PUT(record, 0, event->timeStamp);
+            PUT(record, 4, event->pressure.pressure);
+            break;
+        case StreamLight:
+            PUT(record, 0, event->timeStamp);
+            PUT(record, 4, event->light.ch0);
+            PUT(record, 6, event->light.ch1);
+            break;
+        case StreamGPS:
+        {
+            const GPSDatas* gpsDatas = &event->gps;
+            unsigned char fix = gpsDatas->fix;
+            PUT(record, 0, gpsDatas->dateOfFix.year);
+            PUT(record, 2, gpsDatas->dateOfFix.month);
+            PUT(record, 3, gpsDatas->dateOfFix.day);
+            PUT(record, 4, gpsDatas->dateOfFix.hour);
+            PUT(record, 5, gpsDatas->dateOfFix.minute);
+            PUT(record, 6, gpsDatas->dateOfFix.second);
+            PUT(record, 7, fix);
+            PUT(record, 8, gpsDatas->fixQuality);
+            PUT(record, 9, gpsDatas->latitude);
+            PUT(record, 17, gpsDatas->latitudeDirection);
+            PUT(record, 18, gpsDatas->longitude);
+            PUT(record, 26, gpsDatas->longitudeDirection);
+            PUT(record, 27, gpsDatas->speed);
+            PUT(record, 35, gpsDatas->angle);
+            PUT(record, 43, gpsDatas->altitude);
+            PUT(record, 51, gpsDatas->satellites);
+            PUT(record, 52, gpsDatas->antenna);
+            break;
+        }
+        case StreamMPU:
+            PUT(record, 0, event->timeStamp);
+            memcpy(record + 4, event->mpu, sizeof(event->mpu));
+            break;
+        default:
+            return 0;
+    }
+    return npyFormats[event->stream].recordSize;
+}
+
+// The .npy record and the typed event of a record, when they are wanted
+static void SinkRecord(SensorSink* sink, SensorEvent* event)
+{
+    NpyWriter* writer = StreamWriter(sink, event->stream);
+    if (writer != NULL)
+    {
+        unsigned char record[SENSOR_RECORD_MAX_SIZE];
+        PackSensorRecord(event, record);
+        NpyAppend(writer, record);
+    }
+    if (sink->handler != NULL && (sink->streamMask & (1u << event->stream)) != 0)
+    {
+        event->block = sink->block;
+        event->packetTimeNS = sink->packetTimeNS;
+        sink->events[sink->nbEvents] = *event;
+        PostEvent(sink);
+    }
+}
+
+// Records are only built when some output wants them
+static bool WantsRecords(const SensorSink* sink)
+{
+    return sink->npyPrefix != NULL || sink->handler != NULL;
+}
+
+void SinkBlock(SensorSink* sink, long block)
+{
+    sink->block = block;
+    sink->packetTimeNS = 0;
+}
+
+void SinkPacketTimeStamp(SensorSink* sink, unsigned long long timeStampNS)
+{
+    StatsStage left = StatsSwitch(StatsFormat);
+    sink->packetTimeNS = timeStampNS;
+    if (sink->timeMap != NULL)
+        TimeMapBlock(sink->timeMap, sink->block, timeStampNS);
+    CsvWriter* csv = &sink->csv;
+    if (csv->file != NULL)
+    {
+        CsvPutLiteral(csv, "PACKET TIMESTAMP: ");
+        CsvPutUInt(csv, timeStampNS);
+        CsvPutChar(csv, '\n');
+    }
+    if (WantsRecords(sink))
+    {
+        SensorEvent event = {.stream = StreamPacket, .timeStampNS = timeStampNS};
+        SinkRecord(sink, &event);
+    }
+    StatsSwitch(left);
+}
+
+void SinkXYZ(SensorSink* sink, SensorType type, unsigned int timeStamp, const SensorXYZData* datas)
+{
+    StatsStage left = StatsSwitch(StatsFormat);
+    SensorStream stream;
+    const char* name;
+    switch (type)
+    {
+        case Accel: stream = StreamAccel; name = "ACCEL"; break;
+        case Gyro: stream = StreamGyro; name = "GYRO"; break;
+        default: stream = StreamMag; name = "MAG"; break;
+    }
+    CsvWriter* csv = &sink->csv;
+    if (csv->file != NULL)
+    {
+        // "%s, %d, %lf,%lf,%lf\n"
+        CsvPutText(csv, name, strlen(name));
+        CsvPutLiteral(csv, ", ");
+        CsvPutInt(csv, (int)timeStamp);
+        CsvPutLiteral(csv, ", ");
+        CsvPutDouble(csv, datas->X);
+        CsvPutChar(csv, ',');
+        CsvPutDouble(csv, datas->Y);
+        CsvPutChar(csv, ',');
+        CsvPutDouble(csv, datas->Z);
+        CsvPutChar(csv, '\n');
+    }
+    if (WantsRecords(sink))
+    {
+        SensorEvent event = {.stream = stream, .timeStamp = timeStamp, .xyz = *datas};
+        SinkRecord(sink, &event);
+    }
+    StatsSwitch(left);
+}
+
+void SinkTemperature(SensorSink* sink, const TemperatureData* datas)
+{
+    StatsStage left = StatsSwitch(StatsFormat);
+    CsvWriter* csv = &sink->csv;
+    if (csv->file != NULL)
+    {
+        // "TEMP, %ld, %lf\n"
+        CsvPutLiteral(csv, "TEMP, ");
+        CsvPutInt(csv, (long)(unsigned long)datas->timeStamp);
+        CsvPutLiteral(csv, ", ");
+        CsvPutDouble(csv, datas->temperature);
+        CsvPutChar(csv, '\n');
+    }
+    if (WantsRecords(sink))
+    {
+        SensorEvent event = {.stream = StreamTemperature, .timeStamp = (unsigned int)datas->timeStamp,
+                             .temperature = *datas};
+        SinkRecord(sink, &event);
+    }
+    StatsSwitch(left);
+}
+
+void SinkPressure(SensorSink* sink, const PressureData* datas)
+{
+    StatsStage left = StatsSwitch(StatsFormat);
+    CsvWriter* csv = &sink->csv;
+    if (csv->file != NULL)
+    {
+        // "PRESSURE, %ld, %lf\n"
+        CsvPutLiteral(csv, "PRESSURE, ");
+        CsvPutInt(csv, (long)(unsigned long)datas->timeStamp);
+        CsvPutLiteral(csv, ", ");
+        CsvPutDouble(csv, datas->pressure);
+        CsvPutChar(csv, '\n');
+    }
+    if (WantsRecords(sink))
+    {
+        SensorEvent event = {.stream = StreamPressure, .timeStamp = (unsigned int)datas->timeStamp,
+                             .pressure = *datas};
+        SinkRecord(sink, &event);
+    }
+    StatsSwitch(left);
+}
+
+void SinkLight(SensorSink* sink, const LightData* datas)
+{
+    StatsStage left = StatsSwitch(StatsFormat);
+    CsvWriter* csv = &sink->csv;
+    if (csv->file != NULL)
+    {
+        // "LIGHT, %ld, %d,%d\n"
+        CsvPutLiteral(csv, "LIGHT, ");
+        CsvPutInt(csv, (long)(unsigned long)datas->timeStamp);
+        CsvPutLiteral(csv, ", ");
+        CsvPutInt(csv, datas->ch0);
+        CsvPutChar(csv, ',');
+        CsvPutInt(csv, datas->ch1);
+        CsvPutChar(csv, '\n');
+    }
+    if (WantsRecords(sink))
+    {
+        SensorEvent event = {.stream = StreamLight, .timeStamp = (unsigned int)datas->timeStamp, .light = *datas};
+        SinkRecord(sink, &event);
+    }
+    StatsSwitch(left);
+}
+
+void SinkGPS(SensorSink* sink, const GPSDatas* gpsDatas)
+{
+    StatsStage left = StatsSwitch(StatsFormat);
+    CsvWriter* csv = &sink->csv;
+    if (csv->file != NULL)
+    {
+        // "GPS, %04d/%02d/%02d %02d:%02d:%02d "
+        const DateTime* date = &gpsDatas->dateOfFix;
+        CsvPutLiteral(csv, "GPS, ");
+        CsvPutPadded(csv, date->year, 4);
+        CsvPutChar(csv, '/');
+        CsvPutPadded(csv, date->month, 2);
+        CsvPutChar(csv, '/');
+        CsvPutPadded(csv, date->day, 2);
+        CsvPutChar(csv, ' ');
+        CsvPutPadded(csv, date->hour, 2);
+        CsvPutChar(csv, ':');
+        CsvPutPadded(csv, date->minute, 2);
+        CsvPutChar(csv, ':');
+        CsvPutPadded(csv, date->second, 2);
+        // "fix:%d, fixQual:%d, Lat:%f %c, lon: %f %c,"
+        CsvPutLiteral(csv, " fix:");
+        CsvPutInt(csv, gpsDatas->fix);
+        CsvPutLiteral(csv, ", fixQual:");
+        CsvPutInt(csv, gpsDatas->fixQuality);
+        CsvPutLiteral(csv, ", Lat:");
+        CsvPutDouble(csv, gpsDatas->latitude);
+        CsvPutChar(csv, ' ');
+        CsvPutChar(csv, gpsDatas->latitudeDirection);
+        CsvPutLiteral(csv, ", lon: ");
+        CsvPutDouble(csv, gpsDatas->longitude);
+        CsvPutChar(csv, ' ');
+        CsvPutChar(csv, gpsDatas->longitudeDirection);
+        // "speed:%f, ang:%f, alt:%f, sat:%d\n"
+        CsvPutLiteral(csv, ",speed:");
+        CsvPutDouble(csv, gpsDatas->speed);
+        CsvPutLiteral(csv, ", ang:");
+        CsvPutDouble(csv, gpsDatas->angle);
+        CsvPutLiteral(csv, ", alt:");
+        CsvPutDouble(csv, gpsDatas->altitude);
+        CsvPutLiteral(csv, ", sat:");
+        CsvPutInt(csv, gpsDatas->satellites);
+        CsvPutChar(csv, '\n');
+    }
+    // the script only keeps the rows with a fix, the cells keep the text
+    // between the commas of the .csv line, leading spaces included
+    CsvWriter* table = &sink->gps;
+    if (table->file != NULL && gpsDatas->fix)
+    {
+        const DateTime* date = &gpsDatas->dateOfFix;
+        if (sink->nbGPSRows++ == 0)
+            CsvPutLiteral(table, "Date,Heure,Fix,Fix Qual,Lat,Lon,Speed,Angle,Alt,Sat\n");
+        // the firmware year has 2 digits, the script prefixes it with "20"
+        CsvPutLiteral(table, "20");
+        CsvPutPadded(table, date->year, 2);
+        CsvPutChar(table, '/');
+        CsvPutPadded(table, date->month, 2);
+        CsvPutChar(table, '/');
+        CsvPutPadded(table, date->day, 2);
+        CsvPutChar(table, ',');
+        CsvPutPadded(table, date->hour, 2);
+        CsvPutChar(table, ':');
+        CsvPutPadded(table, date->minute, 2);
+        CsvPutChar(table, ':');
+        CsvPutPadded(table, date->second, 2);
+        CsvPutLiteral(table, ",fix:1, fixQual:");
+        CsvPutInt(table, gpsDatas->fixQuality);
+        CsvPutLiteral(table, ", Lat:");
+        CsvPutDouble(table, gpsDatas->latitude);
+        CsvPutChar(table, ' ');
+        CsvPutChar(table, gpsDatas->latitudeDirection);
+        CsvPutLiteral(table, ", lon: ");
+        CsvPutDouble(table, gpsDatas->longitude);
+        CsvPutChar(table, ' ');
+        CsvPutChar(table, gpsDatas->longitudeDirection);
+        CsvPutLiteral(table, ",speed:");
+        CsvPutDouble(table, gpsDatas->speed);
+        CsvPutLiteral(table, ", ang:");
+        CsvPutDouble(table, gpsDatas->angle);
+        CsvPutLiteral(table, ", alt:");
+        CsvPutDouble(table, gpsDatas->altitude);
+        CsvPutLiteral(table, ", sat:");
+        CsvPutInt(table, gpsDatas->satellites);
+        CsvPutChar(table, '\n');
+    }
+    if (sink->timeMap != NULL)
+        TimeMapGPS(sink->timeMap, gpsDatas, sink->packetTimeNS);
+    if (WantsRecords(sink))
+    {
+        SensorEvent event = {.stream = StreamGPS, .gps = *gpsDatas};
+        SinkRecord(sink, &event);
+    }
+    StatsSwitch(left);
+}
+
+void SinkPPS(SensorSink* sink, unsigned long long timeStampNS)
+{
+    StatsStage left = StatsSwitch(StatsFormat);
+    CsvWriter* csv = &sink->csv;
+    if (csv->file != NULL)
+    {
+        CsvPutLiteral(csv, "PPS:");
+        CsvPutUInt(csv, timeStampNS);
+        CsvPutChar(csv, '\n');
+    }
+    CsvWriter* table = &sink->pps;
+    if (table->file != NULL)
+    {
+        if (sink->nbPPSRows++ == 0)
+            CsvPutLiteral(table, "Timestamp\n");
+        CsvPutUInt(table, timeStampNS);
+        CsvPutChar(table, '\n');
+    }
+    if (sink->timeMap != NULL)
+        TimeMapPPS(sink->timeMap, timeStampNS);
+    if (WantsRecords(sink))
+    {
+        SensorEvent event = {.stream = StreamPPS, .timeStampNS = timeStampNS};
+        SinkRecord(sink, &event);
+    }
+    StatsSwitch(left);
+}
+
+void SinkMPU(SensorSink* sink, int timeStamp, const short values[9])
+{
+    StatsStage left = StatsSwitch(StatsFormat);
+    CsvWriter* csv = &sink->csv;
+    if (csv->file != NULL)
+    {
+        // "%d," then 9 x "%hd,", the last one ending the line
+        CsvPutInt(csv, timeStamp);
+        for (int i = 0; i < 9; i++)
+        {
+            CsvPutChar(csv, ',');
+            CsvPutInt(csv, values[i]);
+        }
+        CsvPutChar(csv, '\n');
+    }
+    if (WantsRecords(sink))
+    {
+        SensorEvent event = {.stream = StreamMPU, .timeStamp = (unsigned int)timeStamp};
+        memcpy(event.mpu, values, sizeof(event.mpu));
+        SinkRecord(sink, &event);
+    }
+    StatsSwitch(left);
+}
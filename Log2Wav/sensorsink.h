@@ -0,0 +1,113 @@
+#ifndef SENSORSINK_H
+#define SENSORSINK_H
+#include <stdbool.h>
+#include <stdio.h>
+#include "MsgProcessor.h"
+#include "npywriter.h"
+#include "csvwriter.h"
+#include "timemap.h"
+
+// Destination of the decoded sensors data : the legacy mixed text .csv and/or
+// one typed .npy file per sensor stream (<prefix>_accel.npy, ...).
+// The .npy files are created on the first record of their stream.
+// The PPS and GPS tables (<name>_pps.csv, <name>_gps.csv) have the columns
+// and the cell text of the tables pps_gps_extraction.py builds from the .csv.
+
+typedef enum SensorStream_e
+{
+    StreamPacket = 0,       // end of packet timestamps (ns), '<u8'
+    StreamAccel,
+    StreamGyro,
+    StreamMag,
+    StreamTemperature,
+    StreamPressure,
+    StreamLight,
+    StreamGPS,
+    StreamPPS,              // PPS timestamps (ns), '<u8'
+    StreamMPU,              // v1 files
+    SENSOR_STREAM_COUNT
+}SensorStream;
+
+// Typed event, for the programs which process the sensors data in memory
+// instead of reading the text outputs back
+typedef struct SensorEvent_s
+{
+    SensorStream stream;
+    long block;                         // block of the .log whose additional data held the message
+    unsigned long long packetTimeNS;    // end of packet time of that block, 0 before firmware 2
+    unsigned int timeStamp;             // raw sensor timestamp (us) as found in the packet, 0 for GPS
+    union
+    {
+        SensorXYZData xyz;              // StreamAccel, StreamGyro, StreamMag
+        TemperatureData temperature;
+        PressureData pressure;
+        LightData light;
+        GPSDatas gps;
+        unsigned long long timeStampNS; // StreamPacket, StreamPPS
+        short mpu[9];                   // StreamMPU
+    };
+}SensorEvent;
+
+// Name of a stream (suffix of its .npy file) and NumPy dtype of its .npy records
+const char* SensorStreamName(SensorStream stream);
+const char* SensorStreamDescr(SensorStream stream);
+size_t SensorStreamRecordSize(SensorStream stream);
+#define SENSOR_RECORD_MAX_SIZE 53
+// Packs the .npy record of an event (little-endian, no padding), returns its size
+size_t PackSensorRecord(const SensorEvent* event, unsigned char* record);
+
+// Receives count events, in the order of the file. events is only valid during the call.
+typedef void (*SensorEventHandler)(const SensorEvent* events, int count, void* context);
+
+typedef struct SensorSink_s
+{
+    CsvWriter csv;                          // csv.file NULL : no text output
+    const char* npyPrefix;                  // NULL : no .npy output
+    NpyWriter npy[SENSOR_STREAM_COUNT];
+    CsvWriter pps;                          // pps.file NULL : no PPS table
+    CsvWriter gps;                          // gps.file NULL : no GPS table
+    long long nbPPSRows;
+    long long nbGPSRows;
+    SensorEventHandler handler;             // NULL : no typed events
+    void* handlerContext;
+    unsigned int streamMask;                // 1 << stream of the events passed to handler
+    SensorEvent* events;                    // batch being filled
+    int batchSize;
+    int nbEvents;
+    long block;                             // block being decoded
+    unsigned long long packetTimeNS;        // its end of packet time
+    TimeMapBuilder* timeMap;                // NULL : no time map
+}SensorSink;
+
+// csv text is formatted by a CsvWriter, write to the FILE directly only before Init or after Close
+void SensorSinkInit(SensorSink* sink, FILE* csv, const char* npyPrefix);
+// Also fill the PPS and GPS tables, the FILEs stay owned by the caller
+void SensorSinkTimeTables(SensorSink* sink, FILE* pps, FILE* gps);
+// Also feed the packet times, PPS and GPS fixes to the clock models of builder
+void SensorSinkTimeMap(SensorSink* sink, TimeMapBuilder* builder);
+// Also pass the events of the streams of streamMask (1 << StreamAccel | ...,
+// SENSOR_EVENTS_ALL) to handler, by batches of up to batchSize events (1 :
+// each event as soon as it is decoded). A batch is passed once full and on
+// SensorSinkFlush / SensorSinkClose.
+#define SENSOR_EVENTS_ALL ((1u << SENSOR_STREAM_COUNT) - 1)
+void SensorSinkSubscribe(SensorSink* sink, unsigned int streamMask, int batchSize, SensorEventHandler handler, void* context);
+bool SensorSinkActive(const SensorSink* sink);
+// Writes out everything received so far, every output is then a valid file (follow mode)
+void SensorSinkFlush(SensorSink* sink);
+// Flushes the csv files and closes the .npy files (the csv FILE stays owned by the caller),
+// returns the number of bytes written to the .npy files
+long long SensorSinkClose(SensorSink* sink);
+
+// The following records come from the additional data of block
+void SinkBlock(SensorSink* sink, long block);
+// timeStamp is the raw sensor timestamp as found in the packet
+void SinkPacketTimeStamp(SensorSink* sink, unsigned long long timeStampNS);
+void SinkXYZ(SensorSink* sink, SensorType type, unsigned int timeStamp, const SensorXYZData* datas);
+void SinkTemperature(SensorSink* sink, const TemperatureData* datas);
+void SinkPressure(SensorSink* sink, const PressureData* datas);
+void SinkLight(SensorSink* sink, const LightData* datas);
+void SinkGPS(SensorSink* sink, const GPSDatas* datas);
+void SinkPPS(SensorSink* sink, unsigned long long timeStampNS);
+void SinkMPU(SensorSink* sink, int timeStamp, const short values[9]);
+
+#endif
@@ -0,0 +1,204 @@
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "stats.h"
+#include "MsgProcessor.h"
+
+_Thread_local StatsClock statsClock;
+
+static const char* stageNames[STATS_STAGE_COUNT] = {
+    [StatsRead] = "read",
+    [StatsDecode] = "decode",
+    [StatsNormalize] = "normalize",
+    [StatsFormat] = "format",
+    [StatsWrite] = "write",
+};
+
+static const char* sensorNames[STATS_SENSOR_COUNT] = {
+    [StatsAccel] = "accel",
+    [StatsGyro] = "gyro",
+    [StatsMag] = "mag",
+    [StatsTemperature] = "temperature",
+    [StatsPressure] = "pressure",
+    [StatsLight] = "light",
+    [StatsIMU] = "imu",
+    [StatsGPS] = "gps",
+    [StatsPPS] = "pps",
+    [StatsOther] = "other",
+};
+
+const char* StatsStageName(StatsStage stage)
+{
+    return stageNames[stage];
+}
+
+const char* StatsSensorName(StatsSensor sensor)
+{
+    return sensorNames[sensor];
+}
+
+StatsSensor StatsSensorOf(short function, const unsigned char* payload, int payloadLength)
+{
+    switch (function)
+    {
+        case (short)HS_DATA_PACKET_FULL_TIMESTAMP:
+            return StatsIMU;
+        case (short)HS_DATA_PACKET_FULL_TIMESTAMP_V2:
+            if (payloadLength < 1)
+                return StatsOther;
+            switch ((SensorType)payload[0])
+            {
+                case Accel: return StatsAccel;
+                case Gyro: return StatsGyro;
+                case Mag: return StatsMag;
+                case Temperature: return StatsTemperature;
+                case Pressure: return StatsPressure;
+                case Light: return StatsLight;
+                case IMU: return StatsIMU;
+                default: return StatsOther;
+            }
+        case (short)GPS_DATA_PACKET:
+            return StatsGPS;
+        case (short)GPS_PPS_PACKET:
+            return StatsPPS;
+        default:
+            return StatsOther;
+    }
+}
+
+double StatsNow(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+void StatsStartClock(StatsStage stage)
+{
+    memset(&statsClock, 0, sizeof(StatsClock));
+    statsClock.running = true;
+    statsClock.stage = stage;
+    statsClock.since = StatsNow();
+}
+
+StatsStage StatsSwitchTimed(StatsStage stage)
+{
+    double now = StatsNow();
+    StatsStage left = statsClock.stage;
+    statsClock.seconds[left] += now - statsClock.since;
+    statsClock.stage = stage;
+    statsClock.since = now;
+    return left;
+}
+
+void StatsStopClock(ConvertStats* stats)
+{
+    if (!statsClock.running)
+        return;
+    StatsSwitchTimed(statsClock.stage);
+    for (int s = 0; s < STATS_STAGE_COUNT; s++)
+        stats->stages[s].seconds += statsClock.seconds[s];
+    statsClock.running = false;
+}
+
+void StatsAdd(ConvertStats* total, const ConvertStats* stats)
+{
+    total->nbFiles += stats->nbFiles;
+    total->nbBlocks += stats->nbBlocks;
+    total->bytesRead += stats->bytesRead;
+    total->bytesWritten += stats->bytesWritten;
+    total->seconds += stats->seconds;
+    total->messages += stats->messages;
+    total->checksumErrors += stats->checksumErrors;
+    total->invalidLengths += stats->invalidLengths;
+    for (int s = 0; s < STATS_STAGE_COUNT; s++)
+    {
+        total->stages[s].seconds += stats->stages[s].seconds;
+        total->stages[s].bytes += stats->stages[s].bytes;
+    }
+    for (int i = 0; i < STATS_SENSOR_COUNT; i++)
+    {
+        SensorStats* t = &total->sensors[i];
+        const SensorStats* s = &stats->sensors[i];
+        t->messages += s->messages;
+        t->samples += s->samples;
+        t->checksumErrors += s->checksumErrors;
+        t->nonMonotonic += s->nonMonotonic;
+        t->rollovers += s->rollovers;
+    }
+}
+
+static bool SensorSeen(const SensorStats* s)
+{
+    return s->messages > 0 || s->checksumErrors > 0;
+}
+
+void PrintStats(FILE* out, const ConvertStats* stats)
+{
+    fprintf(out, "%d file%s, %lld blocks, read %.1f MB, wrote %.1f MB in %.3f s\n", stats->nbFiles,
+            stats->nbFiles > 1 ? "s" : "", stats->nbBlocks, stats->bytesRead / 1e6, stats->bytesWritten / 1e6,
+            stats->seconds);
+    fprintf(out, "  %-12s %10s %10s %10s\n", "stage", "time (s)", "MB", "MB/s");
+    for (int s = 0; s < STATS_STAGE_COUNT; s++)
+    {
+        const StageStats* stage = &stats->stages[s];
+        fprintf(out, "  %-12s %10.3f %10.1f", stageNames[s], stage->seconds, stage->bytes / 1e6);
+        if (stage->seconds > 0)
+            fprintf(out, " %10.1f\n", stage->bytes / 1e6 / stage->seconds);
+        else
+            fprintf(out, " %10s\n", "-");
+    }
+    fprintf(out, "  %lld messages, %lld checksum errors, %lld invalid lengths\n", stats->messages,
+            stats->checksumErrors, stats->invalidLengths);
+    bool header = false;
+    for (int i = 0; i < STATS_SENSOR_COUNT; i++)
+    {
+        const SensorStats* s = &stats->sensors[i];
+        if (!SensorSeen(s))
+            continue;
+        if (!header)
+        {
+            fprintf(out, "  %-12s %10s %10s %10s %10s %10s\n", "sensor", "messages", "samples", "checksum", "non mono.",
+                    "rollovers");
+            header = true;
+        }
+        fprintf(out, "  %-12s %10lld %10lld %10lld %10lld %10lld\n", sensorNames[i], s->messages, s->samples,
+                s->checksumErrors, s->nonMonotonic, s->rollovers);
+    }
+}
+
+bool WriteStatsJson(FILE* out, const ConvertStats* stats)
+{
+    fprintf(out, "{\n  \"files\": %d,\n  \"blocks\": %lld,\n  \"bytes_read\": %lld,\n  \"bytes_written\": %lld,\n"
+                 "  \"seconds\": %.6f,\n  \"messages\": %lld,\n  \"checksum_errors\": %lld,\n  \"invalid_lengths\": %lld,\n",
+            stats->nbFiles, stats->nbBlocks, stats->bytesRead, stats->bytesWritten, stats->seconds, stats->messages,
+            stats->checksumErrors, stats->invalidLengths);
+    fprintf(out, "  \"stages\": {");
+    for (int s = 0; s < STATS_STAGE_COUNT; s++)
+        fprintf(out, "%s\n    \"%s\": {\"seconds\": %.6f, \"bytes\": %lld}", s > 0 ? "," : "", stageNames[s],
+                stats->stages[s].seconds, stats->stages[s].bytes);
+    fprintf(out, "\n  },\n  \"sensors\": {");
+    bool first = true;
+    for (int i = 0; i < STATS_SENSOR_COUNT; i++)
+    {
+        const SensorStats* s = &stats->sensors[i];
+        if (!SensorSeen(s))
+            continue;
+        fprintf(out, "%s\n    \"%s\": {\"messages\": %lld, \"samples\": %lld, \"checksum_errors\": %lld, "
+                     "\"non_monotonic\": %lld, \"rollovers\": %lld}",
+                first ? "" : ",", sensorNames[i], s->messages, s->samples, s->checksumErrors, s->nonMonotonic,
+                s->rollovers);
+        first = false;
+    }
+    fprintf(out, "%s}\n}\n", first ? "" : "\n  ");
+    return !ferror(out);
+}
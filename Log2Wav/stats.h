@@ -0,0 +1,104 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdio.h>
+#include <stdbool.h>
+
+// Statistics of a conversion (--stats) : time and bytes per stage, and the
+// quality of the sensors data (rejected frames, timestamps going back).
+//
+// The counters of the decoder and of the message processor are always kept,
+// a few increments per message. The stage timers only run on the threads
+// which called StatsStartClock : the time between two StatsSwitch calls is
+// charged to the stage left, so that nested stages are timed exclusively
+// (the normalization of a message is not counted in its decoding).
+
+typedef enum StatsStage_e
+{
+    StatsRead = 0,          // blocks fetched from the .log (stdin reads, page cache hints)
+    StatsDecode,            // framing and checksums of the additional data
+    StatsNormalize,         // payloads to physical units (ProcessDecodedMessage)
+    StatsFormat,            // csv text, npy records, audio interleaving, conversion, decimation, FLAC
+    StatsWrite,             // writes to the output files
+    STATS_STAGE_COUNT
+}StatsStage;
+
+typedef enum StatsSensor_e
+{
+    StatsAccel = 0,
+    StatsGyro,
+    StatsMag,
+    StatsTemperature,
+    StatsPressure,
+    StatsLight,
+    StatsIMU,               // HS_DATA_PACKET_FULL_TIMESTAMP and the MPU frames of v1 files
+    StatsGPS,
+    StatsPPS,
+    StatsOther,             // unknown functions or sensor types
+    STATS_SENSOR_COUNT
+}StatsSensor;
+
+typedef struct SensorStats_s
+{
+    long long messages;         // frames with a valid checksum
+    long long samples;          // samples written
+    long long checksumErrors;   // frames rejected by their checksum, under the sensor they announce
+    long long nonMonotonic;     // samples dropped because their timestamp did not increase
+    long long rollovers;        // last timestamp reset after reaching 500000000
+}SensorStats;
+
+typedef struct StageStats_s
+{
+    double seconds;             // summed over the threads doing the stage
+    long long bytes;            // read, decode, normalize, format : input bytes, write : output bytes
+}StageStats;
+
+typedef struct ConvertStats_s
+{
+    int nbFiles;
+    long long nbBlocks;
+    long long bytesRead;
+    long long bytesWritten;
+    double seconds;             // wall clock
+    long long messages;         // frames with a valid checksum
+    long long checksumErrors;
+    long long invalidLengths;   // frames announcing a payload too long, skipped
+    StageStats stages[STATS_STAGE_COUNT];
+    SensorStats sensors[STATS_SENSOR_COUNT];
+}ConvertStats;
+
+const char* StatsStageName(StatsStage stage);
+const char* StatsSensorName(StatsSensor sensor);
+// Sensor a message is about, from its function and the first byte of its payload
+StatsSensor StatsSensorOf(short function, const unsigned char* payload, int payloadLength);
+
+// Monotonic clock, in seconds
+double StatsNow(void);
+
+// Stage timers of the calling thread
+typedef struct StatsClock_s
+{
+    bool running;
+    StatsStage stage;
+    double since;
+    double seconds[STATS_STAGE_COUNT];
+}StatsClock;
+extern _Thread_local StatsClock statsClock;
+
+void StatsStartClock(StatsStage stage);
+// Stops the timers of the thread and adds their times to stats
+void StatsStopClock(ConvertStats* stats);
+StatsStage StatsSwitchTimed(StatsStage stage);
+
+// Enters stage, returns the stage left (to switch back to)
+static inline StatsStage StatsSwitch(StatsStage stage)
+{
+    return statsClock.running ? StatsSwitchTimed(stage) : stage;
+}
+
+// total += stats
+void StatsAdd(ConvertStats* total, const ConvertStats* stats);
+void PrintStats(FILE* out, const ConvertStats* stats);
+// Returns false on a write error
+bool WriteStatsJson(FILE* out, const ConvertStats* stats);
+
+#endif
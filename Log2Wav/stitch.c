@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "logreader.h"
+#include "blockindex.h"
+#include "stitch.h"
+
+// RIFF header with room for the RF64 ds64 chunk (EBU Tech 3306) : a JUNK
+// chunk of the size of ds64 is written, and turned into ds64 only if the
+// file exceeds 4 GB, so that a smaller file stays a plain wav.
+#define STITCH_JUNK_OFFSET 12
+#define STITCH_DS64_SIZE 28
+#define STITCH_FMT_OFFSET (STITCH_JUNK_OFFSET + 8 + STITCH_DS64_SIZE)
+#define STITCH_BEXT_OFFSET (STITCH_FMT_OFFSET + 8 + 16)
+#define STITCH_BEXT_SIZE 602
+#define STITCH_DATA_OFFSET (STITCH_BEXT_OFFSET + 8 + STITCH_BEXT_SIZE)
+_Static_assert(STITCH_DATA_OFFSET + 8 == STITCH_HEADER_SIZE, "STITCH_HEADER_SIZE of stitch.h");
+
+// What the stitching needs to know of a fragment before converting it
+typedef struct Fragment_s
+{
+    HighBlueHeader hdr;
+    long nbBlocks;
+    long samplesPerBlock;
+    unsigned long long firstEndNS;  // end of packet time of the first and last blocks, 0 if unknown
+    unsigned long long lastEndNS;
+}Fragment;
+
+static void PutLE(unsigned char* p, unsigned long long value, int size)
+{
+    for (int i = 0; i < size; i++)
+        p[i] = (unsigned char)(value >> (8 * i));
+}
+
+// Only the header and the additional data of two blocks are read
+static int ProbeFragment(const char* path, Fragment* fragment)
+{
+    LogReader reader;
+    int status = OpenLogReader(&reader, path, 0);
+    if (status != 0)
+        return status;
+    fragment->hdr = reader.hdr;
+    fragment->nbBlocks = reader.nbBlocks;
+    int frameSize = reader.hdr.numberOfChan * (reader.hdr.resolutionBits / 8);
+    fragment->samplesPerBlock = frameSize > 0 ? reader.hdr.dmaBlockSize / frameSize : 0;
+    fragment->firstEndNS = 0;
+    fragment->lastEndNS = 0;
+    if (reader.nbBlocks > 0)
+    {
+        fragment->firstEndNS = BlockEndTimeNS(LogReaderAdditionnalData(&reader, 0));
+        fragment->lastEndNS = BlockEndTimeNS(LogReaderAdditionnalData(&reader, reader.nbBlocks - 1));
+    }
+    CloseLogReader(&reader);
+    return 0;
+}
+
+static bool SameFormat(const HighBlueHeader* a, const HighBlueHeader* b)
+{
+    return a->numberOfChan == b->numberOfChan && a->resolutionBits == b->resolutionBits
+        && a->samplingFrequency == b->samplingFrequency;
+}
+
+void FormatStitchHeader(unsigned char* out, const SampleFormatSpec* format, int sampleRate, int nbChan,
+                        const char* description, long long originNS, unsigned long long dataSize, bool* rf64)
+{
+    int resolutionBytes = SampleFormatBytes(format);
+    memset(out, 0, STITCH_HEADER_SIZE);
+    unsigned long long riffSize = STITCH_HEADER_SIZE - 8 + dataSize + (dataSize & 1);
+    *rf64 = dataSize != STITCH_UNKNOWN_SIZE && riffSize > STITCH_UNKNOWN_SIZE;
+    memcpy(out, *rf64 ? "RF64" : "RIFF", 4);
+    PutLE(out + 4, *rf64 || dataSize == STITCH_UNKNOWN_SIZE ? STITCH_UNKNOWN_SIZE : riffSize, 4);
+    memcpy(out + 8, "WAVE", 4);
+
+    unsigned char* ds64 = out + STITCH_JUNK_OFFSET;
+    memcpy(ds64, *rf64 ? "ds64" : "JUNK", 4);
+    PutLE(ds64 + 4, STITCH_DS64_SIZE, 4);
+    if (*rf64)
+    {
+        PutLE(ds64 + 8, riffSize, 8);
+        PutLE(ds64 + 16, dataSize, 8);
+        PutLE(ds64 + 24, dataSize / (nbChan * resolutionBytes), 8);     // sample count
+        // no table of other large chunks
+    }
+
+    unsigned char* fmt = out + STITCH_FMT_OFFSET;
+    memcpy(fmt, "fmt ", 4);
+    PutLE(fmt + 4, 16, 4);
+    PutLE(fmt + 8, format->format == SampleFormatFloat32 ? 3 : 1, 2);  // IEEE float : PCM
+    PutLE(fmt + 10, nbChan, 2);
+    PutLE(fmt + 12, sampleRate, 4);
+    PutLE(fmt + 16, (unsigned long long)sampleRate * nbChan * resolutionBytes, 4);
+    PutLE(fmt + 20, nbChan * resolutionBytes, 2);
+    PutLE(fmt + 22, resolutionBytes * 8, 2);
+
+    // Broadcast Wave extension (EBU Tech 3285), version 1 without UMID nor loudness
+    unsigned char* bext = out + STITCH_BEXT_OFFSET;
+    memcpy(bext, "bext", 4);
+    PutLE(bext + 4, STITCH_BEXT_SIZE, 4);
+    snprintf((char*)bext + 8, 256, "%s", description);
+    snprintf((char*)bext + 8 + 256, 32, "log2wav");
+    if (originNS >= 0)
+    {
+        // OriginationDate, OriginationTime and TimeReference (samples since midnight)
+        time_t seconds = (time_t)(originNS / 1000000000LL);
+        char date[20];
+        strftime(date, sizeof(date), "%Y-%m-%d%H:%M:%S", gmtime(&seconds));
+        memcpy(bext + 8 + 320, date, 18);
+        long long sinceMidnight = originNS % (86400 * 1000000000LL);
+        unsigned long long timeReference = (unsigned long long)((double)sinceMidnight * sampleRate / 1e9 + 0.5);
+        PutLE(bext + 8 + 338, timeReference, 8);
+    }
+    PutLE(bext + 8 + 346, 1, 2);                                        // version
+
+    unsigned char* data = out + STITCH_DATA_OFFSET;
+    memcpy(data, "data", 4);
+    PutLE(data + 4, *rf64 ? STITCH_UNKNOWN_SIZE : dataSize, 4);
+}
+
+bool PatchStitchHeader(FILE* wavfile, const unsigned char* header)
+{
+    if (fflush(wavfile) != 0 || fseek(wavfile, 0, SEEK_SET) != 0)
+        return false;
+    bool ok = fwrite(header, 1, STITCH_HEADER_SIZE, wavfile) == STITCH_HEADER_SIZE;
+    ok &= fseek(wavfile, 0, SEEK_END) == 0;
+    return ok;
+}
+
+static void WriteGap(FILE* gaps, const char* path, long long sample, int sampleRate, int samplingFrequency,
+                     const Fragment* previous, const Fragment* fragment)
+{
+    fprintf(gaps, "%lld,%.6f,%s,", sample, (double)sample / sampleRate, path);
+    if (previous->lastEndNS != 0 && fragment->firstEndNS != 0)
+    {
+        // the first block of the fragment ends one block after its start
+        long long blockNS = (long long)(fragment->samplesPerBlock * 1e9 / samplingFrequency);
+        long long gapNS = (long long)(fragment->firstEndNS - previous->lastEndNS) - blockNS;
+        fprintf(gaps, "%llu,%llu,%lld\n", previous->lastEndNS, fragment->firstEndNS - blockNS, gapNS);
+    }
+    else
+    {
+        fprintf(gaps, ",,\n");
+    }
+}
+
+// A continuation starts less than half a block after the end of the previous fragment
+static bool IsContinuation(const Fragment* previous, const Fragment* fragment, int samplingFrequency)
+{
+    if (previous->lastEndNS == 0 || fragment->firstEndNS == 0)
+        return false;
+    double blockNS = fragment->samplesPerBlock * 1e9 / samplingFrequency;
+    double gapNS = (double)(long long)(fragment->firstEndNS - previous->lastEndNS) - blockNS;
+    return gapNS < blockNS / 2 && gapNS > -blockNS / 2;
+}
+
+ConvertStatus StitchLogFiles(char* const* logPaths, int nbFiles, const char* wavPath, FILE* wavStream,
+                             const StitchOptions* options, StitchResult* result)
+{
+    memset(result, 0, sizeof(StitchResult));
+    int verbose = options->convert.verbose;
+
+    // every fragment is checked before anything is written
+    Fragment* fragments = calloc(nbFiles > 0 ? nbFiles : 1, sizeof(Fragment));
+    bool* skipped = calloc(nbFiles > 0 ? nbFiles : 1, sizeof(bool));
+    int first = -1;
+    for (int i = 0; i < nbFiles; i++)
+    {
+        int status = ProbeFragment(logPaths[i], &fragments[i]);
+        if (status == -2 || (status == 0 && fragments[i].nbBlocks == 0))
+        {
+            skipped[i] = true;
+            result->nbSkipped++;
+            continue;
+        }
+        if (status != 0)
+        {
+            snprintf(result->error, sizeof(result->error), "%s : %s", logPaths[i],
+                     status == -3 ? "invalid header" : "cannot be opened");
+            free(fragments);
+            free(skipped);
+            return ConvertError;
+        }
+        if (first < 0)
+        {
+            first = i;
+        }
+        else if (!SameFormat(&fragments[first].hdr, &fragments[i].hdr))
+        {
+            snprintf(result->error, sizeof(result->error), "%s : not the format of %s", logPaths[i], logPaths[first]);
+            free(fragments);
+            free(skipped);
+            return ConvertError;
+        }
+    }
+    if (first < 0)
+    {
+        snprintf(result->error, sizeof(result->error), "no block to stitch");
+        free(fragments);
+        free(skipped);
+        return ConvertSkippedEmpty;
+    }
+    const HighBlueHeader* hdr = &fragments[first].hdr;
+    if (hdr->resolutionBits != 16 && hdr->resolutionBits != 24 && hdr->resolutionBits != 32)
+    {
+        snprintf(result->error, sizeof(result->error), "resolution %d not supported yet sorry", hdr->resolutionBits);
+        free(fragments);
+        free(skipped);
+        return ConvertError;
+    }
+    int nbChan = options->convert.nbChannels > 0 ? options->convert.nbChannels : hdr->numberOfChan;
+    SampleFormatSpec format = {.format = options->convert.sampleFormat, .resolutionBytes = hdr->resolutionBits / 8};
+    int frameSize = nbChan * SampleFormatBytes(&format);
+    // the fragments may be decimated on the way
+    int sampleRate = options->convert.decimateRate > 0 ? options->convert.decimateRate : hdr->samplingFrequency;
+
+    FILE* wavfile = wavStream != NULL ? wavStream : fopen(wavPath, "wb");
+    if (wavfile == NULL)
+    {
+        snprintf(result->error, sizeof(result->error), "Failed to open wav output file");
+        free(fragments);
+        free(skipped);
+        return ConvertError;
+    }
+    FILE* gaps = NULL;
+    if (options->gapsPath != NULL)
+    {
+        gaps = fopen(options->gapsPath, "w");
+        if (gaps == NULL)
+        {
+            snprintf(result->error, sizeof(result->error), "Failed to open gaps output file");
+            if (wavfile != wavStream)
+                fclose(wavfile);
+            free(fragments);
+            free(skipped);
+            return ConvertError;
+        }
+        fprintf(gaps, "Sample,Time (s),File,Previous end (ns),Start (ns),Gap (ns)\n");
+    }
+    unsigned char header[STITCH_HEADER_SIZE];
+    bool rf64;
+    int nbStitched = nbFiles - result->nbSkipped;
+    char description[64];
+    snprintf(description, sizeof(description), "QHB recording stitched from %d .log files", nbStitched);
+    FormatStitchHeader(header, &format, sampleRate, nbChan, description, -1, STITCH_UNKNOWN_SIZE, &rf64);
+    bool ok = fwrite(header, 1, STITCH_HEADER_SIZE, wavfile) == STITCH_HEADER_SIZE;
+
+    // each fragment is appended to the wav by the usual conversion, without header
+    ConvertOptions convert = options->convert;
+    convert.rawAudio = true;
+    convert.follow = false;
+    convert.audioThreads = 1;
+    memset(&convert.start, 0, sizeof(ConvertBound));
+    memset(&convert.end, 0, sizeof(ConvertBound));
+    ConvertOutputs outputs = {.wavPath = wavPath, .wavStream = wavfile};
+    unsigned long long dataSize = 0;
+    const Fragment* previous = NULL;
+    for (int i = 0; i < nbFiles && ok; i++)
+    {
+        if (skipped[i])
+            continue;
+        long long sample = (long long)(dataSize / frameSize);
+        if (previous != NULL && !IsContinuation(previous, &fragments[i], hdr->samplingFrequency))
+        {
+            result->nbGaps++;
+            if (gaps != NULL)
+                WriteGap(gaps, logPaths[i], sample, sampleRate, hdr->samplingFrequency, previous, &fragments[i]);
+            if (verbose)
+                printf("gap before %s (sample %lld)\n", logPaths[i], sample);
+        }
+        ConvertResult converted;
+        ConvertStatus status = ConvertLogFile(logPaths[i], &outputs, &convert, &converted);
+        if (status == ConvertError)
+        {
+            snprintf(result->error, sizeof(result->error), "%.100s : %.150s", logPaths[i], converted.error);
+            ok = false;
+            break;
+        }
+        dataSize += converted.bytesWritten;
+        result->bytesRead += converted.bytesRead;
+        result->nbFiles++;
+        previous = &fragments[i];
+    }
+    if (ok && (dataSize & 1))
+        ok = fputc(0, wavfile) != EOF;      // chunks are word aligned
+    if (ok)
+    {
+        FormatStitchHeader(header, &format, sampleRate, nbChan, description, -1, dataSize, &rf64);
+        if (PatchStitchHeader(wavfile, header))
+            result->rf64 = rf64;
+        else if (verbose)
+            printf("wav output not seekable, streaming sizes kept\n");
+    }
+    result->nbSamples = (long long)(dataSize / frameSize);
+    result->bytesWritten = STITCH_HEADER_SIZE + dataSize + (dataSize & 1);
+    if (wavfile == wavStream)
+        ok &= fflush(wavfile) == 0;
+    else
+        ok &= fclose(wavfile) == 0;
+    if (gaps != NULL)
+        fclose(gaps);
+    free(fragments);
+    free(skipped);
+    if (!ok && result->error[0] == '\0')
+        snprintf(result->error, sizeof(result->error), "Failed to write wav output file");
+    return ok ? ConvertOK : ConvertError;
+}
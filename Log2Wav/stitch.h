@@ -0,0 +1,57 @@
+#ifndef STITCH_H
+#define STITCH_H
+#include <stdio.h>
+#include <stdbool.h>
+#include "convert.h"
+
+// Session stitching : the fragments of one deployment (split by the recorder
+// at FILE_Size_Limit or by Record_Use_TimeInterval) are converted in a single
+// sequential pass into one wav, written as RF64 once it exceeds 4 GB.
+//
+// The packet timestamps of the last block of a fragment and of the first block
+// of the next one tell a back-to-back continuation from a real gap. Nothing is
+// inserted in the audio, the gaps are listed in a .csv :
+//   Sample,Time (s),File,Previous end (ns),Start (ns),Gap (ns)
+// where Sample is the first sample (per channel) of the fragment in the
+// stitched wav. Fragments without packet timestamps (firmware < 2) are listed
+// with empty times since their continuity cannot be checked.
+
+// Wav header of the stitched (and aligned, see align.h) outputs : RIFF, or
+// RF64 once dataSize exceeds 4 GB, with a Broadcast Wave bext chunk
+#define STITCH_HEADER_SIZE 690
+#define STITCH_UNKNOWN_SIZE 0xFFFFFFFFu
+// dataSize STITCH_UNKNOWN_SIZE : streaming header, the sizes are not known yet.
+// originNS >= 0 : UTC of the first sample (ns since 1970), written as the bext
+// origination date, time and time reference.
+void FormatStitchHeader(unsigned char* out, const SampleFormatSpec* format, int sampleRate, int nbChan,
+                        const char* description, long long originNS, unsigned long long dataSize, bool* rf64);
+// Sizes of the finished wav, left to the streaming values if it cannot be seeked
+bool PatchStitchHeader(FILE* wavfile, const unsigned char* header);
+
+typedef struct StitchOptions_s
+{
+    ConvertOptions convert;     // verbose, progress, channels and decimateRate (the filter restarts at
+                                // each fragment), the range bounds are ignored
+    const char* gapsPath;       // NULL : no gap list
+}StitchOptions;
+
+typedef struct StitchResult_s
+{
+    int nbFiles;                // fragments stitched
+    int nbSkipped;              // empty fragments
+    int nbGaps;                 // fragment boundaries which are not a continuation
+    long long nbSamples;        // per channel
+    long long bytesRead;
+    long long bytesWritten;
+    bool rf64;                  // the wav needed the RF64 sizes
+    char error[256];
+}StitchResult;
+
+// Stitches the fragments, in the given order, into wavPath or into wavStream
+// if not NULL (flushed, not closed). The fragments must share the channels,
+// resolution and sampling frequency of the first one.
+// A non seekable output keeps the streaming sizes 0xFFFFFFFF.
+ConvertStatus StitchLogFiles(char* const* logPaths, int nbFiles, const char* wavPath, FILE* wavStream,
+                             const StitchOptions* options, StitchResult* result);
+
+#endif
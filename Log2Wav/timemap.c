@@ -0,0 +1,479 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "timemap.h"
+
+#define TIMEMAP_MAGIC "QHBTMAP\0"
+#define TIMEMAP_VERSION 1
+#define TIMEMAP_HEADER_SIZE 96
+
+#define TRACK_STEP_RUN 3            // rejected observations in a row taken as a step of the clock
+#define TRACK_NOISE_POINTS 64       // window of the residual noise estimate
+#define PPS_ALPHA 0.1               // about 20 s of PPS
+#define PPS_GATE_NS 10000.0
+#define PPS_TOLERANCE 0.1           // of a second, between two PPS
+#define AUDIO_ALPHA 0.02            // about 100 blocks
+#define AUDIO_GATE_NS 100000.0
+
+static void PutLE(unsigned char* p, unsigned long long value, int size)
+{
+    for (int i = 0; i < size; i++)
+        p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static unsigned long long GetLE(const unsigned char* p, int size)
+{
+    unsigned long long value = 0;
+    for (int i = size - 1; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static void PutFloatLE(unsigned char* p, float value)
+{
+    unsigned int bits;
+    memcpy(&bits, &value, 4);
+    PutLE(p, bits, 4);
+}
+
+static float GetFloatLE(const unsigned char* p)
+{
+    unsigned int bits = (unsigned int)GetLE(p, 4);
+    float value;
+    memcpy(&value, &bits, 4);
+    return value;
+}
+
+////////////////////
+/// Clock models ///
+////////////////////
+
+static void ClockTrackInit(ClockTrack* track, double alpha, double rate, double gateFloor)
+{
+    memset(track, 0, sizeof(ClockTrack));
+    track->alpha = alpha;
+    track->beta = alpha * alpha / (2 - alpha);
+    track->rate = rate;
+    track->gateFloor = gateFloor;
+}
+
+static void ClockTrackRestart(ClockTrack* track, double x, double y)
+{
+    track->x = x;
+    track->y = y;
+    track->nbPoints = 1;
+    track->noise = 0;
+    track->rejectRun = 0;
+}
+
+// Returns true if (x, y) was accepted, (track->x, track->y) is then the
+// filtered point
+static bool ClockTrackUpdate(ClockTrack* track, double x, double y)
+{
+    if (track->nbPoints == 0)
+    {
+        ClockTrackRestart(track, x, y);
+        track->accepted++;
+        return true;
+    }
+    double dx = x - track->x;
+    if (dx <= 0)
+    {
+        track->rejected++;
+        return false;
+    }
+    double predicted = track->y + track->rate * dx;
+    double residual = y - predicted;
+    // the noise is known from the 4th point
+    if (track->nbPoints >= 3)
+    {
+        double gate = 4 * sqrt(track->noise);
+        if (fabs(residual) > (gate > track->gateFloor ? gate : track->gateFloor))
+        {
+            track->rejected++;
+            if (++track->rejectRun < TRACK_STEP_RUN)
+                return false;
+            track->steps++;
+            ClockTrackRestart(track, x, y);
+            return true;
+        }
+    }
+    track->rejectRun = 0;
+    // gains of the least squares line through the points so far, until they
+    // reach the steady ones
+    double n = (double)(track->nbPoints + 1);
+    double alpha = 2 * (2 * n - 1) / (n * (n + 1));
+    double beta = 6 / (n * (n + 1));
+    if (alpha < track->alpha)
+    {
+        alpha = track->alpha;
+        beta = track->beta;
+    }
+    // the first residuals are mostly the error of the initial rate
+    if (track->nbPoints >= 2)
+    {
+        long long window = track->nbPoints - 1 < TRACK_NOISE_POINTS ? track->nbPoints - 1 : TRACK_NOISE_POINTS;
+        track->noise += (residual * residual - track->noise) / (double)window;
+    }
+    track->x = x;
+    track->y = predicted + alpha * residual;
+    track->rate += beta * residual / dx;
+    track->nbPoints++;
+    track->accepted++;
+    return true;
+}
+
+/////////////
+/// Grids ///
+/////////////
+
+static void GridInit(TimeGrid* grid, double origin, double step)
+{
+    grid->origin = origin;
+    grid->step = step;
+    grid->count = 0;
+}
+
+static void GridAppend(TimeGrid* grid, double value)
+{
+    if (grid->count == grid->capacity)
+    {
+        grid->capacity = grid->capacity > 0 ? 2 * grid->capacity : 1024;
+        grid->values = realloc(grid->values, sizeof(long long) * grid->capacity);
+    }
+    grid->values[grid->count++] = llround(value);
+}
+
+static double GridKey(const TimeGrid* grid, long long i)
+{
+    return grid->origin + (double)i * grid->step;
+}
+
+// Entries up to keyB, on the line through (keyA, valueA) and (keyB, valueB)
+static void GridSegment(TimeGrid* grid, double keyA, double valueA, double keyB, double valueB)
+{
+    if (keyB <= keyA)
+        return;
+    double slope = (valueB - valueA) / (keyB - keyA);
+    while (GridKey(grid, grid->count) <= keyB)
+        GridAppend(grid, valueA + slope * (GridKey(grid, grid->count) - keyA));
+}
+
+// Last entries, up to the first one past key, with the last slope
+static void GridExtend(TimeGrid* grid, double key, double value, double slope)
+{
+    while (grid->count == 0 || GridKey(grid, grid->count - 1) <= key)
+        GridAppend(grid, value + slope * (GridKey(grid, grid->count) - key));
+}
+
+static bool GridValue(const TimeGrid* grid, double key, double* value)
+{
+    if (grid->count < 2)
+        return false;
+    double position = (key - grid->origin) / grid->step;
+    long long i = (long long)floor(position);
+    if (i < 0)
+        i = 0;
+    if (i > grid->count - 2)
+        i = grid->count - 2;
+    double fraction = position - (double)i;
+    *value = (double)grid->values[i] + fraction * (double)(grid->values[i + 1] - grid->values[i]);
+    return true;
+}
+
+// Key of a value of an increasing grid, the cell is found from the mean slope
+static bool GridInverse(const TimeGrid* grid, double value, double* key)
+{
+    if (grid->count < 2)
+        return false;
+    const long long* values = grid->values;
+    long long last = grid->count - 1;
+    double slope = (double)(values[last] - values[0]) / (double)last;
+    if (slope <= 0)
+        return false;
+    long long i = (long long)floor((value - (double)values[0]) / slope);
+    i = i < 0 ? 0 : i > last - 1 ? last - 1 : i;
+    while (i > 0 && (double)values[i] > value)
+        i--;
+    while (i < last - 1 && (double)values[i + 1] <= value)
+        i++;
+    double cell = (double)(values[i + 1] - values[i]);
+    if (cell <= 0)
+        return false;
+    *key = GridKey(grid, i) + (value - (double)values[i]) / cell * grid->step;
+    return true;
+}
+
+///////////////
+/// Builder ///
+///////////////
+
+void TimeMapBuilderInit(TimeMapBuilder* builder, int samplingFrequency, long samplesPerBlock)
+{
+    memset(builder, 0, sizeof(TimeMapBuilder));
+    builder->samplingFrequency = samplingFrequency;
+    builder->samplesPerBlock = samplesPerBlock;
+    ClockTrackInit(&builder->audio, AUDIO_ALPHA, 1e9 / samplingFrequency, AUDIO_GATE_NS);
+    ClockTrackInit(&builder->pps, PPS_ALPHA, 1e9, PPS_GATE_NS);
+    GridInit(&builder->map.audio, 0, samplingFrequency);
+    GridInit(&builder->map.time, 0, 1e9);
+}
+
+void TimeMapBlock(TimeMapBuilder* builder, long block, unsigned long long timeNS)
+{
+    if (timeNS == 0 || builder->samplesPerBlock <= 0)
+        return;
+    ClockTrack* track = &builder->audio;
+    bool first = track->accepted == 0;
+    double lastSample = track->x, lastTime = track->y;
+    // the packet time is the end of the last sample of the block
+    double endSample = (double)(block + 1) * builder->samplesPerBlock;
+    if (!ClockTrackUpdate(track, endSample, (double)timeNS))
+        return;
+    if (first)
+        builder->map.audio.origin = (double)block * builder->samplesPerBlock;
+    else
+        GridSegment(&builder->map.audio, lastSample, lastTime, track->x, track->y);
+}
+
+void TimeMapPPS(TimeMapBuilder* builder, unsigned long long timeNS)
+{
+    ClockTrack* track = &builder->pps;
+    double counter = (double)timeNS;
+    long long second = 0;
+    if (builder->hasPPS)
+    {
+        // whole seconds since the last PPS, a PPS may be missing
+        double seconds = (counter - builder->lastPPSCounter) / track->rate;
+        long long whole = llround(seconds);
+        if (whole < 1 || fabs(seconds - (double)whole) > PPS_TOLERANCE)
+        {
+            track->rejected++;
+            if (++track->rejectRun < TRACK_STEP_RUN)
+                return;
+            // the counter jumped : the count of seconds restarts from here
+            track->steps++;
+            whole = whole > 1 ? whole : 1;
+            second = builder->lastSecond + whole;
+            builder->lastSecond = second;
+            builder->lastPPSCounter = counter;
+            GridSegment(&builder->map.time, track->y, track->x * 1e9, counter, (double)second * 1e9);
+            ClockTrackRestart(track, (double)second, counter);
+            return;
+        }
+        second = builder->lastSecond + whole;
+    }
+    bool first = !builder->hasPPS;
+    double lastSecond = track->x, lastCounter = track->y;
+    if (!ClockTrackUpdate(track, (double)second, counter))
+        return;
+    builder->hasPPS = true;
+    builder->lastSecond = second;
+    builder->lastPPSCounter = counter;
+    // the time grid is uniform in counter time, the values are the seconds
+    if (first)
+        builder->map.time.origin = track->y;
+    else
+        GridSegment(&builder->map.time, lastCounter, lastSecond * 1e9, track->y, track->x * 1e9);
+}
+
+// Days since 1970-01-01 of a date of the proleptic Gregorian calendar
+static long long DaysFromCivil(long long year, unsigned int month, unsigned int day)
+{
+    year -= month <= 2;
+    long long era = (year >= 0 ? year : year - 399) / 400;
+    long long yearOfEra = year - era * 400;
+    long long dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    long long dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+void TimeMapGPS(TimeMapBuilder* builder, const GPSDatas* datas, unsigned long long packetTimeNS)
+{
+    const DateTime* date = &datas->dateOfFix;
+    if (!datas->fix || packetTimeNS == 0 || !builder->hasPPS)
+        return;
+    if (date->month < 1 || date->month > 12 || date->day < 1 || date->day > 31 || date->hour > 23
+        || date->minute > 59 || date->second > 60)
+        return;
+    // the fix follows the PPS of its second, in the same second
+    double since = (double)packetTimeNS - builder->lastPPSCounter;
+    if (since < 0 || since >= builder->pps.rate)
+        return;
+    // the firmware year has 2 digits
+    long long utcSecond = DaysFromCivil(2000 + date->year, date->month, date->day) * 86400
+                          + date->hour * 3600 + date->minute * 60 + date->second;
+    long long origin = (utcSecond - builder->lastSecond) * 1000000000LL;
+    TimeMap* map = &builder->map;
+    if (!(map->flags & TIMEMAP_UTC))
+    {
+        map->flags |= TIMEMAP_UTC;
+        map->utcOrigin = origin;
+        return;
+    }
+    if (origin == map->utcOrigin)
+    {
+        builder->pendingRun = 0;
+        return;
+    }
+    // a few fixes in a row which agree with each other but not with the
+    // first ones : the first ones were wrong (GPS not yet settled)
+    map->gpsMismatches++;
+    builder->pendingRun = origin == builder->pendingOrigin ? builder->pendingRun + 1 : 1;
+    builder->pendingOrigin = origin;
+    if (builder->pendingRun >= TRACK_STEP_RUN)
+    {
+        map->utcOrigin = origin;
+        builder->pendingRun = 0;
+    }
+}
+
+TimeMap* TimeMapFinish(TimeMapBuilder* builder)
+{
+    TimeMap* map = &builder->map;
+    const ClockTrack* audio = &builder->audio;
+    if (audio->accepted > 0)
+        GridExtend(&map->audio, audio->x, audio->y, audio->rate);
+    const ClockTrack* pps = &builder->pps;
+    if (pps->accepted > 0)
+        GridExtend(&map->time, pps->y, pps->x * 1e9, 1e9 / pps->rate);
+    map->ppsAccepted = (unsigned int)pps->accepted;
+    map->ppsRejected = (unsigned int)pps->rejected;
+    map->ppsSteps = (unsigned int)pps->steps;
+    map->jitterNS = (float)sqrt(pps->noise);
+    map->driftPPM = pps->nbPoints >= 2 ? (float)((pps->rate / 1e9 - 1) * 1e6) : 0;
+    return map;
+}
+
+void TimeMapBuilderFree(TimeMapBuilder* builder)
+{
+    FreeTimeMap(&builder->map);
+}
+
+///////////////
+/// Sidecar ///
+///////////////
+
+bool WriteTimeMap(const char* path, const TimeMap* map)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+        return false;
+    unsigned char header[TIMEMAP_HEADER_SIZE];
+    memset(header, 0, TIMEMAP_HEADER_SIZE);
+    memcpy(header, TIMEMAP_MAGIC, 8);
+    PutLE(header + 8, TIMEMAP_VERSION, 4);
+    PutLE(header + 12, map->flags, 4);
+    PutLE(header + 16, (unsigned long long)llround(map->audio.origin), 8);
+    PutLE(header + 24, (unsigned long long)llround(map->audio.step), 8);
+    PutLE(header + 32, (unsigned long long)map->audio.count, 8);
+    PutLE(header + 40, (unsigned long long)llround(map->time.origin), 8);
+    PutLE(header + 48, (unsigned long long)llround(map->time.step), 8);
+    PutLE(header + 56, (unsigned long long)map->time.count, 8);
+    PutLE(header + 64, (unsigned long long)map->utcOrigin, 8);
+    PutLE(header + 72, map->ppsAccepted, 4);
+    PutLE(header + 76, map->ppsRejected, 4);
+    PutLE(header + 80, map->ppsSteps, 4);
+    PutLE(header + 84, map->gpsMismatches, 4);
+    PutFloatLE(header + 88, map->jitterNS);
+    PutFloatLE(header + 92, map->driftPPM);
+    bool ok = fwrite(header, 1, TIMEMAP_HEADER_SIZE, file) == TIMEMAP_HEADER_SIZE;
+    const TimeGrid* grids[2] = {&map->audio, &map->time};
+    unsigned char entry[8];
+    for (int g = 0; g < 2; g++)
+    {
+        for (long long i = 0; i < grids[g]->count && ok; i++)
+        {
+            PutLE(entry, (unsigned long long)grids[g]->values[i], 8);
+            ok = fwrite(entry, 1, 8, file) == 8;
+        }
+    }
+    ok &= fclose(file) == 0;
+    return ok;
+}
+
+static bool ReadGrid(FILE* file, TimeGrid* grid, const unsigned char* header)
+{
+    grid->origin = (double)(long long)GetLE(header, 8);
+    grid->step = (double)GetLE(header + 8, 8);
+    grid->count = (long long)GetLE(header + 16, 8);
+    grid->capacity = grid->count;
+    if (grid->count < 0 || grid->step <= 0)
+        return false;
+    grid->values = malloc(sizeof(long long) * (grid->count > 0 ? grid->count : 1));
+    unsigned char entry[8];
+    for (long long i = 0; i < grid->count; i++)
+    {
+        if (fread(entry, 1, 8, file) != 8)
+            return false;
+        grid->values[i] = (long long)GetLE(entry, 8);
+    }
+    return true;
+}
+
+bool LoadTimeMap(const char* path, TimeMap* map)
+{
+    memset(map, 0, sizeof(TimeMap));
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    unsigned char header[TIMEMAP_HEADER_SIZE];
+    bool ok = fread(header, 1, TIMEMAP_HEADER_SIZE, file) == TIMEMAP_HEADER_SIZE
+              && memcmp(header, TIMEMAP_MAGIC, 8) == 0 && GetLE(header + 8, 4) == TIMEMAP_VERSION;
+    if (ok)
+    {
+        map->flags = (unsigned int)GetLE(header + 12, 4);
+        map->utcOrigin = (long long)GetLE(header + 64, 8);
+        map->ppsAccepted = (unsigned int)GetLE(header + 72, 4);
+        map->ppsRejected = (unsigned int)GetLE(header + 76, 4);
+        map->ppsSteps = (unsigned int)GetLE(header + 80, 4);
+        map->gpsMismatches = (unsigned int)GetLE(header + 84, 4);
+        map->jitterNS = GetFloatLE(header + 88);
+        map->driftPPM = GetFloatLE(header + 92);
+        ok = ReadGrid(file, &map->audio, header + 16) && ReadGrid(file, &map->time, header + 40);
+    }
+    fclose(file);
+    if (!ok)
+        FreeTimeMap(map);
+    return ok;
+}
+
+void FreeTimeMap(TimeMap* map)
+{
+    free(map->audio.values);
+    free(map->time.values);
+    memset(map, 0, sizeof(TimeMap));
+}
+
+///////////////////
+/// Conversions ///
+///////////////////
+
+bool TimeMapSampleCounter(const TimeMap* map, double sample, double* counterNS)
+{
+    return GridValue(&map->audio, sample, counterNS);
+}
+
+bool TimeMapCounterUTC(const TimeMap* map, double counterNS, long long* utcNS)
+{
+    double sincePPS;
+    if (!(map->flags & TIMEMAP_UTC) || !GridValue(&map->time, counterNS, &sincePPS))
+        return false;
+    *utcNS = map->utcOrigin + llround(sincePPS);
+    return true;
+}
+
+bool TimeMapSampleUTC(const TimeMap* map, double sample, long long* utcNS)
+{
+    double counterNS;
+    return TimeMapSampleCounter(map, sample, &counterNS) && TimeMapCounterUTC(map, counterNS, utcNS);
+}
+
+bool TimeMapUTCSample(const TimeMap* map, long long utcNS, double* sample)
+{
+    double counterNS;
+    if (!(map->flags & TIMEMAP_UTC) || !GridInverse(&map->time, (double)(utcNS - map->utcOrigin), &counterNS))
+        return false;
+    return GridInverse(&map->audio, counterNS, sample);
+}
@@ -0,0 +1,117 @@
+#ifndef TIMEMAP_H
+#define TIMEMAP_H
+#include <stdbool.h>
+#include "MsgProcessor.h"
+
+// Absolute timebase of a recording, disciplined by the GPS PPS.
+//
+// Three clocks are involved : the audio sample number, the card counter
+// (100 MHz, in ns : the end of packet time of each block and the PPS
+// timestamps) and UTC (GPS fixes, to the second). Two clock models are fitted
+// while the blocks are decoded, each one updated in O(1) per observation :
+//   - audio sample -> counter, from the end of packet time of each block
+//   - counter -> UTC second, from the PPS, each one labelled by the GPS fix
+//     which follows it (the PPS marks the start of the second of the fix)
+// Each model is an alpha-beta tracker of the offset and of the rate (the
+// drift of the card oscillator), with gains starting as a least squares fit
+// and settling to a fixed time constant. An observation too far from the
+// prediction is rejected as jitter, a run of them is taken as a real step
+// of the clock and the model restarts from there.
+//
+// Sidecar (file.log.tmap), little-endian :
+//   header (96 bytes) : magic "QHBTMAP\0", version (u32), flags (u32),
+//       audio grid : first sample (i64), step in samples (u64), entries (u64)
+//       time grid : first counter (u64), step in counter ns (u64), entries (u64)
+//       UTC of the first PPS in ns since 1970 (i64), PPS accepted, rejected,
+//       steps (u32), GPS fixes which did not match the PPS count (u32),
+//       rms PPS jitter (f32, ns), drift (f32, ppm)
+//   audio entries (u64) : counter time in ns of sample firstSample + i * step
+//   time entries (i64) : time in ns since the first PPS of the counter
+//       firstCounter + i * step
+// Both grids are uniform, so that a sample or a counter time is converted
+// with one division and a linear interpolation between two entries.
+// Sensor rows are dated with the end of packet time of their block (the
+// PACKET TIMESTAMP line before them in the .csv, SensorEvent.packetTimeNS).
+
+#define TIMEMAP_UTC 1u               // flags : utcOrigin was found from the GPS fixes
+
+// Alpha-beta tracker of y (observed with jitter) against x (exact)
+typedef struct ClockTrack_s
+{
+    double alpha;                   // steady gains
+    double beta;
+    double gateFloor;               // residuals below this are never rejected
+    long long nbPoints;             // accepted since the last step
+    double x, y;                    // last filtered point
+    double rate;                    // dy/dx
+    double noise;                   // running mean of the squared residuals
+    int rejectRun;
+    long long accepted, rejected, steps;
+}ClockTrack;
+
+// Uniform grid of the values of a piecewise linear function
+typedef struct TimeGrid_s
+{
+    double origin;                  // key of entry 0
+    double step;
+    long long count;
+    long long capacity;
+    long long* values;
+}TimeGrid;
+
+typedef struct TimeMap_s
+{
+    unsigned int flags;
+    TimeGrid audio;                 // counter ns of the audio samples
+    TimeGrid time;                  // ns since the first PPS of the counter times
+    long long utcOrigin;            // TIMEMAP_UTC : UTC of the first PPS, ns since 1970
+    unsigned int ppsAccepted;
+    unsigned int ppsRejected;
+    unsigned int ppsSteps;
+    unsigned int gpsMismatches;
+    float jitterNS;
+    float driftPPM;
+}TimeMap;
+
+// Streaming construction, fed by the SensorSink (see SensorSinkTimeMap)
+typedef struct TimeMapBuilder_s
+{
+    TimeMap map;
+    long samplesPerBlock;
+    int samplingFrequency;
+    ClockTrack audio;               // x : sample, y : counter ns
+    ClockTrack pps;                 // x : second since the first PPS, y : counter ns
+    long long lastSecond;           // of the last accepted PPS
+    double lastPPSCounter;          // raw counter ns of that PPS
+    bool hasPPS;
+    long long pendingOrigin;        // UTC origin proposed by the last fixes which disagree
+    int pendingRun;
+}TimeMapBuilder;
+
+void TimeMapBuilderInit(TimeMapBuilder* builder, int samplingFrequency, long samplesPerBlock);
+// End of packet time of a block (firmware >= 2)
+void TimeMapBlock(TimeMapBuilder* builder, long block, unsigned long long timeNS);
+void TimeMapPPS(TimeMapBuilder* builder, unsigned long long timeNS);
+// GPS fix decoded from a block whose end of packet time is packetTimeNS
+void TimeMapGPS(TimeMapBuilder* builder, const GPSDatas* datas, unsigned long long packetTimeNS);
+// Completes the grids up to the last observations, the map is then ready
+TimeMap* TimeMapFinish(TimeMapBuilder* builder);
+void TimeMapBuilderFree(TimeMapBuilder* builder);
+
+// Returns false if the file cannot be written
+bool WriteTimeMap(const char* path, const TimeMap* map);
+// Returns false if path is not a time map
+bool LoadTimeMap(const char* path, TimeMap* map);
+void FreeTimeMap(TimeMap* map);
+
+// O(1) conversions, false if the map has no data for them (no block with a
+// packet time, no PPS, or no GPS fix for UTC). Outside of the recording the
+// first or last model segment is extended.
+bool TimeMapSampleCounter(const TimeMap* map, double sample, double* counterNS);
+bool TimeMapCounterUTC(const TimeMap* map, double counterNS, long long* utcNS);
+bool TimeMapSampleUTC(const TimeMap* map, double sample, long long* utcNS);
+// Inverse conversion : fractional audio sample recorded at utcNS (amortized
+// O(1) on the uniform grids, the values are searched from a slope estimate)
+bool TimeMapUTCSample(const TimeMap* map, long long utcNS, double* sample);
+
+#endif
@@ -0,0 +1,566 @@
+// qhb : Python access to the .log files, on top of libqhb.
+//
+//   log = qhb.LogFile("file.log")
+//   log.header           dict of the header fields
+//   log.audio            (block, channel, sample) view of the dmaBlocks
+//   log.samples(0, 10)   int32 copy of blocks 0 to 9 (24-bit samples sign extended)
+//   log.sensors()        dict of structured arrays, one per sensor stream
+//
+//   tmap = qhb.TimeMap("file.log.tmap")     written by log2wav --timemap
+//   tmap.sample_utc(samples)                UTC in ns since 1970 of audio samples
+//   tmap.counter_utc(log.packet_times())    UTC of packet times (and of the sensor rows of those blocks)
+//
+// The file is memory mapped : audio and additional_data are read-only views
+// of the mapping, nothing is read before the array is used. The sensors
+// streams are decoded by the C decoder into arrays with the dtypes of the
+// .npy files written by log2wav --npy.
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+#include <string.h>
+#include "qhb.h"
+
+typedef struct
+{
+    PyObject_HEAD
+    LogReader reader;
+    bool opened;
+    PyObject* sensors;      // dict of the decoded streams, NULL until sensors() is called
+}LogFileObject;
+
+static int LogFile_init(LogFileObject* self, PyObject* args, PyObject* kwds)
+{
+    static char* keywords[] = {"path", NULL};
+    PyObject* pathObject;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&", keywords, PyUnicode_FSConverter, &pathObject))
+        return -1;
+    if (self->opened)
+    {
+        CloseLogReader(&self->reader);
+        self->opened = false;
+    }
+    Py_CLEAR(self->sensors);
+    const char* path = PyBytes_AS_STRING(pathObject);
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = OpenLogReader(&self->reader, path, 0);
+    Py_END_ALLOW_THREADS
+    if (status == -1)
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    else if (status == -2)
+        PyErr_Format(PyExc_ValueError, "%s : empty file", path);
+    else if (status != 0)
+        PyErr_Format(PyExc_ValueError, "%s : invalid header", path);
+    Py_DECREF(pathObject);
+    if (status != 0)
+        return -1;
+    // the views can be read in any order, the pages stay mapped
+    self->reader.releasePages = false;
+    self->opened = true;
+    return 0;
+}
+
+static void LogFile_dealloc(LogFileObject* self)
+{
+    // the views hold a reference on the LogFile, none is left here
+    if (self->opened)
+        CloseLogReader(&self->reader);
+    Py_XDECREF(self->sensors);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+// LogFile.__new__ without __init__ leaves nothing to read
+static bool CheckOpened(const LogFileObject* self)
+{
+    if (!self->opened)
+        PyErr_SetString(PyExc_ValueError, "LogFile not opened");
+    return self->opened;
+}
+
+static int SampleBytes(const LogFileObject* self)
+{
+    return self->reader.hdr.resolutionBits / 8;
+}
+
+static long SamplesPerBlock(const LogFileObject* self)
+{
+    const HighBlueHeader* hdr = &self->reader.hdr;
+    return hdr->dmaBlockSize / (hdr->numberOfChan * SampleBytes(self));
+}
+
+// Read-only array over the mapped file, keeping the LogFile alive
+static PyObject* MappedArray(LogFileObject* self, int type, int nd, npy_intp* shape, npy_intp* strides, const void* data)
+{
+    PyObject* array = PyArray_NewFromDescr(&PyArray_Type, PyArray_DescrFromType(type), nd, shape, strides,
+                                           (void*)data, 0, NULL);
+    if (array == NULL)
+        return NULL;
+    Py_INCREF(self);
+    if (PyArray_SetBaseObject((PyArrayObject*)array, (PyObject*)self) < 0)
+    {
+        Py_DECREF(array);
+        return NULL;
+    }
+    return array;
+}
+
+static PyObject* LogFile_header(LogFileObject* self, void* closure)
+{
+    if (!CheckOpened(self))
+        return NULL;
+    const HighBlueHeader* hdr = &self->reader.hdr;
+    PyObject* peripherals = PyList_New(0);
+    if (peripherals == NULL)
+        return NULL;
+    for (int i = 0; i < hdr->numberOfExternalPeripheral && i < MAX_PERIPHERAL; i++)
+    {
+        const PERIPHERAL_CONFIGURATION* periph = &hdr->periphConfig[i];
+        PyObject* item = Py_BuildValue("{s:i,s:i,s:i,s:i,s:i}", "type", periph->Type, "id", periph->ID, "range",
+                                       periph->Range, "resolution", periph->Resolution, "frequency", periph->Frequency);
+        if (item == NULL || PyList_Append(peripherals, item) < 0)
+        {
+            Py_XDECREF(item);
+            Py_DECREF(peripherals);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    return Py_BuildValue("{s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:N,s:l,s:l,s:L,s:L}",
+                         "header_size", hdr->headerSize,
+                         "version", hdr->versionNumber,
+                         "nb_channels", hdr->numberOfChan,
+                         "resolution_bits", hdr->resolutionBits,
+                         "sampling_frequency", hdr->samplingFrequency,
+                         "dma_block_size", hdr->dmaBlockSize,
+                         "additional_data_size", hdr->sizeOfAdditionnalDataBuffer,
+                         "nb_peripherals", hdr->numberOfExternalPeripheral,
+                         "timestamp_of_start", hdr->timeStampOfStart,
+                         "peripherals", peripherals,
+                         "nb_blocks", self->reader.nbBlocks,
+                         "samples_per_block", SamplesPerBlock(self),
+                         "data_offset", self->reader.dataOffset,
+                         "file_size", self->reader.size);
+}
+
+static PyObject* LogFile_nbBlocks(LogFileObject* self, void* closure)
+{
+    if (!CheckOpened(self))
+        return NULL;
+    return PyLong_FromLong(self->reader.nbBlocks);
+}
+
+// (block, channel, sample), the planar layout of the dmaBlocks. 24-bit
+// samples have no NumPy type : their 3 little-endian bytes are a last axis.
+static PyObject* LogFile_audio(LogFileObject* self, void* closure)
+{
+    if (!CheckOpened(self))
+        return NULL;
+    const LogReader* reader = &self->reader;
+    int bytes = SampleBytes(self);
+    npy_intp shape[4] = {reader->nbBlocks, reader->hdr.numberOfChan, SamplesPerBlock(self), 3};
+    npy_intp strides[4] = {reader->blockSize, SamplesPerBlock(self) * bytes, bytes, 1};
+    const unsigned char* first = reader->data + reader->dataOffset + reader->hdr.sizeOfAdditionnalDataBuffer;
+    switch (bytes)
+    {
+        case 2: return MappedArray(self, NPY_INT16, 3, shape, strides, first);
+        case 4: return MappedArray(self, NPY_INT32, 3, shape, strides, first);
+        default: return MappedArray(self, NPY_UINT8, 4, shape, strides, first);
+    }
+}
+
+static PyObject* LogFile_additionalData(LogFileObject* self, void* closure)
+{
+    if (!CheckOpened(self))
+        return NULL;
+    const LogReader* reader = &self->reader;
+    npy_intp shape[2] = {reader->nbBlocks, reader->hdr.sizeOfAdditionnalDataBuffer};
+    npy_intp strides[2] = {reader->blockSize, 1};
+    return MappedArray(self, NPY_UINT8, 2, shape, strides, reader->data + reader->dataOffset);
+}
+
+// Blocks [first, last) : first is a block number, last a slice bound (None
+// up to the end, negative from the end, clamped to the file)
+static bool BlockRange(const LogFileObject* self, long* first, PyObject* lastObject, long* last)
+{
+    long nbBlocks = self->reader.nbBlocks;
+    if (*first < 0 || *first > nbBlocks)
+    {
+        PyErr_Format(PyExc_IndexError, "first_block %ld out of range (%ld blocks)", *first, nbBlocks);
+        return false;
+    }
+    *last = nbBlocks;
+    if (lastObject != Py_None)
+    {
+        *last = PyLong_AsLong(lastObject);
+        if (*last == -1 && PyErr_Occurred())
+            return false;
+    }
+    if (*last < 0)
+        *last += nbBlocks;
+    *last = *last < *first ? *first : *last > nbBlocks ? nbBlocks : *last;
+    return true;
+}
+
+static PyObject* LogFile_samples(LogFileObject* self, PyObject* args, PyObject* kwds)
+{
+    static char* keywords[] = {"first_block", "last_block", NULL};
+    long first = 0, last;
+    PyObject* lastObject = Py_None;
+    if (!CheckOpened(self) || !PyArg_ParseTupleAndKeywords(args, kwds, "|lO", keywords, &first, &lastObject))
+        return NULL;
+    if (!BlockRange(self, &first, lastObject, &last))
+        return NULL;
+    long nbSamples = SamplesPerBlock(self);
+    int nbChan = self->reader.hdr.numberOfChan;
+    int bytes = SampleBytes(self);
+    npy_intp shape[3] = {last - first, nbChan, nbSamples};
+    PyObject* array = PyArray_SimpleNew(3, shape, NPY_INT32);
+    if (array == NULL)
+        return NULL;
+    int* out = PyArray_DATA((PyArrayObject*)array);
+    long planeSize = nbChan * nbSamples;
+    Py_BEGIN_ALLOW_THREADS
+    for (long k = first; k < last; k++)
+    {
+        const unsigned char* in = LogReaderDmaBlock(&self->reader, k);
+        int* block = out + (k - first) * planeSize;
+        for (long i = 0; i < planeSize; i++, in += bytes)
+        {
+            switch (bytes)
+            {
+                case 2: block[i] = (short)(in[0] | in[1] << 8); break;
+                case 3: block[i] = (int)((unsigned)in[0] << 8 | (unsigned)in[1] << 16 | (unsigned)in[2] << 24) >> 8; break;
+                default: memcpy(&block[i], in, 4); break;
+            }
+        }
+    }
+    Py_END_ALLOW_THREADS
+    return array;
+}
+
+static PyObject* LogFile_packetTimes(LogFileObject* self, PyObject* unused)
+{
+    if (!CheckOpened(self))
+        return NULL;
+    npy_intp nbBlocks = self->reader.nbBlocks;
+    PyObject* array = PyArray_SimpleNew(1, &nbBlocks, NPY_UINT64);
+    if (array == NULL)
+        return NULL;
+    unsigned long long* times = PyArray_DATA((PyArrayObject*)array);
+    for (long k = 0; k < nbBlocks; k++)
+        times[k] = BlockEndTimeNS(LogReaderAdditionnalData(&self->reader, k));
+    return array;
+}
+
+// Records of one stream, packed as in its .npy file
+typedef struct StreamRecords_s
+{
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+}StreamRecords;
+
+static void CollectEvents(const SensorEvent* events, int count, void* context)
+{
+    StreamRecords* streams = context;
+    for (int i = 0; i < count; i++)
+    {
+        StreamRecords* records = &streams[events[i].stream];
+        if (records->size + SENSOR_RECORD_MAX_SIZE > records->capacity)
+        {
+            records->capacity = 2 * records->capacity + 64 * SENSOR_RECORD_MAX_SIZE;
+            records->data = realloc(records->data, records->capacity);
+        }
+        records->size += PackSensorRecord(&events[i], records->data + records->size);
+    }
+}
+
+// dtype of the .npy records of a stream
+static PyArray_Descr* StreamDescr(SensorStream stream)
+{
+    PyObject* ast = PyImport_ImportModule("ast");
+    if (ast == NULL)
+        return NULL;
+    PyObject* spec = PyObject_CallMethod(ast, "literal_eval", "s", SensorStreamDescr(stream));
+    Py_DECREF(ast);
+    if (spec == NULL)
+        return NULL;
+    PyArray_Descr* descr = NULL;
+    PyArray_DescrConverter(spec, &descr);
+    Py_DECREF(spec);
+    return descr;
+}
+
+static PyObject* DecodeSensors(LogFileObject* self)
+{
+    StreamRecords streams[SENSOR_STREAM_COUNT];
+    memset(streams, 0, sizeof(streams));
+    const LogReader* reader = &self->reader;
+    Py_BEGIN_ALLOW_THREADS
+    SensorSink sink;
+    SensorSinkInit(&sink, NULL, NULL);
+    SensorSinkSubscribe(&sink, SENSOR_EVENTS_ALL, 4096, CollectEvents, streams);
+    BlockDecoder decoder;
+    BlockDecoderInit(&decoder, &sink, false);
+    for (long k = 0; k < reader->nbBlocks; k++)
+        BlockDecoderFeed(&decoder, k, LogReaderAdditionnalData(reader, k), reader->hdr.sizeOfAdditionnalDataBuffer);
+    SensorSinkClose(&sink);
+    Py_END_ALLOW_THREADS
+
+    PyObject* result = PyDict_New();
+    for (int s = 0; s < SENSOR_STREAM_COUNT && result != NULL; s++)
+    {
+        if (streams[s].size == 0)
+            continue;
+        PyArray_Descr* descr = StreamDescr(s);
+        if (descr == NULL)
+        {
+            Py_CLEAR(result);
+            break;
+        }
+        npy_intp count = streams[s].size / SensorStreamRecordSize(s);
+        PyObject* array = PyArray_NewFromDescr(&PyArray_Type, descr, 1, &count, NULL, NULL, 0, NULL);
+        if (array == NULL || PyDict_SetItemString(result, SensorStreamName(s), array) < 0)
+            Py_CLEAR(result);
+        else
+            memcpy(PyArray_DATA((PyArrayObject*)array), streams[s].data, streams[s].size);
+        Py_XDECREF(array);
+    }
+    for (int s = 0; s < SENSOR_STREAM_COUNT; s++)
+        free(streams[s].data);
+    return result;
+}
+
+static PyObject* LogFile_sensors(LogFileObject* self, PyObject* unused)
+{
+    if (!CheckOpened(self))
+        return NULL;
+    if (self->sensors == NULL)
+        self->sensors = DecodeSensors(self);
+    Py_XINCREF(self->sensors);
+    return self->sensors;
+}
+
+static PyGetSetDef LogFile_getset[] = {
+    {"header", (getter)LogFile_header, NULL, "header fields, number of blocks and samples per block", NULL},
+    {"nb_blocks", (getter)LogFile_nbBlocks, NULL, "number of complete blocks", NULL},
+    {"audio", (getter)LogFile_audio, NULL,
+     "read-only (block, channel, sample) view of the audio, int16 or int32, 24-bit samples as a last axis of 3 bytes", NULL},
+    {"additional_data", (getter)LogFile_additionalData, NULL, "read-only (block, byte) view of the additional data", NULL},
+    {NULL}
+};
+
+static PyMethodDef LogFile_methods[] = {
+    {"samples", (PyCFunction)(void (*)(void))LogFile_samples, METH_VARARGS | METH_KEYWORDS,
+     "samples(first_block=0, last_block=None) : int32 (block, channel, sample) copy of the audio of the blocks "
+     "[first_block, last_block), last_block negative counts from the end. IndexError if first_block is not in the file"},
+    {"packet_times", (PyCFunction)LogFile_packetTimes, METH_NOARGS,
+     "packet_times() : end of packet time of each block in ns (firmware >= 2)"},
+    {"sensors", (PyCFunction)LogFile_sensors, METH_NOARGS,
+     "sensors() : dict of the sensor streams (accel, gyro, mag, temperature, pressure, light, gps, pps, packet, mpu),\n"
+     "structured arrays with the dtypes of the log2wav --npy files, decoded on the first call"},
+    {NULL}
+};
+
+static PyTypeObject LogFileType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "qhb.LogFile",
+    .tp_doc = "LogFile(path) : memory mapped .log file",
+    .tp_basicsize = sizeof(LogFileObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)LogFile_init,
+    .tp_dealloc = (destructor)LogFile_dealloc,
+    .tp_getset = LogFile_getset,
+    .tp_methods = LogFile_methods,
+};
+
+typedef struct
+{
+    PyObject_HEAD
+    TimeMap map;
+    bool loaded;
+}TimeMapObject;
+
+static int TimeMap_init(TimeMapObject* self, PyObject* args, PyObject* kwds)
+{
+    static char* keywords[] = {"path", NULL};
+    PyObject* pathObject;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&", keywords, PyUnicode_FSConverter, &pathObject))
+        return -1;
+    if (self->loaded)
+    {
+        FreeTimeMap(&self->map);
+        self->loaded = false;
+    }
+    const char* path = PyBytes_AS_STRING(pathObject);
+    bool loaded;
+    Py_BEGIN_ALLOW_THREADS
+    loaded = LoadTimeMap(path, &self->map);
+    Py_END_ALLOW_THREADS
+    if (!loaded)
+        PyErr_Format(PyExc_ValueError, "%s : not a time map", path);
+    Py_DECREF(pathObject);
+    self->loaded = loaded;
+    return loaded ? 0 : -1;
+}
+
+static void TimeMap_dealloc(TimeMapObject* self)
+{
+    if (self->loaded)
+        FreeTimeMap(&self->map);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+typedef enum TimeConversion_e
+{
+    SampleToCounter,
+    SampleToUTC,
+    CounterToUTC
+}TimeConversion;
+
+// Converts every value of an array (or a number) with the map, into an array of the same shape
+static PyObject* ConvertTimes(TimeMapObject* self, PyObject* values, TimeConversion conversion)
+{
+    if (!self->loaded)
+    {
+        PyErr_SetString(PyExc_ValueError, "TimeMap not loaded");
+        return NULL;
+    }
+    if (conversion != SampleToCounter && !(self->map.flags & TIMEMAP_UTC))
+    {
+        PyErr_SetString(PyExc_ValueError, "no GPS fix in this recording, the UTC time is unknown");
+        return NULL;
+    }
+    PyArrayObject* in = (PyArrayObject*)PyArray_FROMANY(values, NPY_DOUBLE, 0, 0, NPY_ARRAY_IN_ARRAY);
+    if (in == NULL)
+        return NULL;
+    PyObject* out = PyArray_SimpleNew(PyArray_NDIM(in), PyArray_DIMS(in), conversion == SampleToCounter ? NPY_DOUBLE : NPY_INT64);
+    if (out == NULL)
+    {
+        Py_DECREF(in);
+        return NULL;
+    }
+    const double* times = PyArray_DATA(in);
+    npy_intp count = PyArray_SIZE(in);
+    bool ok = true;
+    Py_BEGIN_ALLOW_THREADS
+    for (npy_intp i = 0; i < count && ok; i++)
+    {
+        switch (conversion)
+        {
+            case SampleToCounter: ok = TimeMapSampleCounter(&self->map, times[i], (double*)PyArray_DATA((PyArrayObject*)out) + i); break;
+            case SampleToUTC: ok = TimeMapSampleUTC(&self->map, times[i], (long long*)PyArray_DATA((PyArrayObject*)out) + i); break;
+            default: ok = TimeMapCounterUTC(&self->map, times[i], (long long*)PyArray_DATA((PyArrayObject*)out) + i); break;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    Py_DECREF(in);
+    if (!ok)
+    {
+        Py_DECREF(out);
+        PyErr_SetString(PyExc_ValueError, "the time map has no packet time or no PPS");
+        return NULL;
+    }
+    return PyArray_Return((PyArrayObject*)out);
+}
+
+static PyObject* TimeMap_sampleCounter(TimeMapObject* self, PyObject* samples)
+{
+    return ConvertTimes(self, samples, SampleToCounter);
+}
+
+static PyObject* TimeMap_sampleUTC(TimeMapObject* self, PyObject* samples)
+{
+    return ConvertTimes(self, samples, SampleToUTC);
+}
+
+static PyObject* TimeMap_counterUTC(TimeMapObject* self, PyObject* times)
+{
+    return ConvertTimes(self, times, CounterToUTC);
+}
+
+static PyObject* TimeMap_info(TimeMapObject* self, void* closure)
+{
+    if (!self->loaded)
+    {
+        PyErr_SetString(PyExc_ValueError, "TimeMap not loaded");
+        return NULL;
+    }
+    const TimeMap* map = &self->map;
+    PyObject* utcOrigin = Py_None;
+    if (map->flags & TIMEMAP_UTC)
+        utcOrigin = PyLong_FromLongLong(map->utcOrigin);
+    else
+        Py_INCREF(utcOrigin);
+    return Py_BuildValue("{s:N,s:I,s:I,s:I,s:I,s:d,s:d}",
+                         "first_pps_utc", utcOrigin,
+                         "pps_accepted", map->ppsAccepted,
+                         "pps_rejected", map->ppsRejected,
+                         "pps_steps", map->ppsSteps,
+                         "gps_mismatches", map->gpsMismatches,
+                         "jitter_ns", (double)map->jitterNS,
+                         "drift_ppm", (double)map->driftPPM);
+}
+
+static PyGetSetDef TimeMap_getset[] = {
+    {"info", (getter)TimeMap_info, NULL,
+     "UTC of the first PPS (ns since 1970, None without GPS fix), PPS counts, jitter and clock drift", NULL},
+    {NULL}
+};
+
+static PyMethodDef TimeMap_methods[] = {
+    {"sample_counter", (PyCFunction)TimeMap_sampleCounter, METH_O,
+     "sample_counter(samples) : card counter time in ns (float64) of audio sample numbers"},
+    {"sample_utc", (PyCFunction)TimeMap_sampleUTC, METH_O,
+     "sample_utc(samples) : UTC in ns since 1970 (int64, .astype('datetime64[ns]')) of audio sample numbers"},
+    {"counter_utc", (PyCFunction)TimeMap_counterUTC, METH_O,
+     "counter_utc(times) : UTC in ns since 1970 of card counter times in ns (packet times, PPS)"},
+    {NULL}
+};
+
+static PyTypeObject TimeMapType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "qhb.TimeMap",
+    .tp_doc = "TimeMap(path) : PPS disciplined timebase of a recording (.log.tmap)",
+    .tp_basicsize = sizeof(TimeMapObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)TimeMap_init,
+    .tp_dealloc = (destructor)TimeMap_dealloc,
+    .tp_getset = TimeMap_getset,
+    .tp_methods = TimeMap_methods,
+};
+
+static struct PyModuleDef qhbModule = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "qhb",
+    .m_doc = "Reading of the QHB .log recordings",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_qhb(void)
+{
+    import_array();
+    if (PyType_Ready(&LogFileType) < 0 || PyType_Ready(&TimeMapType) < 0)
+        return NULL;
+    PyObject* module = PyModule_Create(&qhbModule);
+    if (module == NULL)
+        return NULL;
+    Py_INCREF(&LogFileType);
+    if (PyModule_AddObject(module, "LogFile", (PyObject*)&LogFileType) < 0)
+    {
+        Py_DECREF(&LogFileType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    Py_INCREF(&TimeMapType);
+    if (PyModule_AddObject(module, "TimeMap", (PyObject*)&TimeMapType) < 0)
+    {
+        Py_DECREF(&TimeMapType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
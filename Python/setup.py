@@ -0,0 +1,32 @@
+"""Build of the qhb Python module, on top of the Log2Wav sources.
+
+    cd Python && python setup.py build_ext --inplace
+"""
+
+import glob
+import os
+
+import numpy
+from setuptools import Extension, setup
+
+LOG2WAV = os.path.join("..", "Log2Wav")
+
+# every Log2Wav source but the command line
+sources = ["qhbmodule.c"] + sorted(
+    path for path in glob.glob(os.path.join(LOG2WAV, "*.c")) if os.path.basename(path) != "log2wav.c"
+)
+
+setup(
+    name="qhb",
+    version="2.3",
+    description="Reading of the QHB .log recordings",
+    ext_modules=[
+        Extension(
+            "qhb",
+            sources=sources,
+            include_dirs=[LOG2WAV, numpy.get_include()],
+            extra_compile_args=["-O2"] if os.name != "nt" else [],
+            libraries=["m", "pthread"] if os.name != "nt" else [],
+        )
+    ],
+)